@@ -19,34 +19,50 @@
 /*******************************************************************/
 
 #include "AudioPeakDetection.h"
+#include "AudioPeakDetection_Batch.h"
+#include "AudioPeakDetection_Export.h"
 
 #include "AE_EffectVers.h"
 #include "AE_Macros.h"
 #include "Param_Utils.h"
 
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <limits>
+#include <map>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
-#define KISS_FFT_STATIC 1
-extern "C" {
-#include "kiss_fftr.h"
-}
-
 namespace {
 
-constexpr PF_UFixed kPreferredSampleRate = 0xAC440000; // 44.1 kHz, 16.16 fixed
-constexpr int kFFTSize = 2048;
-constexpr int kHopSize = kFFTSize / 2;
-constexpr int kThresholdWindow = 8;
+// Analysis rates offered by the Quality controls, 16.16 fixed.
+constexpr PF_UFixed kSampleRate22050 = 0x56220000;
+constexpr PF_UFixed kSampleRate44100 = 0xAC440000;
+constexpr PF_UFixed kSampleRate48000 = 0xBB800000;
+// Layers are checked out in windows of this length so neither the host's
+// sample count (an A_long) nor the checkout buffer grows with layer length.
+constexpr A_long kCheckoutWindowSeconds = 60;
+constexpr size_t kDownmixChunkFrames = 16384;
 constexpr PF_FpLong kLoudnessThreshold = AudioPeakDetection_LOUDNESS_THRESHOLD_PERCENT;
 constexpr A_long kProgressMax = 100;
 constexpr A_long kExpectedParamCount = AudioPeakDetection_NUM_PARAMS;
+// Suggest Settings tries every combination of this many evenly spaced
+// Threshold Multiplier, Smoothing and Min Separation values.
+constexpr int kSuggestThresholdSteps = 41;
+constexpr int kSuggestSmoothingSteps = 11;
+constexpr int kSuggestSeparationSteps = 10;
+
+static_assert(kOnsetBandCount == AudioPeakDetection_NUM_BANDS, "Core and plug-in band counts differ.");
+static_assert(static_cast<int>(kOnsetSpectralFlux) == static_cast<int>(AudioPeakDetection_ODF_SPECTRAL_FLUX) &&
+	static_cast<int>(kOnsetEnergyEnvelope) == static_cast<int>(AudioPeakDetection_ODF_ENERGY),
+	"Core onset functions must follow the Detection Function popup.");
 
 static AEGP_PluginID g_my_plugin_id = 0;
 
@@ -182,58 +198,674 @@ PF_Handle GetStateHandle(PF_InData* in_data, PF_OutData* out_data)
 	return reinterpret_cast<PF_Handle>(out_data ? out_data->sequence_data : nullptr);
 }
 
-AnalysisState* GetState(PF_InData* in_data, PF_OutData* out_data)
+SequenceHandleData* GetHandleData(PF_Handle handle)
+{
+	SequenceHandleData* data = handle ? reinterpret_cast<SequenceHandleData*>(*handle) : nullptr;
+	return (data && data->magic == AudioPeakDetection_SEQUENCE_MAGIC) ? data : nullptr;
+}
+
+// Shared, so a state stays valid for the caller even if SEQUENCE_SETDOWN
+// releases the instance meanwhile.
+std::shared_ptr<AnalysisState> GetState(PF_InData* in_data, PF_OutData* out_data)
+{
+	const SequenceHandleData* data = GetHandleData(GetStateHandle(in_data, out_data));
+	return data ? AnalysisRegistry::Get().Find(data->instance_id) : nullptr;
+}
+
+// Converts seconds to an A_Time. When the tick count does not fit an A_long
+// (very long layers at a fine time scale) the scale is divided down until it
+// does, trading sub-tick precision for a valid time.
+A_Time SecondsToTime(double seconds, A_u_long time_scale)
+{
+	uint32_t scale = time_scale;
+	const int64_t ticks = SecondsToTicks(seconds, scale, std::numeric_limits<A_long>::max());
+	return { static_cast<A_long>(ticks), static_cast<A_u_long>(scale) };
+}
+
+double TimeToSeconds(const A_Time& time)
+{
+	return time.scale ? static_cast<double>(time.value) / static_cast<double>(time.scale) : 0.0;
+}
+
+// Resolves the Analysis Range controls to [begin_ticks, end_ticks) in layer
+// time at in_data->time_scale, clamped to the layer. Work Area and Layer
+// In/Out are read from the layer the effect is applied to.
+PF_Err ResolveAnalysisRange(PF_InData* in_data,
+	PF_ParamDef* params[],
+	int64_t duration_ticks,
+	int64_t& begin_ticks,
+	int64_t& end_ticks)
+{
+	begin_ticks = 0;
+	end_ticks = duration_ticks;
+
+	double begin_seconds = 0.0;
+	double end_seconds = 0.0;
+	const A_long range_mode = params[AudioPeakDetection_RANGE_MODE]->u.pd.value;
+	if (range_mode == AudioPeakDetection_RANGE_CUSTOM) {
+		begin_seconds = params[AudioPeakDetection_RANGE_START]->u.fs_d.value;
+		end_seconds = params[AudioPeakDetection_RANGE_END]->u.fs_d.value;
+	}
+	else if (range_mode == AudioPeakDetection_RANGE_WORK_AREA || range_mode == AudioPeakDetection_RANGE_LAYER_IN_OUT) {
+		AEGP_SuiteHandler suites(in_data->pica_basicP);
+		AEGP_LayerH layerH = nullptr;
+		A_Err ae_err = suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH);
+		if (ae_err != A_Err_NONE || !layerH) {
+			return ae_err != A_Err_NONE ? ae_err : PF_Err_BAD_CALLBACK_PARAM;
+		}
+
+		A_Time begin_time{};
+		A_Time end_time{};
+		if (range_mode == AudioPeakDetection_RANGE_WORK_AREA) {
+			AEGP_CompH compH = nullptr;
+			A_Time work_start{};
+			A_Time work_duration{};
+			ae_err = suites.LayerSuite9()->AEGP_GetLayerParentComp(layerH, &compH);
+			if (ae_err == A_Err_NONE) {
+				ae_err = suites.CompSuite11()->AEGP_GetCompWorkAreaStart(compH, &work_start);
+			}
+			if (ae_err == A_Err_NONE) {
+				ae_err = suites.CompSuite11()->AEGP_GetCompWorkAreaDuration(compH, &work_duration);
+			}
+			const A_Time work_end = SecondsToTime(TimeToSeconds(work_start) + TimeToSeconds(work_duration), work_start.scale);
+			if (ae_err == A_Err_NONE) {
+				ae_err = suites.LayerSuite9()->AEGP_ConvertCompToLayerTime(layerH, &work_start, &begin_time);
+			}
+			if (ae_err == A_Err_NONE) {
+				ae_err = suites.LayerSuite9()->AEGP_ConvertCompToLayerTime(layerH, &work_end, &end_time);
+			}
+		}
+		else {
+			A_Time layer_duration{};
+			ae_err = suites.LayerSuite9()->AEGP_GetLayerInPoint(layerH, AEGP_LTimeMode_LayerTime, &begin_time);
+			if (ae_err == A_Err_NONE) {
+				ae_err = suites.LayerSuite9()->AEGP_GetLayerDuration(layerH, AEGP_LTimeMode_LayerTime, &layer_duration);
+			}
+			end_time = SecondsToTime(TimeToSeconds(begin_time) + TimeToSeconds(layer_duration), begin_time.scale);
+		}
+		if (ae_err != A_Err_NONE) {
+			return ae_err;
+		}
+		begin_seconds = TimeToSeconds(begin_time);
+		end_seconds = TimeToSeconds(end_time);
+	}
+	else {
+		return PF_Err_NONE;
+	}
+
+	const double time_scale = static_cast<double>(std::max<A_u_long>(in_data->time_scale, 1));
+	begin_ticks = ClampValue<int64_t>(std::llround(begin_seconds * time_scale), 0, duration_ticks);
+	end_ticks = ClampValue<int64_t>(std::llround(end_seconds * time_scale), 0, duration_ticks);
+	return PF_Err_NONE;
+}
+
+SampleEncoding EncodingOf(A_long format_flag, A_long bytes_per_sample)
+{
+	if (format_flag == PF_SIGNED_FLOAT && bytes_per_sample == PF_SSS_4) {
+		return kSampleFloat32;
+	}
+	if (format_flag == PF_SIGNED_PCM && bytes_per_sample == PF_SSS_2) {
+		return kSampleInt16;
+	}
+	if (format_flag == PF_SIGNED_PCM && bytes_per_sample == PF_SSS_1) {
+		return kSampleInt8;
+	}
+	return kSampleUnknown;
+}
+
+// STFT and checkout rate selected by the Quality controls. Draft keeps the
+// Standard window and hop in seconds at half the rate, so it costs about half
+// as much for the same timing; Precise halves the hop for twice the cost.
+struct AnalysisQuality {
+	OnsetGeometry geometry;
+	PF_UFixed sample_rate = kSampleRate44100;
+};
+
+AnalysisQuality ReadAnalysisQuality(PF_ParamDef* params[])
+{
+	AnalysisQuality quality;
+	switch (params[AudioPeakDetection_QUALITY]->u.pd.value) {
+	case AudioPeakDetection_QUALITY_DRAFT:
+		quality.geometry = { kFFTSize / 2, kHopSize / 2 };
+		quality.sample_rate = kSampleRate22050;
+		break;
+	case AudioPeakDetection_QUALITY_PRECISE:
+		quality.geometry = { kFFTSize, kHopSize / 2 };
+		break;
+	case AudioPeakDetection_QUALITY_CUSTOM: {
+		const A_long size_choice = ClampValue<A_long>(params[AudioPeakDetection_FFT_SIZE]->u.pd.value,
+			AudioPeakDetection_FFT_SIZE_512,
+			AudioPeakDetection_FFT_SIZE_4096);
+		const A_long overlap_choice = ClampValue<A_long>(params[AudioPeakDetection_OVERLAP]->u.pd.value,
+			AudioPeakDetection_OVERLAP_50,
+			AudioPeakDetection_OVERLAP_87);
+		quality.geometry.fft_size = 512 << (size_choice - AudioPeakDetection_FFT_SIZE_512);
+		quality.geometry.hop_size = quality.geometry.fft_size >> (overlap_choice - AudioPeakDetection_OVERLAP_50 + 1);
+		const A_long rate_choice = params[AudioPeakDetection_ANALYSIS_RATE]->u.pd.value;
+		quality.sample_rate = (rate_choice == AudioPeakDetection_RATE_22050) ? kSampleRate22050 :
+			(rate_choice == AudioPeakDetection_RATE_48000) ? kSampleRate48000 :
+			kSampleRate44100;
+		break;
+	}
+	case AudioPeakDetection_QUALITY_STANDARD:
+	default:
+		break;
+	}
+	return quality;
+}
+
+// Everything that changes the onset frames, so cached frames are only reused
+// by an analysis with the same settings.
+OnsetCacheKey MakeCacheKey(PF_ParamDef* params[], double sample_rate)
+{
+	OnsetCacheKey key;
+	key.onset_function = params[AudioPeakDetection_DETECTION_FUNCTION]->u.pd.value;
+	key.sample_rate = sample_rate;
+	key.low_crossover_hz = params[AudioPeakDetection_LOW_CROSSOVER]->u.fs_d.value;
+	key.high_crossover_hz = params[AudioPeakDetection_HIGH_CROSSOVER]->u.fs_d.value;
+	key.geometry = ReadAnalysisQuality(params).geometry;
+	return key;
+}
+
+A_long LayerItemId(AEGP_SuiteHandler& suites, AEGP_LayerH layerH)
+{
+	AEGP_ItemH itemH = nullptr;
+	A_long item_id = 0;
+	if (suites.LayerSuite9()->AEGP_GetLayerSourceItem(layerH, &itemH) != A_Err_NONE || !itemH ||
+		suites.ItemSuite9()->AEGP_GetItemID(itemH, &item_id) != A_Err_NONE) {
+		return 0;
+	}
+	return item_id;
+}
+
+// Project item played by the Audio Source layer, or 0 when it cannot be
+// determined (the results are then not shared). own_item_id receives the
+// item of the effect's own layer, or 0.
+A_long AudioSourceItemId(PF_InData* in_data, A_long& own_item_id)
+{
+	AEGP_SuiteHandler suites(in_data->pica_basicP);
+	AEGP_LayerH layerH = nullptr;
+	own_item_id = 0;
+	if (suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH) != A_Err_NONE || !layerH) {
+		return 0;
+	}
+	own_item_id = LayerItemId(suites, layerH);
+
+	// Audio Source defaults to the effect's own layer but may name another
+	// layer of the comp; reading it needs the AEGP stream API.
+	if (g_my_plugin_id != 0) {
+		AEGP_EffectRefH effectH = nullptr;
+		if (suites.PFInterfaceSuite1()->AEGP_GetNewEffectForEffect(g_my_plugin_id, in_data->effect_ref, &effectH) == A_Err_NONE && effectH) {
+			AEGP_StreamRefH streamH = nullptr;
+			if (suites.StreamSuite6()->AEGP_GetNewEffectStreamByIndex(g_my_plugin_id, effectH, AudioPeakDetection_INPUT, &streamH) == A_Err_NONE && streamH) {
+				const A_Time now = { in_data->current_time, in_data->time_scale };
+				AEGP_StreamValue2 value{};
+				if (suites.StreamSuite6()->AEGP_GetNewStreamValue(g_my_plugin_id, streamH, AEGP_LTimeMode_LayerTime, &now, FALSE, &value) == A_Err_NONE) {
+					AEGP_CompH compH = nullptr;
+					AEGP_LayerH source_layerH = nullptr;
+					if (value.val.layer_id != 0 &&
+						suites.LayerSuite9()->AEGP_GetLayerParentComp(layerH, &compH) == A_Err_NONE &&
+						suites.LayerSuite9()->AEGP_GetLayerFromLayerID(compH, value.val.layer_id, &source_layerH) == A_Err_NONE &&
+						source_layerH) {
+						layerH = source_layerH;
+					}
+					suites.StreamSuite6()->AEGP_DisposeStreamValue(&value);
+				}
+				suites.StreamSuite6()->AEGP_DisposeStream(streamH);
+			}
+			suites.EffectSuite4()->AEGP_DisposeEffect(effectH);
+		}
+	}
+	return LayerItemId(suites, layerH);
+}
+
+AnalysisResultKey ResultKeyFor(PF_ParamDef* params[], A_long source_item_id, int64_t duration_ticks, A_u_long time_scale)
+{
+	AnalysisResultKey key;
+	key.source_item_id = source_item_id;
+	key.duration_ticks = static_cast<A_long>(std::min<int64_t>(duration_ticks, std::numeric_limits<A_long>::max()));
+	key.time_scale = time_scale;
+	key.detection_function = params[AudioPeakDetection_DETECTION_FUNCTION]->u.pd.value;
+	key.min_separation = params[AudioPeakDetection_MIN_SEPARATION]->u.fs_d.value;
+	key.threshold_multiplier = params[AudioPeakDetection_THRESHOLD_MULTIPLIER]->u.fs_d.value;
+	key.threshold_mode = params[AudioPeakDetection_THRESHOLD_MODE]->u.pd.value;
+	key.threshold_percentile = params[AudioPeakDetection_THRESHOLD_PERCENTILE]->u.fs_d.value;
+	key.percentile_window = params[AudioPeakDetection_PERCENTILE_WINDOW]->u.fs_d.value;
+	key.smoothing = params[AudioPeakDetection_SMOOTHING]->u.fs_d.value;
+	key.low_crossover = params[AudioPeakDetection_LOW_CROSSOVER]->u.fs_d.value;
+	key.high_crossover = params[AudioPeakDetection_HIGH_CROSSOVER]->u.fs_d.value;
+	const AnalysisQuality quality = ReadAnalysisQuality(params);
+	key.fft_size = quality.geometry.fft_size;
+	key.hop_size = quality.geometry.hop_size;
+	key.analysis_rate = quality.sample_rate;
+	return key;
+}
+
+// Returns false when the source cannot be identified.
+bool MakeResultKey(PF_InData* in_data, PF_ParamDef* params[], int64_t duration_ticks, AnalysisResultKey& key)
+{
+	A_long own_item_id = 0;
+	key = ResultKeyFor(params, AudioSourceItemId(in_data, own_item_id), duration_ticks, in_data->time_scale);
+	return key.source_item_id != 0;
+}
+
+// Layer duration in ticks of in_data->time_scale, never zero.
+int64_t LayerDurationTicks(const PF_InData* in_data)
 {
-	const PF_Handle handle = GetStateHandle(in_data, out_data);
-	if (!handle) {
-		return nullptr;
+	int64_t duration_ticks = in_data->total_time;
+	if (duration_ticks <= 0) {
+		duration_ticks = (in_data->time_step > 0) ? in_data->time_step : in_data->time_scale;
 	}
-	return reinterpret_cast<AnalysisState*>(*handle);
+	if (duration_ticks <= 0) {
+		duration_ticks = in_data->time_scale;
+	}
+	return duration_ticks;
 }
 
-std::vector<float> CreateHannWindow()
+// Where BuildPeakMarkers reads the spectral shape of a peak: the packed shape
+// and raw onset value of every frame from frame_origin on. The moving average
+// turns an attack into a plateau whose first frame is picked, up to radius
+// frames before the sound, so the shape is taken at the largest raw value
+// within radius of the peak.
+struct PeakShapeSource {
+	ArenaSpan<const uint64_t> shapes;
+	ArenaSpan<const float> flux;
+	int64_t frame_origin = 0;
+	int radius = 0;
+};
+
+SpectralShape PeakShape(const PeakShapeSource& source, int64_t frame_index, double sample_rate)
 {
-	std::vector<float> window(kFFTSize);
-	constexpr float two_pi = 6.283185307179586476925f;
-	for (int n = 0; n < kFFTSize; ++n) {
-		window[n] = 0.5f - 0.5f * std::cos(two_pi * static_cast<float>(n) / static_cast<float>(kFFTSize - 1));
+	const int64_t count = static_cast<int64_t>(std::min(source.shapes.size(), source.flux.size()));
+	const int64_t frame = frame_index - source.frame_origin;
+	if (frame < 0 || frame >= count) {
+		return SpectralShape();
+	}
+	int64_t attack = frame;
+	const int64_t last = std::min(count - 1, frame + source.radius);
+	for (int64_t other = std::max<int64_t>(0, frame - source.radius); other <= last; ++other) {
+		if (source.flux[static_cast<size_t>(other)] > source.flux[static_cast<size_t>(attack)]) {
+			attack = other;
+		}
 	}
-	return window;
+	return UnpackSpectralShape(source.shapes[static_cast<size_t>(attack)], sample_rate);
 }
 
-void SmoothFlux(const std::vector<float>& in_flux,
-	float smoothing_percent,
-	std::vector<float>& out_flux)
+void BuildPeakMarkers(const CandidatePeak* candidates,
+	size_t candidate_count,
+	float max_flux,
+	const PeakShapeSource& shapes,
+	double sample_rate,
+	const OnsetGeometry& geometry,
+	A_u_long time_scale,
+	std::vector<PeakMarker>& peaks)
 {
-	out_flux = in_flux;
-	if (in_flux.empty()) {
+	peaks.clear();
+	if (max_flux <= 0.0f) {
 		return;
 	}
 
-	const int max_radius = 10;
-	const float clamped_percent = ClampValue(smoothing_percent, 0.0f, 100.0f);
-	const int radius = ClampValue(static_cast<int>(std::round((clamped_percent / 100.0f) * static_cast<float>(max_radius))),
-		0,
-		max_radius);
-	if (radius == 0) {
+	peaks.reserve(candidate_count);
+	for (size_t index = 0; index < candidate_count; ++index) {
+		const CandidatePeak& candidate = candidates[index];
+		const double amplitude_percent = ClampValue((candidate.flux_value / max_flux) * 100.0, 0.0, 100.0);
+
+		PeakMarker marker;
+		marker.time = SecondsToTime(OnsetFrameSeconds(candidate.frame_index, sample_rate, geometry), time_scale);
+		marker.sample = candidate.frame_index * geometry.hop_size;
+		marker.amplitude = static_cast<PF_FpShort>(amplitude_percent);
+		marker.is_loud = (amplitude_percent >= kLoudnessThreshold) ? TRUE : FALSE;
+		marker.shape = PeakShape(shapes, candidate.frame_index, sample_rate);
+		peaks.push_back(marker);
+	}
+}
+
+// Brings the sample positions of markers kept from an analysis at another
+// rate to sample_rate, so the one rate of the results (and of an export)
+// holds for all of them after a range analysis at another Quality.
+void RescaleMarkerSamples(AnalysisResults& results, double sample_rate)
+{
+	if (results.sample_rate <= 0.0 || results.sample_rate == sample_rate) {
 		return;
 	}
+	const double ratio = sample_rate / results.sample_rate;
+	const auto rescale = [ratio](std::vector<PeakMarker>& markers) {
+		for (PeakMarker& marker : markers) {
+			marker.sample = std::llround(static_cast<double>(marker.sample) * ratio);
+		}
+	};
+	rescale(results.peaks);
+	for (std::vector<PeakMarker>& band : results.band_peaks) {
+		rescale(band);
+	}
+	rescale(results.beats);
+	results.sample_rate = sample_rate;
+}
+
+// Replaces the markers of stored that fall in [begin_seconds, end_seconds)
+// with fresh, which must lie in that span; stored stays in time order.
+void MergePeakRange(std::vector<PeakMarker>& stored,
+	const std::vector<PeakMarker>& fresh,
+	double begin_seconds,
+	double end_seconds)
+{
+	auto before = [](const PeakMarker& marker, double seconds) { return TimeToSeconds(marker.time) < seconds; };
+	const auto first = std::lower_bound(stored.begin(), stored.end(), begin_seconds, before);
+	const auto last = std::lower_bound(first, stored.end(), end_seconds, before);
+	const auto position = stored.erase(first, last);
+	stored.insert(position, fresh.begin(), fresh.end());
+}
+
+struct DetectionSettings {
+	A_long detection_function = AudioPeakDetection_ODF_SPECTRAL_FLUX;
+	float min_separation_seconds = 0.0f;
+	float threshold_multiplier = 0.0f;
+	A_long threshold_mode = AudioPeakDetection_THRESHOLD_TRAILING_MEAN;
+	// Quantile (0..1) and look-back of the Rolling Percentile threshold.
+	float threshold_quantile = 0.0f;
+	float percentile_window_seconds = 0.0f;
+	float smoothing_percent = 0.0f;
+	double low_crossover_hz = 0.0;
+	double high_crossover_hz = 0.0;
+	AnalysisQuality quality;
+};
+
+DetectionSettings ReadDetectionSettings(PF_ParamDef* params[])
+{
+	DetectionSettings settings;
+	settings.detection_function = params[AudioPeakDetection_DETECTION_FUNCTION]->u.pd.value;
+	settings.min_separation_seconds = static_cast<float>(params[AudioPeakDetection_MIN_SEPARATION]->u.fs_d.value);
+	settings.threshold_multiplier = static_cast<float>(params[AudioPeakDetection_THRESHOLD_MULTIPLIER]->u.fs_d.value);
+	settings.threshold_mode = params[AudioPeakDetection_THRESHOLD_MODE]->u.pd.value;
+	settings.threshold_quantile = static_cast<float>(params[AudioPeakDetection_THRESHOLD_PERCENTILE]->u.fs_d.value / 100.0);
+	settings.percentile_window_seconds = static_cast<float>(params[AudioPeakDetection_PERCENTILE_WINDOW]->u.fs_d.value);
+	settings.smoothing_percent = static_cast<float>(params[AudioPeakDetection_SMOOTHING]->u.fs_d.value);
+	settings.low_crossover_hz = params[AudioPeakDetection_LOW_CROSSOVER]->u.fs_d.value;
+	settings.high_crossover_hz = params[AudioPeakDetection_HIGH_CROSSOVER]->u.fs_d.value;
+	settings.quality = ReadAnalysisQuality(params);
+	return settings;
+}
+
+PeakPickingSpans DetectionSpans(const DetectionSettings& settings, double frames_per_second)
+{
+	PeakPickingSpans spans = PeakPickingSpansFor(settings.smoothing_percent, settings.min_separation_seconds, frames_per_second);
+	if (settings.threshold_mode == AudioPeakDetection_THRESHOLD_ROLLING_PERCENTILE) {
+		spans.quantile_window = std::max<int64_t>(1,
+			static_cast<int64_t>(std::lround(settings.percentile_window_seconds * frames_per_second)));
+	}
+	return spans;
+}
+
+size_t SelectDetectionPeaks(ArenaSpan<const float> smoothed_flux,
+	const DetectionSettings& settings,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates)
+{
+	if (spans.quantile_window > 0) {
+		return SelectPeaksAboveQuantile(smoothed_flux,
+			settings.threshold_multiplier,
+			settings.threshold_quantile,
+			spans,
+			candidates);
+	}
+	return SelectPeaks(smoothed_flux, settings.threshold_multiplier, spans, candidates);
+}
+
+enum PeakPickOutcome {
+	kPeaksPicked,
+	kNoTransients,
+	kPeakPickOutOfMemory
+};
+
+// Tempo stage, then broadband and band peak picking over the curves of
+// builder. What is found in frames [range_first_frame, range_end_frame)
+// replaces the markers of results inside that span; peak_count and
+// band_counts receive how many were found there.
+PeakPickOutcome PickPeaks(const OnsetCurveBuilder& builder,
+	const DetectionSettings& settings,
+	double sample_rate,
+	A_u_long time_scale,
+	int64_t range_first_frame,
+	int64_t range_end_frame,
+	ScratchArena& arena,
+	AnalysisResults& results,
+	size_t& peak_count,
+	size_t band_counts[AudioPeakDetection_NUM_BANDS])
+{
+	const ArenaSpan<const float> flux = builder.Flux();
+	const int64_t frame_origin = builder.FrameOrigin();
+	PeakShapeSource shapes{ builder.Shapes(), flux, frame_origin, 0 };
+	const OnsetGeometry& geometry = builder.Geometry();
+	const double frames_per_second = OnsetFramesPerSecond(sample_rate, geometry);
+	const double range_begin_seconds = OnsetFrameSeconds(range_first_frame, sample_rate, geometry);
+	const double range_end_seconds = OnsetFrameSeconds(range_end_frame, sample_rate, geometry);
+	std::vector<PeakMarker> fresh_markers;
+	RescaleMarkerSamples(results, sample_rate);
+
+	// Tempo stage: FFT autocorrelation of the onset envelope picks the beat
+	// period, then the DP tracker lays a beat grid over the same envelope.
+	{
+		const BeatGrid grid = TrackBeatGrid(flux, frames_per_second, arena);
+		const ArenaSpan<CandidatePeak> beat_candidates = AllocateSpan<CandidatePeak>(arena, grid.beat_frames.size());
+		if (!grid.beat_frames.empty() && beat_candidates.size() == grid.beat_frames.size()) {
+			float max_beat_flux = 0.0f;
+			for (size_t beat = 0; beat < grid.beat_frames.size(); ++beat) {
+				const float beat_flux = flux[static_cast<size_t>(grid.beat_frames[beat])];
+				beat_candidates[beat] = { grid.beat_frames[beat], beat_flux };
+				max_beat_flux = std::max(max_beat_flux, beat_flux);
+			}
+			const size_t beat_count = ClipCandidates(beat_candidates, beat_candidates.size(), frame_origin, range_first_frame, range_end_frame);
+			BuildPeakMarkers(beat_candidates.data(), beat_count, max_beat_flux, shapes, sample_rate, geometry, time_scale, fresh_markers);
+			MergePeakRange(results.beats, fresh_markers, range_begin_seconds, range_end_seconds);
+			results.tempo_bpm = grid.tempo_bpm;
+		}
+	}
+
+	const PeakPickingSpans spans = DetectionSpans(settings, frames_per_second);
+	const ArenaSpan<const float> smoothed_flux = SmoothFlux(flux, spans.smoothing_radius, arena);
+	const ArenaSpan<CandidatePeak> candidates = AllocateCandidates(arena, builder.FrameCount());
+	if (smoothed_flux.empty() || candidates.empty()) {
+		return kPeakPickOutOfMemory;
+	}
+
+	const auto max_it = std::max_element(smoothed_flux.begin(), smoothed_flux.end());
+	if (max_it == smoothed_flux.end() || *max_it <= 0.0f) {
+		return kNoTransients;
+	}
+	const float max_flux = *max_it;
 
-	std::vector<float> smoothed(in_flux.size(), 0.0f);
-	for (size_t i = 0; i < in_flux.size(); ++i) {
-		const size_t start = (i <= static_cast<size_t>(radius)) ? 0 : i - static_cast<size_t>(radius);
-		const size_t end = std::min(in_flux.size() - 1, i + static_cast<size_t>(radius));
+	// The overlay keeps the curve and threshold of the frames this pass owns.
+	const ArenaSpan<const float> threshold = ThresholdCurve(smoothed_flux,
+		settings.threshold_multiplier,
+		settings.threshold_quantile,
+		spans,
+		arena);
+	if (threshold.empty()) {
+		return kPeakPickOutOfMemory;
+	}
+	const int64_t overlay_first = std::max(frame_origin, range_first_frame);
+	const int64_t overlay_end = std::min(frame_origin + static_cast<int64_t>(smoothed_flux.size()), range_end_frame);
+	if (overlay_end > overlay_first) {
+		const size_t offset = static_cast<size_t>(overlay_first - frame_origin);
+		results.overlay.Assign(frames_per_second,
+			overlay_first,
+			smoothed_flux.data() + offset,
+			threshold.data() + offset,
+			static_cast<size_t>(overlay_end - overlay_first));
+	}
 
-		float sum = 0.0f;
-		for (size_t j = start; j <= end; ++j) {
-			sum += in_flux[j];
+	size_t candidate_count = SelectDetectionPeaks(smoothed_flux, settings, spans, candidates);
+	candidate_count = ClipCandidates(candidates, candidate_count, frame_origin, range_first_frame, range_end_frame);
+	shapes.radius = spans.smoothing_radius;
+	BuildPeakMarkers(candidates.data(), candidate_count, max_flux, shapes, sample_rate, geometry, time_scale, fresh_markers);
+	MergePeakRange(results.peaks, fresh_markers, range_begin_seconds, range_end_seconds);
+	peak_count = fresh_markers.size();
+
+	// Each band keeps its own smoothing, adaptive threshold and peak state so a
+	// dense hat pattern cannot mask the kick underneath it.
+	for (int band = 0; band < AudioPeakDetection_NUM_BANDS; ++band) {
+		const ArenaSpan<const float> smoothed_band_flux = SmoothFlux(builder.BandFlux(band), spans.smoothing_radius, arena);
+		const auto band_max_it = std::max_element(smoothed_band_flux.begin(), smoothed_band_flux.end());
+		fresh_markers.clear();
+		if (band_max_it != smoothed_band_flux.end() && *band_max_it > 0.0f) {
+			candidate_count = SelectDetectionPeaks(smoothed_band_flux, settings, spans, candidates);
+			candidate_count = ClipCandidates(candidates, candidate_count, frame_origin, range_first_frame, range_end_frame);
+			shapes.flux = builder.BandFlux(band);
+			BuildPeakMarkers(candidates.data(), candidate_count, *band_max_it, shapes, sample_rate, geometry, time_scale, fresh_markers);
 		}
-		smoothed[i] = sum / static_cast<float>(end - start + 1);
+		MergePeakRange(results.band_peaks[static_cast<size_t>(band)], fresh_markers, range_begin_seconds, range_end_seconds);
+		band_counts[band] = fresh_markers.size();
+	}
+
+	results.sample_rate = sample_rate;
+	results.has_analyzed = TRUE;
+	return kPeaksPicked;
+}
+
+// Scratch kept alive between analyses; a larger arena (a very long layer) is
+// released after the analysis instead of being pinned for the session.
+constexpr size_t kArenaRetainBytes = static_cast<size_t>(128) << 20;
+
+// Queued audio a comp analysis may hold at once, across all its layers.
+constexpr size_t kBatchMemoryBudgetBytes = static_cast<size_t>(256) << 20;
+
+// A project item analyzed by Analyze Comp, and the comp layers showing it.
+struct BatchSource {
+	AEGP_ItemH itemH = nullptr;
+	int64_t sample_count = 0;
+	AnalysisResultKey key;
+	std::shared_ptr<const AnalysisResults> results;
+};
+
+struct BatchLayer {
+	AEGP_LayerH layerH = nullptr;
+	size_t source = 0;
+};
+
+SampleEncoding EncodingOfSoundData(const AEGP_SoundDataFormat& format)
+{
+	if (format.encoding == AEGP_SoundEncoding_FLOAT && format.bytes_per_sampleL == PF_SSS_4) {
+		return kSampleFloat32;
+	}
+	if (format.encoding == AEGP_SoundEncoding_SIGNED_PCM && format.bytes_per_sampleL == PF_SSS_2) {
+		return kSampleInt16;
+	}
+	if (format.encoding == AEGP_SoundEncoding_SIGNED_PCM && format.bytes_per_sampleL == PF_SSS_1) {
+		return kSampleInt8;
+	}
+	return kSampleUnknown;
+}
+
+// Expresses count samples from first_sample on at samples_per_second as an
+// A_Time range, coarsening the scale past about 13.5 hours at 44.1 kHz (see
+// SampleRangeToTicks). Returns false when no scale fits, rather than
+// clamping the range.
+bool SampleRangeToTimes(int64_t first_sample,
+	int64_t count,
+	A_u_long samples_per_second,
+	A_Time& start,
+	A_Time& duration)
+{
+	TickRange range;
+	if (!SampleRangeToTicks(first_sample, count, samples_per_second, std::numeric_limits<A_long>::max(), range)) {
+		return false;
+	}
+	start = { static_cast<A_long>(range.first_tick), static_cast<A_u_long>(range.ticks_per_second) };
+	duration = { static_cast<A_long>(range.tick_count), static_cast<A_u_long>(range.ticks_per_second) };
+	return true;
+}
+
+// Renders count samples of an item's audio from first_sample on and downmixes
+// them to mono. Samples the host does not deliver are left silent. Returns
+// A_Err_PARAMETER when the range cannot be addressed in A_Time.
+A_Err RenderItemAudio(const AEGP_SuiteHandler& suites,
+	AEGP_ItemH itemH,
+	double sample_rate,
+	int64_t first_sample,
+	int64_t count,
+	std::vector<float>& mono)
+{
+	mono.assign(static_cast<size_t>(count), 0.0f);
+
+	AEGP_SoundDataFormat format{};
+	format.sample_rateF = sample_rate;
+	format.encoding = AEGP_SoundEncoding_FLOAT;
+	format.bytes_per_sampleL = PF_SSS_4;
+	format.num_channelsL = PF_Channels_STEREO;
+
+	// Times in samples keep consecutive windows sample-exact.
+	const A_u_long samples_per_second = static_cast<A_u_long>(std::llround(sample_rate));
+	A_Time start{};
+	A_Time duration{};
+	if (!SampleRangeToTimes(first_sample, count, samples_per_second, start, duration)) {
+		return A_Err_PARAMETER;
+	}
+	AEGP_SoundDataH soundH = nullptr;
+	A_Err ae_err = suites.RenderSuite5()->AEGP_RenderNewItemSoundData(itemH, &start, &duration, &format, nullptr, nullptr, &soundH);
+	if (ae_err != A_Err_NONE || !soundH) {
+		return ae_err;
 	}
 
-	out_flux.swap(smoothed);
+	AEGP_SoundDataFormat delivered{};
+	A_long sample_frames = 0;
+	void* samples = nullptr;
+	ae_err = suites.SoundDataSuite1()->AEGP_GetSoundDataFormat(soundH, &delivered);
+	if (ae_err == A_Err_NONE) {
+		ae_err = suites.SoundDataSuite1()->AEGP_GetNumSamples(soundH, &sample_frames);
+	}
+	if (ae_err == A_Err_NONE) {
+		ae_err = suites.SoundDataSuite1()->AEGP_LockSoundDataSamples(soundH, &samples);
+	}
+	if (ae_err == A_Err_NONE) {
+		const SampleEncoding encoding = EncodingOfSoundData(delivered);
+		if (samples && encoding != kSampleUnknown && delivered.num_channelsL > 0 && sample_frames > 0) {
+			DownmixToMono(samples,
+				encoding,
+				delivered.num_channelsL,
+				static_cast<size_t>(std::min<int64_t>(sample_frames, count)),
+				mono.data());
+		}
+		suites.SoundDataSuite1()->AEGP_UnlockSoundDataSamples(soundH);
+	}
+	suites.SoundDataSuite1()->AEGP_DisposeSoundData(soundH);
+	return ae_err;
 }
 
+struct BandMarkerStyle {
+	const char* name;
+	A_long label;
+};
+
+constexpr BandMarkerStyle kBandMarkerStyles[AudioPeakDetection_NUM_BANDS] = {
+	{ "Low", 9 },
+	{ "Mid", 6 },
+	{ "High", 3 },
+};
+
+constexpr A_long kBeatMarkerLabel = 2;
+
+// Peak marker labels of the Sound Type mode, in OnsetSoundType order.
+constexpr BandMarkerStyle kSoundTypeMarkerStyles[] = {
+	{ "Low Hit", 9 },
+	{ "Noisy Hit", 6 },
+	{ "High Hit", 3 },
+	{ "Tonal", 10 },
+};
+
+// Peak marker labels of the Brightness mode: the first whose ceiling is
+// above the spectral centroid.
+struct BrightnessMarkerStyle {
+	float centroid_ceiling_hz;
+	BandMarkerStyle style;
+};
+
+constexpr BrightnessMarkerStyle kBrightnessMarkerStyles[] = {
+	{ 500.0f, { "Dark", 8 } },
+	{ 1500.0f, { "Warm", 9 } },
+	{ 4000.0f, { "Bright", 2 } },
+	{ 1.0e9f, { "Airy", 1 } },
+};
+
 } // namespace
 
 /* ------------------------------------------------------------- About */
@@ -312,6 +944,16 @@ static PF_Err ParamsSetup(PF_InData* in_data,
         }
         ++param_index;
 
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Detection_Function_Popup_Name),
+                AudioPeakDetection_ODF_NUM_CHOICES,
+                AudioPeakDetection_ODF_SPECTRAL_FLUX,
+                STR(StrID_Detection_Function_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_DETECTION_FUNCTION_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
         AEFX_CLR_STRUCT(def);
         PF_ADD_FLOAT_SLIDERX(STR(StrID_Min_Gap_Slider_Name),
                 AudioPeakDetection_MIN_SEPARATION_MIN,
@@ -342,6 +984,46 @@ static PF_Err ParamsSetup(PF_InData* in_data,
                 ++param_index;
         }
 
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Threshold_Mode_Popup_Name),
+                AudioPeakDetection_THRESHOLD_NUM_CHOICES,
+                AudioPeakDetection_THRESHOLD_TRAILING_MEAN,
+                STR(StrID_Threshold_Mode_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_THRESHOLD_MODE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Threshold_Percentile_Slider_Name),
+                AudioPeakDetection_THRESHOLD_PERCENTILE_MIN,
+                AudioPeakDetection_THRESHOLD_PERCENTILE_MAX,
+                AudioPeakDetection_THRESHOLD_PERCENTILE_MIN,
+                AudioPeakDetection_THRESHOLD_PERCENTILE_MAX,
+                AudioPeakDetection_THRESHOLD_PERCENTILE_DFLT,
+                PF_Precision_TENTHS,
+                0,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_THRESHOLD_PERCENTILE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Percentile_Window_Slider_Name),
+                AudioPeakDetection_PERCENTILE_WINDOW_MIN,
+                AudioPeakDetection_PERCENTILE_WINDOW_MAX,
+                AudioPeakDetection_PERCENTILE_WINDOW_MIN,
+                AudioPeakDetection_PERCENTILE_WINDOW_SLIDER_MAX,
+                AudioPeakDetection_PERCENTILE_WINDOW_DFLT,
+                PF_Precision_TENTHS,
+                0,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_PERCENTILE_WINDOW_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
         AEFX_CLR_STRUCT(def);
         PF_ADD_FLOAT_SLIDERX(STR(StrID_Smoothing_Slider_Name),
                 AudioPeakDetection_SMOOTHING_MIN,
@@ -357,6 +1039,31 @@ static PF_Err ParamsSetup(PF_InData* in_data,
                 ++param_index;
         }
 
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Target_Density_Slider_Name),
+                AudioPeakDetection_TARGET_DENSITY_MIN,
+                AudioPeakDetection_TARGET_DENSITY_MAX,
+                AudioPeakDetection_TARGET_DENSITY_MIN,
+                AudioPeakDetection_TARGET_DENSITY_SLIDER_MAX,
+                AudioPeakDetection_TARGET_DENSITY_DFLT,
+                PF_Precision_TENTHS,
+                0,
+                PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_TARGET_DENSITY_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Suggest_Button_Name),
+                STR(StrID_Suggest_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_SUGGEST_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
         AEFX_CLR_STRUCT(def);
         def.param_type = PF_Param_GROUP_END;
         PF_STRNNCPY(def.name, STR(StrID_Detection_Group_Name), sizeof(def.name));
@@ -371,50 +1078,411 @@ static PF_Err ParamsSetup(PF_InData* in_data,
         ++param_index;
 
         AEFX_CLR_STRUCT(def);
-        PF_ADD_BUTTON(STR(StrID_Analyze_Button_Name),
-                STR(StrID_Analyze_Button_Name),
+        def.param_type = PF_Param_GROUP_START;
+        PF_STRNNCPY(def.name, STR(StrID_Band_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_COLLAPSE_TWIRLY | PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_BAND_GROUP_START_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_CHECKBOXX(STR(StrID_Band_Markers_Checkbox_Name),
+                FALSE,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_BAND_MARKERS_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Low_Crossover_Slider_Name),
+                AudioPeakDetection_LOW_CROSSOVER_MIN,
+                AudioPeakDetection_LOW_CROSSOVER_MAX,
+                AudioPeakDetection_LOW_CROSSOVER_MIN,
+                AudioPeakDetection_LOW_CROSSOVER_MAX,
+                AudioPeakDetection_LOW_CROSSOVER_DFLT,
+                PF_Precision_INTEGER,
                 0,
-                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
-                AUDIO_PEAK_DETECTOR_ANALYZE_BUTTON_DISK_ID);
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_LOW_CROSSOVER_DISK_ID);
         if (!err) {
                 ++param_index;
         }
 
         AEFX_CLR_STRUCT(def);
-        PF_ADD_BUTTON(STR(StrID_Create_Markers_Button_Name),
-                STR(StrID_Create_Markers_Button_Name),
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_High_Crossover_Slider_Name),
+                AudioPeakDetection_HIGH_CROSSOVER_MIN,
+                AudioPeakDetection_HIGH_CROSSOVER_MAX,
+                AudioPeakDetection_HIGH_CROSSOVER_MIN,
+                AudioPeakDetection_HIGH_CROSSOVER_MAX,
+                AudioPeakDetection_HIGH_CROSSOVER_DFLT,
+                PF_Precision_INTEGER,
                 0,
-                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
-                AUDIO_PEAK_DETECTOR_CREATE_MARKERS_BUTTON_DISK_ID);
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_HIGH_CROSSOVER_DISK_ID);
         if (!err) {
                 ++param_index;
         }
 
-        if (!err && param_index != kExpectedParamCount) {
-                err = PF_Err_BAD_CALLBACK_PARAM;
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_END;
+        PF_STRNNCPY(def.name, STR(StrID_Band_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_BAND_GROUP_END_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
         }
+        ++param_index;
 
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_CHECKBOXX(STR(StrID_Beat_Markers_Checkbox_Name),
+                FALSE,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_BEAT_MARKERS_DISK_ID);
         if (!err) {
-                out_data->num_params = param_index;
+                ++param_index;
         }
 
-        return err;
-}
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_START;
+        PF_STRNNCPY(def.name, STR(StrID_Range_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_COLLAPSE_TWIRLY | PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_RANGE_GROUP_START_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
 
-/* ---------------------------------------------------- SequenceSetup */
-static PF_Err SequenceSetup(PF_InData* in_data,
-	PF_OutData* out_data,
-	PF_ParamDef* params[],
-	PF_LayerDef* output)
-{
-	PF_Handle state_handle = PF_NEW_HANDLE(sizeof(AnalysisState));
-	if (!state_handle) {
-		return PF_Err_OUT_OF_MEMORY;
-	}
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Range_Popup_Name),
+                AudioPeakDetection_RANGE_NUM_CHOICES,
+                AudioPeakDetection_RANGE_ENTIRE_LAYER,
+                STR(StrID_Range_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_RANGE_MODE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
 
-	void* memory = *state_handle;
-	new (memory) AnalysisState();
-	out_data->sequence_data = state_handle;
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Range_Start_Slider_Name),
+                AudioPeakDetection_RANGE_SECONDS_MIN,
+                AudioPeakDetection_RANGE_SECONDS_MAX,
+                AudioPeakDetection_RANGE_SECONDS_MIN,
+                AudioPeakDetection_RANGE_SECONDS_SLIDER_MAX,
+                AudioPeakDetection_RANGE_START_DFLT,
+                PF_Precision_HUNDREDTHS,
+                0,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_RANGE_START_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Range_End_Slider_Name),
+                AudioPeakDetection_RANGE_SECONDS_MIN,
+                AudioPeakDetection_RANGE_SECONDS_MAX,
+                AudioPeakDetection_RANGE_SECONDS_MIN,
+                AudioPeakDetection_RANGE_SECONDS_SLIDER_MAX,
+                AudioPeakDetection_RANGE_END_DFLT,
+                PF_Precision_HUNDREDTHS,
+                0,
+                PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE,
+                AUDIO_PEAK_DETECTOR_RANGE_END_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_END;
+        PF_STRNNCPY(def.name, STR(StrID_Range_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_RANGE_GROUP_END_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_START;
+        PF_STRNNCPY(def.name, STR(StrID_Quality_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_COLLAPSE_TWIRLY | PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_QUALITY_GROUP_START_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Quality_Popup_Name),
+                AudioPeakDetection_QUALITY_NUM_CHOICES,
+                AudioPeakDetection_QUALITY_STANDARD,
+                STR(StrID_Quality_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_QUALITY_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_FFT_Size_Popup_Name),
+                AudioPeakDetection_FFT_SIZE_NUM_CHOICES,
+                AudioPeakDetection_FFT_SIZE_2048,
+                STR(StrID_FFT_Size_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_FFT_SIZE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Overlap_Popup_Name),
+                AudioPeakDetection_OVERLAP_NUM_CHOICES,
+                AudioPeakDetection_OVERLAP_50,
+                STR(StrID_Overlap_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_OVERLAP_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Analysis_Rate_Popup_Name),
+                AudioPeakDetection_RATE_NUM_CHOICES,
+                AudioPeakDetection_RATE_44100,
+                STR(StrID_Analysis_Rate_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_ANALYSIS_RATE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_END;
+        PF_STRNNCPY(def.name, STR(StrID_Quality_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_CANNOT_TIME_VARY | PF_ParamFlag_SUPERVISE;
+        def.uu.id = AUDIO_PEAK_DETECTOR_QUALITY_GROUP_END_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_START;
+        PF_STRNNCPY(def.name, STR(StrID_Overlay_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_COLLAPSE_TWIRLY;
+        def.uu.id = AUDIO_PEAK_DETECTOR_OVERLAY_GROUP_START_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_CHECKBOXX(STR(StrID_Show_Overlay_Checkbox_Name),
+                FALSE,
+                0,
+                AUDIO_PEAK_DETECTOR_SHOW_OVERLAY_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Overlay_Span_Slider_Name),
+                AudioPeakDetection_OVERLAY_SPAN_MIN,
+                AudioPeakDetection_OVERLAY_SPAN_MAX,
+                AudioPeakDetection_OVERLAY_SPAN_MIN,
+                AudioPeakDetection_OVERLAY_SPAN_SLIDER_MAX,
+                AudioPeakDetection_OVERLAY_SPAN_DFLT,
+                PF_Precision_TENTHS,
+                0,
+                0,
+                AUDIO_PEAK_DETECTOR_OVERLAY_SPAN_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_END;
+        PF_STRNNCPY(def.name, STR(StrID_Overlay_Group_Name), sizeof(def.name));
+        def.uu.id = AUDIO_PEAK_DETECTOR_OVERLAY_GROUP_END_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_START;
+        PF_STRNNCPY(def.name, STR(StrID_Export_Group_Name), sizeof(def.name));
+        def.flags = PF_ParamFlag_COLLAPSE_TWIRLY | PF_ParamFlag_CANNOT_TIME_VARY;
+        def.uu.id = AUDIO_PEAK_DETECTOR_EXPORT_GROUP_START_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Export_Format_Popup_Name),
+                AudioPeakDetection_EXPORT_NUM_CHOICES,
+                AudioPeakDetection_EXPORT_CSV,
+                STR(StrID_Export_Format_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_EXPORT_FORMAT_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_CHECKBOXX(STR(StrID_Export_Onset_Curve_Checkbox_Name),
+                FALSE,
+                0,
+                AUDIO_PEAK_DETECTOR_EXPORT_ONSET_CURVE_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Export_Button_Name),
+                STR(StrID_Export_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_EXPORT_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        def.param_type = PF_Param_GROUP_END;
+        PF_STRNNCPY(def.name, STR(StrID_Export_Group_Name), sizeof(def.name));
+        def.uu.id = AUDIO_PEAK_DETECTOR_EXPORT_GROUP_END_DISK_ID;
+        if (!err) {
+                err = AddParam(in_data, param_index, &def);
+        }
+        if (err != PF_Err_NONE) {
+                return err;
+        }
+        ++param_index;
+
+        // Keyframe Onset Strength writes the onset curve here, one keyframe
+        // per comp frame, for expressions and animation to follow.
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_FLOAT_SLIDERX(STR(StrID_Onset_Strength_Slider_Name),
+                AudioPeakDetection_ONSET_STRENGTH_MIN,
+                AudioPeakDetection_ONSET_STRENGTH_MAX,
+                AudioPeakDetection_ONSET_STRENGTH_MIN,
+                AudioPeakDetection_ONSET_STRENGTH_MAX,
+                AudioPeakDetection_ONSET_STRENGTH_DFLT,
+                PF_Precision_TENTHS,
+                0,
+                0,
+                AUDIO_PEAK_DETECTOR_ONSET_STRENGTH_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Analyze_Button_Name),
+                STR(StrID_Analyze_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_ANALYZE_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_POPUP(STR(StrID_Marker_Labels_Popup_Name),
+                AudioPeakDetection_LABELS_NUM_CHOICES,
+                AudioPeakDetection_LABELS_LOUDNESS,
+                STR(StrID_Marker_Labels_Popup_Choices),
+                AUDIO_PEAK_DETECTOR_MARKER_LABELS_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Create_Markers_Button_Name),
+                STR(StrID_Create_Markers_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_CREATE_MARKERS_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Keyframe_Button_Name),
+                STR(StrID_Keyframe_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_KEYFRAME_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        AEFX_CLR_STRUCT(def);
+        PF_ADD_BUTTON(STR(StrID_Analyze_Comp_Button_Name),
+                STR(StrID_Analyze_Comp_Button_Name),
+                0,
+                PF_ParamFlag_SUPERVISE | PF_ParamFlag_CANNOT_TIME_VARY,
+                AUDIO_PEAK_DETECTOR_ANALYZE_COMP_BUTTON_DISK_ID);
+        if (!err) {
+                ++param_index;
+        }
+
+        if (!err && param_index != kExpectedParamCount) {
+                err = PF_Err_BAD_CALLBACK_PARAM;
+        }
+
+        if (!err) {
+                out_data->num_params = param_index;
+        }
+
+        return err;
+}
+
+/* ---------------------------------------------------- SequenceSetup */
+static PF_Err SequenceSetup(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[],
+	PF_LayerDef* output)
+{
+	PF_Handle state_handle = PF_NEW_HANDLE(sizeof(SequenceHandleData));
+	if (!state_handle) {
+		return PF_Err_OUT_OF_MEMORY;
+	}
+
+	SequenceHandleData* data = new (*state_handle) SequenceHandleData();
+	data->instance_id = AnalysisRegistry::Get().Attach(state_handle, 0, 0);
+	data->session = AnalysisRegistry::Get().Session();
+	if (data->instance_id == 0) {
+		(*in_data->utils->host_dispose_handle)(state_handle);
+		return PF_Err_OUT_OF_MEMORY;
+	}
+	out_data->sequence_data = state_handle;
 	return PF_Err_NONE;
 }
 
@@ -426,6 +1494,25 @@ static PF_Err SequenceResetup(PF_InData* in_data,
 	if (!in_data->sequence_data) {
 		return SequenceSetup(in_data, out_data, params, output);
 	}
+
+	// Called for the original after a save, for a project being opened and
+	// for a duplicate holding a bitwise copy of the original's handle.
+	// Results are not saved with the project, so a reopened effect starts
+	// empty (its saved session is not this one), while a duplicate shares
+	// the original's results.
+	PF_Handle state_handle = reinterpret_cast<PF_Handle>(in_data->sequence_data);
+	SequenceHandleData* data = GetHandleData(state_handle);
+	const uint64_t previous_id = data ? data->instance_id : 0;
+	const A_u_long previous_session = data ? data->session : 0;
+	if (!data) {
+		data = new (*state_handle) SequenceHandleData();
+	}
+	data->instance_id = AnalysisRegistry::Get().Attach(state_handle, previous_id, previous_session);
+	data->session = AnalysisRegistry::Get().Session();
+	if (data->instance_id == 0) {
+		return PF_Err_OUT_OF_MEMORY;
+	}
+	out_data->sequence_data = state_handle;
 	return PF_Err_NONE;
 }
 
@@ -436,8 +1523,10 @@ static PF_Err SequenceSetdown(PF_InData* in_data,
 {
 	PF_Handle state_handle = reinterpret_cast<PF_Handle>(in_data->sequence_data);
 	if (state_handle) {
-		AnalysisState* state = reinterpret_cast<AnalysisState*>(*state_handle);
-		state->~AnalysisState();
+		const SequenceHandleData* data = GetHandleData(state_handle);
+		if (data) {
+			AnalysisRegistry::Get().Release(state_handle, data->instance_id);
+		}
 		(*in_data->utils->host_dispose_handle)(state_handle);
 		in_data->sequence_data = nullptr;
 	}
@@ -453,504 +1542,1725 @@ static PF_Err SequenceFlatten(PF_InData* /*in_data*/,
 }
 
 /* ----------------------------------------------------------- Render */
-static PF_Err Render(PF_InData* /*in_data*/,
-	PF_OutData* /*out_data*/,
-	PF_ParamDef* /*params*/[],
-	PF_LayerDef* /*output*/)
-{
-	// Visual render path is a no-op.
-	return PF_Err_NONE;
-}
+namespace {
 
-/* -------------------------------------------------------- Audio path */
-static PF_Err AudioSetup(PF_InData* in_data,
-	PF_OutData* out_data,
-	PF_ParamDef* /*params*/[],
-	PF_LayerDef* /*output*/)
-{
-	out_data->start_sampL = 0;
-	out_data->dur_sampL = in_data->total_sampL;
-	return PF_Err_NONE;
-}
+// Overlay colours, alpha first as in PF_Pixel.
+constexpr PF_Pixel kOverlayBackground = { 160, 0, 0, 0 };
+constexpr PF_Pixel kOverlayFlux = { 255, 200, 70, 190 };
+constexpr PF_Pixel kOverlayThreshold = { 255, 255, 150, 40 };
+constexpr PF_Pixel kOverlayPeak = { 255, 255, 255, 255 };
+constexpr PF_Pixel kOverlayPlayhead = { 255, 255, 60, 60 };
+// Share of the frame height taken by the overlay strip along the bottom.
+constexpr double kOverlayHeightShare = 0.3;
 
-static PF_Err AudioRender(PF_InData* in_data,
-	PF_OutData* out_data,
-	PF_ParamDef* /*params*/[],
-	PF_LayerDef* /*output*/)
+void BlendPixel(PF_Pixel& pixel, const PF_Pixel& color)
 {
-	// Pass-through to keep host audio intact.
-	out_data->dest_snd = in_data->src_snd;
-	out_data->start_sampL = in_data->start_sampL;
-	out_data->dur_sampL = in_data->dur_sampL;
-	return PF_Err_NONE;
+	const int alpha = color.alpha;
+	pixel.red = static_cast<A_u_char>((color.red * alpha + pixel.red * (255 - alpha)) / 255);
+	pixel.green = static_cast<A_u_char>((color.green * alpha + pixel.green * (255 - alpha)) / 255);
+	pixel.blue = static_cast<A_u_char>((color.blue * alpha + pixel.blue * (255 - alpha)) / 255);
+	pixel.alpha = static_cast<A_u_char>(std::max<int>(pixel.alpha, alpha));
 }
 
-static PF_Err AudioSetdown(PF_InData* /*in_data*/,
-	PF_OutData* /*out_data*/,
-	PF_ParamDef* /*params*/[],
-	PF_LayerDef* /*output*/)
+// Blends color over rows [top, bottom] of column x.
+void BlendColumn(PF_LayerDef* world, A_long x, A_long top, A_long bottom, const PF_Pixel& color)
 {
-	return PF_Err_NONE;
+	top = std::max<A_long>(top, 0);
+	bottom = std::min<A_long>(bottom, world->height - 1);
+	if (x < 0 || x >= world->width) {
+		return;
+	}
+	char* const base = reinterpret_cast<char*>(world->data);
+	for (A_long y = top; y <= bottom; ++y) {
+		BlendPixel(reinterpret_cast<PF_Pixel*>(base + static_cast<ptrdiff_t>(y) * world->rowbytes)[x], color);
+	}
 }
 
-/* ------------------------------------------------------- AnalyzeAudio */
-static PF_Err AnalyzeAudio(PF_InData* in_data,
+// Draws the smoothed onset curve, its adaptive threshold and the peaks of
+// span_seconds around the current time along the bottom of output. Ranges
+// come from the overlay pyramid one column at a time and peaks are found by
+// binary search per column, so the cost follows the output width whatever
+// the layer length or span.
+void DrawOnsetOverlay(const PF_InData* in_data,
+	const AnalysisResults& results,
+	double span_seconds,
+	PF_LayerDef* output)
+{
+	const OnsetOverlayPyramid& overlay = results.overlay;
+	const A_long width = output->width;
+	const A_long strip_height = std::max<A_long>(8, static_cast<A_long>(std::lround(output->height * kOverlayHeightShare)));
+	const A_long strip_bottom = output->height - 1;
+	const A_long strip_top = std::max<A_long>(0, output->height - strip_height);
+	const float max_value = overlay.MaxValue();
+	if (width <= 0 || max_value <= 0.0f || in_data->time_scale == 0) {
+		return;
+	}
+
+	const double now_seconds = static_cast<double>(in_data->current_time) / static_cast<double>(in_data->time_scale);
+	const double begin_seconds = now_seconds - span_seconds / 2.0;
+	const double seconds_per_column = span_seconds / static_cast<double>(width);
+	const double scale = static_cast<double>(strip_bottom - strip_top) / static_cast<double>(max_value);
+	auto row_of = [&](float value) {
+		return strip_bottom - static_cast<A_long>(std::lround(static_cast<double>(value) * scale));
+	};
+
+	std::vector<OverlayRange> ranges(static_cast<size_t>(width));
+	overlay.Query(begin_seconds * overlay.FramesPerSecond(),
+		seconds_per_column * overlay.FramesPerSecond(),
+		ranges.data(),
+		ranges.size());
+	for (A_long x = 0; x < width; ++x) {
+		BlendColumn(output, x, strip_top, strip_bottom, kOverlayBackground);
+		const OverlayRange& range = ranges[static_cast<size_t>(x)];
+		if (range.covered) {
+			BlendColumn(output, x, row_of(range.flux_max), strip_bottom, kOverlayFlux);
+			BlendColumn(output, x, row_of(range.threshold_max), row_of(range.threshold_min), kOverlayThreshold);
+		}
+	}
+
+	// One tick per column that holds a peak; the search skips the rest of
+	// the column's peaks.
+	auto before = [](const PeakMarker& marker, double seconds) { return TimeToSeconds(marker.time) < seconds; };
+	const double end_seconds = begin_seconds + span_seconds;
+	auto peak = std::lower_bound(results.peaks.begin(), results.peaks.end(), begin_seconds, before);
+	while (peak != results.peaks.end() && TimeToSeconds(peak->time) < end_seconds) {
+		const A_long x = static_cast<A_long>((TimeToSeconds(peak->time) - begin_seconds) / seconds_per_column);
+		BlendColumn(output, x, strip_top, strip_bottom, kOverlayPeak);
+		peak = std::lower_bound(peak, results.peaks.end(), begin_seconds + seconds_per_column * (x + 1), before);
+	}
+
+	BlendColumn(output, width / 2, strip_top, strip_bottom, kOverlayPlayhead);
+}
+
+} // namespace
+
+static PF_Err Render(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[],
+	PF_LayerDef* output)
+{
+	// Without the overlay the visual render path stays a no-op.
+	if (!params[AudioPeakDetection_SHOW_OVERLAY]->u.bd.value) {
+		return PF_Err_NONE;
+	}
+
+	PF_Err err = PF_COPY(&params[AudioPeakDetection_INPUT]->u.ld, output, NULL, NULL);
+	if (err != PF_Err_NONE) {
+		return err;
+	}
+
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	const std::shared_ptr<const AnalysisResults> results = state ? state->Results() : nullptr;
+	if (results && !results->overlay.Empty()) {
+		DrawOnsetOverlay(in_data, *results, params[AudioPeakDetection_OVERLAY_SPAN]->u.fs_d.value, output);
+	}
+	return PF_Err_NONE;
+}
+
+/* -------------------------------------------------------- Audio path */
+// Finds or sets up the flux cache of the footage the layer plays, so
+// AudioRender only adds frames to it and never allocates, and makes this
+// instance the one that feeds it. The footage item is only known once Analyze
+// has run (or the instance was duplicated from one that did); until then
+// nothing is primed.
+static void PrepareFluxCache(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[])
+{
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	if (!state) {
+		return;
+	}
+	OnsetSourceKey key;
+	key.source_item_id = state->own_item_id.load();
+	if (!params || key.source_item_id == 0) {
+		state->SetPrimeCache(nullptr);
+		return;
+	}
+
+	key.onset = MakeCacheKey(params, static_cast<double>(ReadAnalysisQuality(params).sample_rate) / 65536.0);
+	const std::shared_ptr<SharedFluxCache> shared =
+		AnalysisRegistry::Get().PrepareFluxCache(key, OnsetFrameCount(in_data->total_sampL, key.onset.geometry));
+	if (shared) {
+		std::lock_guard<std::mutex> lock(shared->mutex);
+		shared->cache.MonoScratch().resize(kDownmixChunkFrames);
+		shared->feeder = state.get();
+	}
+	state->SetPrimeCache(shared);
+}
+
+static PF_Err AudioSetup(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[],
+	PF_LayerDef* /*output*/)
+{
+	out_data->start_sampL = 0;
+	out_data->dur_sampL = in_data->total_sampL;
+
+	PrepareFluxCache(in_data, out_data, params);
+	return PF_Err_NONE;
+}
+
+// Runs the buffer being played through the flux cache of the layer's footage
+// so a later Analyze of that footage can reuse those frames instead of
+// checking the audio out again. One hop of FFT per hop of samples is all this
+// adds to a render call. Analyze only reuses frames computed at the Quality's
+// rate, so playback at any other rate primes nothing rather than paying for
+// frames that are never read. The cache is set up by AudioSetup (see
+// PrepareFluxCache); a render with other settings adds nothing to it.
+static void PrimeFluxCache(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[])
+{
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	const std::shared_ptr<SharedFluxCache> shared = state ? state->PrimeCache() : nullptr;
+	const PF_SoundWorld& sound = in_data->src_snd;
+	const SampleEncoding encoding = EncodingOf(sound.fi.format, sound.fi.bytes_per_sample);
+	if (!shared || !params || !sound.dataP || sound.num_samples <= 0 || sound.fi.rateF <= 0.0 ||
+		sound.fi.num_channels <= 0 || encoding == kSampleUnknown) {
+		return;
+	}
+
+	const double analysis_rate = static_cast<double>(ReadAnalysisQuality(params).sample_rate) / 65536.0;
+	if (std::fabs(sound.fi.rateF - analysis_rate) > 0.5) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(shared->mutex);
+	OnsetFluxCache& cache = shared->cache;
+	std::vector<float>& mono = cache.MonoScratch();
+	if (shared->feeder != state.get() || cache.Key() != MakeCacheKey(params, analysis_rate) ||
+		mono.size() < kDownmixChunkFrames) {
+		return;
+	}
+	const size_t frame_stride = static_cast<size_t>(sound.fi.bytes_per_sample) * static_cast<size_t>(sound.fi.num_channels);
+	const size_t sample_count = static_cast<size_t>(sound.num_samples);
+	for (size_t done = 0; done < sample_count;) {
+		const size_t chunk = std::min(kDownmixChunkFrames, sample_count - done);
+		DownmixToMono(static_cast<const char*>(sound.dataP) + done * frame_stride,
+			encoding,
+			sound.fi.num_channels,
+			chunk,
+			mono.data());
+		cache.AddSamples(static_cast<int64_t>(in_data->start_sampL) + static_cast<int64_t>(done), mono.data(), chunk);
+		done += chunk;
+	}
+}
+
+static PF_Err AudioRender(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[],
+	PF_LayerDef* /*output*/)
+{
+	// Pass-through to keep host audio intact.
+	out_data->dest_snd = in_data->src_snd;
+	out_data->start_sampL = in_data->start_sampL;
+	out_data->dur_sampL = in_data->dur_sampL;
+
+	PrimeFluxCache(in_data, out_data, params);
+	return PF_Err_NONE;
+}
+
+static PF_Err AudioSetdown(PF_InData* /*in_data*/,
+	PF_OutData* /*out_data*/,
+	PF_ParamDef* /*params*/[],
+	PF_LayerDef* /*output*/)
+{
+	return PF_Err_NONE;
+}
+
+/* ------------------------------------------------------- AnalyzeAudio */
+static PF_Err AnalyzeAudio(PF_InData* in_data,
 	PF_OutData* out_data,
 	PF_ParamDef* params[])
 {
-	AnalysisState* state = GetState(in_data, out_data);
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
 	if (!state) {
 		return PF_Err_INTERNAL_STRUCT_DAMAGED;
 	}
 
-	state->peaks.clear();
-	state->has_analyzed = FALSE;
+	const int64_t duration_ticks = LayerDurationTicks(in_data);
+	const int64_t time_scale = std::max<int64_t>(1, static_cast<int64_t>(in_data->time_scale));
+	const int64_t window_ticks = std::min<int64_t>(time_scale * kCheckoutWindowSeconds, std::numeric_limits<A_long>::max());
+
+	// A partial range only replaces the markers inside it; analyzing the whole
+	// layer starts from scratch.
+	int64_t range_begin_ticks = 0;
+	int64_t range_end_ticks = duration_ticks;
+	PF_Err err = ResolveAnalysisRange(in_data, params, duration_ticks, range_begin_ticks, range_end_ticks);
+	if (err != PF_Err_NONE) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Unable to read the analysis range.");
+		}
+		return err;
+	}
+	if (range_end_ticks <= range_begin_ticks) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: The analysis range is empty.");
+		}
+		return PF_Err_NONE;
+	}
+	const bool whole_layer = (range_begin_ticks == 0 && range_end_ticks == duration_ticks);
+
+	// Another instance may already have analyzed the same footage with the
+	// same settings; its whole-layer results are shared instead of recomputed.
+	// Analyzing again with the shared results in hand refreshes them.
+	A_long own_item_id = 0;
+	const A_long source_item_id = AudioSourceItemId(in_data, own_item_id);
+	state->own_item_id = own_item_id;
+	const AnalysisResultKey result_key = ResultKeyFor(params, source_item_id, duration_ticks, in_data->time_scale);
+	const bool shareable = whole_layer && source_item_id != 0;
+	if (shareable) {
+		const std::shared_ptr<const AnalysisResults> shared = AnalysisRegistry::Get().FindResults(result_key);
+		if (shared && shared != state->Results() && shared->has_analyzed) {
+			state->SetResults(shared);
+			if (in_data->utils) {
+				in_data->utils->ansi.sprintf(out_data->return_msg,
+					"AudioPeakDetector: Shared the analysis of an identical instance: %d peaks (low %d, mid %d, high %d), %.1f BPM.",
+					static_cast<int>(shared->peaks.size()),
+					static_cast<int>(shared->band_peaks[AudioPeakDetection_BAND_LOW].size()),
+					static_cast<int>(shared->band_peaks[AudioPeakDetection_BAND_MID].size()),
+					static_cast<int>(shared->band_peaks[AudioPeakDetection_BAND_HIGH].size()),
+					shared->tempo_bpm);
+			}
+			return ReportProgress(in_data, kProgressMax, kProgressMax);
+		}
+	}
+
+	// Results other instances may hold are never written: a whole-layer
+	// analysis starts from empty results, a range analysis edits a copy. The
+	// instance keeps its previous results until the new ones are complete, so
+	// a cancelled or failed analysis leaves the overlay and markers source as
+	// they were.
+	const std::shared_ptr<const AnalysisResults> previous = state->Results();
+	std::shared_ptr<AnalysisResults> working = std::make_shared<AnalysisResults>();
+	if (whole_layer) {
+		// The pass below updates the store in place, for every instance on
+		// this footage. Stores are only used on the UI thread, and a store
+		// only takes the pass's curves in FinishPass(), so results that still
+		// refer to it never see a partial pass.
+		OnsetSourceKey curves_key;
+		curves_key.source_item_id = source_item_id;
+		curves_key.onset = MakeCacheKey(params, static_cast<double>(ReadAnalysisQuality(params).sample_rate) / 65536.0);
+		if (source_item_id != 0) {
+			working->curve_store = AnalysisRegistry::Get().CurveStore(curves_key);
+		}
+		else {
+			working->curve_store = (previous && previous->curve_store) ? previous->curve_store : std::make_shared<OnsetCurveStore>();
+		}
+	}
+	else if (previous) {
+		*working = *previous;
+	}
+	AnalysisResults& results = *working;
+
+	err = ReportProgress(in_data, 0, kProgressMax);
+	if (err != PF_Err_NONE) {
+		return err;
+	}
+
+	PF_ParamDef audio_layer_param{};
+	err = CheckoutParam(in_data,
+		AudioPeakDetection_INPUT,
+		in_data->current_time,
+		in_data->time_step,
+		in_data->time_scale,
+		&audio_layer_param);
+	if (err != PF_Err_NONE) {
+		return err;
+	}
+
+	const PF_Boolean has_audio_layer = (audio_layer_param.u.ld.data != nullptr);
+	err = CheckinParam(in_data, &audio_layer_param);
+	if (err != PF_Err_NONE) {
+		return err;
+	}
+
+	if (!has_audio_layer) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Please choose an audio layer.");
+		}
+		return PF_Err_NONE;
+	}
+
+	const DetectionSettings settings = ReadDetectionSettings(params);
+
+	PF_LayerAudio audio = nullptr;
+	ScratchArena& arena = AnalysisRegistry::Get().Arena();
+	arena.Reset();
+
+	auto cleanup_audio = [&](PF_Err status) -> PF_Err {
+		arena.Trim(kArenaRetainBytes);
+		if (audio) {
+			const PF_Err checkin_err = CheckinLayerAudio(in_data, audio);
+			audio = nullptr;
+			if (status == PF_Err_NONE && checkin_err != PF_Err_NONE) {
+				status = checkin_err;
+			}
+		}
+		return status;
+	};
+
+	// A whole-layer analysis with the settings of the previous one only
+	// transforms the blocks whose audio changed (see OnsetCurveStore).
+	// Otherwise frames primed by playback (see PrimeFluxCache) are reused when
+	// they were computed with the current settings, which includes the
+	// Quality's rate. Either way the analysis runs at the rate the reused
+	// frames were computed at so positions line up.
+	OnsetCurveStore* curve_store = results.curve_store.get();
+	const OnsetCacheKey store_key = MakeCacheKey(params, curve_store ? curve_store->Key().sample_rate : 0.0);
+	const bool use_store = whole_layer && curve_store && curve_store->HasCurves() && curve_store->Key() == store_key &&
+		store_key.sample_rate < 65536.0;
+
+	// Frames are looked up by the Audio Source's footage, which need not be
+	// the layer this instance primes from.
+	const OnsetCacheKey cache_key = MakeCacheKey(params, static_cast<double>(settings.quality.sample_rate) / 65536.0);
+	std::shared_ptr<SharedFluxCache> primed;
+	if (!use_store && source_item_id != 0) {
+		OnsetSourceKey primed_key;
+		primed_key.source_item_id = source_item_id;
+		primed_key.onset = cache_key;
+		primed = AnalysisRegistry::Get().FindFluxCache(primed_key);
+	}
+	bool use_cache = false;
+	if (primed) {
+		std::lock_guard<std::mutex> lock(primed->mutex);
+		use_cache = primed->cache.CoveredFrames() > 0 && primed->cache.Key() == cache_key;
+	}
+	const bool incremental = whole_layer && curve_store && !use_cache;
+	const double reuse_rate = use_store ? store_key.sample_rate : (use_cache ? cache_key.sample_rate : 0.0);
+	const PF_UFixed checkout_rate = (reuse_rate > 0.0) ?
+		static_cast<PF_UFixed>(std::llround(reuse_rate * 65536.0)) :
+		settings.quality.sample_rate;
+	const OnsetGeometry& geometry = settings.quality.geometry;
+	const int64_t hop_size = geometry.hop_size;
+
+	// Frames are planned at the requested rate; should the host deliver
+	// another rate the plan is redone when the first window arrives.
+	double sample_rate = static_cast<double>(checkout_rate) / 65536.0;
+	auto sample_at_tick = [&](int64_t tick) -> int64_t {
+		return static_cast<int64_t>(std::llround(static_cast<double>(tick) * sample_rate / static_cast<double>(time_scale)));
+	};
+	auto tick_at_sample = [&](int64_t sample) -> int64_t {
+		return static_cast<int64_t>(std::floor(static_cast<double>(sample) * static_cast<double>(time_scale) / sample_rate));
+	};
+
+	// Peaks are kept for frames [range_first_frame, range_end_frame). Peak
+	// picking also looks at the frames around them, which are stored from
+	// store_first_frame on; the STFT itself starts kOnsetWarmupFrames earlier
+	// so the first stored frame has its full ODF history.
+	int64_t range_first_frame = 0;
+	int64_t range_end_frame = 0;
+	int64_t store_first_frame = 0;
+	int64_t store_end_frame = 0;
+	int64_t push_begin = 0;
+	int64_t push_end = 0;
+	auto plan_frames = [&]() {
+		const PeakPickingSpans spans = DetectionSpans(settings, OnsetFramesPerSecond(sample_rate, geometry));
+		const int64_t layer_samples = sample_at_tick(duration_ticks);
+		const int64_t layer_frames = OnsetFrameCount(layer_samples, geometry);
+		range_first_frame = std::min(layer_frames, (sample_at_tick(range_begin_ticks) + hop_size - 1) / hop_size);
+		range_end_frame = std::min(layer_frames, (sample_at_tick(range_end_ticks) + hop_size - 1) / hop_size);
+		store_first_frame = std::max<int64_t>(0, range_first_frame - PeakPickingLeadFrames(spans));
+		store_end_frame = std::min(layer_frames, range_end_frame + PeakPickingTailFrames(spans));
+		push_begin = std::max<int64_t>(0, store_first_frame - kOnsetWarmupFrames) * hop_size;
+		push_end = (store_end_frame > 0) ?
+			std::min(layer_samples, (store_end_frame - 1) * hop_size + geometry.fft_size) :
+			layer_samples;
+	};
+	plan_frames();
+
+	int64_t first_tick = std::min(range_begin_ticks, tick_at_sample(push_begin));
+	while (first_tick > 0 && sample_at_tick(first_tick) > push_begin) {
+		--first_tick;
+	}
+	int64_t last_tick = std::max(range_end_ticks, tick_at_sample(push_end));
+	while (last_tick < duration_ticks && sample_at_tick(last_tick) < push_end) {
+		++last_tick;
+	}
+	last_tick = std::min(last_tick, duration_ticks);
+
+	OnsetCurveBuilder builder;
+	ArenaSpan<float> mono;
+	bool builder_ready = false;
+	auto initialize_builder = [&]() -> bool {
+		mono = AllocateSpan<float>(arena, kDownmixChunkFrames);
+		builder_ready = !mono.empty() &&
+			builder.Initialize(arena,
+				geometry,
+				settings.detection_function,
+				sample_rate,
+				settings.low_crossover_hz,
+				settings.high_crossover_hz,
+				store_end_frame - store_first_frame,
+				store_first_frame);
+		if (builder_ready) {
+			builder.Seek(push_begin / hop_size, store_first_frame);
+		}
+		if (builder_ready && incremental) {
+			builder_ready = curve_store->BeginPass(arena, builder, MakeCacheKey(params, sample_rate), push_end);
+		}
+		return builder_ready;
+	};
+	if (use_cache && !initialize_builder()) {
+		return cleanup_audio(PF_Err_OUT_OF_MEMORY);
+	}
+
+	// After a window is taken from the cache the builder restarts at resume_frame,
+	// re-reading kOnsetWarmupFrames hops before it to rebuild the ODF history.
+	int64_t resume_frame = -1;
+	int64_t cached_frames = 0;
+
+	for (int64_t window_start = first_tick; window_start < last_tick; window_start += window_ticks) {
+		const int64_t window_length = std::min(window_ticks, last_tick - window_start);
+		const int64_t window_end = window_start + window_length;
+
+		bool window_cached = false;
+		if (use_cache) {
+			const int64_t first_frame = std::max(store_first_frame, OnsetFrameCount(sample_at_tick(window_start), geometry));
+			const int64_t end_frame = std::min(OnsetFrameCount(sample_at_tick(window_end), geometry), store_end_frame);
+			std::lock_guard<std::mutex> lock(primed->mutex);
+			const OnsetFluxCache& cache = primed->cache;
+			if (cache.Key() == cache_key && cache.Covers(first_frame, end_frame)) {
+				cache.SpliceInto(builder, first_frame, end_frame);
+				cached_frames += end_frame - first_frame;
+				resume_frame = end_frame;
+				window_cached = true;
+			}
+		}
+
+		if (!window_cached) {
+			int64_t checkout_start = window_start;
+			int64_t push_from = -1;
+			if (resume_frame >= 0) {
+				const int64_t seek_frame = std::max<int64_t>(0, resume_frame - kOnsetWarmupFrames);
+				builder.Seek(seek_frame, resume_frame);
+				push_from = seek_frame * hop_size;
+				checkout_start = std::min(window_start, tick_at_sample(push_from));
+				while (checkout_start > 0 && sample_at_tick(checkout_start) > push_from) {
+					--checkout_start;
+				}
+				resume_frame = -1;
+			}
+
+			err = CheckoutLayerAudio(in_data,
+				AudioPeakDetection_INPUT,
+				static_cast<A_long>(checkout_start),
+				static_cast<A_long>(window_end - checkout_start),
+				in_data->time_scale,
+				checkout_rate,
+				PF_SSS_4,
+				PF_Channels_STEREO,
+				PF_SIGNED_FLOAT,
+				&audio);
+			if (err != PF_Err_NONE) {
+				return cleanup_audio(err);
+			}
+
+			PF_SndSamplePtr audio_data = nullptr;
+			A_long sample_frames = 0;
+			PF_UFixed sample_rate_fixed = 0;
+			A_long bytes_per_sample = 0;
+			A_long channel_count = 0;
+			A_long format_flag = 0;
+			err = GetAudioData(in_data,
+				audio,
+				&audio_data,
+				&sample_frames,
+				&sample_rate_fixed,
+				&bytes_per_sample,
+				&channel_count,
+				&format_flag);
+			if (err != PF_Err_NONE) {
+				return cleanup_audio(err);
+			}
+
+			if (window_start == first_tick && (!audio_data || sample_frames <= 0 || channel_count <= 0)) {
+				if (in_data->utils) {
+					in_data->utils->ansi.sprintf(out_data->return_msg,
+						"AudioPeakDetector: Unable to access audio samples.");
+				}
+				PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
+				if (progress_err != PF_Err_NONE) {
+					return cleanup_audio(progress_err);
+				}
+				return cleanup_audio(PF_Err_NONE);
+			}
+
+			if (!builder_ready) {
+				const double delivered_rate = static_cast<double>(sample_rate_fixed) / 65536.0;
+				if (delivered_rate > 0.0 && delivered_rate != sample_rate) {
+					sample_rate = delivered_rate;
+					plan_frames();
+				}
+				if (!initialize_builder()) {
+					return cleanup_audio(PF_Err_OUT_OF_MEMORY);
+				}
+			}
+
+			// Window boundaries are derived from absolute tick positions so windows
+			// butt together sample-exactly: samples the host did not deliver are
+			// treated as silence and the extra trailing sample it hands back is
+			// dropped.
+			const int64_t host_first = sample_at_tick(checkout_start);
+			const int64_t window_end_sample = std::min(push_end, sample_at_tick(window_end));
+			if (push_from < 0) {
+				push_from = (window_start == first_tick) ? push_begin : sample_at_tick(window_start);
+			}
+			const int64_t host_end = host_first + ((audio_data && channel_count > 0) ? static_cast<int64_t>(sample_frames) : 0);
+			const SampleEncoding encoding = EncodingOf(format_flag, bytes_per_sample);
+			const size_t frame_stride = static_cast<size_t>(bytes_per_sample) * static_cast<size_t>(std::max<A_long>(channel_count, 1));
+
+			for (int64_t position = push_from; position < window_end_sample;) {
+				const int64_t chunk = std::min<int64_t>(static_cast<int64_t>(mono.size()), window_end_sample - position);
+				const int64_t lead = ClampValue<int64_t>(host_first - position, 0, chunk);
+				const int64_t from_host = ClampValue<int64_t>(host_end - (position + lead), 0, chunk - lead);
+				std::fill(mono.begin(), mono.begin() + lead, 0.0f);
+				if (from_host > 0) {
+					DownmixToMono(reinterpret_cast<const char*>(audio_data) + static_cast<size_t>(position + lead - host_first) * frame_stride,
+						encoding,
+						channel_count,
+						static_cast<size_t>(from_host),
+						mono.data() + lead);
+				}
+				std::fill(mono.begin() + lead + from_host, mono.begin() + chunk, 0.0f);
+				if (incremental) {
+					curve_store->Push(mono.data(), static_cast<size_t>(chunk));
+				}
+				else {
+					builder.Push(mono.data(), static_cast<size_t>(chunk));
+				}
+				position += chunk;
+			}
+
+			const PF_Err checkin_err = CheckinLayerAudio(in_data, audio);
+			audio = nullptr;
+			if (checkin_err != PF_Err_NONE) {
+				return cleanup_audio(checkin_err);
+			}
+		}
+
+		err = AbortRequested(in_data);
+		if (err != PF_Err_NONE) {
+			return cleanup_audio(err);
+		}
+		const A_long progress = static_cast<A_long>(((window_end - first_tick) * 80) / std::max<int64_t>(1, last_tick - first_tick));
+		err = ReportProgress(in_data, progress, kProgressMax);
+		if (err != PF_Err_NONE) {
+			return cleanup_audio(err);
+		}
+	}
+
+	if (incremental && builder_ready) {
+		curve_store->FinishPass();
+	}
+
+	const size_t num_frames = builder.FrameCount();
+	if (num_frames == 0 || range_end_frame <= range_first_frame) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				whole_layer ? "AudioPeakDetector: Audio layer is too short to analyze." :
+				"AudioPeakDetector: The analysis range is too short to analyze.");
+		}
+		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
+		if (progress_err != PF_Err_NONE) {
+			return cleanup_audio(progress_err);
+		}
+		return cleanup_audio(PF_Err_NONE);
+	}
+
+	size_t range_peak_count = 0;
+	size_t range_band_counts[AudioPeakDetection_NUM_BANDS] = {};
+	const PeakPickOutcome outcome = PickPeaks(builder,
+		settings,
+		sample_rate,
+		in_data->time_scale,
+		range_first_frame,
+		range_end_frame,
+		arena,
+		results,
+		range_peak_count,
+		range_band_counts);
+	if (outcome == kPeakPickOutOfMemory) {
+		return cleanup_audio(PF_Err_OUT_OF_MEMORY);
+	}
+	if (outcome == kNoTransients) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: No usable transients were detected.");
+		}
+		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
+		if (progress_err != PF_Err_NONE) {
+			return cleanup_audio(progress_err);
+		}
+		return cleanup_audio(PF_Err_NONE);
+	}
+	const double range_begin_seconds = OnsetFrameSeconds(range_first_frame, sample_rate, geometry);
+	const double range_end_seconds = OnsetFrameSeconds(range_end_frame, sample_rate, geometry);
+
+	state->SetResults(working);
+	if (shareable) {
+		AnalysisRegistry::Get().PublishResults(result_key, working);
+	}
+
+	err = ReportProgress(in_data, kProgressMax, kProgressMax);
+	if (err != PF_Err_NONE) {
+		return cleanup_audio(err);
+	}
+
+	if (in_data->utils) {
+		const int64_t reused_frames = incremental ?
+			static_cast<int64_t>(num_frames) - std::min<int64_t>(curve_store->RecomputedFrames(), static_cast<int64_t>(num_frames)) :
+			cached_frames;
+		const int reused_percent = static_cast<int>((reused_frames * 100) / std::max<int64_t>(1, static_cast<int64_t>(num_frames)));
+		if (whole_layer) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Found %d peaks (low %d, mid %d, high %d), %.1f BPM. Scratch %.1f MB, %d allocations, %d%% reused.",
+				static_cast<int>(range_peak_count),
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_LOW]),
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_MID]),
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_HIGH]),
+				results.tempo_bpm,
+				static_cast<double>(arena.PeakBytes()) / (1024.0 * 1024.0),
+				static_cast<int>(arena.HeapAllocations()),
+				reused_percent);
+		}
+		else {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Found %d peaks between %.2f and %.2f sec (low %d, mid %d, high %d), %.1f BPM; %d peaks stored. Scratch %.1f MB, %d allocations, %d%% reused.",
+				static_cast<int>(range_peak_count),
+				range_begin_seconds,
+				range_end_seconds,
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_LOW]),
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_MID]),
+				static_cast<int>(range_band_counts[AudioPeakDetection_BAND_HIGH]),
+				results.tempo_bpm,
+				static_cast<int>(results.peaks.size()),
+				static_cast<double>(arena.PeakBytes()) / (1024.0 * 1024.0),
+				static_cast<int>(arena.HeapAllocations()),
+				reused_percent);
+		}
+	}
+
+	return cleanup_audio(PF_Err_NONE);
+}
+
+/* -------------------------------------------------------- CreateMarkers */
+static A_Err InsertPeakMarker(const AEGP_SuiteHandler& suites,
+	AEGP_StreamRefH marker_streamH,
+	const A_Time& time,
+	A_long label,
+	const char* comment)
+{
+	AEGP_MarkerValP markerP = nullptr;
+	A_Err ae_err = suites.MarkerSuite3()->AEGP_NewMarker(&markerP);
+	if (ae_err != A_Err_NONE || !markerP) {
+		return (ae_err != A_Err_NONE) ? ae_err : static_cast<A_Err>(PF_Err_OUT_OF_MEMORY);
+	}
+
+	suites.MarkerSuite3()->AEGP_SetMarkerLabel(markerP, label);
+
+	A_u_short unicode_comment[128] = {};
+	const size_t length = std::min(sizeof(unicode_comment) / sizeof(unicode_comment[0]) - 1, std::strlen(comment));
+	for (size_t i = 0; i < length; ++i) {
+		unicode_comment[i] = static_cast<A_u_short>(comment[i]);
+	}
+	unicode_comment[length] = 0;
+
+	suites.MarkerSuite3()->AEGP_SetMarkerString(
+		markerP,
+		AEGP_MarkerString_COMMENT,
+		unicode_comment,
+		static_cast<A_long>(length));
+
+	A_long keyframe_index = 0;
+	ae_err = suites.KeyframeSuite5()->AEGP_InsertKeyframe(
+		marker_streamH,
+		AEGP_LTimeMode_LayerTime,
+		&time,
+		&keyframe_index);
+	if (ae_err == A_Err_NONE) {
+		AEGP_StreamValue2 stream_value{};
+		stream_value.streamH = marker_streamH;
+		stream_value.val.markerP = markerP;
+		ae_err = suites.KeyframeSuite5()->AEGP_SetKeyframeValue(marker_streamH, keyframe_index, &stream_value);
+	}
+
+	suites.MarkerSuite3()->AEGP_DisposeMarker(markerP);
+	return ae_err;
+}
+
+struct MarkerCounts {
+	int total = 0;
+	int loud = 0;
+	int quiet = 0;
+	int band = 0;
+	int beat = 0;
+};
+
+// Label and comment of a broadband peak marker under a Marker Labels mode.
+// Loudness keeps the original loud/quiet split, label 1 for loud peaks and 4
+// for quiet ones (red and pink in the default label colours); the spectral
+// modes name the class in the comment and append the descriptors behind it.
+static A_long DescribePeakMarker(const PeakMarker& peak, int labels, char* comment, size_t comment_size)
+{
+	if (labels != AudioPeakDetection_LABELS_SOUND_TYPE && labels != AudioPeakDetection_LABELS_BRIGHTNESS) {
+		std::snprintf(comment, comment_size, "AudioPeak: %.1f", static_cast<double>(peak.amplitude));
+		return peak.is_loud ? 1 : 4;
+	}
+
+	const SpectralShape& shape = peak.shape;
+	const BandMarkerStyle* style = &kSoundTypeMarkerStyles[ClassifySpectralShape(shape)];
+	if (labels == AudioPeakDetection_LABELS_BRIGHTNESS) {
+		size_t slot = 0;
+		while (shape.centroid_hz >= kBrightnessMarkerStyles[slot].centroid_ceiling_hz &&
+			slot + 1 < sizeof(kBrightnessMarkerStyles) / sizeof(kBrightnessMarkerStyles[0])) {
+			++slot;
+		}
+		style = &kBrightnessMarkerStyles[slot].style;
+	}
+	std::snprintf(comment, comment_size,
+		"AudioPeak %s: %.1f, centroid %.0f Hz, rolloff %.0f Hz, flatness %.2f, low/mid/high %.0f/%.0f/%.0f%%",
+		style->name,
+		static_cast<double>(peak.amplitude),
+		static_cast<double>(shape.centroid_hz),
+		static_cast<double>(shape.rolloff_hz),
+		static_cast<double>(shape.flatness),
+		100.0 * shape.band_energy_ratio[AudioPeakDetection_BAND_LOW],
+		100.0 * shape.band_energy_ratio[AudioPeakDetection_BAND_MID],
+		100.0 * shape.band_energy_ratio[AudioPeakDetection_BAND_HIGH]);
+	return style->label;
+}
+
+// Adds the peaks of results to the layer's markers, plus the band and beat
+// markers when they are enabled. labels is a Marker Labels popup value.
+static A_Err WriteResultMarkers(const AEGP_SuiteHandler& suites,
+	AEGP_LayerH layerH,
+	const AnalysisResults& results,
+	int labels,
+	bool band_markers,
+	bool beat_markers,
+	MarkerCounts& counts)
+{
+	AEGP_StreamRefH marker_streamH = nullptr;
+	const A_Err ae_err = suites.StreamSuite6()->AEGP_GetNewLayerStream(
+		g_my_plugin_id,
+		layerH,
+		AEGP_LayerStream_MARKER,
+		&marker_streamH);
+	if (ae_err != A_Err_NONE || !marker_streamH) {
+		if (marker_streamH) {
+			suites.StreamSuite6()->AEGP_DisposeStream(marker_streamH);
+		}
+		return (ae_err != A_Err_NONE) ? ae_err : static_cast<A_Err>(PF_Err_BAD_CALLBACK_PARAM);
+	}
+
+	char comment[128];
+	for (const PeakMarker& peak : results.peaks) {
+		const A_long label = DescribePeakMarker(peak, labels, comment, sizeof(comment));
+		if (InsertPeakMarker(suites, marker_streamH, peak.time, label, comment) != A_Err_NONE) {
+			continue;
+		}
+		++counts.total;
+		if (peak.is_loud) {
+			++counts.loud;
+		}
+		else {
+			++counts.quiet;
+		}
+	}
+
+	if (band_markers) {
+		for (int band = 0; band < AudioPeakDetection_NUM_BANDS; ++band) {
+			const BandMarkerStyle& style = kBandMarkerStyles[band];
+			for (const PeakMarker& peak : results.band_peaks[static_cast<size_t>(band)]) {
+				std::snprintf(comment, sizeof(comment), "AudioPeak %s: %.1f", style.name, static_cast<double>(peak.amplitude));
+				if (InsertPeakMarker(suites, marker_streamH, peak.time, style.label, comment) == A_Err_NONE) {
+					++counts.total;
+					++counts.band;
+				}
+			}
+		}
+	}
+
+	if (beat_markers) {
+		std::snprintf(comment, sizeof(comment), "AudioPeak Beat: %.1f BPM", results.tempo_bpm);
+		for (const PeakMarker& beat : results.beats) {
+			if (InsertPeakMarker(suites, marker_streamH, beat.time, kBeatMarkerLabel, comment) == A_Err_NONE) {
+				++counts.total;
+				++counts.beat;
+			}
+		}
+	}
+
+	suites.StreamSuite6()->AEGP_DisposeStream(marker_streamH);
+	return A_Err_NONE;
+}
+
+static PF_Err CreateMarkers(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[])
+{
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	const std::shared_ptr<const AnalysisResults> results = state ? state->Results() : nullptr;
+	if (!results || !results->has_analyzed) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Run Analyze Audio before creating markers.");
+		}
+		return PF_Err_NONE;
+	}
+
+	if (results->peaks.empty()) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: No peaks available. Re-run analysis with different settings.");
+		}
+		return PF_Err_NONE;
+	}
+
+	if (g_my_plugin_id == 0) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Marker creation unavailable in this build.");
+		}
+		return PF_Err_NONE;
+	}
+
+	AEGP_SuiteHandler suites(in_data->pica_basicP);
+
+	AEGP_LayerH layerH = nullptr;
+	A_Err ae_err = suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH);
+	if (ae_err != A_Err_NONE || !layerH) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Unable to access effect layer.");
+		}
+		return ae_err;
+	}
+
+	MarkerCounts counts;
+	ae_err = WriteResultMarkers(suites,
+		layerH,
+		*results,
+		params[AudioPeakDetection_MARKER_LABELS]->u.pd.value,
+		params[AudioPeakDetection_BAND_MARKERS]->u.bd.value != 0,
+		params[AudioPeakDetection_BEAT_MARKERS]->u.bd.value != 0,
+		counts);
+	if (ae_err != A_Err_NONE) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Layer does not support markers.");
+		}
+		return ae_err;
+	}
+
+	if (in_data->utils) {
+		if (counts.total > 0) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Created %d markers (%d loud, %d quiet, %d band, %d beat).",
+				counts.total,
+				counts.loud,
+				counts.quiet,
+				counts.band,
+				counts.beat);
+		}
+		else {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: No markers were created.");
+		}
+	}
+
+	return PF_Err_NONE;
+}
+
+/* ------------------------------------------------ KeyframeOnsetStrength */
+// Comp time of comp frame index, exact while its tick count fits an A_long.
+static A_Time CompFrameTime(int64_t index, const A_Time& frame_duration)
+{
+	const int64_t ticks = index * static_cast<int64_t>(frame_duration.value);
+	if (ticks > std::numeric_limits<A_long>::max()) {
+		return SecondsToTime(static_cast<double>(index) * TimeToSeconds(frame_duration), frame_duration.scale);
+	}
+	A_Time time{};
+	time.value = static_cast<A_long>(ticks);
+	time.scale = frame_duration.scale;
+	return time;
+}
+
+// Replaces the keyframes of streamH with values[i] at comp frame
+// first_frame + i. The old keys are deleted from the last one down and the
+// new ones go in through one AddKeyframes batch instead of an insert per key.
+static A_Err ReplaceStreamKeyframes(const AEGP_SuiteHandler& suites,
+	AEGP_StreamRefH streamH,
+	int64_t first_frame,
+	const A_Time& frame_duration,
+	const std::vector<float>& values)
+{
+	A_long old_count = 0;
+	A_Err ae_err = suites.KeyframeSuite5()->AEGP_GetStreamNumKFs(streamH, &old_count);
+	for (A_long key = old_count - 1; ae_err == A_Err_NONE && key >= 0; --key) {
+		ae_err = suites.KeyframeSuite5()->AEGP_DeleteKeyframe(streamH, key);
+	}
+	if (ae_err != A_Err_NONE) {
+		return ae_err;
+	}
+
+	AEGP_AddKeyframesInfoH addH = nullptr;
+	ae_err = suites.KeyframeSuite5()->AEGP_StartAddKeyframes(streamH, &addH);
+	if (ae_err != A_Err_NONE || !addH) {
+		return (ae_err != A_Err_NONE) ? ae_err : static_cast<A_Err>(PF_Err_OUT_OF_MEMORY);
+	}
+
+	AEGP_StreamValue2 value{};
+	value.streamH = streamH;
+	for (size_t index = 0; index < values.size() && ae_err == A_Err_NONE; ++index) {
+		const A_Time time = CompFrameTime(first_frame + static_cast<int64_t>(index), frame_duration);
+		A_long key_index = 0;
+		ae_err = suites.KeyframeSuite5()->AEGP_AddKeyframes(addH, AEGP_LTimeMode_CompTime, &time, &key_index);
+		if (ae_err == A_Err_NONE) {
+			value.val.one_d = values[index];
+			ae_err = suites.KeyframeSuite5()->AEGP_SetAddKeyframe(addH, key_index, &value);
+		}
+	}
+
+	// A failed batch is dropped whole rather than left half written.
+	const A_Err end_err = suites.KeyframeSuite5()->AEGP_EndAddKeyframes(ae_err == A_Err_NONE, addH);
+	return (ae_err != A_Err_NONE) ? ae_err : end_err;
+}
+
+// Keyframes Onset Strength on every comp frame the analyzed curve covers,
+// holding the smoothed onset curve normalized to 0-100. Each keyframe takes
+// the curve's peak over its comp frame, so no transient falls between two
+// keys. Layer time is mapped to comp time by the layer's start and stretch;
+// time remapping is not followed.
+static PF_Err KeyframeOnsetStrength(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* /*params*/[])
+{
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	const std::shared_ptr<const AnalysisResults> results = state ? state->Results() : nullptr;
+	if (!results || !results->has_analyzed || results->overlay.Empty()) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Run Analyze Audio before keyframing onset strength.");
+		}
+		return PF_Err_NONE;
+	}
+
+	const OnsetOverlayPyramid& overlay = results->overlay;
+	const float max_flux = overlay.MaxFlux();
+	if (max_flux <= 0.0f) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: No onset strength to keyframe.");
+		}
+		return PF_Err_NONE;
+	}
+
+	if (g_my_plugin_id == 0) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Keyframing unavailable in this build.");
+		}
+		return PF_Err_NONE;
+	}
+
+	AEGP_SuiteHandler suites(in_data->pica_basicP);
+
+	AEGP_LayerH layerH = nullptr;
+	AEGP_CompH compH = nullptr;
+	A_Time frame_duration{};
+	const double curve_seconds = static_cast<double>(overlay.FrameCount()) / overlay.FramesPerSecond();
+	const A_Time layer_begin = SecondsToTime(0.0, in_data->time_scale);
+	const A_Time layer_end = SecondsToTime(curve_seconds, in_data->time_scale);
+	A_Time comp_begin{};
+	A_Time comp_end{};
+	A_Err ae_err = suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH);
+	if (ae_err == A_Err_NONE && layerH) {
+		ae_err = suites.LayerSuite9()->AEGP_GetLayerParentComp(layerH, &compH);
+	}
+	if (ae_err == A_Err_NONE && compH) {
+		ae_err = suites.CompSuite11()->AEGP_GetCompFrameDuration(compH, &frame_duration);
+	}
+	if (ae_err == A_Err_NONE) {
+		ae_err = suites.LayerSuite9()->AEGP_ConvertLayerToCompTime(layerH, &layer_begin, &comp_begin);
+	}
+	if (ae_err == A_Err_NONE) {
+		ae_err = suites.LayerSuite9()->AEGP_ConvertLayerToCompTime(layerH, &layer_end, &comp_end);
+	}
+	if (ae_err != A_Err_NONE || !layerH || !compH || frame_duration.value <= 0 || frame_duration.scale == 0) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Unable to access effect layer.");
+		}
+		return (ae_err != A_Err_NONE) ? ae_err : static_cast<PF_Err>(PF_Err_BAD_CALLBACK_PARAM);
+	}
+
+	// Comp frames starting inside the curve, and the curve frames one comp
+	// frame spans. A reversed layer is sampled forward in layer time and the
+	// values turned around.
+	const double frame_seconds = TimeToSeconds(frame_duration);
+	const double comp_begin_seconds = TimeToSeconds(comp_begin);
+	const double comp_span_seconds = TimeToSeconds(comp_end) - comp_begin_seconds;
+	const double low_seconds = std::min(comp_begin_seconds, comp_begin_seconds + comp_span_seconds);
+	const double high_seconds = std::max(comp_begin_seconds, comp_begin_seconds + comp_span_seconds);
+	const int64_t first_frame = std::max<int64_t>(0, static_cast<int64_t>(std::ceil(low_seconds / frame_seconds - 1e-9)));
+	const int64_t end_frame = static_cast<int64_t>(std::ceil(high_seconds / frame_seconds - 1e-9));
+	if (end_frame <= first_frame || comp_span_seconds == 0.0) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: The analyzed audio covers no comp frame.");
+		}
+		return PF_Err_NONE;
+	}
+
+	const double stretch = TimeToSeconds(layer_end) / comp_span_seconds;
+	const double onset_frames_per_second = overlay.FramesPerSecond();
+	auto onset_frame_at = [&](int64_t comp_frame) {
+		return (static_cast<double>(comp_frame) * frame_seconds - comp_begin_seconds) * stretch * onset_frames_per_second;
+	};
+	std::vector<float> values(static_cast<size_t>(end_frame - first_frame));
+	const double frames_per_value = std::fabs(stretch) * frame_seconds * onset_frames_per_second;
+	if (stretch > 0.0) {
+		overlay.SampleFlux(onset_frame_at(first_frame), frames_per_value, values.data(), values.size());
+	}
+	else {
+		overlay.SampleFlux(onset_frame_at(end_frame), frames_per_value, values.data(), values.size());
+		std::reverse(values.begin(), values.end());
+	}
+	const float percent_per_flux = static_cast<float>(AudioPeakDetection_ONSET_STRENGTH_MAX) / max_flux;
+	for (float& value : values) {
+		value = std::min(value * percent_per_flux, static_cast<float>(AudioPeakDetection_ONSET_STRENGTH_MAX));
+	}
+
+	AEGP_EffectRefH effectH = nullptr;
+	AEGP_StreamRefH streamH = nullptr;
+	suites.UtilitySuite3()->AEGP_StartUndoGroup("Audio Peak Onset Keyframes");
+	ae_err = suites.PFInterfaceSuite1()->AEGP_GetNewEffectForEffect(g_my_plugin_id, in_data->effect_ref, &effectH);
+	if (ae_err == A_Err_NONE && effectH) {
+		ae_err = suites.StreamSuite6()->AEGP_GetNewEffectStreamByIndex(g_my_plugin_id,
+			effectH,
+			AudioPeakDetection_ONSET_STRENGTH,
+			&streamH);
+	}
+	if (ae_err == A_Err_NONE && streamH) {
+		ae_err = ReplaceStreamKeyframes(suites, streamH, first_frame, frame_duration, values);
+	}
+	if (streamH) {
+		suites.StreamSuite6()->AEGP_DisposeStream(streamH);
+	}
+	if (effectH) {
+		suites.EffectSuite4()->AEGP_DisposeEffect(effectH);
+	}
+	suites.UtilitySuite3()->AEGP_EndUndoGroup();
+
+	if (in_data->utils) {
+		if (ae_err == A_Err_NONE && streamH) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Keyframed Onset Strength on %d comp frames.",
+				static_cast<int>(values.size()));
+		}
+		else {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Unable to keyframe Onset Strength.");
+		}
+	}
+	return ae_err;
+}
+
+/* ---------------------------------------------------------- ExportPeaks */
+// Copies the zero-terminated UTF-16 string of memH and frees the handle.
+static std::u16string TakeMemHandleString(const AEGP_SuiteHandler& suites, AEGP_MemHandle memH)
+{
+	std::u16string text;
+	if (!memH) {
+		return text;
+	}
+	void* data = nullptr;
+	if (suites.MemorySuite1()->AEGP_LockMemHandle(memH, &data) == A_Err_NONE && data) {
+		for (const A_UTF16Char* character = static_cast<const A_UTF16Char*>(data); *character; ++character) {
+			text.push_back(static_cast<char16_t>(*character));
+		}
+		suites.MemorySuite1()->AEGP_UnlockMemHandle(memH);
+	}
+	suites.MemorySuite1()->AEGP_FreeMemHandle(memH);
+	return text;
+}
+
+static std::string Utf16ToUtf8(const std::u16string& text)
+{
+	std::string utf8;
+	utf8.reserve(text.size());
+	for (size_t index = 0; index < text.size(); ++index) {
+		uint32_t code = text[index];
+		if (code >= 0xD800 && code < 0xDC00 && index + 1 < text.size() &&
+			text[index + 1] >= 0xDC00 && text[index + 1] < 0xE000) {
+			code = 0x10000 + ((code - 0xD800) << 10) + (text[++index] - 0xDC00);
+		}
+		if (code < 0x80) {
+			utf8.push_back(static_cast<char>(code));
+		}
+		else if (code < 0x800) {
+			utf8.push_back(static_cast<char>(0xC0 | (code >> 6)));
+			utf8.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+		}
+		else if (code < 0x10000) {
+			utf8.push_back(static_cast<char>(0xE0 | (code >> 12)));
+			utf8.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+			utf8.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+		}
+		else {
+			utf8.push_back(static_cast<char>(0xF0 | (code >> 18)));
+			utf8.push_back(static_cast<char>(0x80 | ((code >> 12) & 0x3F)));
+			utf8.push_back(static_cast<char>(0x80 | ((code >> 6) & 0x3F)));
+			utf8.push_back(static_cast<char>(0x80 | (code & 0x3F)));
+		}
+	}
+	return utf8;
+}
+
+static std::FILE* OpenExportFile(const std::u16string& path)
+{
+#ifdef AE_OS_WIN
+	std::FILE* file = nullptr;
+	return (_wfopen_s(&file, reinterpret_cast<const wchar_t*>(path.c_str()), L"wb") == 0) ? file : nullptr;
+#else
+	return std::fopen(Utf16ToUtf8(path).c_str(), "wb");
+#endif
+}
 
-	PF_Err err = ReportProgress(in_data, 0, kProgressMax);
-	if (err != PF_Err_NONE) {
-		return err;
+// The export goes beside the project: "<project>_<layer>_peaks.<ext>".
+static std::u16string ExportPath(const std::u16string& project_path, const std::u16string& layer_name, ExportFormat format)
+{
+	const size_t separator = project_path.find_last_of(u"/\\");
+	const size_t dot = project_path.find_last_of(u'.');
+	std::u16string path = project_path.substr(0,
+		(dot != std::u16string::npos && (separator == std::u16string::npos || dot > separator)) ? dot : project_path.size());
+
+	path += u'_';
+	for (const char16_t character : layer_name) {
+		const bool reserved = character < 0x20 || std::u16string(u"\\/:*?\"<>|").find(character) != std::u16string::npos;
+		path += reserved ? u'_' : character;
 	}
-
-	PF_ParamDef audio_layer_param{};
-	err = CheckoutParam(in_data,
-		AudioPeakDetection_INPUT,
-		in_data->current_time,
-		in_data->time_step,
-		in_data->time_scale,
-		&audio_layer_param);
-	if (err != PF_Err_NONE) {
-		return err;
+	path += u"_peaks.";
+	for (const char* extension = ExportExtension(format); *extension; ++extension) {
+		path += static_cast<char16_t>(*extension);
 	}
+	return path;
+}
 
-	const PF_Boolean has_audio_layer = (audio_layer_param.u.ld.data != nullptr);
-	err = CheckinParam(in_data, &audio_layer_param);
-	if (err != PF_Err_NONE) {
-		return err;
+// Writes the broadband peaks, and with Include Onset Curve the smoothed
+// onset curve, in the chosen Export Format. Peaks and curve are handed to
+// the writer one at a time from the results, so nothing is copied first.
+static PF_Err ExportPeaks(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[])
+{
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	const std::shared_ptr<const AnalysisResults> results = state ? state->Results() : nullptr;
+	if (!results || !results->has_analyzed) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Run Analyze Audio before exporting.");
+		}
+		return PF_Err_NONE;
 	}
 
-	if (!has_audio_layer) {
+	if (g_my_plugin_id == 0) {
 		if (in_data->utils) {
 			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Please choose an audio layer.");
+				"AudioPeakDetector: Export unavailable in this build.");
 		}
 		return PF_Err_NONE;
 	}
 
-	PF_LayerAudio audio = nullptr;
-	PF_SndSamplePtr audio_data = nullptr;
-	A_long sample_frames = 0;
-	PF_UFixed sample_rate_fixed = 0;
-	A_long bytes_per_sample = 0;
-	A_long channel_count = 0;
-	A_long format_flag = 0;
+	const A_long format_choice = ClampValue<A_long>(params[AudioPeakDetection_EXPORT_FORMAT]->u.pd.value,
+		AudioPeakDetection_EXPORT_CSV,
+		AudioPeakDetection_EXPORT_NUM_CHOICES);
+	const ExportFormat format = static_cast<ExportFormat>(format_choice - AudioPeakDetection_EXPORT_CSV);
+	const OnsetOverlayPyramid& overlay = results->overlay;
+	const bool include_curve = params[AudioPeakDetection_EXPORT_ONSET_CURVE]->u.bd.value != 0 &&
+		format != kExportMidi &&
+		!overlay.Empty() &&
+		overlay.MaxFlux() > 0.0f;
 
-	const A_long start_timeL = 0;
-	A_long durationL = in_data->total_time;
-	if (durationL <= 0) {
-		durationL = (in_data->time_step > 0) ? in_data->time_step : in_data->time_scale;
-	}
-	if (durationL <= 0) {
-		durationL = in_data->time_scale;
-	}
+	AEGP_SuiteHandler suites(in_data->pica_basicP);
 
-	err = CheckoutLayerAudio(in_data,
-		AudioPeakDetection_INPUT,
-		start_timeL,
-		durationL,
-		in_data->time_scale,
-		kPreferredSampleRate,
-		PF_SSS_4,
-		PF_Channels_STEREO,
-		PF_SIGNED_FLOAT,
-		&audio);
-	if (err != PF_Err_NONE) {
-		return err;
+	AEGP_ProjectH projectH = nullptr;
+	AEGP_MemHandle project_pathH = nullptr;
+	std::u16string project_path;
+	if (suites.ProjSuite6()->AEGP_GetProjectByIndex(0, &projectH) == A_Err_NONE && projectH &&
+		suites.ProjSuite6()->AEGP_GetProjectPath(projectH, &project_pathH) == A_Err_NONE) {
+		project_path = TakeMemHandleString(suites, project_pathH);
+	}
+	if (project_path.empty()) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Save the project before exporting; the export is written beside it.");
+		}
+		return PF_Err_NONE;
 	}
 
-	auto cleanup_audio = [&](PF_Err status) -> PF_Err {
-		if (audio) {
-			const PF_Err checkin_err = CheckinLayerAudio(in_data, audio);
-			audio = nullptr;
-			if (status == PF_Err_NONE && checkin_err != PF_Err_NONE) {
-				status = checkin_err;
+	// Layers without a name of their own go by their source's name.
+	AEGP_LayerH layerH = nullptr;
+	std::u16string layer_name;
+	if (suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH) == A_Err_NONE && layerH) {
+		AEGP_MemHandle nameH = nullptr;
+		AEGP_MemHandle source_nameH = nullptr;
+		if (suites.LayerSuite9()->AEGP_GetLayerName(g_my_plugin_id, layerH, &nameH, &source_nameH) == A_Err_NONE) {
+			layer_name = TakeMemHandleString(suites, nameH);
+			const std::u16string source_name = TakeMemHandleString(suites, source_nameH);
+			if (layer_name.empty()) {
+				layer_name = source_name;
 			}
 		}
-		return status;
-	};
-
-	err = GetAudioData(in_data,
-		audio,
-		&audio_data,
-		&sample_frames,
-		&sample_rate_fixed,
-		&bytes_per_sample,
-		&channel_count,
-		&format_flag);
-	if (err != PF_Err_NONE) {
-		return cleanup_audio(err);
 	}
 
-	if (!audio_data || sample_frames <= 0 || channel_count <= 0) {
+	const std::u16string path = ExportPath(project_path, layer_name, format);
+	const std::string file_name = Utf16ToUtf8(path.substr(path.find_last_of(u"/\\") + 1));
+	std::FILE* file = OpenExportFile(path);
+	if (!file) {
 		if (in_data->utils) {
 			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Unable to access audio samples.");
-		}
-		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
-		if (progress_err != PF_Err_NONE) {
-			return cleanup_audio(progress_err);
+				"AudioPeakDetector: Unable to create %.160s.",
+				file_name.c_str());
 		}
-		return cleanup_audio(PF_Err_NONE);
-	}
-
-	if (sample_frames > 0) {
-		--sample_frames;
-	}
-
-	double sample_rate = sample_rate_fixed ? static_cast<double>(sample_rate_fixed) / 65536.0 : 44100.0;
-	if (sample_rate <= 0.0) {
-		sample_rate = 44100.0;
+		return PF_Err_NONE;
 	}
 
-	const float min_separation_seconds = static_cast<float>(params[AudioPeakDetection_MIN_SEPARATION]->u.fs_d.value);
-	const float threshold_multiplier = static_cast<float>(params[AudioPeakDetection_THRESHOLD_MULTIPLIER]->u.fs_d.value);
-	const float smoothing_percent = static_cast<float>(params[AudioPeakDetection_SMOOTHING]->u.fs_d.value);
+	ExportHeader header;
+	header.sample_rate = results->sample_rate;
+	header.tempo_bpm = results->tempo_bpm;
+	header.flux_frames_per_second = overlay.FramesPerSecond();
 
-	const bool data_is_float = (format_flag == PF_SIGNED_FLOAT) && (bytes_per_sample == PF_SSS_4);
-	const bool data_is_int16 = (format_flag == PF_SIGNED_PCM) && (bytes_per_sample == PF_SSS_2);
-	const bool data_is_int8 = (format_flag == PF_SIGNED_PCM) && (bytes_per_sample == PF_SSS_1);
-
-	const float* samples_f32 = data_is_float ? reinterpret_cast<const float*>(audio_data) : nullptr;
-	const int16_t* samples_i16 = data_is_int16 ? reinterpret_cast<const int16_t*>(audio_data) : nullptr;
-	const int8_t* samples_i8 = data_is_int8 ? reinterpret_cast<const int8_t*>(audio_data) : nullptr;
-
-	const size_t frame_count = static_cast<size_t>(sample_frames);
-	std::vector<float> mono(frame_count, 0.0f);
-
-	for (A_long i = 0; i < sample_frames; ++i) {
-		float sum = 0.0f;
-		for (A_long ch = 0; ch < channel_count; ++ch) {
-			const size_t idx = static_cast<size_t>(i) * static_cast<size_t>(channel_count) + static_cast<size_t>(ch);
-			float value = 0.0f;
-			if (samples_f32) {
-				value = samples_f32[idx];
-			}
-			else if (samples_i16) {
-				value = static_cast<float>(samples_i16[idx]) / 32768.0f;
-			}
-			else if (samples_i8) {
-				value = static_cast<float>(samples_i8[idx]) / 128.0f;
-			}
-			sum += value;
+	const std::vector<PeakMarker>& peaks = results->peaks;
+	size_t next_peak = 0;
+	const ExportOnsetSource onsets = [&](ExportOnset& onset) {
+		if (next_peak >= peaks.size()) {
+			return false;
 		}
-		mono[static_cast<size_t>(i)] = sum / static_cast<float>(channel_count);
+		const PeakMarker& peak = peaks[next_peak++];
+		onset.sample = peak.sample;
+		onset.amplitude = peak.amplitude;
+		onset.is_loud = peak.is_loud != FALSE;
+		return true;
+	};
 
-		if ((i & 0x3FFF) == 0) {
-			err = AbortRequested(in_data);
-			if (err != PF_Err_NONE) {
-				return cleanup_audio(err);
+	// The curve is read one frame per value at its own rate, scaled like
+	// the peak amplitudes.
+	const size_t curve_frames = static_cast<size_t>(overlay.FrameCount());
+	const float percent_per_flux = include_curve ? 100.0f / overlay.MaxFlux() : 0.0f;
+	size_t next_frame = 0;
+	ExportFluxSource flux;
+	if (include_curve) {
+		flux = [&](float* values, size_t capacity) {
+			const size_t count = std::min(capacity, curve_frames - next_frame);
+			overlay.SampleFlux(static_cast<double>(next_frame), 1.0, values, count);
+			for (size_t index = 0; index < count; ++index) {
+				values[index] *= percent_per_flux;
 			}
-		}
+			next_frame += count;
+			return count;
+		};
 	}
 
-	if (mono.size() < static_cast<size_t>(kFFTSize)) {
-		if (in_data->utils) {
+	ExportCounts counts;
+	const bool written = WriteOnsetExport(file, format, header, onsets, flux, counts);
+	const bool closed = std::fclose(file) == 0;
+	if (in_data->utils) {
+		if (written && closed) {
 			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Audio layer is too short to analyze.");
+				"AudioPeakDetector: Exported %d onsets and %d curve frames to %.160s.",
+				static_cast<int>(counts.onsets),
+				static_cast<int>(counts.flux_frames),
+				file_name.c_str());
 		}
-		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
-		if (progress_err != PF_Err_NONE) {
-			return cleanup_audio(progress_err);
+		else {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Writing %.160s failed.",
+				file_name.c_str());
 		}
-		return cleanup_audio(PF_Err_NONE);
 	}
+	return PF_Err_NONE;
+}
 
-	const size_t num_frames = 1 + (mono.size() - kFFTSize) / kHopSize;
-	if (num_frames == 0) {
-		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
-		if (progress_err != PF_Err_NONE) {
-			return cleanup_audio(progress_err);
+/* -------------------------------------------------------- AnalyzeComp */
+// Analyzes every layer of the comp whose source has audio with this
+// instance's settings and adds their markers in one undo step. Layers showing
+// the same item share one analysis, and items already analyzed with these
+// settings are not analyzed again.
+static PF_Err AnalyzeComp(PF_InData* in_data,
+	PF_OutData* out_data,
+	PF_ParamDef* params[])
+{
+	if (g_my_plugin_id == 0) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Comp analysis unavailable in this build.");
 		}
-		return cleanup_audio(PF_Err_NONE);
+		return PF_Err_NONE;
 	}
 
-	std::vector<float> flux(num_frames, 0.0f);
+	AEGP_SuiteHandler suites(in_data->pica_basicP);
 
-	using KissFftCfgPtr = std::unique_ptr<void, decltype(&free)>;
-	KissFftCfgPtr fft_cfg(kiss_fftr_alloc(kFFTSize, 0, nullptr, nullptr), &free);
-	if (!fft_cfg) {
-		return cleanup_audio(PF_Err_OUT_OF_MEMORY);
+	AEGP_LayerH effect_layerH = nullptr;
+	AEGP_CompH compH = nullptr;
+	A_long layer_count = 0;
+	A_Err ae_err = suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &effect_layerH);
+	if (ae_err == A_Err_NONE && effect_layerH) {
+		ae_err = suites.LayerSuite9()->AEGP_GetLayerParentComp(effect_layerH, &compH);
 	}
-	kiss_fftr_cfg cfg = reinterpret_cast<kiss_fftr_cfg>(fft_cfg.get());
-
-	std::vector<float> window = CreateHannWindow();
-	std::vector<kiss_fft_scalar> fft_in(static_cast<size_t>(kFFTSize), 0.0f);
-	std::vector<kiss_fft_cpx> fft_out(static_cast<size_t>(kFFTSize / 2 + 1));
-	std::vector<float> prev_magnitude(static_cast<size_t>(kFFTSize / 2 + 1), 0.0f);
-	std::vector<float> curr_magnitude(static_cast<size_t>(kFFTSize / 2 + 1), 0.0f);
-
-	for (size_t frame = 0; frame < num_frames; ++frame) {
-		const size_t start = frame * static_cast<size_t>(kHopSize);
-		for (int n = 0; n < kFFTSize; ++n) {
-			fft_in[static_cast<size_t>(n)] = static_cast<kiss_fft_scalar>(mono[start + static_cast<size_t>(n)] * window[static_cast<size_t>(n)]);
+	if (ae_err == A_Err_NONE && compH) {
+		ae_err = suites.LayerSuite9()->AEGP_GetCompNumLayers(compH, &layer_count);
+	}
+	if (ae_err != A_Err_NONE || !compH) {
+		if (in_data->utils) {
+			in_data->utils->ansi.sprintf(out_data->return_msg,
+				"AudioPeakDetector: Unable to access the composition.");
 		}
+		return ae_err;
+	}
 
-		kiss_fftr(cfg, fft_in.data(), fft_out.data());
-
-		float frame_flux = 0.0f;
-		for (int bin = 0; bin <= kFFTSize / 2; ++bin) {
-			const float re = fft_out[static_cast<size_t>(bin)].r;
-			const float im = fft_out[static_cast<size_t>(bin)].i;
-			curr_magnitude[static_cast<size_t>(bin)] = std::sqrt(re * re + im * im);
-			const float diff = curr_magnitude[static_cast<size_t>(bin)] - prev_magnitude[static_cast<size_t>(bin)];
-			if (diff > 0.0f) {
-				frame_flux += diff;
-			}
-			prev_magnitude[static_cast<size_t>(bin)] = curr_magnitude[static_cast<size_t>(bin)];
+	const DetectionSettings settings = ReadDetectionSettings(params);
+	const OnsetGeometry& geometry = settings.quality.geometry;
+	const double sample_rate = static_cast<double>(settings.quality.sample_rate) / 65536.0;
+	const A_u_long time_scale = in_data->time_scale;
+	std::vector<BatchSource> sources;
+	std::vector<BatchLayer> layers;
+	std::map<A_long, size_t> source_of_item;
+	int remapped_layers = 0;
+	for (A_long index = 0; index < layer_count; ++index) {
+		AEGP_LayerH layerH = nullptr;
+		AEGP_ItemH itemH = nullptr;
+		AEGP_ItemFlags item_flags = 0;
+		A_long item_id = 0;
+		if (suites.LayerSuite9()->AEGP_GetCompLayerByIndex(compH, index, &layerH) != A_Err_NONE || !layerH ||
+			suites.LayerSuite9()->AEGP_GetLayerSourceItem(layerH, &itemH) != A_Err_NONE || !itemH ||
+			suites.ItemSuite9()->AEGP_GetItemFlags(itemH, &item_flags) != A_Err_NONE ||
+			!(item_flags & AEGP_ItemFlag_HAS_AUDIO) ||
+			suites.ItemSuite9()->AEGP_GetItemID(itemH, &item_id) != A_Err_NONE) {
+			continue;
 		}
 
-		flux[frame] = frame_flux;
+		// Markers go in layer time, which only follows the source's own time
+		// when the layer is not time-remapped.
+		AEGP_LayerFlags layer_flags = 0;
+		if (suites.LayerSuite9()->AEGP_GetLayerFlags(layerH, &layer_flags) == A_Err_NONE &&
+			(layer_flags & AEGP_LayerFlag_TIME_REMAPPING)) {
+			++remapped_layers;
+			continue;
+		}
 
-		if ((frame & 0x3F) == 0) {
-			err = AbortRequested(in_data);
-			if (err != PF_Err_NONE) {
-				return cleanup_audio(err);
+		auto found = source_of_item.find(item_id);
+		if (found == source_of_item.end()) {
+			A_Time duration{};
+			if (suites.ItemSuite9()->AEGP_GetItemDuration(itemH, &duration) != A_Err_NONE) {
+				continue;
 			}
-			const A_long progress = static_cast<A_long>(10 + (frame * 70) / std::max<size_t>(1, num_frames));
-			ReportProgress(in_data, progress, kProgressMax);
+			const double seconds = TimeToSeconds(duration);
+			BatchSource source;
+			source.itemH = itemH;
+			source.sample_count = std::llround(seconds * sample_rate);
+			source.key = ResultKeyFor(params, item_id, std::llround(seconds * static_cast<double>(time_scale)), time_scale);
+			found = source_of_item.emplace(item_id, sources.size()).first;
+			sources.push_back(source);
 		}
+		layers.push_back({ layerH, found->second });
 	}
 
-	std::vector<float> smoothed_flux;
-	SmoothFlux(flux, smoothing_percent, smoothed_flux);
-
-	const auto max_it = std::max_element(smoothed_flux.begin(), smoothed_flux.end());
-	if (max_it == smoothed_flux.end() || *max_it <= 0.0f) {
+	if (layers.empty()) {
 		if (in_data->utils) {
 			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: No usable transients were detected.");
-		}
-		PF_Err progress_err = ReportProgress(in_data, kProgressMax, kProgressMax);
-		if (progress_err != PF_Err_NONE) {
-			return cleanup_audio(progress_err);
+				"AudioPeakDetector: No layers with audio were found in this comp.");
 		}
-		return cleanup_audio(PF_Err_NONE);
+		return PF_Err_NONE;
 	}
-	const float max_flux = *max_it;
-
-	const double frames_per_second = sample_rate / static_cast<double>(kHopSize);
-	const size_t min_separation_frames = std::max<size_t>(1,
-		static_cast<size_t>(std::ceil(min_separation_seconds * frames_per_second)));
-
-	struct CandidatePeak {
-		size_t frame_index = 0;
-		float flux_value = 0.0f;
-	};
-
-	std::vector<CandidatePeak> candidates;
-	candidates.reserve(smoothed_flux.size() / 4);
 
-	double last_peak_frame = -static_cast<double>(min_separation_frames);
-	for (size_t i = 0; i < smoothed_flux.size(); ++i) {
-		const size_t window_start = (i <= static_cast<size_t>(kThresholdWindow)) ? 0 : i - static_cast<size_t>(kThresholdWindow);
-		float mean = 0.0f;
-		size_t count = 0;
-		for (size_t j = window_start; j < i; ++j) {
-			mean += smoothed_flux[j];
-			++count;
+	int reused_sources = 0;
+	std::vector<size_t> source_of_job;
+	for (size_t source = 0; source < sources.size(); ++source) {
+		const std::shared_ptr<const AnalysisResults> known = AnalysisRegistry::Get().FindResults(sources[source].key);
+		if (known && known->has_analyzed) {
+			sources[source].results = known;
+			++reused_sources;
 		}
-		if (count == 0) {
-			continue;
+		else if (sources[source].sample_count >= geometry.fft_size) {
+			source_of_job.push_back(source);
 		}
-		mean /= static_cast<float>(count);
-		const float adaptive_threshold = mean * threshold_multiplier;
+	}
 
-		const bool is_local_max =
-			(i == 0 || smoothed_flux[i] > smoothed_flux[i - 1]) &&
-			(i + 1 == smoothed_flux.size() || smoothed_flux[i] >= smoothed_flux[i + 1]);
+	PF_Err err = ReportProgress(in_data, 0, kProgressMax);
+	if (err != PF_Err_NONE) {
+		return err;
+	}
 
-		if (!is_local_max || smoothed_flux[i] <= adaptive_threshold) {
-			continue;
+	// Peak picking runs on the worker that finishes a source, so it overlaps
+	// with the transforms of the others.
+	std::vector<std::shared_ptr<AnalysisResults>> fresh(sources.size());
+	const size_t worker_count = std::min<size_t>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), std::max<size_t>(source_of_job.size(), 1));
+	OnsetBatch batch(worker_count, kBatchMemoryBudgetBytes,
+		[&](size_t job, const OnsetCurveBuilder& builder, ScratchArena& arena) {
+			std::shared_ptr<AnalysisResults> results = std::make_shared<AnalysisResults>();
+			size_t peak_count = 0;
+			size_t band_counts[AudioPeakDetection_NUM_BANDS] = {};
+			if (PickPeaks(builder,
+				settings,
+				sample_rate,
+				time_scale,
+				0,
+				static_cast<int64_t>(builder.FrameCount()),
+				arena,
+				*results,
+				peak_count,
+				band_counts) != kPeakPickOutOfMemory) {
+				fresh[source_of_job[job]] = results;
+			}
+		});
+	for (size_t job = 0; job < source_of_job.size(); ++job) {
+		if (batch.AddJob(geometry,
+			settings.detection_function,
+			sample_rate,
+			settings.low_crossover_hz,
+			settings.high_crossover_hz,
+			sources[source_of_job[job]].sample_count) < 0) {
+			return PF_Err_OUT_OF_MEMORY;
 		}
+	}
 
-		const double frame_index = static_cast<double>(i);
-		const double frame_gap = frame_index - last_peak_frame;
-		const float flux_value = smoothed_flux[i];
+	const int64_t window_samples = static_cast<int64_t>(kCheckoutWindowSeconds) * std::llround(sample_rate);
+	int64_t total_windows = 0;
+	for (size_t source : source_of_job) {
+		total_windows += (sources[source].sample_count + window_samples - 1) / window_samples;
+	}
+	int64_t fetched_windows = 0;
+	auto poll = [&]() -> bool {
+		err = AbortRequested(in_data);
+		if (err == PF_Err_NONE) {
+			const A_long progress = static_cast<A_long>((fetched_windows * 80) / std::max<int64_t>(1, total_windows) +
+				static_cast<int64_t>(batch.FinishedJobs() * 20) / static_cast<int64_t>(std::max<size_t>(1, source_of_job.size())));
+			err = ReportProgress(in_data, progress, kProgressMax);
+		}
+		return err == PF_Err_NONE;
+	};
 
-		if (frame_gap < static_cast<double>(min_separation_frames)) {
-			if (!candidates.empty() && flux_value > candidates.back().flux_value) {
-				candidates.back().frame_index = i;
-				candidates.back().flux_value = flux_value;
-				last_peak_frame = frame_index;
+	// Only this thread may render audio. Windows are fetched round-robin across
+	// the sources so each worker has a source to transform while the next
+	// window renders.
+	for (int64_t first_sample = 0; fetched_windows < total_windows; first_sample += window_samples) {
+		for (size_t job = 0; job < source_of_job.size(); ++job) {
+			const BatchSource& source = sources[source_of_job[job]];
+			if (first_sample >= source.sample_count) {
+				continue;
+			}
+			const int64_t count = std::min(window_samples, source.sample_count - first_sample);
+			std::vector<float> mono;
+			ae_err = RenderItemAudio(suites, source.itemH, sample_rate, first_sample, count, mono);
+			if (ae_err != A_Err_NONE) {
+				if (in_data->utils) {
+					in_data->utils->ansi.sprintf(out_data->return_msg,
+						(ae_err == A_Err_PARAMETER) ?
+						"AudioPeakDetector: A layer's audio is too long to render; no markers were changed." :
+						"AudioPeakDetector: Unable to render the audio of a layer.");
+				}
+				return ae_err;
+			}
+			if (!batch.Push(job, std::move(mono), poll)) {
+				return err;
+			}
+			if (first_sample + count >= source.sample_count) {
+				batch.Close(job);
+			}
+			++fetched_windows;
+			if (!poll()) {
+				return err;
 			}
-			continue;
 		}
-
-		candidates.push_back({ i, flux_value });
-		last_peak_frame = frame_index;
+	}
+	if (!batch.Wait(poll)) {
+		return err;
 	}
 
-	state->peaks.clear();
-	state->peaks.reserve(candidates.size());
-	for (const auto& candidate : candidates) {
-		const double frame_time = static_cast<double>(candidate.frame_index * kHopSize) / sample_rate;
-		const double amplitude_percent = ClampValue((candidate.flux_value / max_flux) * 100.0, 0.0, 100.0);
-
-		PeakMarker marker;
-		marker.time.scale = in_data->time_scale;
-		marker.time.value = static_cast<A_long>(std::llround(frame_time * static_cast<double>(in_data->time_scale)));
-		marker.amplitude = static_cast<PF_FpShort>(amplitude_percent);
-		marker.is_loud = (amplitude_percent >= kLoudnessThreshold) ? TRUE : FALSE;
-		state->peaks.push_back(marker);
+	// Published like the results of Analyze Audio, so an instance on one of
+	// these layers with the same settings adopts them while they are alive.
+	for (size_t source = 0; source < sources.size(); ++source) {
+		if (fresh[source]) {
+			sources[source].results = fresh[source];
+			if (fresh[source]->has_analyzed) {
+				AnalysisRegistry::Get().PublishResults(sources[source].key, fresh[source]);
+			}
+		}
+	}
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	AnalysisResultKey own_key;
+	if (state && MakeResultKey(in_data, params, LayerDurationTicks(in_data), own_key)) {
+		const std::shared_ptr<const AnalysisResults> own = AnalysisRegistry::Get().FindResults(own_key);
+		if (own && own->has_analyzed) {
+			state->SetResults(own);
+		}
 	}
 
-	state->has_analyzed = TRUE;
+	MarkerCounts counts;
+	int marked_layers = 0;
+	suites.UtilitySuite3()->AEGP_StartUndoGroup("Audio Peak Comp Markers");
+	for (const BatchLayer& layer : layers) {
+		const std::shared_ptr<const AnalysisResults>& results = sources[layer.source].results;
+		if (results && results->has_analyzed &&
+			WriteResultMarkers(suites,
+				layer.layerH,
+				*results,
+				params[AudioPeakDetection_MARKER_LABELS]->u.pd.value,
+				params[AudioPeakDetection_BAND_MARKERS]->u.bd.value != 0,
+				params[AudioPeakDetection_BEAT_MARKERS]->u.bd.value != 0,
+				counts) == A_Err_NONE) {
+			++marked_layers;
+		}
+	}
+	suites.UtilitySuite3()->AEGP_EndUndoGroup();
 
 	err = ReportProgress(in_data, kProgressMax, kProgressMax);
 	if (err != PF_Err_NONE) {
-		return cleanup_audio(err);
+		return err;
 	}
 
 	if (in_data->utils) {
 		in_data->utils->ansi.sprintf(out_data->return_msg,
-			"AudioPeakDetector: Found %d peaks.",
-			static_cast<int>(state->peaks.size()));
+			"AudioPeakDetector: Marked %d of %d audio layers from %d sources (%d reused, %d time-remapped skipped): %d markers. %d threads, %.1f MB queued at most.",
+			marked_layers,
+			static_cast<int>(layers.size()) + remapped_layers,
+			static_cast<int>(sources.size()),
+			reused_sources,
+			remapped_layers,
+			counts.total,
+			static_cast<int>(batch.WorkerCount()),
+			static_cast<double>(batch.PeakQueuedBytes()) / (1024.0 * 1024.0));
 	}
 
-	return cleanup_audio(PF_Err_NONE);
+	return PF_Err_NONE;
 }
 
-/* -------------------------------------------------------- CreateMarkers */
-static PF_Err CreateMarkers(PF_InData* in_data,
+/* ---------------------------------------------------- SuggestSettings */
+namespace {
+
+float SuggestStep(double min_value, double max_value, int step, int step_count)
+{
+	return static_cast<float>(min_value + (max_value - min_value) * step / (step_count - 1));
+}
+
+// Squared distance from the current controls, each scaled to its slider range.
+double SettingDistance(const SweepSetting& setting, const DetectionSettings& current)
+{
+	const double threshold = (setting.threshold_multiplier - current.threshold_multiplier) /
+		(AudioPeakDetection_THRESHOLD_MULTIPLIER_MAX - AudioPeakDetection_THRESHOLD_MULTIPLIER_MIN);
+	const double smoothing = (setting.smoothing_percent - current.smoothing_percent) /
+		(AudioPeakDetection_SMOOTHING_MAX - AudioPeakDetection_SMOOTHING_MIN);
+	const double separation = (setting.min_separation_seconds - current.min_separation_seconds) /
+		(AudioPeakDetection_MIN_SEPARATION_MAX - AudioPeakDetection_MIN_SEPARATION_MIN);
+	return threshold * threshold + smoothing * smoothing + separation * separation;
+}
+
+} // namespace
+
+// Sweeps Threshold Multiplier, Smoothing and Min Separation over the onset
+// curve kept by the last whole-layer analysis and sets the controls to the
+// combination whose peak density comes closest to Target Density. The sweep
+// models the Trailing Mean threshold, so Threshold Mode is set to it. Among
+// equally close ones the nearest to the current controls wins. Nothing is
+// checked out or transformed, and the Analyze that applies the suggestion
+// reuses the same curve.
+static PF_Err SuggestSettings(PF_InData* in_data,
 	PF_OutData* out_data,
 	PF_ParamDef* params[])
 {
-	AnalysisState* state = GetState(in_data, out_data);
-	if (!state || !state->has_analyzed) {
-		if (in_data->utils) {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Run Analyze Audio before creating markers.");
-		}
-		return PF_Err_NONE;
+	const std::shared_ptr<AnalysisState> state = GetState(in_data, out_data);
+	if (!state) {
+		return PF_Err_INTERNAL_STRUCT_DAMAGED;
 	}
 
-	if (state->peaks.empty()) {
+	// The curve depends on the detection function, the crossovers and the
+	// quality, but not on the settings being swept.
+	const std::shared_ptr<const AnalysisResults> results = state->Results();
+	const std::shared_ptr<OnsetCurveStore> store = results ? results->curve_store : nullptr;
+	if (!store || !store->HasCurves() || store->Flux().empty() ||
+		store->Key() != MakeCacheKey(params, store->Key().sample_rate)) {
 		if (in_data->utils) {
 			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: No peaks available. Re-run analysis with different settings.");
+				"AudioPeakDetector: Analyze the entire layer with the current Detection Function, crossovers and Quality before suggesting settings.");
 		}
 		return PF_Err_NONE;
 	}
 
-	if (g_my_plugin_id == 0) {
-		if (in_data->utils) {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Marker creation unavailable in this build.");
+	std::vector<SweepSetting> grid;
+	grid.reserve(static_cast<size_t>(kSuggestThresholdSteps) * kSuggestSmoothingSteps * kSuggestSeparationSteps);
+	for (int threshold = 0; threshold < kSuggestThresholdSteps; ++threshold) {
+		for (int smoothing = 0; smoothing < kSuggestSmoothingSteps; ++smoothing) {
+			for (int separation = 0; separation < kSuggestSeparationSteps; ++separation) {
+				SweepSetting setting;
+				setting.threshold_multiplier = SuggestStep(AudioPeakDetection_THRESHOLD_MULTIPLIER_MIN,
+					AudioPeakDetection_THRESHOLD_MULTIPLIER_MAX, threshold, kSuggestThresholdSteps);
+				setting.smoothing_percent = SuggestStep(AudioPeakDetection_SMOOTHING_MIN,
+					AudioPeakDetection_SMOOTHING_MAX, smoothing, kSuggestSmoothingSteps);
+				setting.min_separation_seconds = SuggestStep(AudioPeakDetection_MIN_SEPARATION_MIN,
+					AudioPeakDetection_MIN_SEPARATION_MAX, separation, kSuggestSeparationSteps);
+				grid.push_back(setting);
+			}
 		}
-		return PF_Err_NONE;
 	}
-
-	AEGP_SuiteHandler suites(in_data->pica_basicP);
-
-	AEGP_LayerH layerH = nullptr;
-	A_Err ae_err = suites.PFInterfaceSuite1()->AEGP_GetEffectLayer(in_data->effect_ref, &layerH);
-	if (ae_err != A_Err_NONE || !layerH) {
-		if (in_data->utils) {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Unable to access effect layer.");
-		}
-		return ae_err;
+	std::vector<SweepResult> sweep(grid.size());
+
+	const OnsetCacheKey& key = store->Key();
+	ScratchArena& arena = AnalysisRegistry::Get().Arena();
+	arena.Reset();
+	const bool swept = SweepPeakPicking(store->Flux(),
+		OnsetFramesPerSecond(key.sample_rate, key.geometry),
+		grid.data(),
+		grid.size(),
+		sweep.data(),
+		arena);
+	arena.Trim(kArenaRetainBytes);
+	if (!swept) {
+		return PF_Err_OUT_OF_MEMORY;
 	}
 
-	AEGP_StreamRefH marker_streamH = nullptr;
-	ae_err = suites.StreamSuite6()->AEGP_GetNewLayerStream(
-		g_my_plugin_id,
-		layerH,
-		AEGP_LayerStream_MARKER,
-		&marker_streamH);
-	if (ae_err != A_Err_NONE || !marker_streamH) {
-		if (in_data->utils) {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Layer does not support markers.");
+	const DetectionSettings current = ReadDetectionSettings(params);
+	const double target = params[AudioPeakDetection_TARGET_DENSITY]->u.fs_d.value;
+	size_t best = 0;
+	double best_error = std::fabs(sweep[0].peaks_per_minute - target);
+	double best_distance = SettingDistance(grid[0], current);
+	for (size_t index = 1; index < grid.size(); ++index) {
+		const double error = std::fabs(sweep[index].peaks_per_minute - target);
+		const double distance = SettingDistance(grid[index], current);
+		if (error < best_error || (error == best_error && distance < best_distance)) {
+			best = index;
+			best_error = error;
+			best_distance = distance;
 		}
-		if (marker_streamH) {
-			suites.StreamSuite6()->AEGP_DisposeStream(marker_streamH);
-		}
-		return ae_err;
 	}
 
-	int marker_count = 0;
-	int loud_count = 0;
-	int quiet_count = 0;
-
-	for (const PeakMarker& peak : state->peaks) {
-		AEGP_MarkerValP markerP = nullptr;
-		ae_err = suites.MarkerSuite3()->AEGP_NewMarker(&markerP);
-		if (ae_err != A_Err_NONE || !markerP) {
-			continue;
-		}
-
-		ae_err = suites.MarkerSuite3()->AEGP_SetMarkerLabel(markerP, peak.is_loud ? 1 : 4);
-		if (ae_err == A_Err_NONE) {
-			if (peak.is_loud) {
-				++loud_count;
-			}
-			else {
-				++quiet_count;
-			}
-		}
-
-		char comment[128];
-		std::snprintf(comment, sizeof(comment), "AudioPeak: %.1f", static_cast<double>(peak.amplitude));
-
-			A_u_short unicode_comment[128] = {};
-		const size_t length = std::min(sizeof(unicode_comment) / sizeof(unicode_comment[0]) - 1, std::strlen(comment));
-		for (size_t i = 0; i < length; ++i) {
-			unicode_comment[i] = static_cast<A_u_short>(comment[i]);
-		}
-		unicode_comment[length] = 0;
-
-		suites.MarkerSuite3()->AEGP_SetMarkerString(
-			markerP,
-			AEGP_MarkerString_COMMENT,
-			unicode_comment,
-			static_cast<A_long>(length));
-
-		A_long keyframe_index = 0;
-		ae_err = suites.KeyframeSuite5()->AEGP_InsertKeyframe(
-			marker_streamH,
-			AEGP_LTimeMode_LayerTime,
-			&peak.time,
-			&keyframe_index);
-		if (ae_err != A_Err_NONE) {
-			suites.MarkerSuite3()->AEGP_DisposeMarker(markerP);
-			continue;
-		}
-
-		AEGP_StreamValue2 stream_value{};
-		stream_value.streamH = marker_streamH;
-		stream_value.val.markerP = markerP;
-
-		ae_err = suites.KeyframeSuite5()->AEGP_SetKeyframeValue(marker_streamH, keyframe_index, &stream_value);
-		suites.MarkerSuite3()->AEGP_DisposeMarker(markerP);
-		if (ae_err == A_Err_NONE) {
-			++marker_count;
-		}
+	params[AudioPeakDetection_THRESHOLD_MULTIPLIER]->u.fs_d.value = grid[best].threshold_multiplier;
+	params[AudioPeakDetection_THRESHOLD_MULTIPLIER]->uu.change_flags = PF_ChangeFlag_CHANGED_VALUE;
+	params[AudioPeakDetection_SMOOTHING]->u.fs_d.value = grid[best].smoothing_percent;
+	params[AudioPeakDetection_SMOOTHING]->uu.change_flags = PF_ChangeFlag_CHANGED_VALUE;
+	params[AudioPeakDetection_MIN_SEPARATION]->u.fs_d.value = grid[best].min_separation_seconds;
+	params[AudioPeakDetection_MIN_SEPARATION]->uu.change_flags = PF_ChangeFlag_CHANGED_VALUE;
+	if (params[AudioPeakDetection_THRESHOLD_MODE]->u.pd.value != AudioPeakDetection_THRESHOLD_TRAILING_MEAN) {
+		params[AudioPeakDetection_THRESHOLD_MODE]->u.pd.value = AudioPeakDetection_THRESHOLD_TRAILING_MEAN;
+		params[AudioPeakDetection_THRESHOLD_MODE]->uu.change_flags = PF_ChangeFlag_CHANGED_VALUE;
 	}
 
-	suites.StreamSuite6()->AEGP_DisposeStream(marker_streamH);
-
 	if (in_data->utils) {
-		if (marker_count > 0) {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: Created %d markers (%d loud, %d quiet).",
-				marker_count,
-				loud_count,
-				quiet_count);
-		}
-		else {
-			in_data->utils->ansi.sprintf(out_data->return_msg,
-				"AudioPeakDetector: No markers were created.");
-		}
+		in_data->utils->ansi.sprintf(out_data->return_msg,
+			"AudioPeakDetector: Best of %d settings: Threshold %.2f, Smoothing %.0f%%, Min Separation %.2f sec give %d peaks (%.1f/min, target %.1f). Run Analyze Audio to apply.",
+			static_cast<int>(grid.size()),
+			grid[best].threshold_multiplier,
+			grid[best].smoothing_percent,
+			grid[best].min_separation_seconds,
+			static_cast<int>(sweep[best].peak_count),
+			sweep[best].peaks_per_minute,
+			target);
 	}
 
 	return PF_Err_NONE;
@@ -974,6 +3284,22 @@ static PF_Err UserChangedParam(PF_InData* in_data,
 		err = CreateMarkers(in_data, out_data, params);
 		out_data->out_flags |= PF_OutFlag_FORCE_RERENDER | PF_OutFlag_REFRESH_UI;
 		break;
+	case AudioPeakDetection_EXPORT_BUTTON:
+		err = ExportPeaks(in_data, out_data, params);
+		out_data->out_flags |= PF_OutFlag_REFRESH_UI;
+		break;
+	case AudioPeakDetection_KEYFRAME_BUTTON:
+		err = KeyframeOnsetStrength(in_data, out_data, params);
+		out_data->out_flags |= PF_OutFlag_FORCE_RERENDER | PF_OutFlag_REFRESH_UI;
+		break;
+	case AudioPeakDetection_ANALYZE_COMP_BUTTON:
+		err = AnalyzeComp(in_data, out_data, params);
+		out_data->out_flags |= PF_OutFlag_FORCE_RERENDER | PF_OutFlag_REFRESH_UI;
+		break;
+	case AudioPeakDetection_SUGGEST_BUTTON:
+		err = SuggestSettings(in_data, out_data, params);
+		out_data->out_flags |= PF_OutFlag_FORCE_RERENDER | PF_OutFlag_REFRESH_UI;
+		break;
 	default:
 		break;
 	}
@@ -39,7 +39,14 @@
 #include "String_Utils.h"
 
 #include "AudioPeakDetection_Strings.h"
+#include "AudioPeakDetection_Core.h"
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #ifndef DllExport
@@ -62,25 +69,100 @@
 #define AudioPeakDetection_THRESHOLD_MULTIPLIER_MAX 3.0
 #define AudioPeakDetection_THRESHOLD_MULTIPLIER_DFLT 1.5
 
+#define AudioPeakDetection_THRESHOLD_PERCENTILE_MIN 50.0
+#define AudioPeakDetection_THRESHOLD_PERCENTILE_MAX 99.9
+#define AudioPeakDetection_THRESHOLD_PERCENTILE_DFLT 90.0
+
+#define AudioPeakDetection_PERCENTILE_WINDOW_MIN 0.5
+#define AudioPeakDetection_PERCENTILE_WINDOW_MAX 60.0
+#define AudioPeakDetection_PERCENTILE_WINDOW_SLIDER_MAX 20.0
+#define AudioPeakDetection_PERCENTILE_WINDOW_DFLT 5.0
+
 #define AudioPeakDetection_SMOOTHING_MIN 0.0
 #define AudioPeakDetection_SMOOTHING_MAX 100.0
 #define AudioPeakDetection_SMOOTHING_DFLT 30.0
 
+#define AudioPeakDetection_OVERLAY_SPAN_MIN 1.0
+#define AudioPeakDetection_OVERLAY_SPAN_MAX 3600.0
+#define AudioPeakDetection_OVERLAY_SPAN_SLIDER_MAX 120.0
+#define AudioPeakDetection_OVERLAY_SPAN_DFLT 10.0
+
+#define AudioPeakDetection_ONSET_STRENGTH_MIN 0.0
+#define AudioPeakDetection_ONSET_STRENGTH_MAX 100.0
+#define AudioPeakDetection_ONSET_STRENGTH_DFLT 0.0
+
+#define AudioPeakDetection_TARGET_DENSITY_MIN 1.0
+#define AudioPeakDetection_TARGET_DENSITY_MAX 1000.0
+#define AudioPeakDetection_TARGET_DENSITY_SLIDER_MAX 300.0
+#define AudioPeakDetection_TARGET_DENSITY_DFLT 120.0
+
 #define AudioPeakDetection_LOUDNESS_THRESHOLD_PERCENT 75.0
 
+#define AudioPeakDetection_NUM_BANDS 3
+
+#define AudioPeakDetection_LOW_CROSSOVER_MIN 40.0
+#define AudioPeakDetection_LOW_CROSSOVER_MAX 1000.0
+#define AudioPeakDetection_LOW_CROSSOVER_DFLT 150.0
+
+#define AudioPeakDetection_HIGH_CROSSOVER_MIN 1000.0
+#define AudioPeakDetection_HIGH_CROSSOVER_MAX 16000.0
+#define AudioPeakDetection_HIGH_CROSSOVER_DFLT 5000.0
+
+#define AudioPeakDetection_RANGE_SECONDS_MIN 0.0
+#define AudioPeakDetection_RANGE_SECONDS_MAX 86400.0
+#define AudioPeakDetection_RANGE_SECONDS_SLIDER_MAX 600.0
+#define AudioPeakDetection_RANGE_START_DFLT 0.0
+#define AudioPeakDetection_RANGE_END_DFLT 10.0
+
 enum {
     AudioPeakDetection_INPUT = 0,
     AudioPeakDetection_DETECTION_GROUP_START,
+    AudioPeakDetection_DETECTION_FUNCTION,
     AudioPeakDetection_MIN_SEPARATION,
     AudioPeakDetection_THRESHOLD_MULTIPLIER,
+    AudioPeakDetection_THRESHOLD_MODE,
+    AudioPeakDetection_THRESHOLD_PERCENTILE,
+    AudioPeakDetection_PERCENTILE_WINDOW,
     AudioPeakDetection_SMOOTHING,
+    AudioPeakDetection_TARGET_DENSITY,
+    AudioPeakDetection_SUGGEST_BUTTON,
     AudioPeakDetection_DETECTION_GROUP_END,
+    AudioPeakDetection_BAND_GROUP_START,
+    AudioPeakDetection_BAND_MARKERS,
+    AudioPeakDetection_LOW_CROSSOVER,
+    AudioPeakDetection_HIGH_CROSSOVER,
+    AudioPeakDetection_BAND_GROUP_END,
+    AudioPeakDetection_BEAT_MARKERS,
+    AudioPeakDetection_RANGE_GROUP_START,
+    AudioPeakDetection_RANGE_MODE,
+    AudioPeakDetection_RANGE_START,
+    AudioPeakDetection_RANGE_END,
+    AudioPeakDetection_RANGE_GROUP_END,
+    AudioPeakDetection_QUALITY_GROUP_START,
+    AudioPeakDetection_QUALITY,
+    AudioPeakDetection_FFT_SIZE,
+    AudioPeakDetection_OVERLAP,
+    AudioPeakDetection_ANALYSIS_RATE,
+    AudioPeakDetection_QUALITY_GROUP_END,
+    AudioPeakDetection_OVERLAY_GROUP_START,
+    AudioPeakDetection_SHOW_OVERLAY,
+    AudioPeakDetection_OVERLAY_SPAN,
+    AudioPeakDetection_OVERLAY_GROUP_END,
+    AudioPeakDetection_EXPORT_GROUP_START,
+    AudioPeakDetection_EXPORT_FORMAT,
+    AudioPeakDetection_EXPORT_ONSET_CURVE,
+    AudioPeakDetection_EXPORT_BUTTON,
+    AudioPeakDetection_EXPORT_GROUP_END,
+    AudioPeakDetection_ONSET_STRENGTH,
     AudioPeakDetection_ANALYZE_BUTTON,
+    AudioPeakDetection_MARKER_LABELS,
     AudioPeakDetection_CREATE_MARKERS_BUTTON,
+    AudioPeakDetection_KEYFRAME_BUTTON,
+    AudioPeakDetection_ANALYZE_COMP_BUTTON,
     AudioPeakDetection_NUM_PARAMS
 };
 
-static_assert(AudioPeakDetection_CREATE_MARKERS_BUTTON + 1 == AudioPeakDetection_NUM_PARAMS,
+static_assert(AudioPeakDetection_ANALYZE_COMP_BUTTON + 1 == AudioPeakDetection_NUM_PARAMS,
         "Parameter enumeration and count are out of sync.");
 
 enum {
@@ -90,18 +172,316 @@ enum {
     AUDIO_PEAK_DETECTOR_SMOOTHING_DISK_ID,
     AUDIO_PEAK_DETECTOR_GROUP_END_DISK_ID,
     AUDIO_PEAK_DETECTOR_ANALYZE_BUTTON_DISK_ID,
-    AUDIO_PEAK_DETECTOR_CREATE_MARKERS_BUTTON_DISK_ID
+    AUDIO_PEAK_DETECTOR_CREATE_MARKERS_BUTTON_DISK_ID,
+    AUDIO_PEAK_DETECTOR_BAND_GROUP_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_BAND_MARKERS_DISK_ID,
+    AUDIO_PEAK_DETECTOR_LOW_CROSSOVER_DISK_ID,
+    AUDIO_PEAK_DETECTOR_HIGH_CROSSOVER_DISK_ID,
+    AUDIO_PEAK_DETECTOR_BAND_GROUP_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_BEAT_MARKERS_DISK_ID,
+    AUDIO_PEAK_DETECTOR_DETECTION_FUNCTION_DISK_ID,
+    AUDIO_PEAK_DETECTOR_RANGE_GROUP_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_RANGE_MODE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_RANGE_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_RANGE_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_RANGE_GROUP_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_ANALYZE_COMP_BUTTON_DISK_ID,
+    AUDIO_PEAK_DETECTOR_QUALITY_GROUP_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_QUALITY_DISK_ID,
+    AUDIO_PEAK_DETECTOR_FFT_SIZE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_OVERLAP_DISK_ID,
+    AUDIO_PEAK_DETECTOR_ANALYSIS_RATE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_QUALITY_GROUP_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_TARGET_DENSITY_DISK_ID,
+    AUDIO_PEAK_DETECTOR_SUGGEST_BUTTON_DISK_ID,
+    AUDIO_PEAK_DETECTOR_THRESHOLD_MODE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_THRESHOLD_PERCENTILE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_PERCENTILE_WINDOW_DISK_ID,
+    AUDIO_PEAK_DETECTOR_OVERLAY_GROUP_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_SHOW_OVERLAY_DISK_ID,
+    AUDIO_PEAK_DETECTOR_OVERLAY_SPAN_DISK_ID,
+    AUDIO_PEAK_DETECTOR_OVERLAY_GROUP_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_ONSET_STRENGTH_DISK_ID,
+    AUDIO_PEAK_DETECTOR_KEYFRAME_BUTTON_DISK_ID,
+    AUDIO_PEAK_DETECTOR_EXPORT_GROUP_START_DISK_ID,
+    AUDIO_PEAK_DETECTOR_EXPORT_FORMAT_DISK_ID,
+    AUDIO_PEAK_DETECTOR_EXPORT_ONSET_CURVE_DISK_ID,
+    AUDIO_PEAK_DETECTOR_EXPORT_BUTTON_DISK_ID,
+    AUDIO_PEAK_DETECTOR_EXPORT_GROUP_END_DISK_ID,
+    AUDIO_PEAK_DETECTOR_MARKER_LABELS_DISK_ID
+};
+
+/* Detection Function popup entries (1-based, matching popup values). */
+enum {
+    AudioPeakDetection_ODF_SPECTRAL_FLUX = 1,
+    AudioPeakDetection_ODF_LOG_FLUX,
+    AudioPeakDetection_ODF_HFC,
+    AudioPeakDetection_ODF_COMPLEX_DOMAIN,
+    AudioPeakDetection_ODF_ENERGY,
+    AudioPeakDetection_ODF_NUM_CHOICES = AudioPeakDetection_ODF_ENERGY
+};
+
+/* Threshold Mode popup entries. Rolling Percentile reads Threshold
+   Percentile and Percentile Window instead of Threshold Multiplier. */
+enum {
+    AudioPeakDetection_THRESHOLD_TRAILING_MEAN = 1,
+    AudioPeakDetection_THRESHOLD_ROLLING_PERCENTILE,
+    AudioPeakDetection_THRESHOLD_NUM_CHOICES = AudioPeakDetection_THRESHOLD_ROLLING_PERCENTILE
+};
+
+/* Analysis Range popup entries. Start and End are in layer time. */
+enum {
+    AudioPeakDetection_RANGE_ENTIRE_LAYER = 1,
+    AudioPeakDetection_RANGE_WORK_AREA,
+    AudioPeakDetection_RANGE_LAYER_IN_OUT,
+    AudioPeakDetection_RANGE_CUSTOM,
+    AudioPeakDetection_RANGE_NUM_CHOICES = AudioPeakDetection_RANGE_CUSTOM
+};
+
+/* Quality popup entries. Only Custom reads FFT Size, Overlap and Analysis Rate. */
+enum {
+    AudioPeakDetection_QUALITY_DRAFT = 1,
+    AudioPeakDetection_QUALITY_STANDARD,
+    AudioPeakDetection_QUALITY_PRECISE,
+    AudioPeakDetection_QUALITY_CUSTOM,
+    AudioPeakDetection_QUALITY_NUM_CHOICES = AudioPeakDetection_QUALITY_CUSTOM
+};
+
+/* FFT Size popup entries: 512, 1024, 2048 and 4096 samples. */
+enum {
+    AudioPeakDetection_FFT_SIZE_512 = 1,
+    AudioPeakDetection_FFT_SIZE_1024,
+    AudioPeakDetection_FFT_SIZE_2048,
+    AudioPeakDetection_FFT_SIZE_4096,
+    AudioPeakDetection_FFT_SIZE_NUM_CHOICES = AudioPeakDetection_FFT_SIZE_4096
+};
+
+/* Overlap popup entries: a hop of 1/2, 1/4 or 1/8 of the FFT size. */
+enum {
+    AudioPeakDetection_OVERLAP_50 = 1,
+    AudioPeakDetection_OVERLAP_75,
+    AudioPeakDetection_OVERLAP_87,
+    AudioPeakDetection_OVERLAP_NUM_CHOICES = AudioPeakDetection_OVERLAP_87
+};
+
+/* Analysis Rate popup entries. */
+enum {
+    AudioPeakDetection_RATE_22050 = 1,
+    AudioPeakDetection_RATE_44100,
+    AudioPeakDetection_RATE_48000,
+    AudioPeakDetection_RATE_NUM_CHOICES = AudioPeakDetection_RATE_48000
+};
+
+/* Export Format popup entries, in ExportFormat order. */
+enum {
+    AudioPeakDetection_EXPORT_CSV = 1,
+    AudioPeakDetection_EXPORT_JSON,
+    AudioPeakDetection_EXPORT_BINARY,
+    AudioPeakDetection_EXPORT_MIDI,
+    AudioPeakDetection_EXPORT_NUM_CHOICES = AudioPeakDetection_EXPORT_MIDI
+};
+
+/* Marker Labels popup entries: what picks the label colour of a peak
+   marker. Sound Type and Brightness read the peak's spectral shape. */
+enum {
+    AudioPeakDetection_LABELS_LOUDNESS = 1,
+    AudioPeakDetection_LABELS_SOUND_TYPE,
+    AudioPeakDetection_LABELS_BRIGHTNESS,
+    AudioPeakDetection_LABELS_NUM_CHOICES = AudioPeakDetection_LABELS_BRIGHTNESS
 };
 
+/* Frequency bands analyzed alongside the broadband flux. */
+enum {
+    AudioPeakDetection_BAND_LOW = 0,
+    AudioPeakDetection_BAND_MID,
+    AudioPeakDetection_BAND_HIGH
+};
+
+static_assert(AudioPeakDetection_BAND_HIGH + 1 == AudioPeakDetection_NUM_BANDS,
+        "Band enumeration and count are out of sync.");
+
 struct PeakMarker {
     A_Time time{};
+    // Position at AnalysisResults::sample_rate, for export.
+    int64_t sample = 0;
     PF_FpShort amplitude = 0;
     A_Boolean is_loud = FALSE;
+    // Spectrum of the onset's frame, for the Marker Labels modes.
+    SpectralShape shape;
 };
 
-struct AnalysisState {
+// Results of an analysis. Once an analysis finishes they are never written
+// again: instances showing the same footage with the same settings share one
+// copy, and an instance that re-analyzes builds a new one.
+struct AnalysisResults {
     PF_Boolean has_analyzed = FALSE;
+    // Rate of the last pass; kept markers are rescaled to it when a range
+    // analysis runs at another rate.
+    double sample_rate = 0.0;
     std::vector<PeakMarker> peaks;
+    std::array<std::vector<PeakMarker>, AudioPeakDetection_NUM_BANDS> band_peaks;
+    double tempo_bpm = 0.0;
+    std::vector<PeakMarker> beats;
+    // Onset curves and block hashes of the last whole-layer analysis of this
+    // footage with these curve settings, so the next one only transforms
+    // audio that changed. One store per footage and settings, shared through
+    // the AnalysisRegistry by every instance that analyzes it.
+    std::shared_ptr<OnsetCurveStore> curve_store;
+    // Smoothed onset curve and adaptive threshold of every analyzed frame,
+    // drawn by Render when Show Overlay is on.
+    OnsetOverlayPyramid overlay;
+};
+
+// What a whole-layer analysis was computed from: the footage item behind the
+// Audio Source layer, the layer's duration and every setting that changes
+// the result.
+struct AnalysisResultKey {
+    A_long source_item_id = 0;
+    A_long duration_ticks = 0;
+    A_u_long time_scale = 0;
+    A_long detection_function = 0;
+    PF_FpLong min_separation = 0;
+    PF_FpLong threshold_multiplier = 0;
+    A_long threshold_mode = 0;
+    PF_FpLong threshold_percentile = 0;
+    PF_FpLong percentile_window = 0;
+    PF_FpLong smoothing = 0;
+    PF_FpLong low_crossover = 0;
+    PF_FpLong high_crossover = 0;
+    A_long fft_size = 0;
+    A_long hop_size = 0;
+    PF_UFixed analysis_rate = 0;
+
+    bool operator<(const AnalysisResultKey& other) const;
+};
+
+// What onset frames are computed from: the footage item and the settings in
+// OnsetCacheKey, at the Quality's rate. Peak picking settings are not part of
+// it, so instances that only differ in those share frames.
+struct OnsetSourceKey {
+    A_long source_item_id = 0;
+    OnsetCacheKey onset;
+
+    bool operator<(const OnsetSourceKey& other) const;
+};
+
+struct AnalysisState;
+
+// Onset frames gathered from AudioRender buffers of one footage item (see
+// PrimeFluxCache), shared by every instance whose layer plays it. AudioRender
+// and Analyze can run on different threads, so every access holds the mutex.
+struct SharedFluxCache {
+    std::mutex mutex;
+    OnsetFluxCache cache;
+    // The instance whose AudioRender adds to the cache: the last one to set
+    // up audio, so layers playing the same footage run one STFT between them.
+    const AnalysisState* feeder = nullptr;
+};
+
+// Per-instance state. Sequence data only holds a SequenceHandleData naming
+// one of these in the AnalysisRegistry.
+struct AnalysisState {
+    // Render reads the results on a render thread while Analyze replaces them
+    // on the UI thread, so the pointer is only copied and set under the mutex.
+    // Only complete results are ever set.
+    std::shared_ptr<const AnalysisResults> Results() const
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        return results;
+    }
+    void SetResults(std::shared_ptr<const AnalysisResults> complete)
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        results.swap(complete);
+    }
+
+    // Footage item of the effect's own layer. Only the UI thread can ask
+    // for it, so Analyze notes it for AudioSetup; 0 until then.
+    std::atomic<A_long> own_item_id{ 0 };
+
+    // Set by AudioSetup, read by AudioRender.
+    std::shared_ptr<SharedFluxCache> PrimeCache() const
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        return prime_cache;
+    }
+    void SetPrimeCache(std::shared_ptr<SharedFluxCache> cache)
+    {
+        std::lock_guard<std::mutex> lock(results_mutex);
+        prime_cache.swap(cache);
+    }
+
+private:
+    std::shared_ptr<const AnalysisResults> results;
+    std::shared_ptr<SharedFluxCache> prime_cache;
+    mutable std::mutex results_mutex;
+};
+
+#define AudioPeakDetection_SEQUENCE_MAGIC 0x41504453 /* 'APDS' */
+
+// Plain data, so the host may copy it bitwise when it duplicates the effect.
+// The host also saves it with the project; session tells an id handed out in
+// this process from one saved by another, whose ids mean nothing here.
+struct SequenceHandleData {
+    A_u_long magic = AudioPeakDetection_SEQUENCE_MAGIC;
+    A_u_long session = 0;
+    uint64_t instance_id = 0;
+};
+
+/*
+ Process-wide table of effect instances and of the results they can share.
+ A duplicated effect arrives at SEQUENCE_RESETUP with a bitwise copy of the
+ original's handle; Attach() recognises the copy because it is a different
+ handle and gives it its own state that shares the original's results.
+ Published results, curve stores and flux caches are held weakly, so they go
+ away with the last instance that uses them.
+*/
+class AnalysisRegistry {
+public:
+    static AnalysisRegistry& Get();
+
+    // Returns the id of the state bound to handle, creating it (and sharing
+    // the results of instance_id, if that is another live instance) as needed.
+    // An instance_id from another session is treated as no id at all.
+    uint64_t Attach(PF_Handle handle, uint64_t instance_id, A_u_long session);
+    void Release(PF_Handle handle, uint64_t instance_id);
+    std::shared_ptr<AnalysisState> Find(uint64_t instance_id);
+
+    std::shared_ptr<const AnalysisResults> FindResults(const AnalysisResultKey& key);
+    void PublishResults(const AnalysisResultKey& key, const std::shared_ptr<const AnalysisResults>& results);
+
+    // Nonzero and random per process, so saved handles never match it.
+    A_u_long Session() const { return session_; }
+
+    // The store for key, created empty if no live results hold one.
+    std::shared_ptr<OnsetCurveStore> CurveStore(const OnsetSourceKey& key);
+
+    // Frames primed from key's footage, or null if no instance primes them.
+    std::shared_ptr<SharedFluxCache> FindFluxCache(const OnsetSourceKey& key);
+    // The cache for key with room for at least frame_count frames, created
+    // or grown as needed; null when out of memory.
+    std::shared_ptr<SharedFluxCache> PrepareFluxCache(const OnsetSourceKey& key, int64_t frame_count);
+
+    // Scratch for Analyze and Suggest Settings, reset at the start of each.
+    // Both run on the UI thread, so one arena serves every instance.
+    ScratchArena& Arena() { return arena_; }
+
+private:
+    AnalysisRegistry();
+
+    const A_u_long session_;
+    struct Instance {
+        PF_Handle handle = nullptr;
+        std::shared_ptr<AnalysisState> state;
+    };
+
+    std::mutex mutex_;
+    uint64_t next_id_ = 1;
+    std::map<uint64_t, Instance> instances_;
+    std::map<AnalysisResultKey, std::weak_ptr<const AnalysisResults>> results_;
+    std::map<OnsetSourceKey, std::weak_ptr<OnsetCurveStore>> curve_stores_;
+    std::map<OnsetSourceKey, std::weak_ptr<SharedFluxCache>> flux_caches_;
+    ScratchArena arena_;
 };
 
 extern "C" {
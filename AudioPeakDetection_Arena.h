@@ -0,0 +1,236 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#pragma once
+
+#ifndef AUDIO_PEAK_DETECTION_ARENA_H
+#define AUDIO_PEAK_DETECTION_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+/*
+ ScratchArena is a growable bump allocator for per-analysis scratch memory.
+
+ Every buffer an analysis needs is carved from the arena and released in one
+ go by Reset(). When an analysis outgrew the current block, Reset() folds all
+ blocks into a single block sized to the high-water mark, so the next analysis
+ of the same material performs no heap allocation at all. Allocations are
+ 64-byte aligned (cache line, and wide enough for any SIMD load).
+
+ Blocks come from malloc unless an ArenaAllocator is given, so an embedding
+ host can route the arena's memory through its own heap.
+*/
+struct ArenaAllocator {
+	void* (*allocate)(void* context, size_t bytes) = nullptr;
+	void (*release)(void* context, void* memory) = nullptr;
+	void* context = nullptr;
+};
+
+class ScratchArena {
+public:
+	static constexpr size_t kAlignment = 64;
+
+	ScratchArena() = default;
+	explicit ScratchArena(const ArenaAllocator& allocator) : allocator_(allocator) {}
+	~ScratchArena() { ReleaseBlocks(); }
+
+	ScratchArena(const ScratchArena&) = delete;
+	ScratchArena& operator=(const ScratchArena&) = delete;
+
+	void* Allocate(size_t bytes, size_t alignment = kAlignment)
+	{
+		if (bytes == 0) {
+			bytes = 1;
+		}
+		if (alignment < kAlignment) {
+			alignment = kAlignment;
+		}
+
+		void* memory = (block_count_ > 0) ? Carve(blocks_[block_count_ - 1], bytes, alignment) : nullptr;
+		if (!memory) {
+			const size_t previous = (block_count_ > 0) ? blocks_[block_count_ - 1].size : 0;
+			size_t block_size = previous * 2;
+			if (block_size < kMinBlockBytes) {
+				block_size = kMinBlockBytes;
+			}
+			if (block_size < bytes + alignment) {
+				block_size = bytes + alignment;
+			}
+			if (!PushBlock(block_size)) {
+				return nullptr;
+			}
+			memory = Carve(blocks_[block_count_ - 1], bytes, alignment);
+		}
+		if (memory) {
+			used_bytes_ += bytes;
+			if (used_bytes_ > peak_bytes_) {
+				peak_bytes_ = used_bytes_;
+			}
+		}
+		return memory;
+	}
+
+	// Zero-initialised array of trivially constructible elements.
+	template <typename T>
+	T* AllocateArray(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "Arena arrays are never destroyed.");
+		T* data = static_cast<T*>(Allocate(sizeof(T) * (count ? count : 1), alignof(T)));
+		if (data) {
+			std::memset(static_cast<void*>(data), 0, sizeof(T) * count);
+		}
+		return data;
+	}
+
+	// Releases every carve-out. Blocks are kept; if the previous analysis
+	// needed more than one block they are merged so the next one fits.
+	void Reset()
+	{
+		used_bytes_ = 0;
+		peak_bytes_ = 0;
+		if (block_count_ > 1) {
+			size_t total = 0;
+			for (size_t i = 0; i < block_count_; ++i) {
+				total += blocks_[i].size;
+			}
+			ReleaseBlocks();
+			PushBlock(total);
+		}
+		// The merge belongs to the previous analysis, not the next one.
+		heap_allocations_ = 0;
+		for (size_t i = 0; i < block_count_; ++i) {
+			blocks_[i].used = 0;
+		}
+	}
+
+	// Drops the retained block when it is larger than keep_bytes, so a single
+	// very long layer does not pin its scratch memory for the session.
+	void Trim(size_t keep_bytes)
+	{
+		if (CapacityBytes() > keep_bytes) {
+			ReleaseBlocks();
+		}
+	}
+
+	// Heap allocations performed since the last Reset().
+	size_t HeapAllocations() const { return heap_allocations_; }
+	// High-water mark of carved bytes since the last Reset().
+	size_t PeakBytes() const { return peak_bytes_; }
+
+	size_t CapacityBytes() const
+	{
+		size_t total = 0;
+		for (size_t i = 0; i < block_count_; ++i) {
+			total += blocks_[i].size;
+		}
+		return total;
+	}
+
+private:
+	static constexpr size_t kMaxBlocks = 48;
+	static constexpr size_t kMinBlockBytes = 1 << 20;
+
+	struct Block {
+		void* raw = nullptr;
+		unsigned char* data = nullptr;
+		size_t size = 0;
+		size_t used = 0;
+	};
+
+	static void* Carve(Block& block, size_t bytes, size_t alignment)
+	{
+		const uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+		const uintptr_t aligned = (base + block.used + alignment - 1) & ~static_cast<uintptr_t>(alignment - 1);
+		const size_t offset = static_cast<size_t>(aligned - base);
+		if (offset > block.size || block.size - offset < bytes) {
+			return nullptr;
+		}
+		block.used = offset + bytes;
+		return block.data + offset;
+	}
+
+	bool PushBlock(size_t size)
+	{
+		if (block_count_ == kMaxBlocks) {
+			return false;
+		}
+		void* raw = allocator_.allocate ? allocator_.allocate(allocator_.context, size + kAlignment) : std::malloc(size + kAlignment);
+		if (!raw) {
+			return false;
+		}
+		const uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + kAlignment - 1) & ~static_cast<uintptr_t>(kAlignment - 1);
+		Block& block = blocks_[block_count_++];
+		block.raw = raw;
+		block.data = reinterpret_cast<unsigned char*>(aligned);
+		block.size = size;
+		block.used = 0;
+		++heap_allocations_;
+		return true;
+	}
+
+	void ReleaseBlocks()
+	{
+		for (size_t i = 0; i < block_count_; ++i) {
+			if (allocator_.release) {
+				allocator_.release(allocator_.context, blocks_[i].raw);
+			} else {
+				std::free(blocks_[i].raw);
+			}
+			blocks_[i] = Block();
+		}
+		block_count_ = 0;
+	}
+
+	ArenaAllocator allocator_;
+	Block blocks_[kMaxBlocks];
+	size_t block_count_ = 0;
+	size_t used_bytes_ = 0;
+	size_t peak_bytes_ = 0;
+	size_t heap_allocations_ = 0;
+};
+
+// Non-owning view of an arena-carved array.
+template <typename T>
+struct ArenaSpan {
+	T* ptr = nullptr;
+	size_t count = 0;
+
+	T* data() const { return ptr; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T& operator[](size_t index) const { return ptr[index]; }
+	T* begin() const { return ptr; }
+	T* end() const { return ptr + count; }
+	operator ArenaSpan<const T>() const { return ArenaSpan<const T>{ ptr, count }; }
+};
+
+template <typename T>
+inline ArenaSpan<T> AllocateSpan(ScratchArena& arena, size_t count)
+{
+	T* data = arena.template AllocateArray<T>(count);
+	return ArenaSpan<T>{ data, data ? count : 0 };
+}
+
+#endif // AUDIO_PEAK_DETECTION_ARENA_H
@@ -0,0 +1,230 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#include "AudioPeakDetection_Batch.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+
+// How often a blocked Push() or Wait() hands control back to the caller, so
+// the host's progress bar and cancel button stay responsive.
+constexpr std::chrono::milliseconds kPollInterval(50);
+
+} // namespace
+
+OnsetBatch::OnsetBatch(size_t worker_count, size_t memory_budget_bytes, FinishFunction finish)
+	: finish_(std::move(finish)),
+	memory_budget_bytes_(memory_budget_bytes)
+{
+	worker_count = std::max<size_t>(worker_count, 1);
+	workers_.reserve(worker_count);
+	for (size_t worker = 0; worker < worker_count; ++worker) {
+		workers_.emplace_back(&OnsetBatch::WorkerLoop, this);
+	}
+}
+
+OnsetBatch::~OnsetBatch()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_ = true;
+		if (finished_jobs_ < jobs_.size()) {
+			cancelled_ = true;
+		}
+	}
+	work_ready_.notify_all();
+	for (std::thread& worker : workers_) {
+		worker.join();
+	}
+}
+
+int64_t OnsetBatch::AddJob(const OnsetGeometry& geometry,
+	int onset_function,
+	double sample_rate,
+	double low_crossover_hz,
+	double high_crossover_hz,
+	int64_t sample_count)
+{
+	std::unique_ptr<Job> job(new Job());
+	if (!job->builder.Initialize(job->arena,
+		geometry,
+		onset_function,
+		sample_rate,
+		low_crossover_hz,
+		high_crossover_hz,
+		OnsetFrameCount(sample_count, geometry))) {
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	jobs_.push_back(std::move(job));
+	return static_cast<int64_t>(jobs_.size() - 1);
+}
+
+bool OnsetBatch::Push(size_t job, std::vector<float>&& mono, const PollFunction& poll)
+{
+	const size_t bytes = mono.capacity() * sizeof(float);
+	std::unique_lock<std::mutex> lock(mutex_);
+	// A piece larger than the whole budget still goes through once the queue
+	// has drained, so the batch cannot stall on it.
+	while (!cancelled_ && queued_bytes_ > 0 && queued_bytes_ + bytes > memory_budget_bytes_) {
+		WaitFor(lock, poll);
+	}
+	if (cancelled_) {
+		return false;
+	}
+
+	jobs_[job]->queue.push_back(std::move(mono));
+	queued_bytes_ += bytes;
+	peak_queued_bytes_ = std::max(peak_queued_bytes_, queued_bytes_);
+	lock.unlock();
+	work_ready_.notify_one();
+	return true;
+}
+
+void OnsetBatch::Close(size_t job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		jobs_[job]->closed = true;
+	}
+	work_ready_.notify_one();
+}
+
+bool OnsetBatch::Wait(const PollFunction& poll)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!cancelled_ && finished_jobs_ < jobs_.size()) {
+		WaitFor(lock, poll);
+	}
+	return !cancelled_;
+}
+
+void OnsetBatch::Cancel()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		cancelled_ = true;
+	}
+	work_ready_.notify_all();
+	progress_.notify_all();
+}
+
+size_t OnsetBatch::FinishedJobs() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return finished_jobs_;
+}
+
+size_t OnsetBatch::PeakQueuedBytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return peak_queued_bytes_;
+}
+
+// Waits for a worker to make progress. The caller is polled at most every
+// kPollInterval, however often the workers wake it.
+void OnsetBatch::WaitFor(std::unique_lock<std::mutex>& lock, const PollFunction& poll)
+{
+	progress_.wait_for(lock, kPollInterval);
+	const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!poll || now - last_poll_ < kPollInterval) {
+		return;
+	}
+	last_poll_ = now;
+
+	lock.unlock();
+	const bool keep_going = poll();
+	lock.lock();
+	if (!keep_going) {
+		cancelled_ = true;
+		work_ready_.notify_all();
+	}
+}
+
+// Jobs are taken round-robin so every queued job gets a worker before any
+// job gets a second turn.
+OnsetBatch::Job* OnsetBatch::NextRunnable(size_t& index)
+{
+	for (size_t offset = 0; offset < jobs_.size(); ++offset) {
+		const size_t candidate = (next_job_ + offset) % jobs_.size();
+		Job& job = *jobs_[candidate];
+		if (!job.busy && !job.finished && (!job.queue.empty() || job.closed)) {
+			next_job_ = candidate + 1;
+			index = candidate;
+			return &job;
+		}
+	}
+	return nullptr;
+}
+
+void OnsetBatch::WorkerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (;;) {
+		size_t index = 0;
+		Job* job = nullptr;
+		while (!cancelled_ && !(job = NextRunnable(index))) {
+			if (stopping_) {
+				return;
+			}
+			work_ready_.wait(lock);
+		}
+		if (cancelled_) {
+			return;
+		}
+
+		job->busy = true;
+		if (!job->queue.empty()) {
+			std::vector<float> mono = std::move(job->queue.front());
+			job->queue.pop_front();
+			lock.unlock();
+
+			job->builder.Push(mono.data(), mono.size());
+			const size_t bytes = mono.capacity() * sizeof(float);
+			std::vector<float>().swap(mono);
+
+			lock.lock();
+			queued_bytes_ -= bytes;
+		}
+		else {
+			lock.unlock();
+
+			// An exception cannot cross the thread; the job just ends without
+			// whatever the finish function would have produced.
+			try {
+				finish_(index, job->builder, job->arena);
+			}
+			catch (...) {
+			}
+			// The curves have been turned into results; only those are kept.
+			job->arena.Trim(0);
+
+			lock.lock();
+			job->finished = true;
+			++finished_jobs_;
+		}
+		job->busy = false;
+		progress_.notify_all();
+		work_ready_.notify_one();
+	}
+}
@@ -0,0 +1,114 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#pragma once
+
+#ifndef AUDIO_PEAK_DETECTION_BATCH_H
+#define AUDIO_PEAK_DETECTION_BATCH_H
+
+#include "AudioPeakDetection_Core.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ OnsetBatch runs the onset analysis of several mono streams at once on a pool
+ of worker threads. Only the host's main thread may fetch audio, so the caller
+ feeds each job's samples in order through Push() and the workers run them
+ through the job's OnsetCurveBuilder, one worker per job at a time. Samples
+ queued across all jobs are held to a memory budget: Push() waits while it is
+ spent, so fetching never gets further ahead of the transforms than that.
+ Once Close() marks a job complete, a worker passes its curves to the finish
+ function while the other jobs keep running.
+*/
+class OnsetBatch {
+public:
+	// Runs on a worker thread once all of a job's samples are analyzed.
+	typedef std::function<void(size_t job, const OnsetCurveBuilder& builder, ScratchArena& arena)> FinishFunction;
+	// Runs on the calling thread while Push() or Wait() block; returning
+	// false cancels the batch.
+	typedef std::function<bool()> PollFunction;
+
+	OnsetBatch(size_t worker_count, size_t memory_budget_bytes, FinishFunction finish);
+	~OnsetBatch();
+
+	OnsetBatch(const OnsetBatch&) = delete;
+	OnsetBatch& operator=(const OnsetBatch&) = delete;
+
+	// Returns the new job's index, or -1 when its buffers cannot be allocated.
+	int64_t AddJob(const OnsetGeometry& geometry,
+		int onset_function,
+		double sample_rate,
+		double low_crossover_hz,
+		double high_crossover_hz,
+		int64_t sample_count);
+
+	// Queues the next samples of job. Returns false once the batch is cancelled.
+	bool Push(size_t job, std::vector<float>&& mono, const PollFunction& poll);
+	// No more samples follow for job.
+	void Close(size_t job);
+	// Waits until every job is closed and finished; false when cancelled.
+	bool Wait(const PollFunction& poll);
+	void Cancel();
+
+	size_t WorkerCount() const { return workers_.size(); }
+	size_t FinishedJobs() const;
+	// High-water mark of queued sample bytes.
+	size_t PeakQueuedBytes() const;
+
+private:
+	struct Job {
+		ScratchArena arena;
+		OnsetCurveBuilder builder;
+		std::deque<std::vector<float>> queue;
+		bool closed = false;
+		bool busy = false;
+		bool finished = false;
+	};
+
+	void WorkerLoop();
+	Job* NextRunnable(size_t& index);
+	void WaitFor(std::unique_lock<std::mutex>& lock, const PollFunction& poll);
+
+	FinishFunction finish_;
+	size_t memory_budget_bytes_ = 0;
+	mutable std::mutex mutex_;
+	std::condition_variable work_ready_;
+	std::condition_variable progress_;
+	std::vector<std::unique_ptr<Job>> jobs_;
+	std::vector<std::thread> workers_;
+	size_t next_job_ = 0;
+	size_t queued_bytes_ = 0;
+	size_t peak_queued_bytes_ = 0;
+	size_t finished_jobs_ = 0;
+	std::chrono::steady_clock::time_point last_poll_;
+	bool cancelled_ = false;
+	bool stopping_ = false;
+};
+
+#endif // AUDIO_PEAK_DETECTION_BATCH_H
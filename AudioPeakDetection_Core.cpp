@@ -0,0 +1,2579 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#include "AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+namespace {
+
+enum {
+	kBandLow = 0,
+	kBandMid,
+	kBandHigh
+};
+
+template <typename T>
+inline T ClampValue(const T& value, const T& minimum, const T& maximum)
+{
+	return std::min(std::max(value, minimum), maximum);
+}
+
+// Twiddles and Hann window of one frame size. Only a handful of sizes are
+// ever offered, so plans are never evicted.
+struct SharedFftPlan {
+	kiss_fftr_cfg cfg = nullptr;
+	std::vector<float> window;
+
+	SharedFftPlan() = default;
+	SharedFftPlan(const SharedFftPlan&) = delete;
+	SharedFftPlan& operator=(const SharedFftPlan&) = delete;
+	~SharedFftPlan() { kiss_fftr_free(cfg); }
+};
+
+const SharedFftPlan* FindSharedFftPlan(int fft_size)
+{
+	static std::mutex mutex;
+	static std::map<int, std::unique_ptr<SharedFftPlan>> plans;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto existing = plans.find(fft_size);
+	if (existing != plans.end()) {
+		return existing->second.get();
+	}
+
+	std::unique_ptr<SharedFftPlan> plan(new (std::nothrow) SharedFftPlan());
+	if (!plan) {
+		return nullptr;
+	}
+	plan->cfg = kiss_fftr_alloc(fft_size, 0, nullptr, nullptr);
+	if (!plan->cfg) {
+		return nullptr;
+	}
+	plan->window.resize(static_cast<size_t>(fft_size));
+	constexpr float two_pi = 6.283185307179586476925f;
+	for (size_t n = 0; n < plan->window.size(); ++n) {
+		plan->window[n] = 0.5f - 0.5f * std::cos(two_pi * static_cast<float>(n) / static_cast<float>(fft_size - 1));
+	}
+	return plans.emplace(fft_size, std::move(plan)).first->second.get();
+}
+
+// Twiddles and Q15 Hann window of one frame size for the fixed-point STFT.
+struct SharedQ15FftPlan {
+	kiss_fftr_q15_cfg cfg = nullptr;
+	std::vector<int16_t> window;
+
+	SharedQ15FftPlan() = default;
+	SharedQ15FftPlan(const SharedQ15FftPlan&) = delete;
+	SharedQ15FftPlan& operator=(const SharedQ15FftPlan&) = delete;
+	~SharedQ15FftPlan() { kiss_fftr_q15_free(cfg); }
+};
+
+const SharedQ15FftPlan* FindSharedQ15FftPlan(int fft_size)
+{
+	static std::mutex mutex;
+	static std::map<int, std::unique_ptr<SharedQ15FftPlan>> plans;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto existing = plans.find(fft_size);
+	if (existing != plans.end()) {
+		return existing->second.get();
+	}
+
+	const SharedFftPlan* float_plan = FindSharedFftPlan(fft_size);
+	std::unique_ptr<SharedQ15FftPlan> plan(new (std::nothrow) SharedQ15FftPlan());
+	if (!float_plan || !plan) {
+		return nullptr;
+	}
+	plan->cfg = kiss_fftr_q15_alloc(fft_size, 0, nullptr, nullptr);
+	if (!plan->cfg) {
+		return nullptr;
+	}
+	// The float window rounded, so both arithmetics weight samples alike.
+	plan->window.resize(float_plan->window.size());
+	for (size_t n = 0; n < plan->window.size(); ++n) {
+		plan->window[n] = static_cast<int16_t>(std::min(std::lround(float_plan->window[n] * 32768.0f), 32767L));
+	}
+	return plans.emplace(fft_size, std::move(plan)).first->second.get();
+}
+
+// Maps every FFT bin to the band that owns it. Crossovers are in Hz; the
+// high crossover is kept above the low one so no band ends up empty.
+ArenaSpan<int> CreateBandMap(ScratchArena& arena,
+	int fft_size,
+	double sample_rate,
+	double low_crossover_hz,
+	double high_crossover_hz)
+{
+	const double low_edge = std::max(low_crossover_hz, 0.0);
+	const double high_edge = std::max(high_crossover_hz, low_edge + sample_rate / static_cast<double>(fft_size));
+
+	// AllocateSpan zero-fills, and zero is kBandLow.
+	ArenaSpan<int> band_of_bin = AllocateSpan<int>(arena, static_cast<size_t>(fft_size / 2 + 1));
+	for (int bin = 0; bin < static_cast<int>(band_of_bin.size()); ++bin) {
+		const double frequency = static_cast<double>(bin) * sample_rate / static_cast<double>(fft_size);
+		if (frequency >= high_edge) {
+			band_of_bin[static_cast<size_t>(bin)] = kBandHigh;
+		}
+		else if (frequency >= low_edge) {
+			band_of_bin[static_cast<size_t>(bin)] = kBandMid;
+		}
+	}
+	return band_of_bin;
+}
+
+// ------------------------------------------------------------------------
+// Onset detection functions. Each policy turns one bin of the current
+// spectrum into a contribution using the per-bin history in OdfScratch, and
+// Finalize() maps the summed contributions of a frame (or band) to the
+// detection value. The frame loop is instantiated once per policy so the bin
+// loop carries no virtual call or per-bin branch on the selected function.
+// ------------------------------------------------------------------------
+struct OdfScratch {
+	ArenaSpan<float> prev_magnitude;
+	ArenaSpan<kiss_fft_cpx> prev_phasor;
+	ArenaSpan<kiss_fft_cpx> prev2_phasor;
+	// 1 / FFT size of the geometry, for functions weighted by bin index.
+	float inv_fft_size;
+};
+
+// L1 half-wave rectified magnitude difference (the original detector).
+struct SpectralFluxOdf {
+	static inline float Bin(int bin, const kiss_fft_cpx& x, OdfScratch& scratch)
+	{
+		const float magnitude = std::sqrt(x.r * x.r + x.i * x.i);
+		const float diff = magnitude - scratch.prev_magnitude[static_cast<size_t>(bin)];
+		scratch.prev_magnitude[static_cast<size_t>(bin)] = magnitude;
+		return (diff > 0.0f) ? diff : 0.0f;
+	}
+	static inline float Finalize(float sum) { return sum; }
+};
+
+// Flux of log(1 + gamma * |X|); compresses dynamics so quiet material with
+// soft attacks is not dominated by a few loud bins.
+struct LogFluxOdf {
+	static constexpr float kGamma = 1.0f;
+	static inline float Bin(int bin, const kiss_fft_cpx& x, OdfScratch& scratch)
+	{
+		const float compressed = std::log1p(kGamma * std::sqrt(x.r * x.r + x.i * x.i));
+		const float diff = compressed - scratch.prev_magnitude[static_cast<size_t>(bin)];
+		scratch.prev_magnitude[static_cast<size_t>(bin)] = compressed;
+		return (diff > 0.0f) ? diff : 0.0f;
+	}
+	static inline float Finalize(float sum) { return sum; }
+};
+
+// High frequency content (Masri): bin-weighted power, favouring percussive
+// broadband attacks over low sustained energy.
+struct HighFrequencyContentOdf {
+	static inline float Bin(int bin, const kiss_fft_cpx& x, OdfScratch& scratch)
+	{
+		return static_cast<float>(bin) * (x.r * x.r + x.i * x.i) * scratch.inv_fft_size;
+	}
+	static inline float Finalize(float sum) { return sum; }
+};
+
+// Rectified complex-domain deviation (Dixon): distance between the bin and a
+// prediction that keeps the previous magnitude and extrapolates the phase
+// linearly. The prediction is built from unit phasors, so no atan2 is needed.
+struct ComplexDomainOdf {
+	static inline float Bin(int bin, const kiss_fft_cpx& x, OdfScratch& scratch)
+	{
+		const size_t index = static_cast<size_t>(bin);
+		const float magnitude = std::sqrt(x.r * x.r + x.i * x.i);
+		const float prev_magnitude = scratch.prev_magnitude[index];
+		const kiss_fft_cpx u1 = scratch.prev_phasor[index];
+		const kiss_fft_cpx u2 = scratch.prev2_phasor[index];
+
+		// u1 * u1 * conj(u2) == exp(j * (2 * phi1 - phi2))
+		const float sq_r = u1.r * u1.r - u1.i * u1.i;
+		const float sq_i = 2.0f * u1.r * u1.i;
+		const float pred_r = prev_magnitude * (sq_r * u2.r + sq_i * u2.i);
+		const float pred_i = prev_magnitude * (sq_i * u2.r - sq_r * u2.i);
+
+		const float dr = x.r - pred_r;
+		const float di = x.i - pred_i;
+		const float deviation = (magnitude >= prev_magnitude) ? std::sqrt(dr * dr + di * di) : 0.0f;
+
+		scratch.prev2_phasor[index] = u1;
+		if (magnitude > 0.0f) {
+			const float inv = 1.0f / magnitude;
+			scratch.prev_phasor[index] = kiss_fft_cpx{ x.r * inv, x.i * inv };
+		}
+		else {
+			scratch.prev_phasor[index] = kiss_fft_cpx{ 1.0f, 0.0f };
+		}
+		scratch.prev_magnitude[index] = magnitude;
+		return deviation;
+	}
+	static inline float Finalize(float sum) { return sum; }
+};
+
+// Rise of the short-time energy envelope; per-bin power differences are
+// summed first and rectified per frame (and per band).
+struct EnergyEnvelopeOdf {
+	static inline float Bin(int bin, const kiss_fft_cpx& x, OdfScratch& scratch)
+	{
+		const float power = x.r * x.r + x.i * x.i;
+		const float diff = power - scratch.prev_magnitude[static_cast<size_t>(bin)];
+		scratch.prev_magnitude[static_cast<size_t>(bin)] = power;
+		return diff;
+	}
+	static inline float Finalize(float sum) { return (sum > 0.0f) ? sum : 0.0f; }
+};
+
+// log2 to about 0.005 from the exponent bits and a quadratic on the mantissa
+// m in [1, 2), which gives 1 + log2(m); the exponent takes 128 to match. Only
+// the spectral flatness uses it, and that error is 0.4% of it.
+inline float FastLog2(float value)
+{
+	uint32_t bits = 0;
+	std::memcpy(&bits, &value, sizeof(bits));
+	const float exponent = static_cast<float>(static_cast<int32_t>(bits >> 23) - 128);
+	bits = (bits & 0x007FFFFFu) | 0x3F800000u;
+	float mantissa = 0.0f;
+	std::memcpy(&mantissa, &bits, sizeof(mantissa));
+	return exponent + (-0.34484843f * mantissa + 2.02466578f) * mantissa - 0.67487759f;
+}
+
+// Keeps log2 finite for empty bins; far below any bin of audible material.
+constexpr float kShapePowerFloor = 1e-20f;
+
+// Shape of a frame from the bin powers its ODF loop stored in power.
+// band_end[b] is one past the last bin of band b; the bands are contiguous
+// from bin 0. The sums run in four lanes so no add waits on
+// the one before it, and the rolloff skips whole bands and blocks of eight
+// bins before it walks single bins.
+uint64_t MeasureSpectralShape(const float* power, const int* band_end, int fft_size, double sample_rate)
+{
+	constexpr int kLanes = 4;
+	float band_power[kOnsetBandCount] = {};
+	float weighted[kLanes] = {};
+	float log_sum[kLanes] = {};
+	int bin = 0;
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		float total[kLanes] = {};
+		for (; bin + kLanes <= band_end[band]; bin += kLanes) {
+			for (int lane = 0; lane < kLanes; ++lane) {
+				const float p = power[bin + lane];
+				total[lane] += p;
+				weighted[lane] += static_cast<float>(bin + lane) * p;
+				log_sum[lane] += FastLog2(p + kShapePowerFloor);
+			}
+		}
+		for (; bin < band_end[band]; ++bin) {
+			total[0] += power[bin];
+			weighted[0] += static_cast<float>(bin) * power[bin];
+			log_sum[0] += FastLog2(power[bin] + kShapePowerFloor);
+		}
+		band_power[band] = (total[0] + total[1]) + (total[2] + total[3]);
+	}
+
+	const int bin_count = bin;
+	const float total = band_power[kBandLow] + band_power[kBandMid] + band_power[kBandHigh];
+	SpectralShape shape;
+	if (total > 0.0f && bin_count > 0) {
+		const float limit = kSpectralRolloffFraction * total;
+		float running = 0.0f;
+		int band = 0;
+		while (band + 1 < kOnsetBandCount && running + band_power[band] < limit) {
+			running += band_power[band++];
+		}
+		int rolloff = (band == 0) ? 0 : band_end[band - 1];
+		for (float block = 0.0f; rolloff + 8 <= bin_count; rolloff += 8) {
+			block = ((power[rolloff] + power[rolloff + 1]) + (power[rolloff + 2] + power[rolloff + 3])) +
+				((power[rolloff + 4] + power[rolloff + 5]) + (power[rolloff + 6] + power[rolloff + 7]));
+			if (running + block >= limit) {
+				break;
+			}
+			running += block;
+		}
+		while (rolloff < bin_count - 1 && (running += power[rolloff]) < limit) {
+			++rolloff;
+		}
+
+		const float bin_hz = static_cast<float>(sample_rate / fft_size);
+		const float mean_log = ((log_sum[0] + log_sum[1]) + (log_sum[2] + log_sum[3])) / static_cast<float>(bin_count);
+		shape.centroid_hz = ((weighted[0] + weighted[1]) + (weighted[2] + weighted[3])) / total * bin_hz;
+		shape.rolloff_hz = static_cast<float>(rolloff) * bin_hz;
+		shape.flatness = std::exp2(mean_log) / (total / static_cast<float>(bin_count));
+		for (int b = 0; b < kOnsetBandCount; ++b) {
+			shape.band_energy_ratio[b] = band_power[b] / total;
+		}
+	}
+	return PackSpectralShape(shape, sample_rate);
+}
+
+// Scale of 16-bit samples in the float pipeline, as in DownmixToMono.
+constexpr float kPcm16Scale = 32768.0f;
+
+inline int16_t FloatToPcm16(float value)
+{
+	const float scaled = value * kPcm16Scale;
+	if (!(scaled > -32768.0f)) {
+		return (scaled == scaled) ? -32768 : 0;
+	}
+	return (scaled >= 32767.0f) ? 32767 : static_cast<int16_t>(std::lrint(scaled));
+}
+
+// Left shift that brings a frame whose largest magnitude is peak closest to
+// full scale without overflowing 16 bits; 15 for a silent frame.
+inline int BlockExponent(int32_t peak)
+{
+	int shift = 0;
+	while (shift < 15 && (peak << (shift + 1)) <= 32767) {
+		++shift;
+	}
+	return shift;
+}
+
+// floor(sqrt(n)) for n below 1024, the seeds of IntegerSqrt.
+struct SqrtSeeds {
+	uint16_t root[1024];
+};
+
+constexpr SqrtSeeds MakeSqrtSeeds()
+{
+	SqrtSeeds seeds{};
+	int root = 0;
+	for (int n = 0; n < 1024; ++n) {
+		while ((root + 1) * (root + 1) <= n) {
+			++root;
+		}
+		seeds.root[n] = static_cast<uint16_t>(root);
+	}
+	return seeds;
+}
+
+constexpr SqrtSeeds kSqrtSeeds = MakeSqrtSeeds();
+
+// floor(sqrt(value)) for the integer spectral flux: a seed from the top ten
+// bits, which is at most 0.4% high, one Newton step and a final correction.
+inline uint32_t IntegerSqrt(uint32_t value)
+{
+	if (value < 1024) {
+		return kSqrtSeeds.root[value];
+	}
+	int shift = 0;
+	for (int step = 16; step >= 2; step /= 2) {
+		if ((value >> (shift + step)) >= 256) {
+			shift += step;
+		}
+	}
+	uint32_t root = (kSqrtSeeds.root[value >> shift] + 1u) << (shift / 2);
+	root = (root + value / root) / 2;
+	while (root * root > value) {
+		--root;
+	}
+	while ((root + 1) * (root + 1) <= value) {
+		++root;
+	}
+	return root;
+}
+
+// Windows the Q15 frame, shifts it to full scale and transforms it. Returns
+// the factor that takes the Q15 bins to the float path's units: the
+// transform divides by fft_size and the shift multiplies by 2^shift.
+float TransformQ15Frame(kiss_fftr_q15_cfg cfg,
+	ArenaSpan<const int16_t> frame,
+	ArenaSpan<const int16_t> window,
+	ArenaSpan<int16_t> fft_in,
+	kiss_fft_q15_cpx* fft_out,
+	int& shift)
+{
+	int32_t peak = 0;
+	for (size_t n = 0; n < fft_in.size(); ++n) {
+		const int32_t value = (static_cast<int32_t>(frame[n]) * window[n] + (1 << 14)) >> 15;
+		fft_in[n] = static_cast<int16_t>(value);
+		peak = std::max(peak, (value < 0) ? -value : value);
+	}
+	shift = BlockExponent(peak);
+	if (shift > 0) {
+		for (int16_t& value : fft_in) {
+			value = static_cast<int16_t>(value * (1 << shift));
+		}
+	}
+	kiss_fftr_q15(cfg, fft_in.data(), fft_out);
+	return static_cast<float>(fft_in.size()) / (kPcm16Scale * static_cast<float>(1 << shift));
+}
+
+constexpr double kMinTempoBpm = 40.0;
+constexpr double kMaxTempoBpm = 220.0;
+constexpr double kPreferredTempoBpm = 120.0;
+constexpr double kTempoOctaveWidth = 1.0;
+constexpr double kBeatTightness = 100.0;
+constexpr int kTempoCandidateCount = 3;
+
+// Zero-mean, unit-variance copy of the flux curve used as the onset envelope
+// for tempo estimation and beat tracking.
+ArenaSpan<float> NormalizeOnsetEnvelope(ArenaSpan<const float> flux, ScratchArena& arena)
+{
+	ArenaSpan<float> onset = AllocateSpan<float>(arena, flux.size());
+	if (onset.empty()) {
+		return onset;
+	}
+	std::copy(flux.begin(), flux.end(), onset.begin());
+
+	double mean = 0.0;
+	for (float value : onset) {
+		mean += value;
+	}
+	mean /= static_cast<double>(onset.size());
+
+	double variance = 0.0;
+	for (float value : onset) {
+		variance += (value - mean) * (value - mean);
+	}
+	const double deviation = std::sqrt(variance / static_cast<double>(onset.size()));
+	const double scale = (deviation > 0.0) ? 1.0 / deviation : 0.0;
+	for (float& value : onset) {
+		value = static_cast<float>((value - mean) * scale);
+	}
+	return onset;
+}
+
+// Full linear autocorrelation of the onset envelope up to max_lag, computed as
+// the inverse real FFT of the zero-padded power spectrum. Returns an empty
+// span when the arena cannot supply the plans or buffers.
+ArenaSpan<const float> AutocorrelateOnsets(ArenaSpan<const float> onset, size_t max_lag, ScratchArena& arena)
+{
+	const int padded_size = kiss_fftr_next_fast_size_real(static_cast<int>(onset.size() * 2));
+
+	const kiss_fftr_cfg forward_cfg = AllocateFftConfig(arena, padded_size, 0);
+	const kiss_fftr_cfg inverse_cfg = AllocateFftConfig(arena, padded_size, 1);
+	ArenaSpan<kiss_fft_scalar> padded = AllocateSpan<kiss_fft_scalar>(arena, static_cast<size_t>(padded_size));
+	ArenaSpan<kiss_fft_cpx> spectrum = AllocateSpan<kiss_fft_cpx>(arena, static_cast<size_t>(padded_size / 2 + 1));
+	if (!forward_cfg || !inverse_cfg || padded.empty() || spectrum.empty()) {
+		return ArenaSpan<const float>();
+	}
+	std::copy(onset.begin(), onset.end(), padded.begin());
+
+	kiss_fftr(forward_cfg, padded.data(), spectrum.data());
+	for (auto& bin : spectrum) {
+		bin.r = bin.r * bin.r + bin.i * bin.i;
+		bin.i = 0.0f;
+	}
+	kiss_fftri(inverse_cfg, spectrum.data(), padded.data());
+
+	const size_t lag_count = std::min(max_lag + 1, onset.size());
+	return ArenaSpan<const float>{ padded.data(), lag_count };
+}
+
+// Picks the strongest autocorrelation peaks inside the tempo range, weighted
+// towards kPreferredTempoBpm on a log-tempo scale, and returns the winning beat
+// period in (fractional) flux frames. Returns 0 when no periodicity is found.
+double EstimateBeatPeriod(ArenaSpan<const float> autocorrelation, double frames_per_second)
+{
+	const size_t min_lag = std::max<size_t>(1, static_cast<size_t>(std::floor(frames_per_second * 60.0 / kMaxTempoBpm)));
+	const size_t max_lag = static_cast<size_t>(std::ceil(frames_per_second * 60.0 / kMinTempoBpm));
+	if (autocorrelation.size() < 3 || autocorrelation[0] <= 0.0f || min_lag + 1 >= autocorrelation.size()) {
+		return 0.0;
+	}
+
+	struct TempoCandidate {
+		size_t lag = 0;
+		double score = 0.0;
+	};
+	TempoCandidate best[kTempoCandidateCount] = {};
+
+	const size_t last_lag = std::min(max_lag, autocorrelation.size() - 2);
+	for (size_t lag = std::max<size_t>(min_lag, 1); lag <= last_lag; ++lag) {
+		const float value = autocorrelation[lag];
+		if (value <= 0.0f || value < autocorrelation[lag - 1] || value < autocorrelation[lag + 1]) {
+			continue;
+		}
+		const double bpm = 60.0 * frames_per_second / static_cast<double>(lag);
+		const double octaves = std::log2(bpm / kPreferredTempoBpm) / kTempoOctaveWidth;
+		const double score = (value / autocorrelation[0]) * std::exp(-0.5 * octaves * octaves);
+
+		for (int slot = 0; slot < kTempoCandidateCount; ++slot) {
+			if (score > best[slot].score) {
+				for (int shift = kTempoCandidateCount - 1; shift > slot; --shift) {
+					best[shift] = best[shift - 1];
+				}
+				best[slot] = { lag, score };
+				break;
+			}
+		}
+	}
+
+	// Prefer a slower candidate when it is an octave of the winner with nearly
+	// the same support; this keeps half-time grooves from doubling the grid.
+	TempoCandidate chosen = best[0];
+	for (int slot = 1; slot < kTempoCandidateCount; ++slot) {
+		const TempoCandidate& candidate = best[slot];
+		if (candidate.lag == 0 || chosen.lag == 0) {
+			continue;
+		}
+		const double ratio = static_cast<double>(candidate.lag) / static_cast<double>(chosen.lag);
+		if (std::fabs(ratio - 2.0) < 0.05 && candidate.score > 0.9 * chosen.score) {
+			chosen = candidate;
+		}
+	}
+	if (chosen.lag == 0) {
+		return 0.0;
+	}
+
+	// Parabolic interpolation around the integer lag for a sub-frame period.
+	const double left = autocorrelation[chosen.lag - 1];
+	const double centre = autocorrelation[chosen.lag];
+	const double right = autocorrelation[chosen.lag + 1];
+	const double curvature = left - 2.0 * centre + right;
+	const double offset = (curvature < 0.0) ? ClampValue(0.5 * (left - right) / curvature, -0.5, 0.5) : 0.0;
+	return static_cast<double>(chosen.lag) + offset;
+}
+
+// Dynamic-programming beat tracker (Ellis 2007): every frame accumulates its
+// onset strength plus the best predecessor score, penalised by the squared log
+// deviation of the inter-beat interval from the estimated period. The penalty
+// only depends on the step, so it is tabulated once instead of taking a log
+// per (frame, step) pair. Returns the beat frames in ascending order.
+ArenaSpan<int64_t> TrackBeats(ArenaSpan<const float> onset, double period, ScratchArena& arena)
+{
+	const int64_t frame_count = static_cast<int64_t>(onset.size());
+	if (frame_count == 0 || period < 1.0) {
+		return ArenaSpan<int64_t>();
+	}
+
+	const int64_t min_step = std::max<int64_t>(1, static_cast<int64_t>(std::llround(period * 0.5)));
+	const int64_t max_step = std::max<int64_t>(min_step, static_cast<int64_t>(std::llround(period * 2.0)));
+
+	ArenaSpan<double> cumulative = AllocateSpan<double>(arena, onset.size());
+	ArenaSpan<int64_t> backlink = AllocateSpan<int64_t>(arena, onset.size());
+	ArenaSpan<double> penalty = AllocateSpan<double>(arena, static_cast<size_t>(max_step + 1));
+	if (cumulative.empty() || backlink.empty() || penalty.empty()) {
+		return ArenaSpan<int64_t>();
+	}
+	for (int64_t step = min_step; step <= max_step; ++step) {
+		const double deviation = std::log(static_cast<double>(step) / period);
+		penalty[static_cast<size_t>(step)] = kBeatTightness * deviation * deviation;
+	}
+
+	for (int64_t t = 0; t < frame_count; ++t) {
+		double best_score = 0.0;
+		int64_t best_prev = -1;
+		for (int64_t step = min_step; step <= max_step && step <= t; ++step) {
+			const double score = cumulative[static_cast<size_t>(t - step)] - penalty[static_cast<size_t>(step)];
+			if (best_prev < 0 || score > best_score) {
+				best_score = score;
+				best_prev = t - step;
+			}
+		}
+		cumulative[static_cast<size_t>(t)] = onset[static_cast<size_t>(t)] + ((best_prev >= 0) ? best_score : 0.0);
+		backlink[static_cast<size_t>(t)] = best_prev;
+	}
+
+	// Start the backtrace from the strongest frame within the last period.
+	const int64_t tail_start = (frame_count > max_step) ? frame_count - max_step : 0;
+	int64_t last_beat = tail_start;
+	for (int64_t t = tail_start; t < frame_count; ++t) {
+		if (cumulative[static_cast<size_t>(t)] > cumulative[static_cast<size_t>(last_beat)]) {
+			last_beat = t;
+		}
+	}
+
+	size_t beat_count = 0;
+	for (int64_t beat = last_beat; beat >= 0; beat = backlink[static_cast<size_t>(beat)]) {
+		++beat_count;
+	}
+	ArenaSpan<int64_t> beat_frames = AllocateSpan<int64_t>(arena, beat_count);
+	size_t slot = beat_frames.size();
+	for (int64_t beat = last_beat; beat >= 0 && slot > 0; beat = backlink[static_cast<size_t>(beat)]) {
+		beat_frames[--slot] = beat;
+	}
+	return beat_frames;
+}
+
+} // namespace
+
+/* ---------------------------------------------------------- Framing */
+bool IsValidGeometry(const OnsetGeometry& geometry)
+{
+	return geometry.fft_size >= 16 && geometry.fft_size <= 16384 && (geometry.fft_size & 1) == 0 &&
+		geometry.hop_size >= 1 && geometry.hop_size <= geometry.fft_size;
+}
+
+int64_t OnsetFrameCount(int64_t sample_count, const OnsetGeometry& geometry)
+{
+	if (sample_count < geometry.fft_size) {
+		return 0;
+	}
+	return 1 + (sample_count - geometry.fft_size) / geometry.hop_size;
+}
+
+double OnsetFrameSeconds(int64_t frame_index, double sample_rate, const OnsetGeometry& geometry)
+{
+	return static_cast<double>(frame_index) * static_cast<double>(geometry.hop_size) / sample_rate;
+}
+
+double OnsetFramesPerSecond(double sample_rate, const OnsetGeometry& geometry)
+{
+	return sample_rate / static_cast<double>(geometry.hop_size);
+}
+
+bool SampleRangeToTicks(int64_t first_sample,
+	int64_t count,
+	uint32_t samples_per_second,
+	int64_t max_ticks,
+	TickRange& range)
+{
+	const int64_t rate = std::max<int64_t>(1, static_cast<int64_t>(samples_per_second));
+	for (int64_t samples_per_tick = 1; samples_per_tick <= rate; ++samples_per_tick) {
+		if (rate % samples_per_tick != 0 || first_sample % samples_per_tick != 0) {
+			continue;
+		}
+		const int64_t first_tick = first_sample / samples_per_tick;
+		const int64_t tick_count = (count + samples_per_tick - 1) / samples_per_tick;
+		if (first_tick + tick_count <= max_ticks) {
+			range.first_tick = first_tick;
+			range.tick_count = tick_count;
+			range.ticks_per_second = static_cast<uint32_t>(rate / samples_per_tick);
+			return true;
+		}
+	}
+	return false;
+}
+
+int64_t SecondsToTicks(double seconds, uint32_t& time_scale, int64_t max_ticks)
+{
+	if (time_scale == 0) {
+		time_scale = 1;
+	}
+	int64_t ticks = std::llround(std::max(seconds, 0.0) * static_cast<double>(time_scale));
+	while (ticks > max_ticks && time_scale > 1) {
+		time_scale = (time_scale + 1) / 2;
+		ticks = std::llround(std::max(seconds, 0.0) * static_cast<double>(time_scale));
+	}
+	return std::min(ticks, max_ticks);
+}
+
+void DownmixToMono(const void* interleaved,
+	SampleEncoding encoding,
+	int channel_count,
+	size_t frame_count,
+	float* mono)
+{
+	const float* samples_f32 = (encoding == kSampleFloat32) ? static_cast<const float*>(interleaved) : nullptr;
+	const int16_t* samples_i16 = (encoding == kSampleInt16) ? static_cast<const int16_t*>(interleaved) : nullptr;
+	const int8_t* samples_i8 = (encoding == kSampleInt8) ? static_cast<const int8_t*>(interleaved) : nullptr;
+	const size_t channels = static_cast<size_t>(std::max(channel_count, 1));
+
+	for (size_t i = 0; i < frame_count; ++i) {
+		float sum = 0.0f;
+		for (size_t ch = 0; ch < channels; ++ch) {
+			const size_t idx = i * channels + ch;
+			float value = 0.0f;
+			if (samples_f32) {
+				value = samples_f32[idx];
+			}
+			else if (samples_i16) {
+				value = static_cast<float>(samples_i16[idx]) / 32768.0f;
+			}
+			else if (samples_i8) {
+				value = static_cast<float>(samples_i8[idx]) / 128.0f;
+			}
+			sum += value;
+		}
+		mono[i] = sum / static_cast<float>(channels);
+	}
+}
+
+// Places a real FFT plan in arena memory through kiss_fftr_alloc's mem/lenmem
+// interface, so plans are released together with the rest of the scratch.
+kiss_fftr_cfg AllocateFftConfig(ScratchArena& arena, int nfft, int inverse_fft)
+{
+	size_t length = 0;
+	kiss_fftr_alloc(nfft, inverse_fft, nullptr, &length);
+	if (length == 0) {
+		return nullptr;
+	}
+	void* memory = arena.Allocate(length);
+	if (!memory) {
+		return nullptr;
+	}
+	return kiss_fftr_alloc(nfft, inverse_fft, memory, &length);
+}
+
+kiss_fftr_cfg AllocateSharedFftConfig(ScratchArena& arena, int nfft)
+{
+	const SharedFftPlan* plan = FindSharedFftPlan(nfft);
+	if (!plan) {
+		return nullptr;
+	}
+	size_t length = 0;
+	kiss_fftr_alloc_shared(plan->cfg, nullptr, &length);
+	void* memory = (length > 0) ? arena.Allocate(length) : nullptr;
+	if (!memory) {
+		return nullptr;
+	}
+	return kiss_fftr_alloc_shared(plan->cfg, memory, &length);
+}
+
+ArenaSpan<const float> SharedHannWindow(int fft_size)
+{
+	const SharedFftPlan* plan = FindSharedFftPlan(fft_size);
+	return plan ? ArenaSpan<const float>{ plan->window.data(), plan->window.size() } : ArenaSpan<const float>();
+}
+
+kiss_fftr_q15_cfg AllocateSharedQ15FftConfig(ScratchArena& arena, int nfft)
+{
+	const SharedQ15FftPlan* plan = FindSharedQ15FftPlan(nfft);
+	if (!plan) {
+		return nullptr;
+	}
+	size_t length = 0;
+	kiss_fftr_q15_alloc_shared(plan->cfg, nullptr, &length);
+	void* memory = (length > 0) ? arena.Allocate(length) : nullptr;
+	if (!memory) {
+		return nullptr;
+	}
+	return kiss_fftr_q15_alloc_shared(plan->cfg, memory, &length);
+}
+
+ArenaSpan<const int16_t> SharedQ15HannWindow(int fft_size)
+{
+	const SharedQ15FftPlan* plan = FindSharedQ15FftPlan(fft_size);
+	return plan ? ArenaSpan<const int16_t>{ plan->window.data(), plan->window.size() } : ArenaSpan<const int16_t>();
+}
+
+/* ----------------------------------------------------- Pitch kernel */
+double PitchFrequency(int note)
+{
+	return 440.0 * std::pow(2.0, static_cast<double>(note - 69) / 12.0);
+}
+
+namespace {
+
+bool BuildPitchKernel(int fft_size, double sample_rate, PitchKernel& kernel)
+{
+	const SharedFftPlan* plan = FindSharedFftPlan(fft_size);
+	kiss_fft_cfg cfg = plan ? kiss_fft_alloc(fft_size, 0, nullptr, nullptr) : nullptr;
+	if (!cfg) {
+		return false;
+	}
+	const size_t size = static_cast<size_t>(fft_size);
+	const int last_bin = fft_size / 2;
+	std::vector<kiss_fft_cpx> temporal(size);
+	std::vector<kiss_fft_cpx> spectral(size);
+	constexpr double two_pi = 6.283185307179586476925;
+
+	kernel.fft_size = fft_size;
+	kernel.row_start.assign(1, 0);
+	for (int pitch = 0; pitch < kPitchCount; ++pitch) {
+		const double frequency = PitchFrequency(kPitchLowestNote + pitch);
+		if (frequency >= 0.45 * sample_rate) {
+			break;
+		}
+		const int length = std::min(fft_size, static_cast<int>(std::ceil(kPitchQ * sample_rate / frequency)));
+		const int offset = (fft_size - length) / 2;
+
+		// Scaled by the sum of the effective window, so a sine of amplitude 1
+		// on the pitch reads 0.5.
+		std::fill(temporal.begin(), temporal.end(), kiss_fft_cpx{ 0.0f, 0.0f });
+		double gain = 0.0;
+		for (int n = 0; n < length; ++n) {
+			const double window = 0.5 - 0.5 * std::cos(two_pi * n / (length - 1));
+			gain += window * plan->window[static_cast<size_t>(offset + n)];
+		}
+		for (int n = 0; n < length; ++n) {
+			const double window = (0.5 - 0.5 * std::cos(two_pi * n / (length - 1))) / gain;
+			const double phase = two_pi * frequency * (offset + n) / sample_rate;
+			temporal[static_cast<size_t>(offset + n)] = kiss_fft_cpx{
+				static_cast<float>(window * std::cos(phase)), static_cast<float>(window * std::sin(phase)) };
+		}
+		kiss_fft(cfg, temporal.data(), spectral.data());
+
+		// Only the positive frequencies: the kernel is analytic, so its
+		// spectrum below 0 Hz is as small as its sidelobes.
+		float peak = 0.0f;
+		for (int bin = 0; bin <= last_bin; ++bin) {
+			const kiss_fft_cpx& k = spectral[static_cast<size_t>(bin)];
+			peak = std::max(peak, k.r * k.r + k.i * k.i);
+		}
+		const float floor = kPitchKernelThreshold * kPitchKernelThreshold * peak;
+		int first = 0;
+		int last = last_bin;
+		while (first < last && spectral[static_cast<size_t>(first)].r * spectral[static_cast<size_t>(first)].r +
+			spectral[static_cast<size_t>(first)].i * spectral[static_cast<size_t>(first)].i < floor) {
+			++first;
+		}
+		while (last > first && spectral[static_cast<size_t>(last)].r * spectral[static_cast<size_t>(last)].r +
+			spectral[static_cast<size_t>(last)].i * spectral[static_cast<size_t>(last)].i < floor) {
+			--last;
+		}
+
+		// Parseval: the value is sum of X[j] * conj(K[j]) / fft_size.
+		const float scale = 1.0f / static_cast<float>(fft_size);
+		for (int bin = first; bin <= last; ++bin) {
+			const float cr = spectral[static_cast<size_t>(bin)].r * scale;
+			const float ci = -spectral[static_cast<size_t>(bin)].i * scale;
+			kernel.real_weights.push_back(cr);
+			kernel.real_weights.push_back(-ci);
+			kernel.imag_weights.push_back(ci);
+			kernel.imag_weights.push_back(cr);
+		}
+		kernel.first_bin.push_back(first);
+		kernel.row_start.push_back(static_cast<int>(kernel.real_weights.size()));
+		++kernel.pitch_count;
+	}
+	kiss_fft_free(cfg);
+	return true;
+}
+
+} // namespace
+
+const PitchKernel* SharedPitchKernel(int fft_size, double sample_rate)
+{
+	static std::mutex mutex;
+	static std::map<std::pair<int, double>, std::unique_ptr<PitchKernel>> kernels;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	const std::pair<int, double> key(fft_size, sample_rate);
+	const auto existing = kernels.find(key);
+	if (existing != kernels.end()) {
+		return existing->second.get();
+	}
+
+	std::unique_ptr<PitchKernel> kernel(new (std::nothrow) PitchKernel());
+	if (!kernel || !(sample_rate > 0.0) || !BuildPitchKernel(fft_size, sample_rate, *kernel)) {
+		return nullptr;
+	}
+	return kernels.emplace(key, std::move(kernel)).first->second.get();
+}
+
+void ApplyPitchKernel(const PitchKernel& kernel, const kiss_fft_cpx* spectrum, float* magnitude)
+{
+	constexpr int kLanes = 4;
+	const float* bins = reinterpret_cast<const float*>(spectrum);
+	for (int pitch = 0; pitch < kernel.pitch_count; ++pitch) {
+		const int begin = kernel.row_start[static_cast<size_t>(pitch)];
+		const int count = kernel.row_start[static_cast<size_t>(pitch) + 1] - begin;
+		const float* x = bins + 2 * kernel.first_bin[static_cast<size_t>(pitch)];
+		const float* real_weights = kernel.real_weights.data() + begin;
+		const float* imag_weights = kernel.imag_weights.data() + begin;
+
+		float real[kLanes] = {};
+		float imag[kLanes] = {};
+		int i = 0;
+		for (; i + kLanes <= count; i += kLanes) {
+			for (int lane = 0; lane < kLanes; ++lane) {
+				real[lane] += x[i + lane] * real_weights[i + lane];
+				imag[lane] += x[i + lane] * imag_weights[i + lane];
+			}
+		}
+		for (; i < count; ++i) {
+			real[0] += x[i] * real_weights[i];
+			imag[0] += x[i] * imag_weights[i];
+		}
+		const float re = (real[0] + real[1]) + (real[2] + real[3]);
+		const float im = (imag[0] + imag[1]) + (imag[2] + imag[3]);
+		magnitude[pitch] = std::sqrt(re * re + im * im);
+	}
+}
+
+/* --------------------------------------------------- Spectral shape */
+namespace {
+
+constexpr uint64_t kShapeHasPowerBit = uint64_t(1) << 62;
+
+uint64_t QuantizeUnit(float value, int bits)
+{
+	const float top = static_cast<float>((1u << bits) - 1u);
+	return static_cast<uint64_t>(std::lrint(ClampValue(value, 0.0f, 1.0f) * top));
+}
+
+float DequantizeUnit(uint64_t packed, int shift, int bits)
+{
+	const uint64_t top = (uint64_t(1) << bits) - 1u;
+	return static_cast<float>((packed >> shift) & top) / static_cast<float>(top);
+}
+
+} // namespace
+
+uint64_t PackSpectralShape(const SpectralShape& shape, double sample_rate)
+{
+	const float nyquist = static_cast<float>(0.5 * sample_rate);
+	const float shares = shape.band_energy_ratio[kBandLow] + shape.band_energy_ratio[kBandMid] + shape.band_energy_ratio[kBandHigh];
+	if (!(nyquist > 0.0f) || !(shares > 0.0f)) {
+		return 0;
+	}
+	return QuantizeUnit(shape.centroid_hz / nyquist, 16) |
+		(QuantizeUnit(shape.rolloff_hz / nyquist, 16) << 16) |
+		(QuantizeUnit(shape.flatness, 10) << 32) |
+		(QuantizeUnit(shape.band_energy_ratio[kBandLow], 10) << 42) |
+		(QuantizeUnit(shape.band_energy_ratio[kBandMid], 10) << 52) |
+		kShapeHasPowerBit;
+}
+
+SpectralShape UnpackSpectralShape(uint64_t packed, double sample_rate)
+{
+	SpectralShape shape;
+	if ((packed & kShapeHasPowerBit) == 0) {
+		return shape;
+	}
+	const float nyquist = static_cast<float>(0.5 * sample_rate);
+	shape.centroid_hz = DequantizeUnit(packed, 0, 16) * nyquist;
+	shape.rolloff_hz = DequantizeUnit(packed, 16, 16) * nyquist;
+	shape.flatness = DequantizeUnit(packed, 32, 10);
+	shape.band_energy_ratio[kBandLow] = DequantizeUnit(packed, 42, 10);
+	shape.band_energy_ratio[kBandMid] = DequantizeUnit(packed, 52, 10);
+	shape.band_energy_ratio[kBandHigh] =
+		std::max(0.0f, 1.0f - shape.band_energy_ratio[kBandLow] - shape.band_energy_ratio[kBandMid]);
+	return shape;
+}
+
+OnsetSoundType ClassifySpectralShape(const SpectralShape& shape)
+{
+	if (shape.band_energy_ratio[kBandLow] >= 0.5f) {
+		return kSoundLowHit;
+	}
+	if (shape.band_energy_ratio[kBandHigh] >= 0.65f) {
+		return kSoundHighHit;
+	}
+	if (shape.flatness >= 0.2f) {
+		return kSoundNoisyHit;
+	}
+	return kSoundTonal;
+}
+
+template <>
+void OnsetCurveBuilder::AnalyzeFrameQ15<SpectralFluxOdf>(OnsetCurveBuilder& builder);
+
+/* ------------------------------------------------ OnsetCurveBuilder */
+bool OnsetCurveBuilder::Initialize(ScratchArena& arena,
+	const OnsetGeometry& geometry,
+	int onset_function,
+	double sample_rate,
+	double low_crossover_hz,
+	double high_crossover_hz,
+	int64_t frame_capacity,
+	int64_t frame_origin,
+	OnsetArithmetic arithmetic)
+{
+	const bool fixed = (arithmetic == kOnsetFixedQ15);
+	switch (onset_function) {
+	case kOnsetLogFlux:
+		analyze_frame_ = fixed ? &OnsetCurveBuilder::AnalyzeFrameQ15<LogFluxOdf> : &OnsetCurveBuilder::AnalyzeFrame<LogFluxOdf>;
+		break;
+	case kOnsetHighFrequencyContent:
+		analyze_frame_ = fixed ? &OnsetCurveBuilder::AnalyzeFrameQ15<HighFrequencyContentOdf> : &OnsetCurveBuilder::AnalyzeFrame<HighFrequencyContentOdf>;
+		break;
+	case kOnsetComplexDomain:
+		analyze_frame_ = fixed ? &OnsetCurveBuilder::AnalyzeFrameQ15<ComplexDomainOdf> : &OnsetCurveBuilder::AnalyzeFrame<ComplexDomainOdf>;
+		break;
+	case kOnsetEnergyEnvelope:
+		analyze_frame_ = fixed ? &OnsetCurveBuilder::AnalyzeFrameQ15<EnergyEnvelopeOdf> : &OnsetCurveBuilder::AnalyzeFrame<EnergyEnvelopeOdf>;
+		break;
+	case kOnsetSpectralFlux:
+	default:
+		analyze_frame_ = fixed ? &OnsetCurveBuilder::AnalyzeFrameQ15<SpectralFluxOdf> : &OnsetCurveBuilder::AnalyzeFrame<SpectralFluxOdf>;
+		break;
+	}
+	arithmetic_ = fixed ? kOnsetFixedQ15 : kOnsetFloat;
+
+	if (!IsValidGeometry(geometry)) {
+		return false;
+	}
+	geometry_ = geometry;
+	const size_t fft_size = static_cast<size_t>(geometry.fft_size);
+	const size_t bin_count = fft_size / 2 + 1;
+	const size_t capacity = static_cast<size_t>(std::max<int64_t>(frame_capacity, 0));
+
+	// The fixed-point frames still fill fft_out_ for every function but the
+	// integer spectral flux, so it and the float ODF history exist in both.
+	if (fixed) {
+		cfg_q15_ = AllocateSharedQ15FftConfig(arena, geometry.fft_size);
+		window_q15_ = SharedQ15HannWindow(geometry.fft_size);
+		frame_q15_ = AllocateSpan<int16_t>(arena, fft_size);
+		fft_in_q15_ = AllocateSpan<int16_t>(arena, fft_size);
+		fft_out_q15_ = AllocateSpan<kiss_fft_q15_cpx>(arena, bin_count);
+		prev_magnitude_q15_ = AllocateSpan<uint32_t>(arena, bin_count);
+		if (!cfg_q15_ || window_q15_.empty() || frame_q15_.empty() || fft_in_q15_.empty() ||
+			fft_out_q15_.empty() || prev_magnitude_q15_.empty()) {
+			return false;
+		}
+	}
+	else {
+		cfg_ = AllocateSharedFftConfig(arena, geometry.fft_size);
+		window_ = SharedHannWindow(geometry.fft_size);
+		frame_ = AllocateSpan<float>(arena, fft_size);
+		fft_in_ = AllocateSpan<kiss_fft_scalar>(arena, fft_size);
+		if (!cfg_ || window_.empty() || frame_.empty() || fft_in_.empty()) {
+			return false;
+		}
+	}
+	band_of_bin_ = CreateBandMap(arena, geometry.fft_size, sample_rate, low_crossover_hz, high_crossover_hz);
+	std::fill(std::begin(band_end_), std::end(band_end_), 0);
+	for (size_t bin = 0; bin < band_of_bin_.size(); ++bin) {
+		band_end_[band_of_bin_[bin]] = static_cast<int>(bin + 1);
+	}
+	for (int band = 1; band < kOnsetBandCount; ++band) {
+		band_end_[band] = std::max(band_end_[band], band_end_[band - 1]);
+	}
+	fft_out_ = AllocateSpan<kiss_fft_cpx>(arena, bin_count);
+	prev_magnitude_ = AllocateSpan<float>(arena, bin_count);
+	prev_phasor_ = AllocateSpan<kiss_fft_cpx>(arena, bin_count);
+	prev2_phasor_ = AllocateSpan<kiss_fft_cpx>(arena, bin_count);
+	bin_power_ = AllocateSpan<float>(arena, bin_count);
+	flux_ = AllocateSpan<float>(arena, capacity);
+	shape_ = AllocateSpan<uint64_t>(arena, capacity);
+
+	bool ok = !band_of_bin_.empty() && !fft_out_.empty() && !prev_magnitude_.empty() && !prev_phasor_.empty() && !prev2_phasor_.empty() &&
+		!bin_power_.empty() && (capacity == 0 || (!flux_.empty() && !shape_.empty()));
+	for (auto& curve : band_flux_) {
+		curve = AllocateSpan<float>(arena, capacity);
+		ok = ok && (capacity == 0 || !curve.empty());
+	}
+	if (!ok) {
+		return false;
+	}
+
+	pitch_kernel_ = nullptr;
+	pitch_value_ = ArenaSpan<float>();
+	prev_pitch_level_ = ArenaSpan<float>();
+	last_pitch_flux_ = ArenaSpan<float>();
+	pitch_flux_ = ArenaSpan<float>();
+	sample_rate_ = sample_rate;
+	frame_origin_ = std::max<int64_t>(frame_origin, 0);
+	frame_end_ = 0;
+	Seek(frame_origin_, frame_origin_);
+	return true;
+}
+
+void OnsetCurveBuilder::Seek(int64_t first_frame, int64_t store_from_frame)
+{
+	for (size_t bin = 0; bin < prev_magnitude_.size(); ++bin) {
+		prev_magnitude_[bin] = 0.0f;
+		prev_phasor_[bin] = kiss_fft_cpx{ 1.0f, 0.0f };
+		prev2_phasor_[bin] = kiss_fft_cpx{ 1.0f, 0.0f };
+	}
+	std::fill(prev_magnitude_q15_.begin(), prev_magnitude_q15_.end(), 0u);
+	frame_fill_ = 0;
+	last_flux_ = 0.0f;
+	std::fill(std::begin(last_band_flux_), std::end(last_band_flux_), 0.0f);
+	last_shape_ = 0;
+	std::fill(prev_pitch_level_.begin(), prev_pitch_level_.end(), 0.0f);
+	std::fill(last_pitch_flux_.begin(), last_pitch_flux_.end(), 0.0f);
+	samples_pushed_ = first_frame * geometry_.hop_size;
+	frames_analyzed_ = first_frame;
+	store_from_ = store_from_frame;
+}
+
+void OnsetCurveBuilder::StoreFrame(int64_t frame, float flux, const float* band_flux, uint64_t shape)
+{
+	const int64_t index = frame - frame_origin_;
+	if (index < 0 || index >= static_cast<int64_t>(flux_.size())) {
+		return;
+	}
+	flux_[static_cast<size_t>(index)] = flux;
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		band_flux_[band][static_cast<size_t>(index)] = band_flux[band];
+	}
+	shape_[static_cast<size_t>(index)] = shape;
+	frame_end_ = std::max(frame_end_, index + 1);
+}
+
+template <typename Fill>
+void OnsetCurveBuilder::PushFrames(size_t count, const Fill& fill)
+{
+	const size_t frame_size = static_cast<size_t>(geometry_.fft_size);
+	const size_t hop_size = static_cast<size_t>(geometry_.hop_size);
+	const size_t overlap = frame_size - hop_size;
+	size_t offset = 0;
+	while (offset < count) {
+		const size_t take = std::min(count - offset, frame_size - frame_fill_);
+		fill(offset, take);
+		frame_fill_ += take;
+		offset += take;
+		samples_pushed_ += static_cast<int64_t>(take);
+
+		if (frame_fill_ == frame_size) {
+			analyze_frame_(*this);
+			if (arithmetic_ == kOnsetFixedQ15) {
+				std::memmove(frame_q15_.data(), frame_q15_.data() + hop_size, overlap * sizeof(int16_t));
+			}
+			else {
+				std::memmove(frame_.data(), frame_.data() + hop_size, overlap * sizeof(float));
+			}
+			frame_fill_ = overlap;
+		}
+	}
+}
+
+void OnsetCurveBuilder::Push(const float* mono, size_t count)
+{
+	if (arithmetic_ == kOnsetFixedQ15) {
+		PushFrames(count, [&](size_t offset, size_t take) {
+			int16_t* destination = frame_q15_.data() + frame_fill_;
+			for (size_t i = 0; i < take; ++i) {
+				destination[i] = FloatToPcm16(mono[offset + i]);
+			}
+		});
+		return;
+	}
+	PushFrames(count, [&](size_t offset, size_t take) {
+		std::memcpy(frame_.data() + frame_fill_, mono + offset, take * sizeof(float));
+	});
+}
+
+void OnsetCurveBuilder::PushPcm16(const int16_t* interleaved, int channel_count, size_t frame_count)
+{
+	const size_t channels = static_cast<size_t>(std::max(channel_count, 1));
+	if (arithmetic_ != kOnsetFixedQ15) {
+		PushFrames(frame_count, [&](size_t offset, size_t take) {
+			DownmixToMono(interleaved + offset * channels, kSampleInt16, channel_count, take, frame_.data() + frame_fill_);
+		});
+		return;
+	}
+	PushFrames(frame_count, [&](size_t offset, size_t take) {
+		const int16_t* source = interleaved + offset * channels;
+		int16_t* destination = frame_q15_.data() + frame_fill_;
+		if (channels == 1) {
+			std::memcpy(destination, source, take * sizeof(int16_t));
+			return;
+		}
+		// Rounded to nearest, so the mean of two equal channels is exact.
+		const int32_t count = static_cast<int32_t>(channels);
+		for (size_t i = 0; i < take; ++i) {
+			int32_t sum = 0;
+			for (size_t ch = 0; ch < channels; ++ch) {
+				sum += source[i * channels + ch];
+			}
+			destination[i] = static_cast<int16_t>((sum >= 0 ? sum + count / 2 : sum - count / 2) / count);
+		}
+	});
+}
+
+size_t OnsetCurveBuilder::FrameCount() const
+{
+	return static_cast<size_t>(std::min<int64_t>(frame_end_, static_cast<int64_t>(flux_.size())));
+}
+
+ArenaSpan<const float> OnsetCurveBuilder::Flux() const
+{
+	return ArenaSpan<const float>{ flux_.data(), FrameCount() };
+}
+
+ArenaSpan<const float> OnsetCurveBuilder::BandFlux(int band) const
+{
+	return ArenaSpan<const float>{ band_flux_[band].data(), FrameCount() };
+}
+
+ArenaSpan<const uint64_t> OnsetCurveBuilder::Shapes() const
+{
+	return ArenaSpan<const uint64_t>{ shape_.data(), FrameCount() };
+}
+
+bool OnsetCurveBuilder::EnablePitchFlux(ScratchArena& arena)
+{
+	pitch_kernel_ = SharedPitchKernel(geometry_.fft_size, sample_rate_);
+	if (!pitch_kernel_ || pitch_kernel_->pitch_count == 0) {
+		return pitch_kernel_ != nullptr;
+	}
+	const size_t pitch_count = static_cast<size_t>(pitch_kernel_->pitch_count);
+	pitch_value_ = AllocateSpan<float>(arena, pitch_count);
+	prev_pitch_level_ = AllocateSpan<float>(arena, pitch_count);
+	last_pitch_flux_ = AllocateSpan<float>(arena, pitch_count);
+	pitch_flux_ = AllocateSpan<float>(arena, pitch_count * flux_.size());
+	if (pitch_value_.empty() || prev_pitch_level_.empty() || last_pitch_flux_.empty() ||
+		(!flux_.empty() && pitch_flux_.empty())) {
+		pitch_kernel_ = nullptr;
+		return false;
+	}
+	return true;
+}
+
+ArenaSpan<const float> OnsetCurveBuilder::PitchFlux(int pitch) const
+{
+	if (pitch < 0 || pitch >= PitchCount() || pitch_flux_.empty()) {
+		return ArenaSpan<const float>();
+	}
+	return ArenaSpan<const float>{ pitch_flux_.data() + static_cast<size_t>(pitch) * flux_.size(), FrameCount() };
+}
+
+void OnsetCurveBuilder::AnalyzePitches(const kiss_fft_cpx* spectrum)
+{
+	// pitch_value_ takes the magnitudes, then each pitch's rise.
+	const int pitch_count = pitch_kernel_->pitch_count;
+	ApplyPitchKernel(*pitch_kernel_, spectrum, pitch_value_.data());
+	for (int pitch = 0; pitch < pitch_count; ++pitch) {
+		const size_t index = static_cast<size_t>(pitch);
+		const float level = std::log1p(kPitchGamma * pitch_value_[index]);
+		const float rise = level - prev_pitch_level_[index];
+		prev_pitch_level_[index] = level;
+		pitch_value_[index] = (rise > 0.0f) ? rise : 0.0f;
+	}
+	const float* level = prev_pitch_level_.data();
+	for (int pitch = 0; pitch < pitch_count; ++pitch) {
+		const size_t index = static_cast<size_t>(pitch);
+		const float rise = pitch_value_[index];
+		const bool rise_peak = (pitch == 0 || rise > pitch_value_[index - 1]) &&
+			(pitch + 1 == pitch_count || rise >= pitch_value_[index + 1]);
+		const bool level_peak = (pitch == 0 || level[index] >= level[index - 1]) &&
+			(pitch + 1 == pitch_count || level[index] >= level[index + 1]);
+		last_pitch_flux_[index] = (rise_peak && level_peak) ? rise : 0.0f;
+	}
+}
+
+void OnsetCurveBuilder::AnalyzePitchesQ15(float scale)
+{
+	for (size_t bin = 0; bin < fft_out_q15_.size(); ++bin) {
+		const kiss_fft_q15_cpx& q = fft_out_q15_[bin];
+		fft_out_[bin] = kiss_fft_cpx{ q.r * scale, q.i * scale };
+	}
+	AnalyzePitches(fft_out_.data());
+}
+
+OnsetShard PlanOnsetShard(int64_t sample_count, const OnsetGeometry& geometry, int shard_index, int shard_count)
+{
+	OnsetShard shard;
+	if (shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+		return shard;
+	}
+	const int64_t frame_count = OnsetFrameCount(sample_count, geometry);
+	shard.first_frame = frame_count * shard_index / shard_count;
+	shard.end_frame = frame_count * (shard_index + 1) / shard_count;
+	if (shard.end_frame > shard.first_frame) {
+		shard.first_sample = std::max<int64_t>(0, shard.first_frame - kOnsetWarmupFrames) * geometry.hop_size;
+		shard.end_sample = (shard.end_frame - 1) * geometry.hop_size + geometry.fft_size;
+	} else {
+		shard.first_sample = shard.end_sample = shard.first_frame * geometry.hop_size;
+	}
+	return shard;
+}
+
+template <typename Odf>
+void OnsetCurveBuilder::AnalyzeFrame(OnsetCurveBuilder& builder)
+{
+	for (size_t n = 0; n < builder.fft_in_.size(); ++n) {
+		builder.fft_in_[n] = static_cast<kiss_fft_scalar>(builder.frame_[n] * builder.window_[n]);
+	}
+
+	kiss_fftr(builder.cfg_, builder.fft_in_.data(), builder.fft_out_.data());
+
+	OdfScratch scratch{ builder.prev_magnitude_, builder.prev_phasor_, builder.prev2_phasor_,
+		1.0f / static_cast<float>(builder.geometry_.fft_size) };
+	float frame_sum = 0.0f;
+	float band_sum[kOnsetBandCount] = {};
+	const int last_bin = builder.geometry_.fft_size / 2;
+	for (int bin = 0; bin <= last_bin; ++bin) {
+		const kiss_fft_cpx& x = builder.fft_out_[static_cast<size_t>(bin)];
+		const float contribution = Odf::Bin(bin, x, scratch);
+		frame_sum += contribution;
+		band_sum[builder.band_of_bin_[static_cast<size_t>(bin)]] += contribution;
+		builder.bin_power_[static_cast<size_t>(bin)] = x.r * x.r + x.i * x.i;
+	}
+
+	float band_flux[kOnsetBandCount];
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		band_flux[band] = Odf::Finalize(band_sum[band]);
+	}
+	if (builder.pitch_kernel_) {
+		builder.AnalyzePitches(builder.fft_out_.data());
+	}
+	builder.FinishFrame(Odf::Finalize(frame_sum), band_flux,
+		MeasureSpectralShape(builder.bin_power_.data(), builder.band_end_, builder.geometry_.fft_size, builder.sample_rate_));
+}
+
+// Any function on the fixed-point spectrum: the bins are brought to float
+// and scored by the float policy.
+template <typename Odf>
+void OnsetCurveBuilder::AnalyzeFrameQ15(OnsetCurveBuilder& builder)
+{
+	int shift = 0;
+	const float scale = TransformQ15Frame(builder.cfg_q15_, builder.frame_q15_, builder.window_q15_,
+		builder.fft_in_q15_, builder.fft_out_q15_.data(), shift);
+
+	OdfScratch scratch{ builder.prev_magnitude_, builder.prev_phasor_, builder.prev2_phasor_,
+		1.0f / static_cast<float>(builder.geometry_.fft_size) };
+	float frame_sum = 0.0f;
+	float band_sum[kOnsetBandCount] = {};
+	const int last_bin = builder.geometry_.fft_size / 2;
+	for (int bin = 0; bin <= last_bin; ++bin) {
+		const kiss_fft_q15_cpx& q = builder.fft_out_q15_[static_cast<size_t>(bin)];
+		const kiss_fft_cpx x = { q.r * scale, q.i * scale };
+		const float contribution = Odf::Bin(bin, x, scratch);
+		frame_sum += contribution;
+		band_sum[builder.band_of_bin_[static_cast<size_t>(bin)]] += contribution;
+		builder.bin_power_[static_cast<size_t>(bin)] = x.r * x.r + x.i * x.i;
+	}
+
+	float band_flux[kOnsetBandCount];
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		band_flux[band] = Odf::Finalize(band_sum[band]);
+	}
+	if (builder.pitch_kernel_) {
+		builder.AnalyzePitchesQ15(scale);
+	}
+	builder.FinishFrame(Odf::Finalize(frame_sum), band_flux,
+		MeasureSpectralShape(builder.bin_power_.data(), builder.band_end_, builder.geometry_.fft_size, builder.sample_rate_));
+}
+
+// Spectral flux in integers: magnitudes from an integer square root, brought
+// to a common scale across block exponents, rectified differences summed in
+// 64 bits. Only the frame and band totals are converted to float.
+template <>
+void OnsetCurveBuilder::AnalyzeFrameQ15<SpectralFluxOdf>(OnsetCurveBuilder& builder)
+{
+	int shift = 0;
+	const float scale = TransformQ15Frame(builder.cfg_q15_, builder.frame_q15_, builder.window_q15_,
+		builder.fft_in_q15_, builder.fft_out_q15_.data(), shift);
+
+	const float power_scale = scale * scale;
+	uint64_t frame_sum = 0;
+	uint64_t band_sum[kOnsetBandCount] = {};
+	const int common_shift = 15 - shift;
+	const int last_bin = builder.geometry_.fft_size / 2;
+	for (int bin = 0; bin <= last_bin; ++bin) {
+		const size_t index = static_cast<size_t>(bin);
+		const kiss_fft_q15_cpx& q = builder.fft_out_q15_[index];
+		const uint32_t power = static_cast<uint32_t>(q.r * q.r) + static_cast<uint32_t>(q.i * q.i);
+		const uint32_t magnitude = IntegerSqrt(power) << common_shift;
+		const uint32_t previous = builder.prev_magnitude_q15_[index];
+		builder.prev_magnitude_q15_[index] = magnitude;
+		if (magnitude > previous) {
+			frame_sum += magnitude - previous;
+			band_sum[builder.band_of_bin_[index]] += magnitude - previous;
+		}
+		builder.bin_power_[index] = static_cast<float>(power) * power_scale;
+	}
+
+	// scale is for this frame's exponent; the sums are 2^common_shift finer.
+	const float unit = scale * static_cast<float>(1 << shift) / 32768.0f;
+	float band_flux[kOnsetBandCount];
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		band_flux[band] = static_cast<float>(band_sum[band]) * unit;
+	}
+	if (builder.pitch_kernel_) {
+		builder.AnalyzePitchesQ15(scale);
+	}
+	builder.FinishFrame(static_cast<float>(frame_sum) * unit, band_flux,
+		MeasureSpectralShape(builder.bin_power_.data(), builder.band_end_, builder.geometry_.fft_size, builder.sample_rate_));
+}
+
+void OnsetCurveBuilder::FinishFrame(float flux, const float* band_flux, uint64_t shape)
+{
+	last_flux_ = flux;
+	std::copy(band_flux, band_flux + kOnsetBandCount, last_band_flux_);
+	last_shape_ = shape;
+	const int64_t frame = frames_analyzed_++;
+	if (frame < store_from_) {
+		return;
+	}
+	StoreFrame(frame, last_flux_, last_band_flux_, last_shape_);
+	const int64_t index = frame - frame_origin_;
+	if (pitch_kernel_ && index >= 0 && index < static_cast<int64_t>(flux_.size())) {
+		for (size_t pitch = 0; pitch < last_pitch_flux_.size(); ++pitch) {
+			pitch_flux_[pitch * flux_.size() + static_cast<size_t>(index)] = last_pitch_flux_[pitch];
+		}
+	}
+}
+
+/* --------------------------------------------------- OnsetFluxCache */
+bool OnsetFluxCache::Configure(const OnsetCacheKey& key, int64_t frame_count)
+{
+	const size_t frames = static_cast<size_t>(std::max<int64_t>(frame_count, 0));
+	if (stream_ready_ && key == key_ && frames == valid_.size()) {
+		return true;
+	}
+
+	Clear();
+	key_ = key;
+	arena_.Reset();
+	stream_ready_ = key.sample_rate > 0.0 &&
+		stream_.Initialize(arena_, key.geometry, key.onset_function, key.sample_rate, key.low_crossover_hz, key.high_crossover_hz, 0);
+	if (!stream_ready_) {
+		return false;
+	}
+	flux_.assign(frames, 0.0f);
+	band_flux_.assign(frames * kOnsetBandCount, 0.0f);
+	shape_.assign(frames, 0);
+	valid_.assign(frames, 0);
+	return true;
+}
+
+void OnsetFluxCache::Clear()
+{
+	flux_.clear();
+	band_flux_.clear();
+	shape_.clear();
+	valid_.clear();
+	next_sample_ = -1;
+	trusted_from_frame_ = 0;
+	covered_frames_ = 0;
+}
+
+void OnsetFluxCache::AddSamples(int64_t first_sample, const float* mono, size_t count)
+{
+	if (!stream_ready_ || count == 0 || first_sample < 0) {
+		return;
+	}
+
+	if (first_sample != next_sample_) {
+		const int64_t hop_size = key_.geometry.hop_size;
+		const int64_t first_frame = (first_sample + hop_size - 1) / hop_size;
+		const int64_t skip = first_frame * hop_size - first_sample;
+		if (skip >= static_cast<int64_t>(count)) {
+			next_sample_ = -1;
+			return;
+		}
+		trusted_from_frame_ = (first_frame == 0) ? 0 : first_frame + kOnsetWarmupFrames;
+		stream_.Seek(first_frame, trusted_from_frame_);
+		mono += skip;
+		count -= static_cast<size_t>(skip);
+		first_sample += skip;
+	}
+	next_sample_ = first_sample + static_cast<int64_t>(count);
+
+	while (count > 0) {
+		const size_t take = std::min(count, stream_.SamplesUntilFrame());
+		const int64_t frames_before = stream_.FramesAnalyzed();
+		stream_.Push(mono, take);
+		mono += take;
+		count -= take;
+
+		const int64_t frame = frames_before;
+		if (stream_.FramesAnalyzed() == frames_before || frame < trusted_from_frame_ ||
+			frame >= static_cast<int64_t>(valid_.size())) {
+			continue;
+		}
+		const size_t index = static_cast<size_t>(frame);
+		flux_[index] = stream_.LastFlux();
+		std::copy(stream_.LastBandFlux(), stream_.LastBandFlux() + kOnsetBandCount,
+			band_flux_.begin() + static_cast<std::ptrdiff_t>(index * kOnsetBandCount));
+		shape_[index] = stream_.LastShape();
+		if (!valid_[index]) {
+			valid_[index] = 1;
+			++covered_frames_;
+		}
+	}
+}
+
+bool OnsetFluxCache::Covers(int64_t first_frame, int64_t end_frame) const
+{
+	if (first_frame < 0 || end_frame > static_cast<int64_t>(valid_.size()) || first_frame >= end_frame) {
+		return false;
+	}
+	for (int64_t frame = first_frame; frame < end_frame; ++frame) {
+		if (!valid_[static_cast<size_t>(frame)]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void OnsetFluxCache::SpliceInto(OnsetCurveBuilder& builder, int64_t first_frame, int64_t end_frame) const
+{
+	const int64_t last = std::min(end_frame, static_cast<int64_t>(valid_.size()));
+	for (int64_t frame = std::max<int64_t>(first_frame, 0); frame < last; ++frame) {
+		const size_t index = static_cast<size_t>(frame);
+		builder.StoreFrame(frame, flux_[index], band_flux_.data() + index * kOnsetBandCount, shape_[index]);
+	}
+}
+
+/* --------------------------------------------------- OnsetCurveStore */
+namespace {
+
+// FNV-1a over the sample bit patterns, four words at a time in independent
+// lanes so the multiply chain does not serialize the whole block.
+uint64_t HashSamples(const float* samples, size_t count)
+{
+	constexpr uint64_t kPrime = 0x100000001b3ull;
+	uint64_t lanes[4] = { 0xcbf29ce484222325ull, 0x84222325cbf29ce4ull, 0x9ce484222325cbf2ull, 0x2325cbf29ce48422ull };
+	size_t index = 0;
+	for (; index + 4 <= count; index += 4) {
+		for (int lane = 0; lane < 4; ++lane) {
+			uint32_t bits = 0;
+			std::memcpy(&bits, samples + index + lane, sizeof(bits));
+			lanes[lane] = (lanes[lane] ^ bits) * kPrime;
+		}
+	}
+	for (; index < count; ++index) {
+		uint32_t bits = 0;
+		std::memcpy(&bits, samples + index, sizeof(bits));
+		lanes[0] = (lanes[0] ^ bits) * kPrime;
+	}
+	uint64_t hash = static_cast<uint64_t>(count);
+	for (uint64_t lane : lanes) {
+		hash = (hash ^ lane) * kPrime;
+	}
+	return hash;
+}
+
+} // namespace
+
+bool OnsetCurveStore::BeginPass(ScratchArena& arena,
+	OnsetCurveBuilder& builder,
+	const OnsetCacheKey& key,
+	int64_t sample_count)
+{
+	builder_ = nullptr;
+	history_samples_ = static_cast<size_t>(key.geometry.fft_size + kOnsetWarmupFrames * key.geometry.hop_size);
+	staging_ = AllocateSpan<float>(arena, history_samples_ + static_cast<size_t>(kContentBlockSamples));
+	if (staging_.empty()) {
+		return false;
+	}
+
+	builder_ = &builder;
+	pass_key_ = key;
+	reuse_ = HasCurves() && key == key_;
+	pass_hashes_.clear();
+	pass_hashes_.reserve(static_cast<size_t>((std::max<int64_t>(sample_count, 0) + kContentBlockSamples - 1) / kContentBlockSamples));
+	staged_ = 0;
+	block_index_ = 0;
+	streaming_ = false;
+	recomputed_frames_ = 0;
+
+	if (reuse_) {
+		for (size_t frame = 0; frame < flux_.size(); ++frame) {
+			builder.StoreFrame(static_cast<int64_t>(frame), flux_[frame], band_flux_.data() + frame * kOnsetBandCount, shape_[frame]);
+		}
+	}
+	return true;
+}
+
+void OnsetCurveStore::Push(const float* mono, size_t count)
+{
+	if (!builder_) {
+		return;
+	}
+	const size_t block_size = static_cast<size_t>(kContentBlockSamples);
+	while (count > 0) {
+		const size_t take = std::min(count, block_size - staged_);
+		std::memcpy(staging_.data() + history_samples_ + staged_, mono, take * sizeof(float));
+		staged_ += take;
+		mono += take;
+		count -= take;
+
+		if (staged_ == block_size) {
+			ProcessBlock(block_size);
+			std::memmove(staging_.data(), staging_.data() + block_size, history_samples_ * sizeof(float));
+			staged_ = 0;
+			++block_index_;
+		}
+	}
+}
+
+void OnsetCurveStore::ProcessBlock(size_t length)
+{
+	const float* block = staging_.data() + history_samples_;
+	const int64_t block_begin = block_index_ * kContentBlockSamples;
+	const int64_t fft_size = pass_key_.geometry.fft_size;
+	const int64_t hop_size = pass_key_.geometry.hop_size;
+	const uint64_t hash = HashSamples(block, length);
+	pass_hashes_.push_back(hash);
+	const bool changed = !reuse_ || block_index_ >= static_cast<int64_t>(block_hashes_.size()) ||
+		block_hashes_[static_cast<size_t>(block_index_)] != hash;
+
+	if (streaming_) {
+		if (changed) {
+			builder_->Push(block, length);
+			return;
+		}
+		// Finish the frames that straddle the edge and the ones whose ODF
+		// history reaches back across it, then fall back to stored frames.
+		const int64_t last_frame = (block_begin - 1) / hop_size + kOnsetWarmupFrames;
+		const int64_t head = ClampValue<int64_t>(last_frame * hop_size + fft_size - block_begin, 0, static_cast<int64_t>(length));
+		builder_->Push(block, static_cast<size_t>(head));
+		EndSegment();
+		return;
+	}
+	if (!changed) {
+		return;
+	}
+
+	// First frame that reads any sample of this block; restart the STFT
+	// kOnsetWarmupFrames before it from the kept history.
+	const int64_t first_frame = (block_begin >= fft_size) ? (block_begin - fft_size) / hop_size + 1 : 0;
+	const int64_t seek_frame = std::max<int64_t>(0, first_frame - kOnsetWarmupFrames);
+	const size_t history = static_cast<size_t>(block_begin - seek_frame * hop_size);
+	builder_->Seek(seek_frame, first_frame);
+	builder_->Push(block - history, history);
+	builder_->Push(block, length);
+	segment_first_frame_ = first_frame;
+	streaming_ = true;
+}
+
+void OnsetCurveStore::EndSegment()
+{
+	recomputed_frames_ += std::max<int64_t>(0, builder_->FramesAnalyzed() - segment_first_frame_);
+	streaming_ = false;
+}
+
+void OnsetCurveStore::FinishPass()
+{
+	if (!builder_) {
+		return;
+	}
+	if (staged_ > 0) {
+		ProcessBlock(staged_);
+		staged_ = 0;
+	}
+	if (streaming_) {
+		EndSegment();
+	}
+
+	const ArenaSpan<const float> flux = builder_->Flux();
+	flux_.assign(flux.begin(), flux.end());
+	band_flux_.resize(flux.size() * kOnsetBandCount);
+	for (int band = 0; band < kOnsetBandCount; ++band) {
+		const ArenaSpan<const float> curve = builder_->BandFlux(band);
+		for (size_t frame = 0; frame < curve.size(); ++frame) {
+			band_flux_[frame * kOnsetBandCount + static_cast<size_t>(band)] = curve[frame];
+		}
+	}
+	const ArenaSpan<const uint64_t> shapes = builder_->Shapes();
+	shape_.assign(shapes.begin(), shapes.end());
+	block_hashes_.swap(pass_hashes_);
+	key_ = pass_key_;
+	builder_ = nullptr;
+	staging_ = ArenaSpan<float>();
+}
+
+void OnsetCurveStore::Clear()
+{
+	key_ = OnsetCacheKey();
+	block_hashes_.clear();
+	flux_.clear();
+	band_flux_.clear();
+	shape_.clear();
+	pass_hashes_.clear();
+	builder_ = nullptr;
+	staging_ = ArenaSpan<float>();
+}
+
+/* ------------------------------------------------- Rolling quantile */
+void P2Quantile::Reset(double quantile)
+{
+	quantile_ = ClampValue(quantile, 0.0, 1.0);
+	count_ = 0;
+}
+
+void P2Quantile::Add(float value)
+{
+	const double x = static_cast<double>(value);
+	if (count_ < 5) {
+		// Insertion sort of the first five values, which become the markers.
+		int slot = static_cast<int>(count_);
+		while (slot > 0 && heights_[slot - 1] > x) {
+			heights_[slot] = heights_[slot - 1];
+			--slot;
+		}
+		heights_[slot] = x;
+		if (++count_ == 5) {
+			const double p = quantile_;
+			for (int marker = 0; marker < 5; ++marker) {
+				positions_[marker] = static_cast<double>(marker);
+			}
+			desired_[0] = 0.0;
+			desired_[1] = 2.0 * p;
+			desired_[2] = 4.0 * p;
+			desired_[3] = 2.0 + 2.0 * p;
+			desired_[4] = 4.0;
+			increments_[0] = 0.0;
+			increments_[1] = p / 2.0;
+			increments_[2] = p;
+			increments_[3] = (1.0 + p) / 2.0;
+			increments_[4] = 1.0;
+		}
+		return;
+	}
+
+	int cell = 0;
+	if (x < heights_[0]) {
+		heights_[0] = x;
+	}
+	else if (x >= heights_[4]) {
+		heights_[4] = x;
+		cell = 3;
+	}
+	else {
+		while (cell < 3 && x >= heights_[cell + 1]) {
+			++cell;
+		}
+	}
+	for (int marker = cell + 1; marker < 5; ++marker) {
+		positions_[marker] += 1.0;
+	}
+	for (int marker = 0; marker < 5; ++marker) {
+		desired_[marker] += increments_[marker];
+	}
+	++count_;
+
+	for (int marker = 1; marker < 4; ++marker) {
+		const double offset = desired_[marker] - positions_[marker];
+		const double next_gap = positions_[marker + 1] - positions_[marker];
+		const double prev_gap = positions_[marker - 1] - positions_[marker];
+		if ((offset < 1.0 || next_gap <= 1.0) && (offset > -1.0 || prev_gap >= -1.0)) {
+			continue;
+		}
+		const double step = (offset >= 0.0) ? 1.0 : -1.0;
+		const double span = positions_[marker + 1] - positions_[marker - 1];
+		const double parabolic = heights_[marker] + step / span *
+			((positions_[marker] - positions_[marker - 1] + step) * (heights_[marker + 1] - heights_[marker]) / next_gap +
+			(positions_[marker + 1] - positions_[marker] - step) * (heights_[marker] - heights_[marker - 1]) / -prev_gap);
+		if (heights_[marker - 1] < parabolic && parabolic < heights_[marker + 1]) {
+			heights_[marker] = parabolic;
+		}
+		else {
+			const int neighbour = marker + static_cast<int>(step);
+			heights_[marker] += step * (heights_[neighbour] - heights_[marker]) /
+				(positions_[neighbour] - positions_[marker]);
+		}
+		positions_[marker] += step;
+	}
+}
+
+float P2Quantile::Estimate() const
+{
+	if (count_ == 0) {
+		return 0.0f;
+	}
+	if (count_ < 5) {
+		const double rank = quantile_ * static_cast<double>(count_ - 1);
+		return static_cast<float>(heights_[static_cast<int>(std::lround(rank))]);
+	}
+	return static_cast<float>(heights_[2]);
+}
+
+int64_t RollingQuantileReach(int64_t window_frames)
+{
+	const int64_t window = std::max<int64_t>(window_frames, 1);
+	const int64_t stride = (window + kRollingQuantileSketches - 2) / (kRollingQuantileSketches - 1);
+	return stride * kRollingQuantileSketches;
+}
+
+void RollingQuantile::Reset(double quantile, int64_t window_frames)
+{
+	quantile_ = quantile;
+	stride_ = RollingQuantileReach(window_frames) / kRollingQuantileSketches;
+	frames_ = 0;
+	for (P2Quantile& sketch : sketches_) {
+		sketch.Reset(quantile_);
+	}
+}
+
+void RollingQuantile::Add(float value)
+{
+	const int64_t period = stride_ * kRollingQuantileSketches;
+	for (int index = 0; index < kRollingQuantileSketches; ++index) {
+		const int64_t start = stride_ * index;
+		if (frames_ < start) {
+			continue;
+		}
+		if ((frames_ - start) % period == 0) {
+			sketches_[index].Reset(quantile_);
+		}
+		sketches_[index].Add(value);
+	}
+	++frames_;
+}
+
+float RollingQuantile::Estimate() const
+{
+	const P2Quantile* oldest = &sketches_[0];
+	for (const P2Quantile& sketch : sketches_) {
+		if (sketch.Count() > oldest->Count()) {
+			oldest = &sketch;
+		}
+	}
+	return oldest->Estimate();
+}
+
+/* ---------------------------------------------------- Peak picking */
+int SmoothingRadius(float smoothing_percent)
+{
+	const float clamped_percent = ClampValue(smoothing_percent, 0.0f, 100.0f);
+	return ClampValue(static_cast<int>(std::round((clamped_percent / 100.0f) * static_cast<float>(kMaxSmoothingRadius))),
+		0,
+		kMaxSmoothingRadius);
+}
+
+PeakPickingSpans PeakPickingSpansFor(float smoothing_percent, float min_separation_seconds, double frames_per_second)
+{
+	// Exactly 1 for the Standard quality, whose spans stay as they always were.
+	const double scale = frames_per_second * static_cast<double>(kHopSize) / kStandardSampleRate;
+
+	PeakPickingSpans spans;
+	spans.smoothing_radius = static_cast<int>(std::lround(static_cast<double>(SmoothingRadius(smoothing_percent)) * scale));
+	spans.threshold_window = std::max(1, static_cast<int>(std::lround(static_cast<double>(kThresholdWindow) * scale)));
+	spans.min_separation = std::max<int64_t>(1,
+		static_cast<int64_t>(std::ceil(min_separation_seconds * frames_per_second)));
+	return spans;
+}
+
+namespace {
+
+// Centred moving average of in_flux into smoothed, which has its size.
+void MovingAverage(ArenaSpan<const float> in_flux, int radius, float* smoothed)
+{
+	for (size_t i = 0; i < in_flux.size(); ++i) {
+		const size_t start = (i <= static_cast<size_t>(radius)) ? 0 : i - static_cast<size_t>(radius);
+		const size_t end = std::min(in_flux.size() - 1, i + static_cast<size_t>(radius));
+
+		float sum = 0.0f;
+		for (size_t j = start; j <= end; ++j) {
+			sum += in_flux[j];
+		}
+		smoothed[i] = sum / static_cast<float>(end - start + 1);
+	}
+}
+
+} // namespace
+
+ArenaSpan<const float> SmoothFlux(ArenaSpan<const float> in_flux,
+	int radius,
+	ScratchArena& arena)
+{
+	if (in_flux.empty() || radius <= 0) {
+		return in_flux;
+	}
+
+	ArenaSpan<float> smoothed = AllocateSpan<float>(arena, in_flux.size());
+	if (smoothed.empty()) {
+		return ArenaSpan<const float>();
+	}
+	MovingAverage(in_flux, radius, smoothed.data());
+	return smoothed;
+}
+
+int64_t PeakPickingLeadFrames(const PeakPickingSpans& spans)
+{
+	// Threshold window (or rolling-quantile reach) of smoothed frames, each
+	// reaching radius raw frames back, plus the gap within which an earlier
+	// peak can absorb a later one.
+	const int64_t threshold_reach = (spans.quantile_window > 0) ?
+		RollingQuantileReach(spans.quantile_window) :
+		static_cast<int64_t>(spans.threshold_window);
+	return static_cast<int64_t>(spans.smoothing_radius) + threshold_reach +
+		std::max<int64_t>(spans.min_separation, 1);
+}
+
+int64_t PeakPickingTailFrames(const PeakPickingSpans& spans)
+{
+	// Local-maximum test looks one smoothed frame ahead; a stronger peak within
+	// min separation replaces the one before it.
+	return static_cast<int64_t>(spans.smoothing_radius + 1) +
+		std::max<int64_t>(spans.min_separation, 1);
+}
+
+ArenaSpan<CandidatePeak> AllocateCandidates(ScratchArena& arena, size_t frame_count)
+{
+	return AllocateSpan<CandidatePeak>(arena, frame_count / 2 + 1);
+}
+
+namespace {
+
+// Mean of the threshold_window smoothed frames before frame i, summed in
+// frame order; false for the first frame, which has none.
+bool TrailingMean(ArenaSpan<const float> smoothed_flux, size_t i, size_t threshold_window, float& mean)
+{
+	const size_t window_start = (i <= threshold_window) ? 0 : i - threshold_window;
+	mean = 0.0f;
+	size_t count = 0;
+	for (size_t j = window_start; j < i; ++j) {
+		mean += smoothed_flux[j];
+		++count;
+	}
+	if (count == 0) {
+		return false;
+	}
+	mean /= static_cast<float>(count);
+	return true;
+}
+
+// Local-maximum, threshold and min-separation rules shared by the threshold
+// modes. threshold(i, value) is called for every frame in order and returns
+// false while frame i has no threshold yet.
+template <typename Threshold>
+size_t SelectPeaksWith(ArenaSpan<const float> smoothed_flux,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates,
+	Threshold threshold)
+{
+	size_t candidate_count = 0;
+	const int64_t min_separation_frames = spans.min_separation;
+
+	double last_peak_frame = -static_cast<double>(min_separation_frames);
+	for (size_t i = 0; i < smoothed_flux.size(); ++i) {
+		float adaptive_threshold = 0.0f;
+		if (!threshold(i, adaptive_threshold)) {
+			continue;
+		}
+
+		const bool is_local_max =
+			(i == 0 || smoothed_flux[i] > smoothed_flux[i - 1]) &&
+			(i + 1 == smoothed_flux.size() || smoothed_flux[i] >= smoothed_flux[i + 1]);
+
+		if (!is_local_max || smoothed_flux[i] <= adaptive_threshold) {
+			continue;
+		}
+
+		const double frame_index = static_cast<double>(i);
+		const double frame_gap = frame_index - last_peak_frame;
+		const float flux_value = smoothed_flux[i];
+
+		if (frame_gap < static_cast<double>(min_separation_frames)) {
+			if (candidate_count > 0 && flux_value > candidates[candidate_count - 1].flux_value) {
+				candidates[candidate_count - 1].frame_index = static_cast<int64_t>(i);
+				candidates[candidate_count - 1].flux_value = flux_value;
+				last_peak_frame = frame_index;
+			}
+			continue;
+		}
+
+		if (candidate_count == candidates.size()) {
+			break;
+		}
+		candidates[candidate_count++] = { static_cast<int64_t>(i), flux_value };
+		last_peak_frame = frame_index;
+	}
+	return candidate_count;
+}
+
+} // namespace
+
+// Candidates must hold smoothed_flux.size() / 2 + 1 entries: strict local
+// maxima are never adjacent, so that bounds the number of peaks. Returns the
+// number of peaks written.
+size_t SelectPeaks(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates)
+{
+	const size_t threshold_window = static_cast<size_t>(std::max(spans.threshold_window, 1));
+	return SelectPeaksWith(smoothed_flux, spans, candidates, [&](size_t i, float& adaptive_threshold) {
+		float mean = 0.0f;
+		if (!TrailingMean(smoothed_flux, i, threshold_window, mean)) {
+			return false;
+		}
+		adaptive_threshold = mean * threshold_multiplier;
+		return true;
+	});
+}
+
+size_t SelectPeaksAboveQuantile(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	float quantile,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates)
+{
+	const size_t threshold_window = static_cast<size_t>(std::max(spans.threshold_window, 1));
+	RollingQuantile rolling;
+	rolling.Reset(quantile, std::max<int64_t>(spans.quantile_window, 1));
+	return SelectPeaksWith(smoothed_flux, spans, candidates, [&](size_t i, float& adaptive_threshold) {
+		// The sketch has to see every frame, peak or not.
+		const float floor = rolling.Estimate();
+		rolling.Add(smoothed_flux[i]);
+		float mean = 0.0f;
+		if (!TrailingMean(smoothed_flux, i, threshold_window, mean)) {
+			return false;
+		}
+		adaptive_threshold = std::max(mean * threshold_multiplier, floor);
+		return true;
+	});
+}
+
+size_t ClipCandidates(ArenaSpan<CandidatePeak> candidates,
+	size_t candidate_count,
+	int64_t frame_origin,
+	int64_t first_frame,
+	int64_t end_frame)
+{
+	size_t kept = 0;
+	for (size_t index = 0; index < candidate_count && index < candidates.size(); ++index) {
+		CandidatePeak candidate = candidates[index];
+		candidate.frame_index += frame_origin;
+		if (candidate.frame_index >= first_frame && candidate.frame_index < end_frame) {
+			candidates[kept++] = candidate;
+		}
+	}
+	return kept;
+}
+
+/* ------------------------------------------------------ Note onsets */
+namespace {
+
+// Semitones from a note up to its harmonics 2 to 6.
+constexpr int kHarmonicIntervals[] = { 12, 19, 24, 28, 31 };
+
+// One value of MovingAverage(flux, radius).
+float SmoothedAt(ArenaSpan<const float> flux, size_t frame, int radius)
+{
+	const size_t start = (frame <= static_cast<size_t>(radius)) ? 0 : frame - static_cast<size_t>(radius);
+	const size_t end = std::min(flux.size() - 1, frame + static_cast<size_t>(radius));
+	float sum = 0.0f;
+	for (size_t j = start; j <= end; ++j) {
+		sum += flux[j];
+	}
+	return sum / static_cast<float>(end - start + 1);
+}
+
+// Whether pitch flux at least as strong rises within a frame of frame on a
+// pitch that has pitch among its harmonics. The curves are read directly, so
+// a harmonic goes even when its fundamental is not picked itself.
+bool RisesAsHarmonic(const OnsetCurveBuilder& builder, int pitch, size_t frame, float strength, int radius)
+{
+	for (const int interval : kHarmonicIntervals) {
+		if (pitch - interval < 0) {
+			break;
+		}
+		const ArenaSpan<const float> flux = builder.PitchFlux(pitch - interval);
+		const size_t last = std::min(frame + 1, flux.size() - 1);
+		for (size_t other = (frame > 0) ? frame - 1 : 0; other <= last; ++other) {
+			if (SmoothedAt(flux, other, radius) >= strength) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+bool SelectPitchOnsets(const OnsetCurveBuilder& builder,
+	float threshold_multiplier,
+	const PeakPickingSpans& spans,
+	ScratchArena& arena,
+	ArenaSpan<PitchOnset>& onsets)
+{
+	onsets = ArenaSpan<PitchOnset>();
+	const int pitch_count = builder.PitchCount();
+	const size_t frame_count = builder.FrameCount();
+	if (pitch_count == 0 || frame_count == 0) {
+		return true;
+	}
+	const ArenaSpan<float> smoothed = AllocateSpan<float>(arena, frame_count);
+	const ArenaSpan<CandidatePeak> candidates = AllocateCandidates(arena, frame_count);
+	if (smoothed.empty() || candidates.empty()) {
+		return false;
+	}
+	const ArenaSpan<const float> smoothed_flux = { smoothed.data(), smoothed.size() };
+	const int radius = std::max(spans.smoothing_radius, 0);
+
+	// The floor needs the strongest pitch first; the candidates counted on the
+	// way bound what the second pass keeps.
+	float max_flux = 0.0f;
+	size_t candidate_total = 0;
+	for (int pitch = 0; pitch < pitch_count; ++pitch) {
+		MovingAverage(builder.PitchFlux(pitch), radius, smoothed.data());
+		max_flux = std::max(max_flux, *std::max_element(smoothed.begin(), smoothed.end()));
+		candidate_total += SelectPeaks(smoothed_flux, threshold_multiplier, spans, candidates);
+	}
+	if (max_flux <= 0.0f || candidate_total == 0) {
+		return true;
+	}
+	const ArenaSpan<PitchOnset> picked = AllocateSpan<PitchOnset>(arena, candidate_total);
+	if (picked.empty()) {
+		return false;
+	}
+
+	const float floor = kPitchOnsetFloor * max_flux;
+	size_t picked_count = 0;
+	for (int pitch = 0; pitch < pitch_count; ++pitch) {
+		MovingAverage(builder.PitchFlux(pitch), radius, smoothed.data());
+		const size_t count = SelectPeaks(smoothed_flux, threshold_multiplier, spans, candidates);
+		for (size_t index = 0; index < count; ++index) {
+			const CandidatePeak& candidate = candidates[index];
+			if (candidate.flux_value < floor ||
+				RisesAsHarmonic(builder, pitch, static_cast<size_t>(candidate.frame_index), candidate.flux_value, radius)) {
+				continue;
+			}
+			PitchOnset& onset = picked[picked_count++];
+			onset.frame_index = candidate.frame_index + builder.FrameOrigin();
+			onset.note = kPitchLowestNote + pitch;
+			onset.strength = candidate.flux_value;
+		}
+	}
+	std::sort(picked.begin(), picked.begin() + picked_count, [](const PitchOnset& a, const PitchOnset& b) {
+		return (a.frame_index != b.frame_index) ? a.frame_index < b.frame_index : a.note < b.note;
+	});
+	onsets = ArenaSpan<PitchOnset>{ picked.data(), picked_count };
+	return true;
+}
+
+/* ------------------------------------------------------------ Sweep */
+bool SweepPeakPicking(ArenaSpan<const float> flux,
+	double frames_per_second,
+	const SweepSetting* settings,
+	size_t setting_count,
+	SweepResult* results,
+	ScratchArena& arena)
+{
+	std::fill(results, results + setting_count, SweepResult());
+	if (flux.size() < 2 || setting_count == 0 || !(frames_per_second > 0.0)) {
+		return true;
+	}
+
+	ArenaSpan<PeakPickingSpans> spans = AllocateSpan<PeakPickingSpans>(arena, setting_count);
+	ArenaSpan<size_t> order = AllocateSpan<size_t>(arena, setting_count);
+	// Selection state of one radius group, laid out per field so the inner
+	// loop over settings runs without branches.
+	ArenaSpan<float> multipliers = AllocateSpan<float>(arena, setting_count);
+	ArenaSpan<int64_t> min_separations = AllocateSpan<int64_t>(arena, setting_count);
+	ArenaSpan<int64_t> last_frames = AllocateSpan<int64_t>(arena, setting_count);
+	ArenaSpan<float> last_values = AllocateSpan<float>(arena, setting_count);
+	ArenaSpan<int64_t> counts = AllocateSpan<int64_t>(arena, setting_count);
+	// Local maxima of the group's smoothed curve and their trailing means.
+	const size_t max_maxima = flux.size() / 2 + 1;
+	ArenaSpan<int64_t> maxima_frames = AllocateSpan<int64_t>(arena, max_maxima);
+	ArenaSpan<float> maxima_values = AllocateSpan<float>(arena, max_maxima);
+	ArenaSpan<float> maxima_means = AllocateSpan<float>(arena, max_maxima);
+	if (spans.empty() || order.empty() || multipliers.empty() || min_separations.empty() ||
+		last_frames.empty() || last_values.empty() || counts.empty() ||
+		maxima_frames.empty() || maxima_values.empty() || maxima_means.empty()) {
+		return false;
+	}
+
+	for (size_t index = 0; index < setting_count; ++index) {
+		spans[index] = PeakPickingSpansFor(settings[index].smoothing_percent,
+			settings[index].min_separation_seconds,
+			frames_per_second);
+		order[index] = index;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return spans[a].smoothing_radius < spans[b].smoothing_radius;
+	});
+
+	const double minutes = static_cast<double>(flux.size()) / frames_per_second / 60.0;
+	for (size_t group_begin = 0; group_begin < setting_count;) {
+		const int radius = spans[order[group_begin]].smoothing_radius;
+		size_t group_end = group_begin + 1;
+		while (group_end < setting_count && spans[order[group_end]].smoothing_radius == radius) {
+			++group_end;
+		}
+
+		const ArenaSpan<const float> smoothed = SmoothFlux(flux, radius, arena);
+		if (smoothed.empty()) {
+			return false;
+		}
+
+		// Same threshold window, mean and local-maximum rules as SelectPeaks;
+		// the window only depends on the frame rate, so one serves the group.
+		const size_t threshold_window = static_cast<size_t>(std::max(spans[order[group_begin]].threshold_window, 1));
+		size_t maxima_count = 0;
+		for (size_t i = 1; i < smoothed.size(); ++i) {
+			const bool is_local_max =
+				smoothed[i] > smoothed[i - 1] &&
+				(i + 1 == smoothed.size() || smoothed[i] >= smoothed[i + 1]);
+			if (!is_local_max) {
+				continue;
+			}
+			float mean = 0.0f;
+			TrailingMean(smoothed, i, threshold_window, mean);
+			maxima_frames[maxima_count] = static_cast<int64_t>(i);
+			maxima_values[maxima_count] = smoothed[i];
+			maxima_means[maxima_count] = mean;
+			++maxima_count;
+		}
+
+		const size_t group_size = group_end - group_begin;
+		for (size_t slot = 0; slot < group_size; ++slot) {
+			const size_t index = order[group_begin + slot];
+			multipliers[slot] = settings[index].threshold_multiplier;
+			min_separations[slot] = spans[index].min_separation;
+			last_frames[slot] = -spans[index].min_separation;
+			last_values[slot] = 0.0f;
+			counts[slot] = 0;
+		}
+
+		float* const multiplier = multipliers.data();
+		const int64_t* const min_separation = min_separations.data();
+		int64_t* const last_frame = last_frames.data();
+		float* const last_value = last_values.data();
+		int64_t* const count = counts.data();
+		for (size_t maximum = 0; maximum < maxima_count; ++maximum) {
+			const int64_t frame = maxima_frames[maximum];
+			const float value = maxima_values[maximum];
+			const float mean = maxima_means[maximum];
+			for (size_t slot = 0; slot < group_size; ++slot) {
+				// A peak past min separation starts a new marker; a stronger one
+				// within it moves the last marker, as in SelectPeaks.
+				const bool above = value > mean * multiplier[slot];
+				const bool separated = frame - last_frame[slot] >= min_separation[slot];
+				const bool take = above && separated;
+				const bool move = take || (above && value > last_value[slot]);
+				count[slot] += take ? 1 : 0;
+				last_frame[slot] = move ? frame : last_frame[slot];
+				last_value[slot] = move ? value : last_value[slot];
+			}
+		}
+
+		for (size_t slot = 0; slot < group_size; ++slot) {
+			SweepResult& result = results[order[group_begin + slot]];
+			result.peak_count = static_cast<size_t>(count[slot]);
+			result.peaks_per_minute = static_cast<double>(count[slot]) / minutes;
+		}
+		group_begin = group_end;
+	}
+	return true;
+}
+
+/* ---------------------------------------------------------- Overlay */
+ArenaSpan<const float> ThresholdCurve(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	float quantile,
+	const PeakPickingSpans& spans,
+	ScratchArena& arena)
+{
+	ArenaSpan<float> threshold = AllocateSpan<float>(arena, smoothed_flux.size());
+	if (threshold.size() != smoothed_flux.size()) {
+		return ArenaSpan<const float>();
+	}
+
+	const size_t threshold_window = static_cast<size_t>(std::max(spans.threshold_window, 1));
+	const bool use_quantile = spans.quantile_window > 0;
+	RollingQuantile rolling;
+	rolling.Reset(quantile, std::max<int64_t>(spans.quantile_window, 1));
+	for (size_t i = 0; i < smoothed_flux.size(); ++i) {
+		const float floor = use_quantile ? rolling.Estimate() : 0.0f;
+		if (use_quantile) {
+			rolling.Add(smoothed_flux[i]);
+		}
+		float mean = 0.0f;
+		threshold[i] = TrailingMean(smoothed_flux, i, threshold_window, mean) ?
+			std::max(mean * threshold_multiplier, floor) :
+			0.0f;
+	}
+	return threshold;
+}
+
+namespace {
+
+OverlayRange MergeRanges(const OverlayRange& a, const OverlayRange& b)
+{
+	if (!a.covered) {
+		return b;
+	}
+	if (!b.covered) {
+		return a;
+	}
+	OverlayRange merged;
+	merged.flux_min = std::min(a.flux_min, b.flux_min);
+	merged.flux_max = std::max(a.flux_max, b.flux_max);
+	merged.threshold_min = std::min(a.threshold_min, b.threshold_min);
+	merged.threshold_max = std::max(a.threshold_max, b.threshold_max);
+	merged.covered = true;
+	return merged;
+}
+
+} // namespace
+
+void OnsetOverlayPyramid::Clear()
+{
+	frames_per_second_ = 0.0;
+	levels_.clear();
+}
+
+int64_t OnsetOverlayPyramid::FrameCount() const
+{
+	return levels_.empty() ? 0 : static_cast<int64_t>(levels_[0].size());
+}
+
+float OnsetOverlayPyramid::MaxValue() const
+{
+	if (levels_.empty() || levels_.back().empty()) {
+		return 0.0f;
+	}
+	const OverlayRange& top = levels_.back()[0];
+	return std::max(top.flux_max, top.threshold_max);
+}
+
+float OnsetOverlayPyramid::MaxFlux() const
+{
+	return (levels_.empty() || levels_.back().empty()) ? 0.0f : levels_.back()[0].flux_max;
+}
+
+void OnsetOverlayPyramid::Assign(double frames_per_second,
+	int64_t first_frame,
+	const float* flux,
+	const float* threshold,
+	size_t count)
+{
+	if (frames_per_second != frames_per_second_) {
+		Clear();
+		frames_per_second_ = frames_per_second;
+	}
+	if (first_frame < 0 || count == 0) {
+		return;
+	}
+
+	const size_t first = static_cast<size_t>(first_frame);
+	const size_t end = first + count;
+	if (levels_.empty()) {
+		levels_.resize(1);
+	}
+	std::vector<OverlayRange>& base = levels_[0];
+	// Frames between the old end and first_frame are new too.
+	size_t dirty_first = std::min(first, base.size());
+	if (base.size() < end) {
+		OverlayRange silent;
+		silent.covered = true;
+		base.resize(end, silent);
+	}
+	for (size_t frame = first; frame < end; ++frame) {
+		OverlayRange& range = base[frame];
+		range.flux_min = range.flux_max = flux[frame - first];
+		range.threshold_min = range.threshold_max = threshold[frame - first];
+		range.covered = true;
+	}
+
+	// Each level halves the one below, down to a single entry; only the
+	// entries above the assigned frames are recomputed.
+	size_t dirty_end = end;
+	for (size_t level = 1; levels_[level - 1].size() > 1; ++level) {
+		if (levels_.size() <= level) {
+			levels_.resize(level + 1);
+		}
+		const std::vector<OverlayRange>& below = levels_[level - 1];
+		std::vector<OverlayRange>& above = levels_[level];
+		above.resize((below.size() + 1) / 2);
+		dirty_first /= 2;
+		dirty_end = (dirty_end + 1) / 2;
+		for (size_t index = dirty_first; index < dirty_end; ++index) {
+			const OverlayRange& left = below[index * 2];
+			above[index] = (index * 2 + 1 < below.size()) ? MergeRanges(left, below[index * 2 + 1]) : left;
+		}
+	}
+}
+
+void OnsetOverlayPyramid::Query(double first_frame,
+	double frames_per_column,
+	OverlayRange* ranges,
+	size_t column_count) const
+{
+	std::fill(ranges, ranges + column_count, OverlayRange());
+	if (levels_.empty() || !(frames_per_column > 0.0)) {
+		return;
+	}
+
+	size_t level = 0;
+	while (level + 1 < levels_.size() && static_cast<double>(size_t(1) << (level + 1)) <= frames_per_column) {
+		++level;
+	}
+	const std::vector<OverlayRange>& entries = levels_[level];
+	const double frame_count = static_cast<double>(levels_[0].size());
+
+	for (size_t column = 0; column < column_count; ++column) {
+		const double begin = first_frame + frames_per_column * static_cast<double>(column);
+		const double end = begin + frames_per_column;
+		if (end <= 0.0 || begin >= frame_count) {
+			continue;
+		}
+		const size_t first = static_cast<size_t>(std::max(0.0, std::floor(begin)));
+		const size_t last = static_cast<size_t>(std::min(frame_count, std::ceil(end))) - 1;
+		OverlayRange range;
+		for (size_t index = first >> level; index <= (last >> level) && index < entries.size(); ++index) {
+			range = MergeRanges(range, entries[index]);
+		}
+		ranges[column] = range;
+	}
+}
+
+void OnsetOverlayPyramid::SampleFlux(double first_frame,
+	double frames_per_value,
+	float* values,
+	size_t value_count) const
+{
+	std::fill(values, values + value_count, 0.0f);
+	if (levels_.empty() || !(frames_per_value > 0.0)) {
+		return;
+	}
+
+	const std::vector<OverlayRange>& frames = levels_[0];
+	const double frame_count = static_cast<double>(frames.size());
+	for (size_t index = 0; index < value_count; ++index) {
+		const double begin = first_frame + frames_per_value * static_cast<double>(index);
+		const double end = begin + frames_per_value;
+		if (end <= 0.0 || begin >= frame_count) {
+			continue;
+		}
+		const size_t first = static_cast<size_t>(std::max(0.0, std::floor(begin)));
+		const size_t last = static_cast<size_t>(std::min(frame_count, std::ceil(end)));
+		float peak = 0.0f;
+		for (size_t frame = first; frame < last; ++frame) {
+			peak = std::max(peak, frames[frame].flux_max);
+		}
+		values[index] = peak;
+	}
+}
+
+/* ----------------------------------------------------------- Tempo */
+BeatGrid TrackBeatGrid(ArenaSpan<const float> flux, double frames_per_second, ScratchArena& arena)
+{
+	BeatGrid grid;
+	const ArenaSpan<float> onset = NormalizeOnsetEnvelope(flux, arena);
+	const size_t max_lag = static_cast<size_t>(std::ceil(frames_per_second * 60.0 / kMinTempoBpm)) + 1;
+	const ArenaSpan<const float> autocorrelation = AutocorrelateOnsets(onset, max_lag, arena);
+	const double beat_period = EstimateBeatPeriod(autocorrelation, frames_per_second);
+	if (beat_period <= 0.0) {
+		return grid;
+	}
+
+	grid.beat_frames = TrackBeats(onset, beat_period, arena);
+
+	// Report the tempo of the tracked grid rather than the raw lag so the BPM
+	// reflects the beats that will actually be written.
+	double grid_period = beat_period;
+	if (grid.beat_frames.size() >= 2) {
+		grid_period = static_cast<double>(grid.beat_frames[grid.beat_frames.size() - 1] - grid.beat_frames[0]) /
+			static_cast<double>(grid.beat_frames.size() - 1);
+	}
+	grid.tempo_bpm = 60.0 * frames_per_second / grid_period;
+	return grid;
+}
+
+/* ------------------------------------------- StreamingOnsetDetector */
+bool StreamingOnsetDetector::Initialize(const StreamingDetectorSettings& settings)
+{
+	arena_.Reset();
+	if (settings.sample_rate <= 0.0 ||
+		!builder_.Initialize(arena_,
+			OnsetGeometry(),
+			settings.onset_function,
+			settings.sample_rate,
+			settings.low_crossover_hz,
+			settings.high_crossover_hz,
+			0)) {
+		return false;
+	}
+	queue_ = AllocateSpan<StreamingOnset>(arena_, std::max<size_t>(settings.queue_capacity, 1));
+	if (queue_.empty()) {
+		return false;
+	}
+
+	const double frames_per_second = settings.sample_rate / static_cast<double>(kHopSize);
+	radius_ = SmoothingRadius(settings.smoothing_percent);
+	threshold_multiplier_ = settings.threshold_multiplier;
+	min_separation_frames_ = std::max<int64_t>(1,
+		static_cast<int64_t>(std::ceil(settings.min_separation_seconds * frames_per_second)));
+	peak_decay_ = (settings.normalization_half_life_seconds > 0.0) ?
+		std::pow(0.5, 1.0 / (settings.normalization_half_life_seconds * frames_per_second)) :
+		0.0;
+
+	queue_head_ = 0;
+	queue_count_ = 0;
+	dropped_onsets_ = 0;
+	running_peak_ = 0.0;
+	std::fill(std::begin(raw_history_), std::end(raw_history_), 0.0f);
+	std::fill(std::begin(smoothed_history_), std::end(smoothed_history_), 0.0f);
+	previous_smoothed_ = 0.0f;
+	current_smoothed_ = 0.0f;
+	frames_seen_ = 0;
+	last_onset_frame_ = -1;
+	return true;
+}
+
+void StreamingOnsetDetector::Push(const float* mono, size_t count)
+{
+	// Feed the builder at most one frame's worth at a time so every analyzed
+	// frame is observed as it is produced.
+	while (count > 0) {
+		const size_t take = std::min(count, builder_.SamplesUntilFrame());
+		const int64_t frames_before = builder_.FramesAnalyzed();
+		builder_.Push(mono, take);
+		mono += take;
+		count -= take;
+		if (builder_.FramesAnalyzed() != frames_before) {
+			ProcessFrame(builder_.LastFlux());
+		}
+	}
+}
+
+size_t StreamingOnsetDetector::Poll(StreamingOnset* onsets, size_t capacity)
+{
+	size_t written = 0;
+	while (written < capacity && queue_count_ > 0) {
+		onsets[written++] = queue_[queue_head_];
+		queue_head_ = (queue_head_ + 1) % queue_.size();
+		--queue_count_;
+	}
+	return written;
+}
+
+int64_t StreamingOnsetDetector::LatencySamples() const
+{
+	return static_cast<int64_t>(kFFTSize) + static_cast<int64_t>(radius_ + 1) * kHopSize;
+}
+
+// The trailing average of the last 2 * radius + 1 raw values is the offline
+// centred average of the frame radius steps back, so smoothed frame j becomes
+// known with raw frame j + radius. Frame k is then judged once frame k + 1 is
+// smoothed, with the same threshold and local-maximum rules as SelectPeaks.
+void StreamingOnsetDetector::ProcessFrame(float flux)
+{
+	const int64_t span = 2 * static_cast<int64_t>(radius_) + 1;
+	const int64_t frame = frames_seen_++;
+	raw_history_[static_cast<size_t>(frame % span)] = flux;
+
+	const int64_t smoothed_index = frame - radius_;
+	if (smoothed_index < 0) {
+		return;
+	}
+	const int64_t filled = std::min(frame + 1, span);
+	float sum = 0.0f;
+	for (int64_t i = 0; i < filled; ++i) {
+		sum += raw_history_[static_cast<size_t>(i)];
+	}
+	const float next_smoothed = sum / static_cast<float>(filled);
+
+	if (smoothed_index >= 1) {
+		const int64_t candidate = smoothed_index - 1;
+		const float value = current_smoothed_;
+		running_peak_ = std::max(static_cast<double>(value), running_peak_ * peak_decay_);
+
+		const int64_t history = std::min<int64_t>(candidate, kThresholdWindow);
+		if (history > 0) {
+			float mean = 0.0f;
+			for (int64_t i = 1; i <= history; ++i) {
+				mean += smoothed_history_[static_cast<size_t>((candidate - i) % kThresholdWindow)];
+			}
+			mean /= static_cast<float>(history);
+
+			const bool is_local_max = (value > previous_smoothed_) && (value >= next_smoothed);
+			const bool separated = (last_onset_frame_ < 0) || (candidate - last_onset_frame_ >= min_separation_frames_);
+			if (is_local_max && value > mean * threshold_multiplier_ && separated) {
+				last_onset_frame_ = candidate;
+				if (queue_count_ == queue_.size()) {
+					++dropped_onsets_;
+				}
+				else {
+					StreamingOnset& onset = queue_[(queue_head_ + queue_count_) % queue_.size()];
+					onset.sample_position = candidate * kHopSize;
+					onset.strength = value;
+					onset.amplitude = (running_peak_ > 0.0) ? static_cast<float>(value / running_peak_) : 0.0f;
+					++queue_count_;
+				}
+			}
+		}
+		smoothed_history_[static_cast<size_t>(candidate % kThresholdWindow)] = value;
+	}
+
+	previous_smoothed_ = current_smoothed_;
+	current_smoothed_ = next_smoothed;
+}
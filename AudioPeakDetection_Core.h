@@ -0,0 +1,829 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#pragma once
+
+#ifndef AUDIO_PEAK_DETECTION_CORE_H
+#define AUDIO_PEAK_DETECTION_CORE_H
+
+/*
+ Host-independent detection core: downmix, STFT onset curves, peak picking and
+ tempo tracking. Nothing in here includes the AE SDK. Sample positions and
+ frame indices are 64-bit throughout; the plug-in converts to A_long / A_Time
+ only where it talks to the host.
+*/
+
+#include "AudioPeakDetection_Arena.h"
+#include "kiss_fftr.h"
+#include "kiss_fftr_q15.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// STFT of the Standard quality. The threshold window and smoothing radius are
+// in frames of this STFT at kStandardSampleRate; other geometries scale them to
+// the same span in seconds (see PeakPickingSpansFor).
+constexpr int kFFTSize = 2048;
+constexpr int kHopSize = kFFTSize / 2;
+constexpr double kStandardSampleRate = 44100.0;
+constexpr int kThresholdWindow = 8;
+constexpr int kMaxSmoothingRadius = 10;
+// Frames whose value depends on earlier spectra (the complex-domain ODF looks
+// two frames back); after a seek they are recomputed rather than stored.
+constexpr int kOnsetWarmupFrames = 2;
+
+// Band indices follow AudioPeakDetection_BAND_LOW / MID / HIGH. The count is
+// fixed per build: each band edge is an effect parameter, and an effect's
+// parameter list is declared once in ParamsSetup, so a fourth band needs a
+// third crossover parameter and disk id, a marker label, and room in
+// PackSpectralShape (which stores two band shares and derives the third).
+constexpr int kOnsetBandCount = 3;
+
+// Values follow the AudioPeakDetection_ODF_* popup entries.
+enum OnsetFunction {
+	kOnsetSpectralFlux = 1,
+	kOnsetLogFlux,
+	kOnsetHighFrequencyContent,
+	kOnsetComplexDomain,
+	kOnsetEnergyEnvelope
+};
+
+enum SampleEncoding {
+	kSampleUnknown = 0,
+	kSampleFloat32,
+	kSampleInt16,
+	kSampleInt8
+};
+
+/*
+ Spectral shape of one STFT frame, taken from the bins that give its onset
+ value: centroid and 85% rolloff in Hz, flatness (geometric over arithmetic
+ mean of the bin powers, near 0 for a tone and near 1 for white noise) and
+ each band's share of the frame's power. All zero for a silent frame.
+*/
+struct SpectralShape {
+	float centroid_hz = 0.0f;
+	float rolloff_hz = 0.0f;
+	float flatness = 0.0f;
+	float band_energy_ratio[kOnsetBandCount] = {};
+};
+
+constexpr float kSpectralRolloffFraction = 0.85f;
+
+/*
+ Which frames become peaks is only known once a whole curve is smoothed,
+ and stored curves are re-picked with other thresholds, so the curves carry
+ every frame's shape packed into 64 bits: centroid and rolloff as 16-bit
+ fractions of Nyquist, flatness and the low and mid ratios in 10 bits each.
+ It is unpacked only at the frames that are marked.
+*/
+uint64_t PackSpectralShape(const SpectralShape& shape, double sample_rate);
+SpectralShape UnpackSpectralShape(uint64_t packed, double sample_rate);
+
+// Coarse kind of sound behind an onset, read from its spectral shape.
+enum OnsetSoundType {
+	kSoundLowHit = 0, // kick, floor tom, bass notes
+	kSoundNoisyHit,   // snare, clap
+	kSoundHighHit,    // hi-hat, cymbal, shaker
+	kSoundTonal       // voice, melodic instruments
+};
+
+OnsetSoundType ClassifySpectralShape(const SpectralShape& shape);
+
+/*
+ Arithmetic of the STFT and the detection function. kOnsetFixedQ15 keeps
+ each frame in 16-bit fixed point from the downmix to the spectrum: a Q15
+ Hann window, the kiss_fftr_q15 transform, and for spectral flux integer
+ magnitudes and flux. Each windowed frame is shifted up to full scale before
+ the transform (block floating point), so quiet passages keep their
+ precision through its per-stage scaling. Curves come out in the units of
+ the float path; see README.md for how closely they follow it.
+*/
+enum OnsetArithmetic {
+	kOnsetFloat = 0,
+	kOnsetFixedQ15
+};
+
+/*
+ Frame length and hop of an STFT. Frame positions follow from the hop alone,
+ so everything that stores or compares onset frames keys on the geometry as
+ well as on the rate.
+*/
+struct OnsetGeometry {
+	int fft_size = kFFTSize;
+	int hop_size = kHopSize;
+
+	bool operator==(const OnsetGeometry& other) const
+	{
+		return fft_size == other.fft_size && hop_size == other.hop_size;
+	}
+	bool operator!=(const OnsetGeometry& other) const { return !(*this == other); }
+};
+
+// Even FFT sizes from 16 to 16384 samples, hops from 1 sample to a whole frame.
+bool IsValidGeometry(const OnsetGeometry& geometry);
+
+// Number of STFT frames produced by sample_count samples.
+int64_t OnsetFrameCount(int64_t sample_count, const OnsetGeometry& geometry);
+
+// Start of an STFT frame in seconds.
+double OnsetFrameSeconds(int64_t frame_index, double sample_rate, const OnsetGeometry& geometry);
+
+double OnsetFramesPerSecond(double sample_rate, const OnsetGeometry& geometry);
+
+/*
+ Hosts such as After Effects address time in 32-bit ticks of a time scale.
+ Past max_ticks both conversions coarsen the scale instead of clamping the
+ value, so multi-hour layers at high sample rates stay addressable.
+*/
+struct TickRange {
+	int64_t first_tick = 0;
+	int64_t tick_count = 0;
+	uint32_t ticks_per_second = 1;
+};
+
+// count samples from first_sample on. Ticks are samples while they fit; past
+// that the scale drops to the finest divisor of the rate that fits and still
+// lands exactly on first_sample, and the count is rounded up to whole ticks.
+// Returns false when no scale does.
+bool SampleRangeToTicks(int64_t first_sample,
+	int64_t count,
+	uint32_t samples_per_second,
+	int64_t max_ticks,
+	TickRange& range);
+
+// Ticks of time_scale in seconds, halving time_scale until they fit.
+int64_t SecondsToTicks(double seconds, uint32_t& time_scale, int64_t max_ticks);
+
+// Averages frame_count interleaved frames into mono. Unknown encodings give
+// silence, matching how the plug-in has always treated unsupported formats.
+void DownmixToMono(const void* interleaved,
+	SampleEncoding encoding,
+	int channel_count,
+	size_t frame_count,
+	float* mono);
+
+kiss_fftr_cfg AllocateFftConfig(ScratchArena& arena, int nfft, int inverse_fft);
+
+// Forward real FFT of nfft points whose twiddles are shared by every caller in
+// the process; only the transform's work buffer comes from the arena. The
+// plan of each size is built on first use and kept until the plug-in unloads.
+kiss_fftr_cfg AllocateSharedFftConfig(ScratchArena& arena, int nfft);
+
+// Hann window of fft_size points, built once per size like the shared plans.
+ArenaSpan<const float> SharedHannWindow(int fft_size);
+
+// The Q15 counterparts of the two above, built on first use.
+kiss_fftr_q15_cfg AllocateSharedQ15FftConfig(ScratchArena& arena, int nfft);
+ArenaSpan<const int16_t> SharedQ15HannWindow(int fft_size);
+
+/*
+ Constant-Q pitch kernel after Brown and Puckette: one complex value per
+ equal-tempered semitone from each frame's STFT, without another transform.
+ The temporal kernel of a pitch is a Hann window kPitchQ periods long (cut to
+ the frame) centred in the frame and modulated to the pitch; its spectrum is
+ computed once, and by Parseval the pitch's value is the dot product of that
+ spectrum with the frame's. The product of the two windows is the pitch's
+ effective window, so pitches whose kernel fills the frame (below about
+ Q * sample_rate / fft_size, F#4 for the Standard STFT) get the frame's own
+ resolution: one note still peaks on its semitone, two notes a few
+ semitones apart there blur together.
+
+ Kernel spectra are concentrated around their pitch, so entries below
+ kPitchKernelThreshold of each row's largest are dropped. What is left of a
+ row is stored as a single run of bins: CSR whose column indices reduce to
+ each row's first bin. Every row is then a plain dot product over
+ interleaved floats in lanes of four, which any vector unit can take.
+ The weights are kept twice, as (re, -im) and (im, re) pairs, so the real
+ and imaginary parts are two such dot products with no shuffles.
+*/
+constexpr int kPitchLowestNote = 36; // MIDI C2, 65.4 Hz
+constexpr int kPitchCount = 72;      // six octaves, C2 to B7
+constexpr int kPitchClassCount = 12;
+constexpr double kPitchQ = 16.817;   // 1 / (2^(1/12) - 1)
+constexpr float kPitchKernelThreshold = 0.01f;
+
+struct PitchKernel {
+	// Pitches below 0.45 of the sample rate, at most kPitchCount.
+	int pitch_count = 0;
+	int fft_size = 0;
+	// Row p holds floats [row_start[p], row_start[p + 1]) of both weight
+	// arrays, for bins from first_bin[p] on.
+	std::vector<int> row_start;
+	std::vector<int> first_bin;
+	std::vector<float> real_weights;
+	std::vector<float> imag_weights;
+
+	size_t NonzeroBins() const { return real_weights.size() / 2; }
+};
+
+double PitchFrequency(int note);
+
+// Kernel of one frame size and rate, built on first use like the FFT plans.
+const PitchKernel* SharedPitchKernel(int fft_size, double sample_rate);
+
+// magnitude[p] = |constant-Q value| of pitch p, for kernel.pitch_count
+// pitches, from the fft_size / 2 + 1 bins of a Hann-windowed frame. A sine
+// of amplitude 1 on a pitch reads 0.5.
+void ApplyPitchKernel(const PitchKernel& kernel, const kiss_fft_cpx* spectrum, float* magnitude);
+
+/*
+ OnsetCurveBuilder turns a mono stream into the broadband and per-band onset
+ curves one hop at a time. Samples can be pushed in pieces of any size (one
+ host checkout window at a time), so the whole layer never has to be resident;
+ only one frame of samples is kept. All buffers come from the arena passed to
+ Initialize, apart from the FFT twiddles and window, which are shared by all
+ builders of the same frame size. Frames [frame_origin, frame_origin +
+ frame_capacity) are stored, so Flux()[0] is frame frame_origin; frames
+ outside that span are counted but not stored.
+
+ Seek() restarts the stream at any frame so unchanged or already known ranges
+ can be skipped; the caller then pushes from sample first_frame * hop_size
+ and frames before store_from_frame are analyzed only to warm up the ODF
+ history. StoreFrame() splices externally known frames into the curves.
+
+ Push() and PushPcm16() can be mixed and both work in either arithmetic;
+ a kOnsetFixedQ15 builder rounds float input to 16 bits and a float builder
+ scales PCM16 input by 1/32768, as DownmixToMono does.
+*/
+class OnsetCurveBuilder {
+public:
+	bool Initialize(ScratchArena& arena,
+		const OnsetGeometry& geometry,
+		int onset_function,
+		double sample_rate,
+		double low_crossover_hz,
+		double high_crossover_hz,
+		int64_t frame_capacity,
+		int64_t frame_origin = 0,
+		OnsetArithmetic arithmetic = kOnsetFloat);
+
+	void Push(const float* mono, size_t count);
+	// frame_count interleaved frames of channel_count channels, averaged.
+	void PushPcm16(const int16_t* interleaved, int channel_count, size_t frame_count);
+	void Seek(int64_t first_frame, int64_t store_from_frame);
+	void StoreFrame(int64_t frame, float flux, const float* band_flux, uint64_t shape);
+
+	int64_t SamplesPushed() const { return samples_pushed_; }
+	int64_t FramesAnalyzed() const { return frames_analyzed_; }
+	int64_t FrameOrigin() const { return frame_origin_; }
+	const OnsetGeometry& Geometry() const { return geometry_; }
+	// Stored frames, counted from FrameOrigin().
+	size_t FrameCount() const;
+
+	// Samples still needed before the next frame is analyzed.
+	size_t SamplesUntilFrame() const { return static_cast<size_t>(geometry_.fft_size) - frame_fill_; }
+	// Values of the most recent frame, stored or not.
+	float LastFlux() const { return last_flux_; }
+	const float* LastBandFlux() const { return last_band_flux_; }
+	uint64_t LastShape() const { return last_shape_; }
+
+	ArenaSpan<const float> Flux() const;
+	ArenaSpan<const float> BandFlux(int band) const;
+	// PackSpectralShape of every stored frame, at the builder's sample rate.
+	ArenaSpan<const uint64_t> Shapes() const;
+
+	// Adds per-pitch flux from SharedPitchKernel to every frame analyzed from
+	// now on; call after Initialize(). Frames stored with StoreFrame() keep 0.
+	bool EnablePitchFlux(ScratchArena& arena);
+	int PitchCount() const { return pitch_kernel_ ? pitch_kernel_->pitch_count : 0; }
+	// Rise of log(1 + kPitchGamma * magnitude) of pitch p (MIDI note
+	// kPitchLowestNote + p), kept only where both the rise and the level
+	// peak across pitch so a note does not also rise on the semitones its
+	// window leaks into.
+	ArenaSpan<const float> PitchFlux(int pitch) const;
+
+private:
+	typedef void (*FrameFunction)(OnsetCurveBuilder& builder);
+
+	template <typename Odf>
+	static void AnalyzeFrame(OnsetCurveBuilder& builder);
+	template <typename Odf>
+	static void AnalyzeFrameQ15(OnsetCurveBuilder& builder);
+	// Calls fill(offset, count) to write input [offset, offset + count) at
+	// the end of the current frame, and analyzes every frame it completes.
+	template <typename Fill>
+	void PushFrames(size_t count, const Fill& fill);
+	void FinishFrame(float flux, const float* band_flux, uint64_t shape);
+	void AnalyzePitches(const kiss_fft_cpx* spectrum);
+	// The fixed-point frames only reach the pitch stage through fft_out_.
+	void AnalyzePitchesQ15(float scale);
+
+	FrameFunction analyze_frame_ = nullptr;
+	OnsetArithmetic arithmetic_ = kOnsetFloat;
+	OnsetGeometry geometry_;
+	kiss_fftr_cfg cfg_ = nullptr;
+	kiss_fftr_q15_cfg cfg_q15_ = nullptr;
+	ArenaSpan<const float> window_;
+	ArenaSpan<const int16_t> window_q15_;
+	ArenaSpan<int> band_of_bin_;
+	ArenaSpan<float> frame_;
+	ArenaSpan<kiss_fft_scalar> fft_in_;
+	ArenaSpan<kiss_fft_cpx> fft_out_;
+	ArenaSpan<int16_t> frame_q15_;
+	ArenaSpan<int16_t> fft_in_q15_;
+	ArenaSpan<kiss_fft_q15_cpx> fft_out_q15_;
+	// Previous frame's magnitudes for the integer spectral flux, shifted by
+	// 15 minus the frame's block exponent so every frame has the same scale.
+	ArenaSpan<uint32_t> prev_magnitude_q15_;
+	ArenaSpan<float> prev_magnitude_;
+	ArenaSpan<kiss_fft_cpx> prev_phasor_;
+	ArenaSpan<kiss_fft_cpx> prev2_phasor_;
+	// Power of every bin of the current frame and one past the last bin of
+	// each band, for MeasureSpectralShape.
+	ArenaSpan<float> bin_power_;
+	int band_end_[kOnsetBandCount] = {};
+	ArenaSpan<float> flux_;
+	ArenaSpan<float> band_flux_[kOnsetBandCount];
+	ArenaSpan<uint64_t> shape_;
+	// Pitch stage, only set up by EnablePitchFlux(). pitch_flux_ holds one
+	// curve of flux_.size() frames per pitch.
+	const PitchKernel* pitch_kernel_ = nullptr;
+	ArenaSpan<float> pitch_value_;
+	ArenaSpan<float> prev_pitch_level_;
+	ArenaSpan<float> last_pitch_flux_;
+	ArenaSpan<float> pitch_flux_;
+	double sample_rate_ = 0.0;
+	size_t frame_fill_ = 0;
+	float last_flux_ = 0.0f;
+	float last_band_flux_[kOnsetBandCount] = {};
+	uint64_t last_shape_ = 0;
+	int64_t samples_pushed_ = 0;
+	int64_t frames_analyzed_ = 0;
+	int64_t store_from_ = 0;
+	int64_t frame_origin_ = 0;
+	int64_t frame_end_ = 0;
+};
+
+/*
+ One shard of a recording split across processes or machines. Shard
+ shard_index of shard_count owns an equal share [first_frame, end_frame) of
+ the OnsetFrameCount(sample_count) frames; together the shards own every
+ frame once. It reads samples [first_sample, end_sample): kOnsetWarmupFrames
+ hops before its first frame, so that frame has its full ODF history, up to
+ the end of its last window. A builder initialised with capacity
+ end_frame - first_frame and origin first_frame, then Seek(first_sample /
+ hop_size, first_frame), computes exactly the frames a single pass over the
+ whole recording would, so the shard curves laid end to end are the
+ single-pass curve and smoothing and peak picking over them match it.
+*/
+struct OnsetShard {
+	int64_t first_frame = 0;
+	int64_t end_frame = 0;
+	int64_t first_sample = 0;
+	int64_t end_sample = 0;
+};
+
+OnsetShard PlanOnsetShard(int64_t sample_count, const OnsetGeometry& geometry, int shard_index, int shard_count);
+
+/*
+ OnsetFluxCache collects onset frames from audio the host renders anyway
+ (playback, RAM preview, export). AddSamples() follows the render calls with
+ one continuous STFT stream; a call that does not continue where the last one
+ ended restarts the stream at the next hop boundary, and the first
+ kOnsetWarmupFrames frames after a restart are not trusted. Frames are only
+ comparable with an analysis that uses the same key, so Configure() drops
+ everything when the detection function, crossovers, rate or STFT geometry
+ change.
+*/
+struct OnsetCacheKey {
+	int onset_function = 0;
+	double sample_rate = 0.0;
+	double low_crossover_hz = 0.0;
+	double high_crossover_hz = 0.0;
+	OnsetGeometry geometry;
+
+	bool operator==(const OnsetCacheKey& other) const
+	{
+		return onset_function == other.onset_function && sample_rate == other.sample_rate &&
+			low_crossover_hz == other.low_crossover_hz && high_crossover_hz == other.high_crossover_hz &&
+			geometry == other.geometry;
+	}
+	bool operator!=(const OnsetCacheKey& other) const { return !(*this == other); }
+};
+
+class OnsetFluxCache {
+public:
+	bool Configure(const OnsetCacheKey& key, int64_t frame_count);
+	void Clear();
+
+	// Mono samples starting at absolute sample position first_sample.
+	void AddSamples(int64_t first_sample, const float* mono, size_t count);
+
+	const OnsetCacheKey& Key() const { return key_; }
+	int64_t FrameCapacity() const { return static_cast<int64_t>(valid_.size()); }
+	int64_t CoveredFrames() const { return covered_frames_; }
+	bool Covers(int64_t first_frame, int64_t end_frame) const;
+	// Copies frames [first_frame, end_frame) into the builder's curves.
+	void SpliceInto(OnsetCurveBuilder& builder, int64_t first_frame, int64_t end_frame) const;
+
+	// Mono scratch the caller can downmix render buffers into.
+	std::vector<float>& MonoScratch() { return mono_scratch_; }
+
+private:
+	ScratchArena arena_;
+	OnsetCurveBuilder stream_;
+	bool stream_ready_ = false;
+	OnsetCacheKey key_;
+	std::vector<float> flux_;
+	std::vector<float> band_flux_;
+	std::vector<uint64_t> shape_;
+	std::vector<unsigned char> valid_;
+	std::vector<float> mono_scratch_;
+	int64_t next_sample_ = -1;
+	int64_t trusted_from_frame_ = 0;
+	int64_t covered_frames_ = 0;
+};
+
+/*
+ OnsetCurveStore keeps the onset curves of the last whole-layer analysis with
+ a content hash of every kContentBlockSamples block of mono input. A pass
+ pushes the layer from sample 0 through Push(); when the key matches, the
+ stored frames are copied into the builder first and only blocks whose hash
+ changed are run through the STFT again, together with the frames that
+ overlap their edges and kOnsetWarmupFrames of ODF history on either side.
+ Unchanged audio is hashed but never transformed, so trimming or replacing a
+ few seconds of a long layer costs an FFT pass over those seconds.
+
+ Hashes are positional: audio inserted or removed shifts every later block
+ and marks it changed. Blocks are longer than the history a frame of any
+ valid geometry needs, so a restart only reaches back into the block before.
+*/
+constexpr int64_t kContentBlockSamples = 128 * static_cast<int64_t>(kHopSize);
+
+class OnsetCurveStore {
+public:
+	// builder must already be initialized for the pass (origin 0) and is used
+	// until FinishPass().
+	bool BeginPass(ScratchArena& arena,
+		OnsetCurveBuilder& builder,
+		const OnsetCacheKey& key,
+		int64_t sample_count);
+	void Push(const float* mono, size_t count);
+	// Flushes the last block and keeps the pass's curves and hashes.
+	void FinishPass();
+	void Clear();
+
+	bool HasCurves() const { return !block_hashes_.empty(); }
+	const OnsetCacheKey& Key() const { return key_; }
+	// Whole-layer onset curve of the last pass.
+	ArenaSpan<const float> Flux() const { return ArenaSpan<const float>{ flux_.data(), flux_.size() }; }
+	// Frames run through the STFT by the current or last pass.
+	int64_t RecomputedFrames() const { return recomputed_frames_; }
+
+private:
+	void ProcessBlock(size_t length);
+	void EndSegment();
+
+	OnsetCacheKey key_;
+	std::vector<uint64_t> block_hashes_;
+	std::vector<float> flux_;
+	std::vector<float> band_flux_;
+	std::vector<uint64_t> shape_;
+
+	OnsetCurveBuilder* builder_ = nullptr;
+	bool reuse_ = false;
+	std::vector<uint64_t> pass_hashes_;
+	OnsetCacheKey pass_key_;
+	// One frame and kOnsetWarmupFrames hops of the pass's geometry.
+	size_t history_samples_ = 0;
+	// History samples followed by the block being collected.
+	ArenaSpan<float> staging_;
+	size_t staged_ = 0;
+	int64_t block_index_ = 0;
+	bool streaming_ = false;
+	int64_t segment_first_frame_ = 0;
+	int64_t recomputed_frames_ = 0;
+};
+
+// Half-width in Standard frames of the moving average selected by a
+// Smoothing (%) value.
+int SmoothingRadius(float smoothing_percent);
+
+// Peak-picking spans in frames of one analysis. Min separation is set in
+// seconds; the smoothing radius and threshold window cover the time they
+// cover at the Standard frame rate. quantile_window is the look-back of the
+// rolling-quantile threshold (see SelectPeaksAboveQuantile), 0 when the
+// trailing mean sets the threshold.
+struct PeakPickingSpans {
+	int smoothing_radius = 0;
+	int threshold_window = kThresholdWindow;
+	int64_t min_separation = 1;
+	int64_t quantile_window = 0;
+};
+
+PeakPickingSpans PeakPickingSpansFor(float smoothing_percent, float min_separation_seconds, double frames_per_second);
+
+// Returns in_flux itself when radius is 0; otherwise the smoothed curve is
+// carved from the arena.
+ArenaSpan<const float> SmoothFlux(ArenaSpan<const float> in_flux,
+	int radius,
+	ScratchArena& arena);
+
+// Frames of onset curve beyond each end of a range that smoothing, the
+// adaptive threshold and min separation look at. Peak picking over a range
+// padded by these margins agrees with picking over the whole curve.
+int64_t PeakPickingLeadFrames(const PeakPickingSpans& spans);
+int64_t PeakPickingTailFrames(const PeakPickingSpans& spans);
+
+struct CandidatePeak {
+	int64_t frame_index = 0;
+	float flux_value = 0.0f;
+};
+
+ArenaSpan<CandidatePeak> AllocateCandidates(ScratchArena& arena, size_t frame_count);
+
+size_t SelectPeaks(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates);
+
+/*
+ P-square estimator (Jain and Chlamtac) of one quantile of a stream: five
+ marker heights are nudged towards their ideal positions by piecewise-
+ parabolic interpolation as values arrive, so memory and the cost of Add()
+ are constant however long the stream runs. Exact for the first five values.
+*/
+class P2Quantile {
+public:
+	void Reset(double quantile);
+	void Add(float value);
+	int64_t Count() const { return count_; }
+	// 0 before the first value.
+	float Estimate() const;
+
+private:
+	double quantile_ = 0.5;
+	int64_t count_ = 0;
+	double heights_[5] = {};
+	double positions_[5] = {};
+	double desired_[5] = {};
+	double increments_[5] = {};
+};
+
+/*
+ Quantile of roughly the last window_frames values of a stream, from
+ kRollingQuantileSketches P-square sketches restarted in turn every
+ window_frames / (kRollingQuantileSketches - 1) values. The oldest running
+ sketch answers, so the estimate covers between window_frames and
+ RollingQuantileReach(window_frames) values; until the first restart it
+ covers everything seen so far.
+*/
+constexpr int kRollingQuantileSketches = 4;
+
+int64_t RollingQuantileReach(int64_t window_frames);
+
+class RollingQuantile {
+public:
+	void Reset(double quantile, int64_t window_frames);
+	void Add(float value);
+	bool Empty() const { return frames_ == 0; }
+	float Estimate() const;
+
+private:
+	P2Quantile sketches_[kRollingQuantileSketches];
+	double quantile_ = 0.5;
+	int64_t stride_ = 1;
+	int64_t frames_ = 0;
+};
+
+// SelectPeaks with a floor under the adaptive threshold: a peak must also
+// rise above the given quantile (0..1) of the smoothed curve over the
+// spans.quantile_window frames before it. The floor follows the level of the
+// material, so the multiplier can stay low without small bumps in quiet
+// stretches passing. Same candidate bound, local-maximum and min-separation
+// rules.
+size_t SelectPeaksAboveQuantile(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	float quantile,
+	const PeakPickingSpans& spans,
+	ArenaSpan<CandidatePeak> candidates);
+
+// Moves candidates picked from a curve whose first entry is frame frame_origin
+// to absolute frame indices and drops those outside [first_frame, end_frame).
+// Returns the number kept.
+size_t ClipCandidates(ArenaSpan<CandidatePeak> candidates,
+	size_t candidate_count,
+	int64_t frame_origin,
+	int64_t first_frame,
+	int64_t end_frame);
+
+/*
+ Note onsets from a builder's pitch flux: each pitch's curve is smoothed and
+ picked like the broadband one, and onsets must also reach
+ kPitchOnsetFloor of the strongest smoothed pitch flux, since most pitches
+ are silent most of the time and a trailing mean of nothing passes any
+ bump. A note's harmonics rise with it, so an onset is taken for a
+ harmonic and dropped when the smoothed flux of the pitch 12, 19, 24, 28 or
+ 31 semitones below (harmonics 2 to 6) is at least as strong within a frame
+ of it, whether or not that pitch is picked itself. Onsets come out in time
+ order, lower notes first within a frame. Returns false when the arena runs
+ dry.
+*/
+constexpr float kPitchGamma = 10.0f;
+constexpr float kPitchOnsetFloor = 0.2f;
+
+struct PitchOnset {
+	int64_t frame_index = 0;
+	int note = 0; // MIDI
+	float strength = 0.0f;
+};
+
+bool SelectPitchOnsets(const OnsetCurveBuilder& builder,
+	float threshold_multiplier,
+	const PeakPickingSpans& spans,
+	ScratchArena& arena,
+	ArenaSpan<PitchOnset>& onsets);
+
+/*
+ Peak-picking sweep: counts the peaks SelectPeaks would pick from one onset
+ curve under each of a grid of settings, without picking them one by one.
+ Settings that land on the same smoothing radius share one smoothed curve,
+ one set of local maxima and their trailing threshold means. A single scan
+ over those maxima then advances the selection of every setting in the group
+ side by side, so the threshold and min separation cost one compare per
+ maximum and setting. Counts match SmoothFlux + SelectPeaks exactly.
+*/
+struct SweepSetting {
+	float threshold_multiplier = 1.5f;
+	float smoothing_percent = 30.0f;
+	float min_separation_seconds = 0.12f;
+};
+
+struct SweepResult {
+	size_t peak_count = 0;
+	double peaks_per_minute = 0.0;
+};
+
+// Fills results[i] for settings[i]. Returns false when the arena runs dry.
+bool SweepPeakPicking(ArenaSpan<const float> flux,
+	double frames_per_second,
+	const SweepSetting* settings,
+	size_t setting_count,
+	SweepResult* results,
+	ScratchArena& arena);
+
+// The adaptive threshold SelectPeaks applies at every frame of smoothed_flux,
+// or SelectPeaksAboveQuantile when spans.quantile_window is set; carved from
+// the arena. Frame 0, which has no threshold, gets 0.
+ArenaSpan<const float> ThresholdCurve(ArenaSpan<const float> smoothed_flux,
+	float threshold_multiplier,
+	float quantile,
+	const PeakPickingSpans& spans,
+	ScratchArena& arena);
+
+/*
+ Min/max mip pyramid of a smoothed onset curve and its adaptive threshold for
+ drawing. Level k holds the range of each run of 2^k frames. Query() answers
+ columns of any width from the finest level whose runs fit in a column, so a
+ column reads at most three entries and drawing costs the same for any zoom
+ of any layer. Assign() rewrites a span of frames and the entries above it,
+ so a range analysis only touches its own frames. SampleFlux() reads the
+ frames themselves, for keyframing the curve at another frame rate.
+*/
+struct OverlayRange {
+	float flux_min = 0.0f;
+	float flux_max = 0.0f;
+	float threshold_min = 0.0f;
+	float threshold_max = 0.0f;
+	bool covered = false;
+};
+
+class OnsetOverlayPyramid {
+public:
+	void Clear();
+	// Stores frames [first_frame, first_frame + count). A different frame rate
+	// than the stored frames' starts over; frames not yet assigned read as 0.
+	void Assign(double frames_per_second,
+		int64_t first_frame,
+		const float* flux,
+		const float* threshold,
+		size_t count);
+
+	bool Empty() const { return levels_.empty(); }
+	double FramesPerSecond() const { return frames_per_second_; }
+	int64_t FrameCount() const;
+	// Largest flux and threshold value of all frames.
+	float MaxValue() const;
+	// Largest flux value of all frames.
+	float MaxFlux() const;
+
+	// ranges[c] receives frames [first_frame + c * frames_per_column,
+	// first_frame + (c + 1) * frames_per_column); columns outside the curve
+	// are left uncovered.
+	void Query(double first_frame, double frames_per_column, OverlayRange* ranges, size_t column_count) const;
+	// values[i] receives the largest flux of the frames that overlap
+	// [first_frame + i * frames_per_value, first_frame + (i + 1) * frames_per_value),
+	// or 0 when none do, so a short transient survives any resampling.
+	void SampleFlux(double first_frame, double frames_per_value, float* values, size_t value_count) const;
+
+private:
+	double frames_per_second_ = 0.0;
+	std::vector<std::vector<OverlayRange>> levels_;
+};
+
+struct BeatGrid {
+	ArenaSpan<int64_t> beat_frames;
+	double tempo_bpm = 0.0;
+};
+
+// Estimates the tempo from the onset curve and lays a beat grid over it. An
+// empty grid means no periodicity was found (or the arena ran dry).
+BeatGrid TrackBeatGrid(ArenaSpan<const float> flux, double frames_per_second, ScratchArena& arena);
+
+/*
+ StreamingOnsetDetector follows live input: Push() feeds mono samples as they
+ arrive and Poll() hands back the onsets found so far. It always runs the
+ Standard STFT. Every buffer is carved in Initialize(), so Push() and Poll()
+ never allocate and can run on an audio callback thread (one thread at a
+ time; the detector is not internally locked).
+
+ Compared with the offline pass:
+ - Smoothing is the same moving average evaluated causally, so each smoothed
+   value is radius frames late.
+ - The local-maximum test needs one more frame.
+ - Min separation keeps the first onset of a burst instead of swapping in a
+   stronger one that follows, so nothing is ever retracted.
+ - Amplitude is normalised against a running peak that decays with
+   normalization_half_life_seconds instead of the maximum of the whole curve.
+
+ An onset stamped at sample position p is therefore reported once sample
+ p + LatencySamples() - 1 has been pushed.
+*/
+struct StreamingOnset {
+	int64_t sample_position = 0;
+	float strength = 0.0f;  // smoothed onset value
+	float amplitude = 0.0f; // strength relative to the running peak, 0..1
+};
+
+struct StreamingDetectorSettings {
+	int onset_function = kOnsetSpectralFlux;
+	double sample_rate = 44100.0;
+	double low_crossover_hz = 150.0;
+	double high_crossover_hz = 5000.0;
+	float min_separation_seconds = 0.12f;
+	float threshold_multiplier = 1.5f;
+	float smoothing_percent = 30.0f;
+	double normalization_half_life_seconds = 10.0;
+	size_t queue_capacity = 256;
+};
+
+class StreamingOnsetDetector {
+public:
+	bool Initialize(const StreamingDetectorSettings& settings);
+
+	void Push(const float* mono, size_t count);
+
+	// Moves up to capacity pending onsets into onsets, oldest first, and
+	// returns how many were written.
+	size_t Poll(StreamingOnset* onsets, size_t capacity);
+
+	int64_t LatencySamples() const;
+	// Onsets discarded because the queue was full when they were found.
+	int64_t DroppedOnsets() const { return dropped_onsets_; }
+	// Heap blocks taken by the detector's arena since Initialize() began.
+	size_t HeapAllocations() const { return arena_.HeapAllocations(); }
+
+private:
+	void ProcessFrame(float flux);
+
+	ScratchArena arena_;
+	OnsetCurveBuilder builder_;
+	ArenaSpan<StreamingOnset> queue_;
+	size_t queue_head_ = 0;
+	size_t queue_count_ = 0;
+	int64_t dropped_onsets_ = 0;
+
+	int radius_ = 0;
+	float threshold_multiplier_ = 1.5f;
+	int64_t min_separation_frames_ = 1;
+	double peak_decay_ = 1.0;
+	double running_peak_ = 0.0;
+
+	float raw_history_[2 * kMaxSmoothingRadius + 1] = {};
+	float smoothed_history_[kThresholdWindow] = {};
+	float previous_smoothed_ = 0.0f;
+	float current_smoothed_ = 0.0f;
+	int64_t frames_seen_ = 0;
+	int64_t last_onset_frame_ = -1;
+};
+
+#endif // AUDIO_PEAK_DETECTION_CORE_H
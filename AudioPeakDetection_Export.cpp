@@ -0,0 +1,438 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#include "AudioPeakDetection_Export.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+constexpr size_t kWriteBufferBytes = static_cast<size_t>(64) << 10;
+// Curve values pulled from the caller per call.
+constexpr size_t kFluxChunkValues = 1024;
+
+constexpr uint32_t kBinaryVersion = 1;
+constexpr long kBinaryOnsetCountOffset = 24;
+
+constexpr uint16_t kMidiTicksPerQuarter = 480;
+constexpr double kMidiDefaultBpm = 120.0;
+// Middle C on channel 1, held for 50 ms or until the next onset.
+constexpr uint8_t kMidiNoteOn = 0x90;
+constexpr uint8_t kMidiNoteOff = 0x80;
+constexpr uint8_t kMidiOnsetNote = 60;
+constexpr double kMidiNoteSeconds = 0.05;
+
+// Everything goes through one fixed buffer that is handed to fwrite when it
+// fills. Numbers are formatted with to_chars straight into it.
+class BufferedWriter {
+public:
+	explicit BufferedWriter(std::FILE* file)
+		: file_(file),
+		buffer_(kWriteBufferBytes)
+	{
+	}
+
+	void Write(const void* data, size_t size)
+	{
+		if (size > buffer_.size() - used_) {
+			Flush();
+			if (size > buffer_.size()) {
+				WriteThrough(data, size);
+				return;
+			}
+		}
+		std::memcpy(buffer_.data() + used_, data, size);
+		used_ += size;
+	}
+
+	void Text(const char* text) { Write(text, std::strlen(text)); }
+
+	void Character(char character)
+	{
+		if (used_ == buffer_.size()) {
+			Flush();
+		}
+		buffer_[used_++] = character;
+	}
+
+	void Integer(int64_t value)
+	{
+		char digits[24];
+		const std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+		Write(digits, static_cast<size_t>(result.ptr - digits));
+	}
+
+	void Fixed(double value, int precision)
+	{
+		char digits[64];
+		const std::to_chars_result result =
+			std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, precision);
+		if (result.ec == std::errc()) {
+			Write(digits, static_cast<size_t>(result.ptr - digits));
+		}
+		else {
+			Character('0');
+		}
+	}
+
+	void LittleEndian(uint64_t value, int bytes)
+	{
+		uint8_t encoded[8];
+		for (int index = 0; index < bytes; ++index) {
+			encoded[index] = static_cast<uint8_t>(value >> (8 * index));
+		}
+		Write(encoded, static_cast<size_t>(bytes));
+	}
+
+	void BigEndian(uint64_t value, int bytes)
+	{
+		uint8_t encoded[8];
+		for (int index = 0; index < bytes; ++index) {
+			encoded[index] = static_cast<uint8_t>(value >> (8 * (bytes - 1 - index)));
+		}
+		Write(encoded, static_cast<size_t>(bytes));
+	}
+
+	void Float32(float value)
+	{
+		uint32_t bits = 0;
+		std::memcpy(&bits, &value, sizeof(bits));
+		LittleEndian(bits, 4);
+	}
+
+	void Float64(double value)
+	{
+		uint64_t bits = 0;
+		std::memcpy(&bits, &value, sizeof(bits));
+		LittleEndian(bits, 8);
+	}
+
+	// Bytes written so far, buffered or not.
+	uint64_t Position() const { return written_ + used_; }
+
+	// Overwrites bytes already written at position (a length or count that
+	// is only known at the end) and returns to the end of the file.
+	void Patch(long position, const void* data, size_t size)
+	{
+		Flush();
+		if (failed_ || std::fseek(file_, position, SEEK_SET) != 0 ||
+			std::fwrite(data, 1, size, file_) != size ||
+			std::fseek(file_, 0, SEEK_END) != 0) {
+			failed_ = true;
+		}
+	}
+
+	bool Flush()
+	{
+		if (used_ > 0) {
+			WriteThrough(buffer_.data(), used_);
+			used_ = 0;
+		}
+		return !failed_;
+	}
+
+private:
+	void WriteThrough(const void* data, size_t size)
+	{
+		if (!failed_ && std::fwrite(data, 1, size, file_) != size) {
+			failed_ = true;
+		}
+		written_ += size;
+	}
+
+	std::FILE* file_ = nullptr;
+	std::vector<char> buffer_;
+	size_t used_ = 0;
+	uint64_t written_ = 0;
+	bool failed_ = false;
+};
+
+double SampleSeconds(int64_t sample, const ExportHeader& header)
+{
+	return (header.sample_rate > 0.0) ? static_cast<double>(sample) / header.sample_rate : 0.0;
+}
+
+// Pulls the whole curve from flux, handing each chunk and the index of its
+// first frame to write_chunk.
+template <typename WriteChunk>
+size_t ForEachFluxChunk(const ExportFluxSource& flux, WriteChunk write_chunk)
+{
+	if (!flux) {
+		return 0;
+	}
+	float values[kFluxChunkValues];
+	size_t frame = 0;
+	for (size_t count = flux(values, kFluxChunkValues); count > 0; count = flux(values, kFluxChunkValues)) {
+		write_chunk(values, std::min(count, kFluxChunkValues), frame);
+		frame += std::min(count, kFluxChunkValues);
+	}
+	return frame;
+}
+
+int64_t FluxFrameSample(size_t frame, const ExportHeader& header)
+{
+	if (header.flux_frames_per_second <= 0.0) {
+		return 0;
+	}
+	return static_cast<int64_t>(std::llround(static_cast<double>(frame) * header.sample_rate / header.flux_frames_per_second));
+}
+
+void WriteCsv(BufferedWriter& writer,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	const ExportFluxSource& flux,
+	ExportCounts& counts)
+{
+	writer.Text("type,seconds,sample,value,loud\n");
+	ExportOnset onset;
+	while (onsets(onset)) {
+		writer.Text("onset,");
+		writer.Fixed(SampleSeconds(onset.sample, header), 6);
+		writer.Character(',');
+		writer.Integer(onset.sample);
+		writer.Character(',');
+		writer.Fixed(onset.amplitude, 3);
+		writer.Text(onset.is_loud ? ",1\n" : ",0\n");
+		++counts.onsets;
+	}
+
+	counts.flux_frames = ForEachFluxChunk(flux, [&](const float* values, size_t count, size_t first_frame) {
+		for (size_t index = 0; index < count; ++index) {
+			const int64_t sample = FluxFrameSample(first_frame + index, header);
+			writer.Text("flux,");
+			writer.Fixed(SampleSeconds(sample, header), 6);
+			writer.Character(',');
+			writer.Integer(sample);
+			writer.Character(',');
+			writer.Fixed(values[index], 3);
+			writer.Text(",\n");
+		}
+	});
+}
+
+void WriteJson(BufferedWriter& writer,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	const ExportFluxSource& flux,
+	ExportCounts& counts)
+{
+	writer.Text("{\n\"sample_rate\": ");
+	writer.Fixed(header.sample_rate, 3);
+	writer.Text(",\n\"tempo_bpm\": ");
+	writer.Fixed(header.tempo_bpm, 3);
+	writer.Text(",\n\"onsets\": [");
+	ExportOnset onset;
+	while (onsets(onset)) {
+		writer.Text(counts.onsets > 0 ? ",\n{\"seconds\": " : "\n{\"seconds\": ");
+		writer.Fixed(SampleSeconds(onset.sample, header), 6);
+		writer.Text(", \"sample\": ");
+		writer.Integer(onset.sample);
+		writer.Text(", \"amplitude\": ");
+		writer.Fixed(onset.amplitude, 3);
+		writer.Text(onset.is_loud ? ", \"loud\": true}" : ", \"loud\": false}");
+		++counts.onsets;
+	}
+	writer.Text("\n]");
+
+	if (flux) {
+		writer.Text(",\n\"flux\": {\"frames_per_second\": ");
+		writer.Fixed(header.flux_frames_per_second, 6);
+		writer.Text(", \"values\": [");
+		counts.flux_frames = ForEachFluxChunk(flux, [&](const float* values, size_t count, size_t first_frame) {
+			for (size_t index = 0; index < count; ++index) {
+				if (first_frame + index > 0) {
+					writer.Character(',');
+				}
+				writer.Fixed(values[index], 3);
+			}
+			writer.Character('\n');
+		});
+		writer.Text("]}");
+	}
+	writer.Text("\n}\n");
+}
+
+void WriteBinary(BufferedWriter& writer,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	const ExportFluxSource& flux,
+	ExportCounts& counts)
+{
+	writer.Text("APKS");
+	writer.LittleEndian(kBinaryVersion, 4);
+	writer.Float64(header.sample_rate);
+	writer.Float64(header.flux_frames_per_second);
+	// Counts are patched in at the end.
+	writer.LittleEndian(0, 8);
+	writer.LittleEndian(0, 8);
+	writer.LittleEndian(0, 8);
+
+	ExportOnset onset;
+	while (onsets(onset)) {
+		writer.LittleEndian(static_cast<uint64_t>(onset.sample), 8);
+		writer.Float32(onset.amplitude);
+		++counts.onsets;
+	}
+	counts.flux_frames = ForEachFluxChunk(flux, [&](const float* values, size_t count, size_t /*first_frame*/) {
+		for (size_t index = 0; index < count; ++index) {
+			writer.Float32(values[index]);
+		}
+	});
+
+	uint8_t encoded[16];
+	for (int index = 0; index < 8; ++index) {
+		encoded[index] = static_cast<uint8_t>(static_cast<uint64_t>(counts.onsets) >> (8 * index));
+		encoded[8 + index] = static_cast<uint8_t>(static_cast<uint64_t>(counts.flux_frames) >> (8 * index));
+	}
+	writer.Patch(kBinaryOnsetCountOffset, encoded, sizeof(encoded));
+}
+
+void WriteVariableLength(BufferedWriter& writer, uint32_t value)
+{
+	uint8_t encoded[5];
+	int length = 0;
+	encoded[length++] = static_cast<uint8_t>(value & 0x7F);
+	while ((value >>= 7) > 0) {
+		encoded[length++] = static_cast<uint8_t>(0x80 | (value & 0x7F));
+	}
+	while (length > 0) {
+		writer.Character(static_cast<char>(encoded[--length]));
+	}
+}
+
+void WriteMidiEvent(BufferedWriter& writer, int64_t& last_tick, int64_t tick, uint8_t status, uint8_t velocity)
+{
+	tick = std::max(tick, last_tick);
+	WriteVariableLength(writer, static_cast<uint32_t>(std::min<int64_t>(tick - last_tick, 0x0FFFFFFF)));
+	last_tick = tick;
+	writer.Character(static_cast<char>(status));
+	writer.Character(static_cast<char>(kMidiOnsetNote));
+	writer.Character(static_cast<char>(velocity));
+}
+
+void WriteMidi(BufferedWriter& writer,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	ExportCounts& counts)
+{
+	const double bpm = (header.tempo_bpm > 0.0) ? header.tempo_bpm : kMidiDefaultBpm;
+	const double ticks_per_second = kMidiTicksPerQuarter * bpm / 60.0;
+	const int64_t note_ticks = std::max<int64_t>(1, std::llround(kMidiNoteSeconds * ticks_per_second));
+
+	writer.Text("MThd");
+	writer.BigEndian(6, 4);
+	writer.BigEndian(0, 2);
+	writer.BigEndian(1, 2);
+	writer.BigEndian(kMidiTicksPerQuarter, 2);
+	writer.Text("MTrk");
+	const uint64_t length_position = writer.Position();
+	writer.BigEndian(0, 4);
+	const uint64_t track_start = writer.Position();
+
+	// Set Tempo, in microseconds per quarter note.
+	writer.Character(0);
+	writer.Write("\xFF\x51\x03", 3);
+	writer.BigEndian(static_cast<uint64_t>(std::llround(60000000.0 / bpm)) & 0xFFFFFF, 3);
+
+	// Each note is released when the next onset arrives, or after its
+	// length, whichever comes first.
+	int64_t last_tick = 0;
+	int64_t held_tick = -1;
+	ExportOnset onset;
+	while (onsets(onset)) {
+		const int64_t tick = std::llround(SampleSeconds(onset.sample, header) * ticks_per_second);
+		if (held_tick >= 0) {
+			WriteMidiEvent(writer, last_tick, std::min(held_tick + note_ticks, tick), kMidiNoteOff, 0);
+		}
+		const int velocity = 1 + static_cast<int>(std::lround(std::min(std::max(onset.amplitude, 0.0f), 100.0f) * 1.26f));
+		WriteMidiEvent(writer, last_tick, tick, kMidiNoteOn, static_cast<uint8_t>(velocity));
+		held_tick = std::max(tick, last_tick);
+		++counts.onsets;
+	}
+	if (held_tick >= 0) {
+		WriteMidiEvent(writer, last_tick, held_tick + note_ticks, kMidiNoteOff, 0);
+	}
+
+	// End of Track.
+	writer.Character(0);
+	writer.Write("\xFF\x2F\x00", 3);
+
+	const uint64_t track_length = writer.Position() - track_start;
+	const uint8_t encoded[4] = {
+		static_cast<uint8_t>(track_length >> 24),
+		static_cast<uint8_t>(track_length >> 16),
+		static_cast<uint8_t>(track_length >> 8),
+		static_cast<uint8_t>(track_length)
+	};
+	writer.Patch(static_cast<long>(length_position), encoded, sizeof(encoded));
+}
+
+} // namespace
+
+bool WriteOnsetExport(std::FILE* file,
+	ExportFormat format,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	const ExportFluxSource& flux,
+	ExportCounts& counts)
+{
+	counts = ExportCounts();
+	if (!file || !onsets) {
+		return false;
+	}
+
+	BufferedWriter writer(file);
+	switch (format) {
+	case kExportCsv:
+		WriteCsv(writer, header, onsets, flux, counts);
+		break;
+	case kExportJson:
+		WriteJson(writer, header, onsets, flux, counts);
+		break;
+	case kExportBinary:
+		WriteBinary(writer, header, onsets, flux, counts);
+		break;
+	case kExportMidi:
+		WriteMidi(writer, header, onsets, counts);
+		break;
+	default:
+		return false;
+	}
+	return writer.Flush();
+}
+
+const char* ExportExtension(ExportFormat format)
+{
+	switch (format) {
+	case kExportJson:
+		return "json";
+	case kExportBinary:
+		return "bin";
+	case kExportMidi:
+		return "mid";
+	case kExportCsv:
+	default:
+		return "csv";
+	}
+}
@@ -0,0 +1,95 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#pragma once
+
+#ifndef AUDIO_PEAK_DETECTION_EXPORT_H
+#define AUDIO_PEAK_DETECTION_EXPORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+
+/*
+ Writes detected onsets, and optionally the onset curve, for tools outside
+ After Effects. Onsets and curve values are pulled from the caller one at a
+ time (or one chunk at a time) and pass through a fixed 64 KB buffer, so the
+ document is never held in memory whatever its length.
+
+ - CSV: one row per onset and per curve frame,
+   "type,seconds,sample,value,loud".
+ - JSON: {"sample_rate", "tempo_bpm", "onsets": [...], "flux": {...}}.
+ - Binary, little-endian: a 48-byte header ("APKS", u32 version 1,
+   f64 sample rate, f64 curve frames per second, u64 onset count,
+   u64 curve frame count, u64 reserved), then per onset an i64 sample
+   index and an f32 amplitude, then the curve as f32.
+ - Standard MIDI File, type 0: one note per onset, velocity from the
+   amplitude, at the detected tempo. It carries no curve.
+
+ Onsets must arrive in time order. Amplitudes and curve values are
+ percentages of the strongest onset, as on the markers.
+*/
+
+enum ExportFormat {
+	kExportCsv,
+	kExportJson,
+	kExportBinary,
+	kExportMidi
+};
+
+struct ExportOnset {
+	// Position at the analysis sample rate.
+	int64_t sample = 0;
+	float amplitude = 0.0f;
+	bool is_loud = false;
+};
+
+struct ExportHeader {
+	double sample_rate = 0.0;
+	// 0 when no tempo was found; the MIDI file then runs at 120 BPM.
+	double tempo_bpm = 0.0;
+	double flux_frames_per_second = 0.0;
+};
+
+// Fills onset with the next onset; false once there are no more.
+typedef std::function<bool(ExportOnset& onset)> ExportOnsetSource;
+// Fills up to capacity curve values in frame order and returns how many; 0
+// once the curve is done. Empty when the curve is not exported.
+typedef std::function<size_t(float* values, size_t capacity)> ExportFluxSource;
+
+struct ExportCounts {
+	size_t onsets = 0;
+	size_t flux_frames = 0;
+};
+
+// Writes the export to file, which must be open for binary writing; the
+// caller closes it. False on a write error.
+bool WriteOnsetExport(std::FILE* file,
+	ExportFormat format,
+	const ExportHeader& header,
+	const ExportOnsetSource& onsets,
+	const ExportFluxSource& flux,
+	ExportCounts& counts);
+
+// File name extension of format, without the dot.
+const char* ExportExtension(ExportFormat format);
+
+#endif // AUDIO_PEAK_DETECTION_EXPORT_H
@@ -0,0 +1,182 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/* Incorporated.                                                   */
+/*                                                                 */
+/*******************************************************************/
+
+#include "AudioPeakDetection.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <new>
+#include <random>
+#include <tuple>
+
+bool AnalysisResultKey::operator<(const AnalysisResultKey& other) const
+{
+	return std::tie(source_item_id, duration_ticks, time_scale, detection_function, min_separation,
+			threshold_multiplier, threshold_mode, threshold_percentile, percentile_window, smoothing,
+			low_crossover, high_crossover, fft_size, hop_size, analysis_rate) <
+		std::tie(other.source_item_id, other.duration_ticks, other.time_scale, other.detection_function,
+			other.min_separation, other.threshold_multiplier, other.threshold_mode, other.threshold_percentile,
+			other.percentile_window, other.smoothing, other.low_crossover, other.high_crossover,
+			other.fft_size, other.hop_size, other.analysis_rate);
+}
+
+namespace {
+
+A_u_long NewSession()
+{
+	A_u_long session = 0;
+	try {
+		std::random_device device;
+		session = static_cast<A_u_long>(device());
+	} catch (...) {
+	}
+	// Without a random device, the clock still differs between sessions.
+	session ^= static_cast<A_u_long>(std::chrono::steady_clock::now().time_since_epoch().count());
+	return session ? session : 1;
+}
+
+} // namespace
+
+AnalysisRegistry::AnalysisRegistry()
+	: session_(NewSession())
+{
+}
+
+bool OnsetSourceKey::operator<(const OnsetSourceKey& other) const
+{
+	return std::tie(source_item_id, onset.onset_function, onset.sample_rate, onset.low_crossover_hz,
+			onset.high_crossover_hz, onset.geometry.fft_size, onset.geometry.hop_size) <
+		std::tie(other.source_item_id, other.onset.onset_function, other.onset.sample_rate,
+			other.onset.low_crossover_hz, other.onset.high_crossover_hz, other.onset.geometry.fft_size,
+			other.onset.geometry.hop_size);
+}
+
+AnalysisRegistry& AnalysisRegistry::Get()
+{
+	static AnalysisRegistry registry;
+	return registry;
+}
+
+uint64_t AnalysisRegistry::Attach(PF_Handle handle, uint64_t instance_id, A_u_long session)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	// A project saved by another session carries ids that may belong to
+	// unrelated live instances here.
+	const auto existing = (session == session_) ? instances_.find(instance_id) : instances_.end();
+	if (existing != instances_.end() && existing->second.handle == handle) {
+		return instance_id;
+	}
+
+	Instance instance;
+	instance.handle = handle;
+	instance.state.reset(new (std::nothrow) AnalysisState());
+	if (!instance.state) {
+		return 0;
+	}
+	if (existing != instances_.end()) {
+		// A duplicated layer plays the same footage, so it can prime the
+		// original's flux cache before it is ever analyzed.
+		const AnalysisState& original = *existing->second.state;
+		instance.state->SetResults(original.Results());
+		instance.state->own_item_id = original.own_item_id.load();
+	}
+	const uint64_t id = next_id_++;
+	instances_.emplace(id, std::move(instance));
+	return id;
+}
+
+void AnalysisRegistry::Release(PF_Handle handle, uint64_t instance_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto existing = instances_.find(instance_id);
+	if (existing != instances_.end() && existing->second.handle == handle) {
+		instances_.erase(existing);
+	}
+	for (auto entry = results_.begin(); entry != results_.end();) {
+		entry = entry->second.expired() ? results_.erase(entry) : std::next(entry);
+	}
+	for (auto entry = curve_stores_.begin(); entry != curve_stores_.end();) {
+		entry = entry->second.expired() ? curve_stores_.erase(entry) : std::next(entry);
+	}
+	for (auto entry = flux_caches_.begin(); entry != flux_caches_.end();) {
+		entry = entry->second.expired() ? flux_caches_.erase(entry) : std::next(entry);
+	}
+}
+
+std::shared_ptr<AnalysisState> AnalysisRegistry::Find(uint64_t instance_id)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto existing = instances_.find(instance_id);
+	return (existing != instances_.end()) ? existing->second.state : nullptr;
+}
+
+std::shared_ptr<const AnalysisResults> AnalysisRegistry::FindResults(const AnalysisResultKey& key)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto entry = results_.find(key);
+	return (entry != results_.end()) ? entry->second.lock() : nullptr;
+}
+
+void AnalysisRegistry::PublishResults(const AnalysisResultKey& key, const std::shared_ptr<const AnalysisResults>& results)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	results_[key] = results;
+}
+
+std::shared_ptr<OnsetCurveStore> AnalysisRegistry::CurveStore(const OnsetSourceKey& key)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::weak_ptr<OnsetCurveStore>& entry = curve_stores_[key];
+	std::shared_ptr<OnsetCurveStore> store = entry.lock();
+	if (!store) {
+		store = std::make_shared<OnsetCurveStore>();
+		entry = store;
+	}
+	return store;
+}
+
+std::shared_ptr<SharedFluxCache> AnalysisRegistry::FindFluxCache(const OnsetSourceKey& key)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	const auto entry = flux_caches_.find(key);
+	return (entry != flux_caches_.end()) ? entry->second.lock() : nullptr;
+}
+
+std::shared_ptr<SharedFluxCache> AnalysisRegistry::PrepareFluxCache(const OnsetSourceKey& key, int64_t frame_count)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::weak_ptr<SharedFluxCache>& entry = flux_caches_[key];
+	std::shared_ptr<SharedFluxCache> shared = entry.lock();
+	if (!shared) {
+		shared = std::make_shared<SharedFluxCache>();
+		entry = shared;
+	}
+
+	// Layers of one item can differ in length; the cache only ever grows, so
+	// they do not clear it for each other.
+	std::lock_guard<std::mutex> cache_lock(shared->mutex);
+	OnsetFluxCache& cache = shared->cache;
+	if (cache.Key() == key.onset && cache.FrameCapacity() >= frame_count) {
+		return shared;
+	}
+	return cache.Configure(key.onset, std::max(cache.FrameCapacity(), frame_count)) ? shared : nullptr;
+}
@@ -36,6 +36,69 @@ TableString g_strs[StrID_NUMTYPES] = {
 	StrID_Min_Gap_Slider_Name,     "Min Peak Separation (sec)",
 	StrID_Threshold_Multiplier_Slider_Name, "Adaptive Threshold Multiplier",
 	StrID_Smoothing_Slider_Name, "Smoothing (%)",
+	StrID_Band_Group_Name,         "Band Settings",
+	StrID_Band_Markers_Checkbox_Name, "Band Markers",
+	StrID_Low_Crossover_Slider_Name, "Low/Mid Crossover (Hz)",
+	StrID_High_Crossover_Slider_Name, "Mid/High Crossover (Hz)",
+	StrID_Beat_Markers_Checkbox_Name, "Beat Grid Markers",
+	StrID_Detection_Function_Popup_Name, "Detection Function",
+	StrID_Detection_Function_Popup_Choices, "Spectral Flux|"
+										"Log Spectral Flux|"
+										"High Frequency Content|"
+										"Complex Domain|"
+										"Energy Envelope",
+	StrID_Range_Group_Name,        "Analysis Range",
+	StrID_Range_Popup_Name,        "Range",
+	StrID_Range_Popup_Choices,     "Entire Layer|"
+										"Work Area|"
+										"Layer In/Out|"
+										"Custom",
+	StrID_Range_Start_Slider_Name, "Range Start (sec)",
+	StrID_Range_End_Slider_Name,   "Range End (sec)",
+	StrID_Analyze_Comp_Button_Name, "Analyze Comp",
+	StrID_Quality_Group_Name,      "Analysis Quality",
+	StrID_Quality_Popup_Name,      "Quality",
+	StrID_Quality_Popup_Choices,   "Draft|"
+										"Standard|"
+										"Precise|"
+										"Custom",
+	StrID_FFT_Size_Popup_Name,     "FFT Size",
+	StrID_FFT_Size_Popup_Choices,  "512|"
+										"1024|"
+										"2048|"
+										"4096",
+	StrID_Overlap_Popup_Name,      "Overlap",
+	StrID_Overlap_Popup_Choices,   "50%|"
+										"75%|"
+										"87.5%",
+	StrID_Analysis_Rate_Popup_Name, "Analysis Rate",
+	StrID_Analysis_Rate_Popup_Choices, "22.05 kHz|"
+										"44.1 kHz|"
+										"48 kHz",
+	StrID_Target_Density_Slider_Name, "Target Density (peaks/min)",
+	StrID_Suggest_Button_Name,     "Suggest Settings",
+	StrID_Threshold_Mode_Popup_Name, "Threshold Mode",
+	StrID_Threshold_Mode_Popup_Choices, "Trailing Mean|"
+										"Rolling Percentile",
+	StrID_Threshold_Percentile_Slider_Name, "Threshold Percentile",
+	StrID_Percentile_Window_Slider_Name, "Percentile Window (sec)",
+	StrID_Overlay_Group_Name,      "Onset Overlay",
+	StrID_Show_Overlay_Checkbox_Name, "Show Overlay",
+	StrID_Overlay_Span_Slider_Name, "Overlay Span (sec)",
+	StrID_Onset_Strength_Slider_Name, "Onset Strength",
+	StrID_Keyframe_Button_Name,    "Keyframe Onset Strength",
+	StrID_Export_Group_Name,       "Export",
+	StrID_Export_Format_Popup_Name, "Export Format",
+	StrID_Export_Format_Popup_Choices, "CSV|"
+										"JSON|"
+										"Binary|"
+										"Standard MIDI File",
+	StrID_Export_Onset_Curve_Checkbox_Name, "Include Onset Curve",
+	StrID_Export_Button_Name,      "Export Peaks",
+	StrID_Marker_Labels_Popup_Name, "Marker Labels",
+	StrID_Marker_Labels_Popup_Choices, "Loudness|"
+										"Sound Type|"
+										"Brightness",
 };
 
 extern "C" {
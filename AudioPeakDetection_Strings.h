@@ -31,5 +31,45 @@ typedef enum {
 	StrID_Min_Gap_Slider_Name,
 	StrID_Threshold_Multiplier_Slider_Name,
 	StrID_Smoothing_Slider_Name,
+	StrID_Band_Group_Name,
+	StrID_Band_Markers_Checkbox_Name,
+	StrID_Low_Crossover_Slider_Name,
+	StrID_High_Crossover_Slider_Name,
+	StrID_Beat_Markers_Checkbox_Name,
+	StrID_Detection_Function_Popup_Name,
+	StrID_Detection_Function_Popup_Choices,
+	StrID_Range_Group_Name,
+	StrID_Range_Popup_Name,
+	StrID_Range_Popup_Choices,
+	StrID_Range_Start_Slider_Name,
+	StrID_Range_End_Slider_Name,
+	StrID_Analyze_Comp_Button_Name,
+	StrID_Quality_Group_Name,
+	StrID_Quality_Popup_Name,
+	StrID_Quality_Popup_Choices,
+	StrID_FFT_Size_Popup_Name,
+	StrID_FFT_Size_Popup_Choices,
+	StrID_Overlap_Popup_Name,
+	StrID_Overlap_Popup_Choices,
+	StrID_Analysis_Rate_Popup_Name,
+	StrID_Analysis_Rate_Popup_Choices,
+	StrID_Target_Density_Slider_Name,
+	StrID_Suggest_Button_Name,
+	StrID_Threshold_Mode_Popup_Name,
+	StrID_Threshold_Mode_Popup_Choices,
+	StrID_Threshold_Percentile_Slider_Name,
+	StrID_Percentile_Window_Slider_Name,
+	StrID_Overlay_Group_Name,
+	StrID_Show_Overlay_Checkbox_Name,
+	StrID_Overlay_Span_Slider_Name,
+	StrID_Onset_Strength_Slider_Name,
+	StrID_Keyframe_Button_Name,
+	StrID_Export_Group_Name,
+	StrID_Export_Format_Popup_Name,
+	StrID_Export_Format_Popup_Choices,
+	StrID_Export_Onset_Curve_Checkbox_Name,
+	StrID_Export_Button_Name,
+	StrID_Marker_Labels_Popup_Name,
+	StrID_Marker_Labels_Popup_Choices,
 	StrID_NUMTYPES
 } StrIDType;
@@ -28,9 +28,40 @@ struct kiss_fft_state{
     int nfft;
     int inverse;
     int factors[2*MAXFACTORS];
+    /* number of Stockham passes, 0 when kf_work recurses instead */
+    int stockham_stages;
+    /* per pass, the radix-1 twiddles of each butterfly side by side */
+    kiss_fft_cpx * stage_twiddles;
+    /* largest factor kf_bfly_generic handles, 0 when every factor is 2 to 5 */
+    int generic_radix;
+    /* work buffer of kiss_fft_stride, NULL in a plan that kiss_fftr places */
+    kiss_fft_cpx * work;
     kiss_fft_cpx twiddles[1];
 };
 
+/* Transforms of at least this many points whose factors are all 2, 3, 4 or 5
+   run as iterative Stockham passes instead of the recursive kf_work (see
+   kiss_fft_bench.c). Below it the recursion is as fast and its plans carry
+   a smaller work buffer. */
+#ifndef KISS_FFT_STOCKHAM_MIN_SIZE
+#define KISS_FFT_STOCKHAM_MIN_SIZE 32
+#endif
+
+/* Number of Stockham passes a transform of nfft points uses, or 0. */
+int kf_stockham_stages(int nfft);
+
+/* Points of work buffer kf_transform needs for nfft: nfft for the Stockham
+   passes, else room for kf_bfly_generic's largest factor, else 0. */
+int kf_scratch_points(int nfft);
+
+/* kiss_fft_alloc, leaving out the plan's own work buffer when with_work is
+   0, for plans that are only driven through kf_transform. */
+kiss_fft_cfg kf_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem,int with_work);
+
+/* kiss_fft_stride with a caller-supplied work buffer of
+   kf_scratch_points(st->nfft) points; fin and fout must differ. */
+void kf_transform(kiss_fft_cfg st,const kiss_fft_cpx *fin,kiss_fft_cpx *fout,int in_stride,kiss_fft_cpx *scratch);
+
 /*
   Explanation of macros dealing with complex math:
 
@@ -150,18 +181,83 @@ struct kiss_fft_state{
     KISS_FFT_DEBUG("%g + %gi\n",(double)((c)->r),(double)((c)->i))
 
 
-#ifdef KISS_FFT_USE_ALLOCA
-// define this to allow use of alloca instead of malloc for temporary buffers
-// Temporary buffers are used in two case:
-// 1. FFT sizes that have "bad" factors. i.e. not 2,3 and 5
-// 2. "in-place" FFTs.  Notice the quotes, since kissfft does not really do an in-place transform.
-#include <alloca.h>
-#define  KISS_FFT_TMP_ALLOC(nbytes) alloca(nbytes)
-#define  KISS_FFT_TMP_FREE(ptr)
+/*
+  Four-lane float vectors for loops over kiss_fft_cpx arrays, on SSE2 and
+  NEON in the default float build. A load splits four consecutive points into
+  a vector of real parts and one of imaginary parts; the _REV forms take
+  p[0], p[-1], p[-2], p[-3] into lanes 0..3 and store the same way, for loops
+  that walk an array from both ends. KISS_FFT_VECTOR is 0 where they are not
+  available, or when KISS_FFT_NO_VECTOR is defined.
+
+   KF_V4_LOAD( re, im, p )      : re, im = p[0..3]
+   KF_V4_LOAD_REV( re, im, p )  : re, im = p[0], p[-1], p[-2], p[-3]
+   KF_V4_STORE( p, re, im )     : p[0..3] = re, im
+   KF_V4_STORE_REV( p, re, im ) : p[0], p[-1], p[-2], p[-3] = re, im
+   KF_V4_LOADU( s )             : s[0..3] of a kiss_fft_scalar array
+   KF_V4_CMUL( mr, mi, ar, ai, br, bi ) : m = a*b, in C_MUL's order; m must
+                                  not alias a or b
+ * */
+#if !defined(KISS_FFT_NO_VECTOR) && defined(KISS_FFT_SCALAR_IS_FLOAT) && \
+    (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define KISS_FFT_VECTOR 1
+typedef __m128 kf_v4;
+#define KF_V4_ADD(a,b) _mm_add_ps(a,b)
+#define KF_V4_SUB(a,b) _mm_sub_ps(a,b)
+#define KF_V4_MUL(a,b) _mm_mul_ps(a,b)
+#define KF_V4_NEG(a) _mm_xor_ps(a,_mm_set1_ps(-0.0f))
+#define KF_V4_SET1(x) _mm_set1_ps(x)
+#define KF_V4_LOADU(s) _mm_loadu_ps(s)
+#define KF_V4_LOAD(re,im,p) \
+    do{ __m128 kf_lo_ = _mm_loadu_ps(&(p)[0].r), kf_hi_ = _mm_loadu_ps(&(p)[2].r); \
+        (re) = _mm_shuffle_ps(kf_lo_, kf_hi_, _MM_SHUFFLE(2,0,2,0)); \
+        (im) = _mm_shuffle_ps(kf_lo_, kf_hi_, _MM_SHUFFLE(3,1,3,1)); }while(0)
+#define KF_V4_LOAD_REV(re,im,p) \
+    do{ __m128 kf_lo_ = _mm_loadu_ps(&(p)[-3].r), kf_hi_ = _mm_loadu_ps(&(p)[-1].r); \
+        (re) = _mm_shuffle_ps(kf_hi_, kf_lo_, _MM_SHUFFLE(0,2,0,2)); \
+        (im) = _mm_shuffle_ps(kf_hi_, kf_lo_, _MM_SHUFFLE(1,3,1,3)); }while(0)
+#define KF_V4_STORE(p,re,im) \
+    do{ _mm_storeu_ps(&(p)[0].r, _mm_unpacklo_ps(re, im)); \
+        _mm_storeu_ps(&(p)[2].r, _mm_unpackhi_ps(re, im)); }while(0)
+#define KF_V4_STORE_REV(p,re,im) \
+    do{ __m128 kf_re_ = _mm_shuffle_ps(re, re, _MM_SHUFFLE(0,1,2,3)); \
+        __m128 kf_im_ = _mm_shuffle_ps(im, im, _MM_SHUFFLE(0,1,2,3)); \
+        _mm_storeu_ps(&(p)[-3].r, _mm_unpacklo_ps(kf_re_, kf_im_)); \
+        _mm_storeu_ps(&(p)[-1].r, _mm_unpackhi_ps(kf_re_, kf_im_)); }while(0)
+#elif !defined(KISS_FFT_NO_VECTOR) && defined(KISS_FFT_SCALAR_IS_FLOAT) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define KISS_FFT_VECTOR 1
+typedef float32x4_t kf_v4;
+#define KF_V4_ADD(a,b) vaddq_f32(a,b)
+#define KF_V4_SUB(a,b) vsubq_f32(a,b)
+#define KF_V4_MUL(a,b) vmulq_f32(a,b)
+#define KF_V4_NEG(a) vnegq_f32(a)
+#define KF_V4_SET1(x) vdupq_n_f32(x)
+#define KF_V4_LOADU(s) vld1q_f32(s)
+#define KF_V4_REVERSE(v) \
+    vcombine_f32(vget_high_f32(vrev64q_f32(v)), vget_low_f32(vrev64q_f32(v)))
+#define KF_V4_LOAD(re,im,p) \
+    do{ float32x4x2_t kf_v_ = vld2q_f32(&(p)[0].r); \
+        (re) = kf_v_.val[0]; (im) = kf_v_.val[1]; }while(0)
+#define KF_V4_LOAD_REV(re,im,p) \
+    do{ float32x4x2_t kf_v_ = vld2q_f32(&(p)[-3].r); \
+        (re) = KF_V4_REVERSE(kf_v_.val[0]); (im) = KF_V4_REVERSE(kf_v_.val[1]); }while(0)
+#define KF_V4_STORE(p,re,im) \
+    do{ float32x4x2_t kf_v_; kf_v_.val[0] = (re); kf_v_.val[1] = (im); \
+        vst2q_f32(&(p)[0].r, kf_v_); }while(0)
+#define KF_V4_STORE_REV(p,re,im) \
+    do{ float32x4x2_t kf_v_; kf_v_.val[0] = KF_V4_REVERSE(re); kf_v_.val[1] = KF_V4_REVERSE(im); \
+        vst2q_f32(&(p)[-3].r, kf_v_); }while(0)
 #else
-#define  KISS_FFT_TMP_ALLOC(nbytes) KISS_FFT_MALLOC(nbytes)
-#define  KISS_FFT_TMP_FREE(ptr) KISS_FFT_FREE(ptr)
+#define KISS_FFT_VECTOR 0
 #endif
 
+#if KISS_FFT_VECTOR
+#define KF_V4_CMUL(mr,mi,ar,ai,br,bi) \
+    do{ (mr) = KF_V4_SUB(KF_V4_MUL(ar,br), KF_V4_MUL(ai,bi)); \
+        (mi) = KF_V4_ADD(KF_V4_MUL(ar,bi), KF_V4_MUL(ai,br)); }while(0)
+#endif
+
+
 #endif /* _kiss_fft_guts_h */
 
@@ -188,13 +188,15 @@ static void kf_bfly5(
     }
 }
 
-/* perform the butterfly for one stage of a mixed radix FFT */
+/* perform the butterfly for one stage of a mixed radix FFT, gathering each
+   butterfly's p inputs into scratch */
 static void kf_bfly_generic(
         kiss_fft_cpx * Fout,
         const size_t fstride,
         const kiss_fft_cfg st,
         int m,
-        int p
+        int p,
+        kiss_fft_cpx * scratch
         )
 {
     int u,k,q1,q;
@@ -202,12 +204,6 @@ static void kf_bfly_generic(
     kiss_fft_cpx t;
     int Norig = st->nfft;
 
-    kiss_fft_cpx * scratch = (kiss_fft_cpx*)KISS_FFT_TMP_ALLOC(sizeof(kiss_fft_cpx)*p);
-    if (scratch == NULL){
-        KISS_FFT_ERROR("Memory allocation failed.");
-        return;
-    }
-
     for ( u=0; u<m; ++u ) {
         k=u;
         for ( q1=0 ; q1<p ; ++q1 ) {
@@ -229,7 +225,6 @@ static void kf_bfly_generic(
             k += m;
         }
     }
-    KISS_FFT_TMP_FREE(scratch);
 }
 
 static
@@ -239,7 +234,8 @@ void kf_work(
         const size_t fstride,
         int in_stride,
         int * factors,
-        const kiss_fft_cfg st
+        const kiss_fft_cfg st,
+        kiss_fft_cpx * scratch
         )
 {
     kiss_fft_cpx * Fout_beg=Fout;
@@ -254,10 +250,12 @@ void kf_work(
     {
         int k;
 
-        // execute the p different work units in different threads
+        // execute the p different work units in different threads,
+        // each with its own slice of the generic radix scratch
 #       pragma omp parallel for
         for (k=0;k<p;++k)
-            kf_work( Fout +k*m, f+ fstride*in_stride*k,fstride*p,in_stride,factors,st);
+            kf_work( Fout +k*m, f+ fstride*in_stride*k,fstride*p,in_stride,factors,st,
+                     scratch + k*st->generic_radix);
         // all threads have joined by this point
 
         switch (p) {
@@ -265,7 +263,7 @@ void kf_work(
             case 3: kf_bfly3(Fout,fstride,st,m); break;
             case 4: kf_bfly4(Fout,fstride,st,m); break;
             case 5: kf_bfly5(Fout,fstride,st,m); break;
-            default: kf_bfly_generic(Fout,fstride,st,m,p); break;
+            default: kf_bfly_generic(Fout,fstride,st,m,p,scratch); break;
         }
         return;
     }
@@ -282,7 +280,7 @@ void kf_work(
             // DFT of size m*p performed by doing
             // p instances of smaller DFTs of size m,
             // each one takes a decimated version of the input
-            kf_work( Fout , f, fstride*p, in_stride, factors,st);
+            kf_work( Fout , f, fstride*p, in_stride, factors,st,scratch);
             f += fstride*in_stride;
         }while( (Fout += m) != Fout_end );
     }
@@ -291,11 +289,317 @@ void kf_work(
 
     // recombine the p smaller DFTs
     switch (p) {
+        case 1: break; /* nfft == 1: the copy above is the transform, and
+                          the plan holds no scratch for kf_bfly_generic */
         case 2: kf_bfly2(Fout,fstride,st,m); break;
         case 3: kf_bfly3(Fout,fstride,st,m); break;
         case 4: kf_bfly4(Fout,fstride,st,m); break;
         case 5: kf_bfly5(Fout,fstride,st,m); break;
-        default: kf_bfly_generic(Fout,fstride,st,m,p); break;
+        default: kf_bfly_generic(Fout,fstride,st,m,p,scratch); break;
+    }
+}
+
+/*
+ Stockham autosort passes. A pass of radix p over sub-transforms of n points
+ at stride s reads x[q + s*(j + k*m)] and writes y[q + s*(p*j + k)], m = n/p,
+ so every pass streams through both buffers in order and the output comes
+ out sorted without a bit-reversal or a recursive descent. The passes
+ ping-pong between fout and a work buffer; the radix-1 twiddles of each
+ butterfly are stored next to each other in st->stage_twiddles.
+ */
+static void kf_stockham2(
+        const kiss_fft_cpx * x,
+        size_t xstride,
+        kiss_fft_cpx * y,
+        size_t m,
+        size_t s,
+        const kiss_fft_cpx * tw
+        )
+{
+    size_t j,q;
+    const size_t xm = s*m*xstride;
+    for (j=0;j<m;++j) {
+        const kiss_fft_cpx * x0 = x + j*s*xstride;
+        kiss_fft_cpx * y0 = y + 2*j*s;
+        for (q=0;q<s;++q) {
+            kiss_fft_cpx a0 = x0[q*xstride];
+            kiss_fft_cpx a1 = x0[q*xstride + xm];
+            kiss_fft_cpx t;
+            C_FIXDIV(a0,2); C_FIXDIV(a1,2);
+            C_ADD( y0[q] , a0 , a1 );
+            C_SUB( t , a0 , a1 );
+            C_MUL( y0[q+s] , t , tw[j] );
+        }
+    }
+}
+
+static void kf_stockham3(
+        const kiss_fft_cpx * x,
+        size_t xstride,
+        kiss_fft_cpx * y,
+        size_t m,
+        size_t s,
+        const kiss_fft_cpx * tw,
+        const kiss_fft_cfg st
+        )
+{
+    size_t j,q;
+    const size_t xm = s*m*xstride;
+    const kiss_fft_cpx epi3 = st->twiddles[st->nfft/3];
+    for (j=0;j<m;++j,tw+=2) {
+        const kiss_fft_cpx * x0 = x + j*s*xstride;
+        kiss_fft_cpx * y0 = y + 3*j*s;
+        q = 0;
+#if KISS_FFT_VECTOR
+        /* four butterflies at a time, all with the same twiddles */
+        if (xstride == 1) {
+            const kf_v4 w1r = KF_V4_SET1(tw[0].r), w1i = KF_V4_SET1(tw[0].i);
+            const kf_v4 w2r = KF_V4_SET1(tw[1].r), w2i = KF_V4_SET1(tw[1].i);
+            const kf_v4 e = KF_V4_SET1(epi3.i), half = KF_V4_SET1(.5f);
+            for (;q+4<=s;q+=4) {
+                kf_v4 a0r,a0i,a1r,a1i,a2r,a2i,sumr,sumi,difr,difi,midr,midi,br,bi,yr,yi;
+                KF_V4_LOAD(a0r,a0i,x0+q);
+                KF_V4_LOAD(a1r,a1i,x0+q+xm);
+                KF_V4_LOAD(a2r,a2i,x0+q+2*xm);
+
+                sumr = KF_V4_ADD(a1r,a2r); sumi = KF_V4_ADD(a1i,a2i);
+                difr = KF_V4_SUB(a1r,a2r); difi = KF_V4_SUB(a1i,a2i);
+                midr = KF_V4_SUB(a0r,KF_V4_MUL(sumr,half));
+                midi = KF_V4_SUB(a0i,KF_V4_MUL(sumi,half));
+                difr = KF_V4_MUL(difr,e); difi = KF_V4_MUL(difi,e);
+
+                KF_V4_STORE(y0+q,KF_V4_ADD(a0r,sumr),KF_V4_ADD(a0i,sumi));
+                br = KF_V4_SUB(midr,difi); bi = KF_V4_ADD(midi,difr);
+                KF_V4_CMUL(yr,yi,br,bi,w1r,w1i);
+                KF_V4_STORE(y0+q+s,yr,yi);
+                br = KF_V4_ADD(midr,difi); bi = KF_V4_SUB(midi,difr);
+                KF_V4_CMUL(yr,yi,br,bi,w2r,w2i);
+                KF_V4_STORE(y0+q+2*s,yr,yi);
+            }
+        }
+#endif
+        for (;q<s;++q) {
+            kiss_fft_cpx a0 = x0[q*xstride];
+            kiss_fft_cpx a1 = x0[q*xstride + xm];
+            kiss_fft_cpx a2 = x0[q*xstride + 2*xm];
+            kiss_fft_cpx sum,dif,mid,b;
+            C_FIXDIV(a0,3); C_FIXDIV(a1,3); C_FIXDIV(a2,3);
+
+            C_ADD(sum,a1,a2);
+            C_SUB(dif,a1,a2);
+            mid.r = a0.r - HALF_OF(sum.r);
+            mid.i = a0.i - HALF_OF(sum.i);
+            C_MULBYSCALAR( dif , epi3.i );
+
+            C_ADD(y0[q],a0,sum);
+            b.r = mid.r - dif.i;
+            b.i = mid.i + dif.r;
+            C_MUL(y0[q+s],b,tw[0]);
+            b.r = mid.r + dif.i;
+            b.i = mid.i - dif.r;
+            C_MUL(y0[q+2*s],b,tw[1]);
+        }
+    }
+}
+
+static void kf_stockham4(
+        const kiss_fft_cpx * x,
+        size_t xstride,
+        kiss_fft_cpx * y,
+        size_t m,
+        size_t s,
+        const kiss_fft_cpx * tw,
+        const kiss_fft_cfg st
+        )
+{
+    size_t j,q;
+    const size_t xm = s*m*xstride;
+    for (j=0;j<m;++j,tw+=3) {
+        const kiss_fft_cpx * x0 = x + j*s*xstride;
+        kiss_fft_cpx * y0 = y + 4*j*s;
+        for (q=0;q<s;++q) {
+            kiss_fft_cpx a0 = x0[q*xstride];
+            kiss_fft_cpx a1 = x0[q*xstride + xm];
+            kiss_fft_cpx a2 = x0[q*xstride + 2*xm];
+            kiss_fft_cpx a3 = x0[q*xstride + 3*xm];
+            kiss_fft_cpx apc,amc,bpd,bmd,b;
+            C_FIXDIV(a0,4); C_FIXDIV(a1,4); C_FIXDIV(a2,4); C_FIXDIV(a3,4);
+
+            C_ADD(apc,a0,a2);
+            C_SUB(amc,a0,a2);
+            C_ADD(bpd,a1,a3);
+            C_SUB(bmd,a1,a3);
+
+            C_ADD(y0[q],apc,bpd);
+            C_SUB(b,apc,bpd);
+            C_MUL(y0[q+2*s],b,tw[1]);
+            if(st->inverse) {
+                b.r = amc.r - bmd.i;
+                b.i = amc.i + bmd.r;
+                C_MUL(y0[q+s],b,tw[0]);
+                b.r = amc.r + bmd.i;
+                b.i = amc.i - bmd.r;
+                C_MUL(y0[q+3*s],b,tw[2]);
+            }else{
+                b.r = amc.r + bmd.i;
+                b.i = amc.i - bmd.r;
+                C_MUL(y0[q+s],b,tw[0]);
+                b.r = amc.r - bmd.i;
+                b.i = amc.i + bmd.r;
+                C_MUL(y0[q+3*s],b,tw[2]);
+            }
+        }
+    }
+}
+
+static void kf_stockham5(
+        const kiss_fft_cpx * x,
+        size_t xstride,
+        kiss_fft_cpx * y,
+        size_t m,
+        size_t s,
+        const kiss_fft_cpx * tw,
+        const kiss_fft_cfg st
+        )
+{
+    size_t j,q;
+    const size_t xm = s*m*xstride;
+    const kiss_fft_cpx ya = st->twiddles[st->nfft/5];
+    const kiss_fft_cpx yb = st->twiddles[2*(st->nfft/5)];
+    for (j=0;j<m;++j,tw+=4) {
+        const kiss_fft_cpx * x0 = x + j*s*xstride;
+        kiss_fft_cpx * y0 = y + 5*j*s;
+        q = 0;
+#if KISS_FFT_VECTOR
+        /* four butterflies at a time, in the scalar loop's order of operations */
+        if (xstride == 1) {
+            const kf_v4 yar = KF_V4_SET1(ya.r), yai = KF_V4_SET1(ya.i);
+            const kf_v4 ybr = KF_V4_SET1(yb.r), ybi = KF_V4_SET1(yb.i);
+            kf_v4 wr[4],wi[4];
+            int k;
+            for (k=0;k<4;++k) {
+                wr[k] = KF_V4_SET1(tw[k].r);
+                wi[k] = KF_V4_SET1(tw[k].i);
+            }
+            for (;q+4<=s;q+=4) {
+                kf_v4 a0r,a0i,a1r,a1i,a2r,a2i,a3r,a3i,a4r,a4i;
+                kf_v4 s7r,s7i,s8r,s8i,s9r,s9i,s10r,s10i,s5r,s5i,s6r,s6i,s11r,s11i,s12r,s12i;
+                kf_v4 br,bi,yr,yi;
+                KF_V4_LOAD(a0r,a0i,x0+q);
+                KF_V4_LOAD(a1r,a1i,x0+q+xm);
+                KF_V4_LOAD(a2r,a2i,x0+q+2*xm);
+                KF_V4_LOAD(a3r,a3i,x0+q+3*xm);
+                KF_V4_LOAD(a4r,a4i,x0+q+4*xm);
+
+                s7r = KF_V4_ADD(a1r,a4r); s7i = KF_V4_ADD(a1i,a4i);
+                s10r = KF_V4_SUB(a1r,a4r); s10i = KF_V4_SUB(a1i,a4i);
+                s8r = KF_V4_ADD(a2r,a3r); s8i = KF_V4_ADD(a2i,a3i);
+                s9r = KF_V4_SUB(a2r,a3r); s9i = KF_V4_SUB(a2i,a3i);
+
+                KF_V4_STORE(y0+q,KF_V4_ADD(KF_V4_ADD(a0r,s7r),s8r),KF_V4_ADD(KF_V4_ADD(a0i,s7i),s8i));
+
+                s5r = KF_V4_ADD(KF_V4_ADD(a0r,KF_V4_MUL(s7r,yar)),KF_V4_MUL(s8r,ybr));
+                s5i = KF_V4_ADD(KF_V4_ADD(a0i,KF_V4_MUL(s7i,yar)),KF_V4_MUL(s8i,ybr));
+                s6r = KF_V4_ADD(KF_V4_MUL(s10i,yai),KF_V4_MUL(s9i,ybi));
+                s6i = KF_V4_SUB(KF_V4_NEG(KF_V4_MUL(s10r,yai)),KF_V4_MUL(s9r,ybi));
+
+                br = KF_V4_SUB(s5r,s6r); bi = KF_V4_SUB(s5i,s6i);
+                KF_V4_CMUL(yr,yi,br,bi,wr[0],wi[0]);
+                KF_V4_STORE(y0+q+s,yr,yi);
+                br = KF_V4_ADD(s5r,s6r); bi = KF_V4_ADD(s5i,s6i);
+                KF_V4_CMUL(yr,yi,br,bi,wr[3],wi[3]);
+                KF_V4_STORE(y0+q+4*s,yr,yi);
+
+                s11r = KF_V4_ADD(KF_V4_ADD(a0r,KF_V4_MUL(s7r,ybr)),KF_V4_MUL(s8r,yar));
+                s11i = KF_V4_ADD(KF_V4_ADD(a0i,KF_V4_MUL(s7i,ybr)),KF_V4_MUL(s8i,yar));
+                s12r = KF_V4_ADD(KF_V4_NEG(KF_V4_MUL(s10i,ybi)),KF_V4_MUL(s9i,yai));
+                s12i = KF_V4_SUB(KF_V4_MUL(s10r,ybi),KF_V4_MUL(s9r,yai));
+
+                br = KF_V4_ADD(s11r,s12r); bi = KF_V4_ADD(s11i,s12i);
+                KF_V4_CMUL(yr,yi,br,bi,wr[1],wi[1]);
+                KF_V4_STORE(y0+q+2*s,yr,yi);
+                br = KF_V4_SUB(s11r,s12r); bi = KF_V4_SUB(s11i,s12i);
+                KF_V4_CMUL(yr,yi,br,bi,wr[2],wi[2]);
+                KF_V4_STORE(y0+q+3*s,yr,yi);
+            }
+        }
+#endif
+        for (;q<s;++q) {
+            kiss_fft_cpx scratch[13];
+            kiss_fft_cpx b;
+            scratch[0] = x0[q*xstride];
+            scratch[1] = x0[q*xstride + xm];
+            scratch[2] = x0[q*xstride + 2*xm];
+            scratch[3] = x0[q*xstride + 3*xm];
+            scratch[4] = x0[q*xstride + 4*xm];
+            C_FIXDIV(scratch[0],5); C_FIXDIV(scratch[1],5); C_FIXDIV(scratch[2],5);
+            C_FIXDIV(scratch[3],5); C_FIXDIV(scratch[4],5);
+
+            C_ADD( scratch[7],scratch[1],scratch[4]);
+            C_SUB( scratch[10],scratch[1],scratch[4]);
+            C_ADD( scratch[8],scratch[2],scratch[3]);
+            C_SUB( scratch[9],scratch[2],scratch[3]);
+
+            y0[q].r = scratch[0].r + scratch[7].r + scratch[8].r;
+            y0[q].i = scratch[0].i + scratch[7].i + scratch[8].i;
+
+            scratch[5].r = scratch[0].r + S_MUL(scratch[7].r,ya.r) + S_MUL(scratch[8].r,yb.r);
+            scratch[5].i = scratch[0].i + S_MUL(scratch[7].i,ya.r) + S_MUL(scratch[8].i,yb.r);
+
+            scratch[6].r =  S_MUL(scratch[10].i,ya.i) + S_MUL(scratch[9].i,yb.i);
+            scratch[6].i = -S_MUL(scratch[10].r,ya.i) - S_MUL(scratch[9].r,yb.i);
+
+            C_SUB(b,scratch[5],scratch[6]);
+            C_MUL(y0[q+s],b,tw[0]);
+            C_ADD(b,scratch[5],scratch[6]);
+            C_MUL(y0[q+4*s],b,tw[3]);
+
+            scratch[11].r = scratch[0].r + S_MUL(scratch[7].r,yb.r) + S_MUL(scratch[8].r,ya.r);
+            scratch[11].i = scratch[0].i + S_MUL(scratch[7].i,yb.r) + S_MUL(scratch[8].i,ya.r);
+            scratch[12].r = - S_MUL(scratch[10].i,yb.i) + S_MUL(scratch[9].i,ya.i);
+            scratch[12].i = S_MUL(scratch[10].r,yb.i) - S_MUL(scratch[9].r,ya.i);
+
+            C_ADD(b,scratch[11],scratch[12]);
+            C_MUL(y0[q+2*s],b,tw[1]);
+            C_SUB(b,scratch[11],scratch[12]);
+            C_MUL(y0[q+3*s],b,tw[2]);
+        }
+    }
+}
+
+static
+void kf_stockham(
+        const kiss_fft_cfg st,
+        const kiss_fft_cpx * fin,
+        int in_stride,
+        kiss_fft_cpx * fout,
+        kiss_fft_cpx * scratch
+        )
+{
+    const int * factors = st->factors;
+    const kiss_fft_cpx * tw = st->stage_twiddles;
+    const kiss_fft_cpx * x = fin;
+    size_t xstride = in_stride;
+    size_t n = st->nfft;
+    size_t s = 1;
+    int stage;
+
+    for (stage=0;stage<st->stockham_stages;++stage) {
+        const int p = factors[2*stage];
+        const size_t m = n/p;
+        /* the last pass lands in fout */
+        kiss_fft_cpx * y = ((st->stockham_stages - 1 - stage) & 1) ? scratch : fout;
+        switch (p) {
+            case 2: kf_stockham2(x,xstride,y,m,s,tw); break;
+            case 3: kf_stockham3(x,xstride,y,m,s,tw,st); break;
+            case 4: kf_stockham4(x,xstride,y,m,s,tw,st); break;
+            default: kf_stockham5(x,xstride,y,m,s,tw,st); break;
+        }
+        tw += (p-1)*m;
+        x = y;
+        xstride = 1;
+        n = m;
+        s *= p;
     }
 }
 
@@ -327,20 +631,64 @@ void kf_factor(int n,int * facbuf)
     } while (n > 1);
 }
 
-/*
- *
- * User-callable function to allocate all necessary storage space for the fft.
- *
- * The return value is a contiguous block of memory, allocated with malloc.  As such,
- * It can be freed with free(), rather than a kiss_fft-specific function.
- * */
-kiss_fft_cfg kiss_fft_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem )
+int kf_stockham_stages(int nfft)
+{
+    int factors[2*MAXFACTORS];
+    int stages = 0;
+    if (nfft < 2 || nfft < KISS_FFT_STOCKHAM_MIN_SIZE)
+        return 0;
+    kf_factor(nfft,factors);
+    do {
+        if (factors[2*stages] > 5)
+            return 0;
+        ++stages;
+    } while (factors[2*stages-1] > 1);
+    return stages;
+}
+
+/* largest factor above 5, which kf_bfly_generic handles, or 0 */
+static
+int kf_generic_radix(const int * factors)
+{
+    int radix = 0;
+    do {
+        if (factors[0] > 5 && factors[0] > radix)
+            radix = factors[0];
+        factors += 2;
+    } while (factors[-1] > 1);
+    return radix;
+}
+
+int kf_scratch_points(int nfft)
+{
+    int factors[2*MAXFACTORS];
+    if (kf_stockham_stages(nfft))
+        return nfft;
+    if (nfft < 2)
+        return 0;
+    kf_factor(nfft,factors);
+#ifdef _OPENMP
+    /* a slice for each of the up to 5 top-level work units of kf_work */
+    return 5*kf_generic_radix(factors);
+#else
+    return kf_generic_radix(factors);
+#endif
+}
+
+kiss_fft_cfg kf_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem,int with_work)
 {
     KISS_FFT_ALIGN_CHECK(mem)
 
     kiss_fft_cfg st=NULL;
+    const int stockham_stages = kf_stockham_stages(nfft);
+    /* an in-place kiss_fft also needs nfft points to transform into, which
+       the Stockham passes share with their own work buffer */
+    const size_t work_points = !with_work ? 0 :
+        (size_t)nfft + (stockham_stages ? 0 : (size_t)kf_scratch_points(nfft));
     size_t memneeded = KISS_FFT_ALIGN_SIZE_UP(sizeof(struct kiss_fft_state)
-        + sizeof(kiss_fft_cpx)*(nfft-1)); /* twiddle factors*/
+        + sizeof(kiss_fft_cpx)*(nfft-1) /* twiddle factors*/
+        + (stockham_stages ? sizeof(kiss_fft_cpx)*(nfft-1) : 0) /* per pass twiddles */
+        + sizeof(kiss_fft_cpx)*work_points); /* work buffer */
 
     if ( lenmem==NULL ) {
         st = ( kiss_fft_cfg)KISS_FFT_MALLOC( memneeded );
@@ -363,34 +711,85 @@ kiss_fft_cfg kiss_fft_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem
         }
 
         kf_factor(nfft,st->factors);
+        st->generic_radix = kf_generic_radix(st->factors);
+
+        st->stockham_stages = stockham_stages;
+        st->stage_twiddles = NULL;
+        st->work = st->twiddles + nfft;
+        if (stockham_stages) {
+            kiss_fft_cpx * tw = st->twiddles + nfft;
+            int n = nfft;
+            int stage;
+            st->stage_twiddles = tw;
+            for (stage=0;stage<stockham_stages;++stage) {
+                const int p = st->factors[2*stage];
+                const int m = n/p;
+                int j,k;
+                for (j=0;j<m;++j)
+                    for (k=1;k<p;++k)
+                        *tw++ = st->twiddles[(size_t)k*j*(nfft/n)];
+                n = m;
+            }
+            st->work = tw;
+        }
+        if (!with_work)
+            st->work = NULL;
     }
     return st;
 }
 
+/*
+ *
+ * User-callable function to allocate all necessary storage space for the fft.
+ *
+ * The return value is a contiguous block of memory, allocated with malloc.  As such,
+ * It can be freed with free(), rather than a kiss_fft-specific function.
+ * */
+kiss_fft_cfg kiss_fft_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem )
+{
+    return kf_alloc(nfft,inverse_fft,mem,lenmem,1);
+}
+
+
+void kf_transform(kiss_fft_cfg st,const kiss_fft_cpx *fin,kiss_fft_cpx *fout,int in_stride,kiss_fft_cpx *scratch)
+{
+    if (st->stockham_stages)
+        kf_stockham(st,fin,in_stride,fout,scratch);
+    else
+        kf_work(fout,fin,1,in_stride,st->factors,st,scratch);
+}
 
 void kiss_fft_stride(kiss_fft_cfg st,const kiss_fft_cpx *fin,kiss_fft_cpx *fout,int in_stride)
 {
-    if (fin == fout) {
-        //NOTE: this is not really an in-place FFT algorithm.
-        //It just performs an out-of-place FFT into a temp buffer
-        if (fout == NULL){
-            KISS_FFT_ERROR("fout buffer NULL.");
+    kiss_fft_cpx * work = st->work;
+    const int nfft = st->nfft;
+    if (fout == NULL){
+        KISS_FFT_ERROR("fout buffer NULL.");
         return;
-        }
-
-        kiss_fft_cpx * tmpbuf = (kiss_fft_cpx*)KISS_FFT_TMP_ALLOC( sizeof(kiss_fft_cpx)*st->nfft);
-        if (tmpbuf == NULL){
-            KISS_FFT_ERROR("Memory allocation error.");
+    }
+    if (work == NULL){
+        KISS_FFT_ERROR("kiss fft usage error: plan has no work buffer");
         return;
+    }
+    if (fin == fout) {
+        //NOTE: this is not really an in-place FFT algorithm.
+        //It just performs an out-of-place FFT into the plan's work buffer
+        if (!st->stockham_stages) {
+            kf_work(work,fin,1,in_stride,st->factors,st,work + nfft);
+            memcpy(fout,work,sizeof(kiss_fft_cpx)*nfft);
+        } else if (st->stockham_stages & 1) {
+            /* the first of an odd number of passes writes fout, so it reads
+               a copy; the work buffer is free again by the second pass */
+            int i;
+            for (i=0;i<nfft;++i)
+                work[i] = fin[(size_t)i*in_stride];
+            kf_stockham(st,work,1,fout,work);
+        } else {
+            /* the first pass reads fin before anything lands in fout */
+            kf_stockham(st,fin,in_stride,fout,work);
         }
-
-
-
-        kf_work(tmpbuf,fin,1,in_stride, st->factors,st);
-        memcpy(fout,tmpbuf,sizeof(kiss_fft_cpx)*st->nfft);
-        KISS_FFT_TMP_FREE(tmpbuf);
     }else{
-        kf_work( fout, fin, 1,in_stride, st->factors,st );
+        kf_transform(st,fin,fout,in_stride,st->stockham_stages ? work : work + nfft);
     }
 }
 
@@ -81,6 +81,7 @@ extern "C" {
 # ifndef kiss_fft_scalar
 /*  default is float */
 #   define kiss_fft_scalar float
+#   define KISS_FFT_SCALAR_IS_FLOAT
 # endif
 #endif
 
@@ -125,6 +126,9 @@ kiss_fft_cfg KISS_FFT_API kiss_fft_alloc(int nfft,int inverse_fft,void * mem,siz
  * fout will be   F[0] , F[1] , ... ,F[nfft-1]
  * Note that each element is complex and can be accessed like
     f[k].r and f[k].i
+ *
+ * The cfg holds the work buffer a call needs, so kiss_fft never allocates;
+ * it also means one cfg serves one thread at a time.
  * */
 void KISS_FFT_API kiss_fft(kiss_fft_cfg cfg,const kiss_fft_cpx *fin,kiss_fft_cpx *fout);
 
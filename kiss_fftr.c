@@ -12,10 +12,11 @@
 struct kiss_fftr_state{
     kiss_fft_cfg substate;
     kiss_fft_cpx * tmpbuf;
-    kiss_fft_cpx * super_twiddles;
-#ifdef USE_SIMD
-    void * pad;
-#endif
+    /* real and imaginary parts of the split twiddles, nfft/4 each */
+    kiss_fft_scalar * super_twiddles_r;
+    kiss_fft_scalar * super_twiddles_i;
+    /* work buffer of kf_transform, NULL when the substate needs none */
+    kiss_fft_cpx * scratch;
 };
 
 kiss_fftr_cfg kiss_fftr_alloc(int nfft,int inverse_fft,void * mem,size_t * lenmem)
@@ -25,6 +26,7 @@ kiss_fftr_cfg kiss_fftr_alloc(int nfft,int inverse_fft,void * mem,size_t * lenme
     int i;
     kiss_fftr_cfg st = NULL;
     size_t subsize = 0, memneeded;
+    int scratch_points;
 
     if (nfft & 1) {
         KISS_FFT_ERROR("Real FFT optimization must be even.");
@@ -32,8 +34,11 @@ kiss_fftr_cfg kiss_fftr_alloc(int nfft,int inverse_fft,void * mem,size_t * lenme
     }
     nfft >>= 1;
 
-    kiss_fft_alloc (nfft, inverse_fft, NULL, &subsize);
-    memneeded = sizeof(struct kiss_fftr_state) + subsize + sizeof(kiss_fft_cpx) * ( nfft * 3 / 2);
+    /* the substate is only driven through kf_transform with st->scratch */
+    kf_alloc (nfft, inverse_fft, NULL, &subsize, 0);
+    scratch_points = kf_scratch_points(nfft);
+    memneeded = sizeof(struct kiss_fftr_state) + subsize
+        + sizeof(kiss_fft_cpx) * ( nfft * 3 / 2 + scratch_points);
 
     if (lenmem == NULL) {
         st = (kiss_fftr_cfg) KISS_FFT_MALLOC (memneeded);
@@ -47,16 +52,54 @@ kiss_fftr_cfg kiss_fftr_alloc(int nfft,int inverse_fft,void * mem,size_t * lenme
 
     st->substate = (kiss_fft_cfg) (st + 1); /*just beyond kiss_fftr_state struct */
     st->tmpbuf = (kiss_fft_cpx *) (((char *) st->substate) + subsize);
-    st->super_twiddles = st->tmpbuf + nfft;
-    kiss_fft_alloc(nfft, inverse_fft, st->substate, &subsize);
+    st->super_twiddles_r = (kiss_fft_scalar *) (st->tmpbuf + nfft);
+    st->super_twiddles_i = st->super_twiddles_r + nfft / 2;
+    st->scratch = scratch_points ? st->tmpbuf + nfft + nfft / 2 : NULL;
+    kf_alloc(nfft, inverse_fft, st->substate, &subsize, 0);
 
     for (i = 0; i < nfft/2; ++i) {
+        kiss_fft_cpx tw;
         double phase =
             -3.14159265358979323846264338327 * ((double) (i+1) / nfft + .5);
         if (inverse_fft)
             phase *= -1;
-        kf_cexp (st->super_twiddles+i,phase);
+        kf_cexp (&tw,phase);
+        st->super_twiddles_r[i] = tw.r;
+        st->super_twiddles_i[i] = tw.i;
+    }
+    return st;
+}
+
+kiss_fftr_cfg kiss_fftr_alloc_shared(kiss_fftr_cfg plan,void * mem,size_t * lenmem)
+{
+	KISS_FFT_ALIGN_CHECK(mem)
+
+    kiss_fftr_cfg st = NULL;
+    size_t memneeded;
+    int scratch_points;
+
+    if (plan == NULL)
+        return NULL;
+    scratch_points = kf_scratch_points(plan->substate->nfft);
+    memneeded = sizeof(struct kiss_fftr_state)
+        + sizeof(kiss_fft_cpx) * (plan->substate->nfft + scratch_points);
+
+    if (lenmem == NULL) {
+        st = (kiss_fftr_cfg) KISS_FFT_MALLOC (memneeded);
+    } else {
+        if (*lenmem >= memneeded)
+            st = (kiss_fftr_cfg) mem;
+        *lenmem = memneeded;
     }
+    if (!st)
+        return NULL;
+
+    /* only tmpbuf is written by a transform; the tables stay with plan */
+    st->substate = plan->substate;
+    st->tmpbuf = (kiss_fft_cpx *) (st + 1);
+    st->super_twiddles_r = plan->super_twiddles_r;
+    st->super_twiddles_i = plan->super_twiddles_i;
+    st->scratch = scratch_points ? st->tmpbuf + plan->substate->nfft : NULL;
     return st;
 }
 
@@ -64,7 +107,7 @@ void kiss_fftr(kiss_fftr_cfg st,const kiss_fft_scalar *timedata,kiss_fft_cpx *fr
 {
     /* input buffer timedata is stored row-wise */
     int k,ncfft;
-    kiss_fft_cpx fpnk,fpk,f1k,f2k,tw,tdc;
+    kiss_fft_cpx fpnk,fpk,f1k,f2k,tw,tdc,w;
 
     if ( st->substate->inverse) {
         KISS_FFT_ERROR("kiss fft usage error: improper alloc");
@@ -74,7 +117,7 @@ void kiss_fftr(kiss_fftr_cfg st,const kiss_fft_scalar *timedata,kiss_fft_cpx *fr
     ncfft = st->substate->nfft;
 
     /*perform the parallel fft of two real signals packed in real,imag*/
-    kiss_fft( st->substate , (const kiss_fft_cpx*)timedata, st->tmpbuf );
+    kf_transform( st->substate , (const kiss_fft_cpx*)timedata, st->tmpbuf, 1, st->scratch );
     /* The real part of the DC element of the frequency spectrum in st->tmpbuf
      * contains the sum of the even-numbered elements of the input time sequence
      * The imag part is the sum of the odd-numbered elements
@@ -98,7 +141,36 @@ void kiss_fftr(kiss_fftr_cfg st,const kiss_fft_scalar *timedata,kiss_fft_cpx *fr
     freqdata[ncfft].i = freqdata[0].i = 0;
 #endif
 
-    for ( k=1;k <= ncfft/2 ; ++k ) {
+    k = 1;
+#if KISS_FFT_VECTOR
+    /* four k at a time while the blocks at k and ncfft-k stay apart */
+    {
+        const kf_v4 half = KF_V4_SET1(.5f);
+        for ( ; 2 * k + 6 < ncfft ; k += 4 ) {
+            kf_v4 ar, ai, br, bi, wr, wi, f1r, f1i, f2r, f2i, twr, twi;
+            KF_V4_LOAD( ar, ai, st->tmpbuf + k );
+            KF_V4_LOAD_REV( br, bi, st->tmpbuf + ncfft - k );
+            wr = KF_V4_LOADU( st->super_twiddles_r + k - 1 );
+            wi = KF_V4_LOADU( st->super_twiddles_i + k - 1 );
+
+            /* fpnk is the conjugate of b */
+            f1r = KF_V4_ADD( ar, br );
+            f1i = KF_V4_SUB( ai, bi );
+            f2r = KF_V4_SUB( ar, br );
+            f2i = KF_V4_ADD( ai, bi );
+            twr = KF_V4_SUB( KF_V4_MUL( f2r, wr ), KF_V4_MUL( f2i, wi ) );
+            twi = KF_V4_ADD( KF_V4_MUL( f2r, wi ), KF_V4_MUL( f2i, wr ) );
+
+            KF_V4_STORE( freqdata + k,
+                KF_V4_MUL( half, KF_V4_ADD( f1r, twr ) ),
+                KF_V4_MUL( half, KF_V4_ADD( f1i, twi ) ) );
+            KF_V4_STORE_REV( freqdata + ncfft - k,
+                KF_V4_MUL( half, KF_V4_SUB( f1r, twr ) ),
+                KF_V4_MUL( half, KF_V4_SUB( twi, f1i ) ) );
+        }
+    }
+#endif
+    for ( ; k <= ncfft/2 ; ++k ) {
         fpk    = st->tmpbuf[k];
         fpnk.r =   st->tmpbuf[ncfft-k].r;
         fpnk.i = - st->tmpbuf[ncfft-k].i;
@@ -107,7 +179,9 @@ void kiss_fftr(kiss_fftr_cfg st,const kiss_fft_scalar *timedata,kiss_fft_cpx *fr
 
         C_ADD( f1k, fpk , fpnk );
         C_SUB( f2k, fpk , fpnk );
-        C_MUL( tw , f2k , st->super_twiddles[k-1]);
+        w.r = st->super_twiddles_r[k-1];
+        w.i = st->super_twiddles_i[k-1];
+        C_MUL( tw , f2k , w );
 
         freqdata[k].r = HALF_OF(f1k.r + tw.r);
         freqdata[k].i = HALF_OF(f1k.i + tw.i);
@@ -132,8 +206,30 @@ void kiss_fftri(kiss_fftr_cfg st,const kiss_fft_cpx *freqdata,kiss_fft_scalar *t
     st->tmpbuf[0].i = freqdata[0].r - freqdata[ncfft].r;
     C_FIXDIV(st->tmpbuf[0],2);
 
-    for (k = 1; k <= ncfft / 2; ++k) {
-        kiss_fft_cpx fk, fnkc, fek, fok, tmp;
+    k = 1;
+#if KISS_FFT_VECTOR
+    /* four k at a time while the blocks at k and ncfft-k stay apart */
+    for ( ; 2 * k + 6 < ncfft ; k += 4 ) {
+        kf_v4 ar, ai, br, bi, wr, wi, fer, fei, tr, ti, fr, fi;
+        KF_V4_LOAD( ar, ai, freqdata + k );
+        KF_V4_LOAD_REV( br, bi, freqdata + ncfft - k );
+        wr = KF_V4_LOADU( st->super_twiddles_r + k - 1 );
+        wi = KF_V4_LOADU( st->super_twiddles_i + k - 1 );
+
+        /* fnkc is the conjugate of b */
+        fer = KF_V4_ADD( ar, br );
+        fei = KF_V4_SUB( ai, bi );
+        tr = KF_V4_SUB( ar, br );
+        ti = KF_V4_ADD( ai, bi );
+        fr = KF_V4_SUB( KF_V4_MUL( tr, wr ), KF_V4_MUL( ti, wi ) );
+        fi = KF_V4_ADD( KF_V4_MUL( tr, wi ), KF_V4_MUL( ti, wr ) );
+
+        KF_V4_STORE( st->tmpbuf + k, KF_V4_ADD( fer, fr ), KF_V4_ADD( fei, fi ) );
+        KF_V4_STORE_REV( st->tmpbuf + ncfft - k, KF_V4_SUB( fer, fr ), KF_V4_SUB( fi, fei ) );
+    }
+#endif
+    for ( ; k <= ncfft / 2; ++k) {
+        kiss_fft_cpx fk, fnkc, fek, fok, tmp, tw;
         fk = freqdata[k];
         fnkc.r = freqdata[ncfft - k].r;
         fnkc.i = -freqdata[ncfft - k].i;
@@ -142,7 +238,9 @@ void kiss_fftri(kiss_fftr_cfg st,const kiss_fft_cpx *freqdata,kiss_fft_scalar *t
 
         C_ADD (fek, fk, fnkc);
         C_SUB (tmp, fk, fnkc);
-        C_MUL (fok, tmp, st->super_twiddles[k-1]);
+        tw.r = st->super_twiddles_r[k-1];
+        tw.i = st->super_twiddles_i[k-1];
+        C_MUL (fok, tmp, tw);
         C_ADD (st->tmpbuf[k],     fek, fok);
         C_SUB (st->tmpbuf[ncfft - k], fek, fok);
 #ifdef USE_SIMD
@@ -151,5 +249,5 @@ void kiss_fftri(kiss_fftr_cfg st,const kiss_fft_cpx *freqdata,kiss_fft_scalar *t
         st->tmpbuf[ncfft - k].i *= -1;
 #endif
     }
-    kiss_fft (st->substate, st->tmpbuf, (kiss_fft_cpx *) timedata);
+    kf_transform (st->substate, st->tmpbuf, (kiss_fft_cpx *) timedata, 1, st->scratch);
 }
@@ -33,6 +33,14 @@ kiss_fftr_cfg KISS_FFT_API kiss_fftr_alloc(int nfft,int inverse_fft,void * mem,
  If you don't care to allocate space, use mem = lenmem = NULL 
 */
 
+kiss_fftr_cfg KISS_FFT_API kiss_fftr_alloc_shared(kiss_fftr_cfg plan,void * mem, size_t * lenmem);
+/*
+ Returns a config for the same transform as plan that shares plan's twiddle
+ tables and only owns a work buffer, so one plan can serve transforms running
+ on several threads at once. plan must outlive it. mem and lenmem work as in
+ kiss_fftr_alloc.
+*/
+
 
 void KISS_FFT_API kiss_fftr(kiss_fftr_cfg cfg,const kiss_fft_scalar *timedata,kiss_fft_cpx *freqdata);
 /*
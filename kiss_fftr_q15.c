@@ -0,0 +1,40 @@
+/*
+ *  Copyright (c) 2003-2004, Mark Borgerding. All rights reserved.
+ *  This file is part of KISS FFT - https://github.com/mborgerding/kissfft
+ *
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *  See COPYING file for more information.
+ */
+
+/* Compiles kiss_fft.c and kiss_fftr.c again with FIXED_POINT=16, every
+   external name moved to a _q15 spelling, for the declarations in
+   kiss_fftr_q15.h. Only kiss_fftr_q15_* is meant to be called. */
+
+#define FIXED_POINT 16
+
+#define kiss_fft_cpx kiss_fft_q15_cpx
+#define kiss_fft_cfg kiss_fft_q15_cfg
+#define kiss_fft_state kiss_fft_q15_state
+#define kiss_fftr_cfg kiss_fftr_q15_cfg
+#define kiss_fftr_state kiss_fftr_q15_state
+
+#define kiss_fft_alloc kiss_fft_q15_alloc
+#define kiss_fft kiss_fft_q15
+#define kiss_fft_stride kiss_fft_q15_stride
+#define kiss_fft_cleanup kiss_fft_q15_cleanup
+#define kiss_fft_next_fast_size kiss_fft_q15_next_fast_size
+#define kiss_fftr_alloc kiss_fftr_q15_alloc
+#define kiss_fftr_alloc_shared kiss_fftr_q15_alloc_shared
+#define kiss_fftr kiss_fftr_q15
+#define kiss_fftri kiss_fftri_q15
+
+#define kf_work kf_q15_work
+#define kf_stockham kf_q15_stockham
+#define kf_factor kf_q15_factor
+#define kf_stockham_stages kf_q15_stockham_stages
+#define kf_transform kf_q15_transform
+#define kf_scratch_points kf_q15_scratch_points
+#define kf_alloc kf_q15_alloc
+
+#include "kiss_fft.c"
+#include "kiss_fftr.c"
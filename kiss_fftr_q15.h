@@ -0,0 +1,45 @@
+/*
+ *  Copyright (c) 2003-2004, Mark Borgerding. All rights reserved.
+ *  This file is part of KISS FFT - https://github.com/mborgerding/kissfft
+ *
+ *  SPDX-License-Identifier: BSD-3-Clause
+ *  See COPYING file for more information.
+ */
+
+#ifndef KISS_FTR_Q15_H
+#define KISS_FTR_Q15_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ The real FFT of kiss_fftr.h built with FIXED_POINT=16 (kiss_fftr_q15.c), so
+ it links beside the float build. Samples and bins are Q15. The forward
+ transform scales by 1/nfft to stay in range, so bin k holds X[k] / nfft.
+*/
+
+typedef struct {
+    int16_t r;
+    int16_t i;
+}kiss_fft_q15_cpx;
+
+typedef struct kiss_fftr_q15_state *kiss_fftr_q15_cfg;
+
+kiss_fftr_q15_cfg kiss_fftr_q15_alloc(int nfft,int inverse_fft,void * mem, size_t * lenmem);
+
+kiss_fftr_q15_cfg kiss_fftr_q15_alloc_shared(kiss_fftr_q15_cfg plan,void * mem, size_t * lenmem);
+
+void kiss_fftr_q15(kiss_fftr_q15_cfg cfg,const int16_t *timedata,kiss_fft_q15_cpx *freqdata);
+
+void kiss_fftri_q15(kiss_fftr_q15_cfg cfg,const kiss_fft_q15_cpx *freqdata,int16_t *timedata);
+
+#define kiss_fftr_q15_free free
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,613 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#define AUDIOPEAK_BUILD
+
+#include "audiopeak.h"
+
+#include "../AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+struct audiopeak_detector {
+	audiopeak_detector(const audiopeak_allocator& in_allocator, const ArenaAllocator& arena_allocator)
+		: allocator(in_allocator), arena(arena_allocator) {}
+
+	audiopeak_allocator allocator;
+	audiopeak_settings settings = {};
+	ScratchArena arena;
+	OnsetCurveBuilder builder;
+};
+
+// Header of the single block holding a result; the curve, the peaks, the
+// notes and the chroma flux follow it in the same allocation.
+struct audiopeak_result {
+	audiopeak_allocator allocator;
+	double frames_per_second;
+	int64_t first_frame;
+	const float* flux;
+	size_t frame_count;
+	const audiopeak_peak* peaks;
+	size_t peak_count;
+	const audiopeak_note* notes;
+	size_t note_count;
+	const float* chroma_flux;
+};
+
+namespace {
+
+constexpr float kLoudnessThresholdPercent = 75.0f;
+
+// Input frames downmixed per Push and read per call by a shard, so neither
+// a buffer nor a shard's input is ever held in mono as a whole.
+constexpr size_t kDownmixChunkFrames = 16384;
+
+void* HeapAllocate(void*, size_t bytes)
+{
+	return std::malloc(bytes);
+}
+
+void HeapRelease(void*, void* memory)
+{
+	std::free(memory);
+}
+
+size_t AlignUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+bool IsValidSettings(const audiopeak_settings& settings)
+{
+	const OnsetGeometry geometry = { settings.fft_size, settings.hop_size };
+	return IsValidGeometry(geometry) &&
+		std::isfinite(settings.sample_rate) && settings.sample_rate > 0.0 &&
+		settings.onset_function >= AUDIOPEAK_ONSET_SPECTRAL_FLUX &&
+		settings.onset_function <= AUDIOPEAK_ONSET_ENERGY_ENVELOPE &&
+		(settings.threshold_mode == AUDIOPEAK_THRESHOLD_TRAILING_MEAN ||
+			settings.threshold_mode == AUDIOPEAK_THRESHOLD_ROLLING_PERCENTILE) &&
+		settings.threshold_multiplier >= 0.0f &&
+		settings.threshold_percentile >= 0.0f && settings.threshold_percentile <= 100.0f &&
+		settings.percentile_window_seconds > 0.0f &&
+		settings.smoothing_percent >= 0.0f && settings.smoothing_percent <= 100.0f &&
+		settings.min_separation_seconds >= 0.0f &&
+		settings.low_crossover_hz > 0.0 && settings.high_crossover_hz > settings.low_crossover_hz &&
+		(settings.arithmetic == AUDIOPEAK_ARITHMETIC_FLOAT || settings.arithmetic == AUDIOPEAK_ARITHMETIC_FIXED_Q15);
+}
+
+// Shards leave the pitch stage off: notes are only picked in one pass.
+bool InitializeBuilder(audiopeak_detector& detector, int64_t frame_capacity, int64_t frame_origin, bool note_onsets)
+{
+	const audiopeak_settings& settings = detector.settings;
+	return detector.builder.Initialize(detector.arena,
+		OnsetGeometry{ settings.fft_size, settings.hop_size },
+		settings.onset_function,
+		settings.sample_rate,
+		settings.low_crossover_hz,
+		settings.high_crossover_hz,
+		frame_capacity,
+		frame_origin,
+		(settings.arithmetic == AUDIOPEAK_ARITHMETIC_FIXED_Q15) ? kOnsetFixedQ15 : kOnsetFloat) &&
+		(!note_onsets || detector.builder.EnablePitchFlux(detector.arena));
+}
+
+// Downmixes count interleaved frames through mono, a chunk of
+// kDownmixChunkFrames, and pushes them into the detector's builder.
+void PushInterleaved(audiopeak_detector& detector,
+	const float* samples,
+	int channel_count,
+	size_t count,
+	ArenaSpan<float> mono)
+{
+	if (channel_count == 1) {
+		detector.builder.Push(samples, count);
+		return;
+	}
+	for (size_t first = 0; first < count; first += kDownmixChunkFrames) {
+		const size_t chunk = std::min(kDownmixChunkFrames, count - first);
+		DownmixToMono(samples + first * static_cast<size_t>(channel_count), kSampleFloat32, channel_count, chunk, mono.data());
+		detector.builder.Push(mono.data(), chunk);
+	}
+}
+
+PeakPickingSpans SpansFor(const audiopeak_settings& settings)
+{
+	const double frames_per_second = OnsetFramesPerSecond(settings.sample_rate, OnsetGeometry{ settings.fft_size, settings.hop_size });
+	PeakPickingSpans spans = PeakPickingSpansFor(settings.smoothing_percent, settings.min_separation_seconds, frames_per_second);
+	if (settings.threshold_mode == AUDIOPEAK_THRESHOLD_ROLLING_PERCENTILE) {
+		spans.quantile_window = std::max<int64_t>(1,
+			static_cast<int64_t>(std::lround(settings.percentile_window_seconds * frames_per_second)));
+	}
+	return spans;
+}
+
+// Same peak picking as the plug-in's broadband markers: smoothing, then the
+// trailing-mean threshold with the optional rolling-percentile floor.
+// flux must start at frame 0.
+audiopeak_status PickPeaks(audiopeak_detector& detector,
+	ArenaSpan<const float> flux,
+	ArenaSpan<CandidatePeak>& candidates,
+	size_t& candidate_count,
+	float& max_flux)
+{
+	const audiopeak_settings& settings = detector.settings;
+	const PeakPickingSpans spans = SpansFor(settings);
+
+	candidate_count = 0;
+	max_flux = 0.0f;
+	if (flux.empty()) {
+		return AUDIOPEAK_OK;
+	}
+	const ArenaSpan<const float> smoothed = SmoothFlux(flux, spans.smoothing_radius, detector.arena);
+	candidates = AllocateCandidates(detector.arena, flux.size());
+	if (smoothed.empty() || candidates.empty()) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	max_flux = *std::max_element(smoothed.begin(), smoothed.end());
+	if (max_flux > 0.0f) {
+		candidate_count = (spans.quantile_window > 0) ?
+			SelectPeaksAboveQuantile(smoothed,
+				settings.threshold_multiplier,
+				settings.threshold_percentile / 100.0f,
+				spans,
+				candidates) :
+			SelectPeaks(smoothed, settings.threshold_multiplier, spans, candidates);
+	}
+	return AUDIOPEAK_OK;
+}
+
+// Note onsets and chroma flux of a pass with note_onsets set; empty
+// otherwise.
+struct NoteAnalysis {
+	ArenaSpan<const PitchOnset> onsets;
+	ArenaSpan<const float> chroma_flux;
+};
+
+// Picks the note onsets of the pitch flux the detector's builder holds and
+// sums it over octaves into kPitchClassCount values per frame.
+audiopeak_status PickNotes(audiopeak_detector& detector, NoteAnalysis& notes)
+{
+	const OnsetCurveBuilder& builder = detector.builder;
+	ArenaSpan<PitchOnset> onsets;
+	if (!SelectPitchOnsets(builder, detector.settings.threshold_multiplier, SpansFor(detector.settings), detector.arena, onsets)) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	const size_t frame_count = builder.FrameCount();
+	const ArenaSpan<float> chroma = AllocateSpan<float>(detector.arena, frame_count * kPitchClassCount);
+	if (frame_count > 0 && chroma.empty()) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	for (int pitch = 0; pitch < builder.PitchCount(); ++pitch) {
+		const ArenaSpan<const float> flux = builder.PitchFlux(pitch);
+		const size_t pitch_class = static_cast<size_t>((kPitchLowestNote + pitch) % kPitchClassCount);
+		for (size_t frame = 0; frame < flux.size(); ++frame) {
+			chroma[frame * kPitchClassCount + pitch_class] += flux[frame];
+		}
+	}
+	notes.onsets = onsets;
+	notes.chroma_flux = chroma;
+	return AUDIOPEAK_OK;
+}
+
+// Copies the curve, the picked peaks and any notes into one block from the
+// detector's allocator.
+audiopeak_status MakeResult(const audiopeak_detector& detector,
+	ArenaSpan<const float> flux,
+	int64_t first_frame,
+	ArenaSpan<const CandidatePeak> candidates,
+	size_t candidate_count,
+	float max_flux,
+	const NoteAnalysis& notes,
+	audiopeak_result*& result)
+{
+	const audiopeak_settings& settings = detector.settings;
+	const OnsetGeometry geometry = { settings.fft_size, settings.hop_size };
+	const size_t flux_offset = AlignUp(sizeof(audiopeak_result), alignof(float));
+	const size_t peaks_offset = AlignUp(flux_offset + flux.size() * sizeof(float), alignof(audiopeak_peak));
+	const size_t notes_offset = AlignUp(peaks_offset + candidate_count * sizeof(audiopeak_peak), alignof(audiopeak_note));
+	const size_t chroma_offset = AlignUp(notes_offset + notes.onsets.size() * sizeof(audiopeak_note), alignof(float));
+	void* const block = detector.allocator.allocate(detector.allocator.user,
+		chroma_offset + notes.chroma_flux.size() * sizeof(float));
+	if (!block) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	unsigned char* const bytes = static_cast<unsigned char*>(block);
+	float* const result_flux = reinterpret_cast<float*>(bytes + flux_offset);
+	audiopeak_peak* const result_peaks = reinterpret_cast<audiopeak_peak*>(bytes + peaks_offset);
+	audiopeak_note* const result_notes = reinterpret_cast<audiopeak_note*>(bytes + notes_offset);
+	float* const result_chroma = reinterpret_cast<float*>(bytes + chroma_offset);
+	if (!flux.empty()) {
+		std::memcpy(result_flux, flux.data(), flux.size() * sizeof(float));
+	}
+	for (size_t index = 0; index < candidate_count; ++index) {
+		const CandidatePeak& candidate = candidates[index];
+		const float amplitude = std::min(std::max(candidate.flux_value / max_flux * 100.0f, 0.0f), 100.0f);
+		audiopeak_peak& peak = result_peaks[index];
+		peak.sample = candidate.frame_index * geometry.hop_size;
+		peak.seconds = OnsetFrameSeconds(candidate.frame_index, settings.sample_rate, geometry);
+		peak.strength = candidate.flux_value;
+		peak.amplitude = amplitude;
+		peak.is_loud = (amplitude >= kLoudnessThresholdPercent) ? 1 : 0;
+	}
+	float max_strength = 0.0f;
+	for (const PitchOnset& onset : notes.onsets) {
+		max_strength = std::max(max_strength, onset.strength);
+	}
+	for (size_t index = 0; index < notes.onsets.size(); ++index) {
+		const PitchOnset& onset = notes.onsets[index];
+		audiopeak_note& note = result_notes[index];
+		note.sample = onset.frame_index * geometry.hop_size;
+		note.seconds = OnsetFrameSeconds(onset.frame_index, settings.sample_rate, geometry);
+		note.note = onset.note;
+		note.strength = onset.strength;
+		note.amplitude = std::min(std::max(onset.strength / max_strength * 100.0f, 0.0f), 100.0f);
+	}
+	if (!notes.chroma_flux.empty()) {
+		std::memcpy(result_chroma, notes.chroma_flux.data(), notes.chroma_flux.size() * sizeof(float));
+	}
+
+	result = new (block) audiopeak_result;
+	result->allocator = detector.allocator;
+	result->frames_per_second = OnsetFramesPerSecond(settings.sample_rate, geometry);
+	result->first_frame = first_frame;
+	result->flux = result_flux;
+	result->frame_count = flux.size();
+	result->peaks = result_peaks;
+	result->peak_count = candidate_count;
+	result->notes = result_notes;
+	result->note_count = notes.onsets.size();
+	result->chroma_flux = notes.chroma_flux.empty() ? nullptr : result_chroma;
+	return AUDIOPEAK_OK;
+}
+
+// Picks the peaks of the curve the detector's builder holds from frame 0.
+audiopeak_status FinishAnalysis(audiopeak_detector& detector, audiopeak_result*& result)
+{
+	const ArenaSpan<const float> flux = detector.builder.Flux();
+	ArenaSpan<CandidatePeak> candidates;
+	size_t candidate_count = 0;
+	float max_flux = 0.0f;
+	audiopeak_status status = PickPeaks(detector, flux, candidates, candidate_count, max_flux);
+	NoteAnalysis notes;
+	if (status == AUDIOPEAK_OK && detector.builder.PitchCount() > 0) {
+		status = PickNotes(detector, notes);
+	}
+	if (status != AUDIOPEAK_OK) {
+		return status;
+	}
+	return MakeResult(detector, flux, 0, candidates, candidate_count, max_flux, notes, result);
+}
+
+audiopeak_status Analyze(audiopeak_detector& detector,
+	const float* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result*& result)
+{
+	const OnsetGeometry geometry = { detector.settings.fft_size, detector.settings.hop_size };
+	detector.arena.Reset();
+	const ArenaSpan<float> mono = AllocateSpan<float>(detector.arena, kDownmixChunkFrames);
+	if (mono.empty() || !InitializeBuilder(detector, OnsetFrameCount(static_cast<int64_t>(frame_count), geometry), 0, detector.settings.note_onsets != 0)) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	PushInterleaved(detector, samples, channel_count, frame_count, mono);
+	return FinishAnalysis(detector, result);
+}
+
+// The builder downmixes PCM16 itself, in the detector's arithmetic.
+audiopeak_status AnalyzePcm16(audiopeak_detector& detector,
+	const int16_t* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result*& result)
+{
+	const OnsetGeometry geometry = { detector.settings.fft_size, detector.settings.hop_size };
+	detector.arena.Reset();
+	if (!InitializeBuilder(detector, OnsetFrameCount(static_cast<int64_t>(frame_count), geometry), 0, detector.settings.note_onsets != 0)) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	detector.builder.PushPcm16(samples, channel_count, frame_count);
+	return FinishAnalysis(detector, result);
+}
+
+audiopeak_status AnalyzeShard(audiopeak_detector& detector,
+	const audiopeak_shard& shard,
+	int channel_count,
+	audiopeak_read_function read,
+	void* user,
+	audiopeak_result*& result)
+{
+	const int64_t hop_size = detector.settings.hop_size;
+	detector.arena.Reset();
+	const ArenaSpan<float> input = AllocateSpan<float>(detector.arena, kDownmixChunkFrames * static_cast<size_t>(channel_count));
+	const ArenaSpan<float> mono = AllocateSpan<float>(detector.arena, kDownmixChunkFrames);
+	if (input.empty() || mono.empty() || !InitializeBuilder(detector, shard.end_frame - shard.first_frame, shard.first_frame, false)) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	detector.builder.Seek(shard.first_sample / hop_size, shard.first_frame);
+
+	for (int64_t position = shard.first_sample; position < shard.end_sample;) {
+		const size_t wanted = static_cast<size_t>(std::min<int64_t>(static_cast<int64_t>(kDownmixChunkFrames), shard.end_sample - position));
+		const size_t delivered = std::min(read(user, input.data(), wanted), wanted);
+		PushInterleaved(detector, input.data(), channel_count, delivered, mono);
+		position += static_cast<int64_t>(delivered);
+		if (delivered < wanted) {
+			break;
+		}
+	}
+
+	return MakeResult(detector, detector.builder.Flux(), shard.first_frame, ArenaSpan<const CandidatePeak>(), 0, 0.0f, NoteAnalysis(), result);
+}
+
+audiopeak_status PickCurvePeaks(audiopeak_detector& detector,
+	const float* flux_values,
+	size_t frame_count,
+	audiopeak_result*& result)
+{
+	detector.arena.Reset();
+	const ArenaSpan<const float> flux = { flux_values, frame_count };
+	ArenaSpan<CandidatePeak> candidates;
+	size_t candidate_count = 0;
+	float max_flux = 0.0f;
+	const audiopeak_status status = PickPeaks(detector, flux, candidates, candidate_count, max_flux);
+	if (status != AUDIOPEAK_OK) {
+		return status;
+	}
+	return MakeResult(detector, flux, 0, candidates, candidate_count, max_flux, NoteAnalysis(), result);
+}
+
+} // namespace
+
+/* ---------------------------------------------------------------- C API */
+
+unsigned audiopeak_abi_version(void)
+{
+	return AUDIOPEAK_ABI_VERSION;
+}
+
+const char* audiopeak_status_string(audiopeak_status status)
+{
+	switch (status) {
+	case AUDIOPEAK_OK:
+		return "ok";
+	case AUDIOPEAK_ERROR_INVALID_ARGUMENT:
+		return "invalid argument";
+	case AUDIOPEAK_ERROR_OUT_OF_MEMORY:
+		return "out of memory";
+	}
+	return "unknown status";
+}
+
+void audiopeak_default_settings(audiopeak_settings* settings)
+{
+	if (!settings) {
+		return;
+	}
+	*settings = audiopeak_settings();
+	settings->struct_size = sizeof(audiopeak_settings);
+	settings->onset_function = AUDIOPEAK_ONSET_SPECTRAL_FLUX;
+	settings->sample_rate = kStandardSampleRate;
+	settings->fft_size = kFFTSize;
+	settings->hop_size = kHopSize;
+	settings->threshold_multiplier = 1.5f;
+	settings->threshold_mode = AUDIOPEAK_THRESHOLD_TRAILING_MEAN;
+	settings->threshold_percentile = 90.0f;
+	settings->percentile_window_seconds = 5.0f;
+	settings->smoothing_percent = 30.0f;
+	settings->min_separation_seconds = 0.12f;
+	settings->low_crossover_hz = 150.0;
+	settings->high_crossover_hz = 5000.0;
+	settings->arithmetic = AUDIOPEAK_ARITHMETIC_FLOAT;
+	settings->note_onsets = 0;
+}
+
+audiopeak_status audiopeak_create(const audiopeak_settings* settings,
+	const audiopeak_allocator* allocator,
+	audiopeak_detector** detector)
+{
+	if (!settings || !detector || settings->struct_size < offsetof(audiopeak_settings, onset_function)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	*detector = nullptr;
+	if (allocator && (!allocator->allocate || !allocator->release)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+
+	// Fields the caller's header does not have keep their defaults; fields
+	// added after this version are ignored.
+	audiopeak_settings copy;
+	audiopeak_default_settings(&copy);
+	std::memcpy(&copy, settings, std::min(settings->struct_size, sizeof(audiopeak_settings)));
+	copy.struct_size = sizeof(audiopeak_settings);
+	if (!IsValidSettings(copy)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+
+	audiopeak_allocator resolved = { HeapAllocate, HeapRelease, nullptr };
+	if (allocator) {
+		resolved = *allocator;
+	}
+	ArenaAllocator arena_allocator;
+	arena_allocator.allocate = resolved.allocate;
+	arena_allocator.release = resolved.release;
+	arena_allocator.context = resolved.user;
+
+	void* const memory = resolved.allocate(resolved.user, sizeof(audiopeak_detector));
+	if (!memory) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+	audiopeak_detector* const created = new (memory) audiopeak_detector(resolved, arena_allocator);
+	created->settings = copy;
+	*detector = created;
+	return AUDIOPEAK_OK;
+}
+
+void audiopeak_destroy(audiopeak_detector* detector)
+{
+	if (!detector) {
+		return;
+	}
+	const audiopeak_allocator allocator = detector->allocator;
+	detector->~audiopeak_detector();
+	allocator.release(allocator.user, detector);
+}
+
+audiopeak_status audiopeak_analyze(audiopeak_detector* detector,
+	const float* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result** result)
+{
+	if (!detector || !result || channel_count < 1 || (!samples && frame_count > 0)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	*result = nullptr;
+	try {
+		return Analyze(*detector, samples, channel_count, frame_count, *result);
+	} catch (...) {
+		// Only building a shared FFT plan or pitch kernel can throw
+		// (std::bad_alloc), and no exception may unwind into C.
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+}
+
+audiopeak_status audiopeak_analyze_pcm16(audiopeak_detector* detector,
+	const int16_t* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result** result)
+{
+	if (!detector || !result || channel_count < 1 || (!samples && frame_count > 0)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	*result = nullptr;
+	try {
+		return AnalyzePcm16(*detector, samples, channel_count, frame_count, *result);
+	} catch (...) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+}
+
+audiopeak_status audiopeak_plan_shard(const audiopeak_detector* detector,
+	int64_t frame_count,
+	int shard_index,
+	int shard_count,
+	audiopeak_shard* shard)
+{
+	if (!detector || !shard || frame_count < 0 || shard_count < 1 || shard_index < 0 || shard_index >= shard_count) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	const OnsetGeometry geometry = { detector->settings.fft_size, detector->settings.hop_size };
+	const OnsetShard planned = PlanOnsetShard(frame_count, geometry, shard_index, shard_count);
+	shard->first_frame = planned.first_frame;
+	shard->end_frame = planned.end_frame;
+	shard->first_sample = planned.first_sample;
+	shard->end_sample = planned.end_sample;
+	return AUDIOPEAK_OK;
+}
+
+audiopeak_status audiopeak_analyze_shard(audiopeak_detector* detector,
+	const audiopeak_shard* shard,
+	int channel_count,
+	audiopeak_read_function read,
+	void* user,
+	audiopeak_result** result)
+{
+	if (!detector || !shard || !read || !result || channel_count < 1 ||
+		shard->first_frame < 0 || shard->end_frame < shard->first_frame ||
+		shard->first_sample < 0 || shard->end_sample < shard->first_sample ||
+		shard->first_sample % detector->settings.hop_size != 0) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	*result = nullptr;
+	try {
+		return AnalyzeShard(*detector, *shard, channel_count, read, user, *result);
+	} catch (...) {
+		return AUDIOPEAK_ERROR_OUT_OF_MEMORY;
+	}
+}
+
+audiopeak_status audiopeak_pick_peaks(audiopeak_detector* detector,
+	const float* flux,
+	size_t frame_count,
+	audiopeak_result** result)
+{
+	if (!detector || !result || (!flux && frame_count > 0)) {
+		return AUDIOPEAK_ERROR_INVALID_ARGUMENT;
+	}
+	*result = nullptr;
+	return PickCurvePeaks(*detector, flux, frame_count, *result);
+}
+
+const float* audiopeak_result_flux(const audiopeak_result* result, size_t* frame_count)
+{
+	if (frame_count) {
+		*frame_count = result ? result->frame_count : 0;
+	}
+	return result ? result->flux : nullptr;
+}
+
+double audiopeak_result_frames_per_second(const audiopeak_result* result)
+{
+	return result ? result->frames_per_second : 0.0;
+}
+
+int64_t audiopeak_result_first_frame(const audiopeak_result* result)
+{
+	return result ? result->first_frame : 0;
+}
+
+const audiopeak_peak* audiopeak_result_peaks(const audiopeak_result* result, size_t* peak_count)
+{
+	if (peak_count) {
+		*peak_count = result ? result->peak_count : 0;
+	}
+	return result ? result->peaks : nullptr;
+}
+
+const audiopeak_note* audiopeak_result_notes(const audiopeak_result* result, size_t* note_count)
+{
+	if (note_count) {
+		*note_count = result ? result->note_count : 0;
+	}
+	return result ? result->notes : nullptr;
+}
+
+const float* audiopeak_result_chroma_flux(const audiopeak_result* result, size_t* frame_count)
+{
+	if (frame_count) {
+		*frame_count = (result && result->chroma_flux) ? result->frame_count : 0;
+	}
+	return result ? result->chroma_flux : nullptr;
+}
+
+void audiopeak_result_free(audiopeak_result* result)
+{
+	if (!result) {
+		return;
+	}
+	const audiopeak_allocator allocator = result->allocator;
+	result->~audiopeak_result();
+	allocator.release(allocator.user, result);
+}
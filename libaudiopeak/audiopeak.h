@@ -0,0 +1,242 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+#pragma once
+
+#ifndef AUDIOPEAK_H
+#define AUDIOPEAK_H
+
+/*
+ libaudiopeak: the detection core of the Audio Peak Detector plug-in behind a
+ plain C ABI, for use outside After Effects.
+
+ A detector handle owns its settings and its scratch memory and keeps no
+ state anywhere else, so any number of handles can analyze on different
+ threads at once. One handle must not be used by two threads at the same
+ time. The only data shared between handles is the core's FFT plan and Hann
+ window of each frame size, and its pitch kernel of each frame size and
+ rate, built once under a lock and read-only after that; they come from
+ malloc.
+
+ All other memory (scratch and results) comes from the allocator given to
+ audiopeak_create(), or from malloc when none is given. A detector reuses its
+ scratch between calls, so analyzing material of the same length again
+ performs no allocation besides the result.
+
+ Settings and results only grow at their ends; struct_size tells the library
+ which fields the caller knows about.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#	if defined(AUDIOPEAK_BUILD)
+#		define AUDIOPEAK_API __declspec(dllexport)
+#	else
+#		define AUDIOPEAK_API __declspec(dllimport)
+#	endif
+#elif defined(__GNUC__)
+#	define AUDIOPEAK_API __attribute__((visibility("default")))
+#else
+#	define AUDIOPEAK_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AUDIOPEAK_ABI_VERSION 1
+
+typedef enum audiopeak_status {
+	AUDIOPEAK_OK = 0,
+	AUDIOPEAK_ERROR_INVALID_ARGUMENT,
+	AUDIOPEAK_ERROR_OUT_OF_MEMORY
+} audiopeak_status;
+
+/* Values follow the plug-in's Detection Function popup. */
+typedef enum audiopeak_onset_function {
+	AUDIOPEAK_ONSET_SPECTRAL_FLUX = 1,
+	AUDIOPEAK_ONSET_LOG_FLUX,
+	AUDIOPEAK_ONSET_HIGH_FREQUENCY_CONTENT,
+	AUDIOPEAK_ONSET_COMPLEX_DOMAIN,
+	AUDIOPEAK_ONSET_ENERGY_ENVELOPE
+} audiopeak_onset_function;
+
+typedef enum audiopeak_threshold_mode {
+	AUDIOPEAK_THRESHOLD_TRAILING_MEAN = 1,
+	AUDIOPEAK_THRESHOLD_ROLLING_PERCENTILE
+} audiopeak_threshold_mode;
+
+/* AUDIOPEAK_ARITHMETIC_FIXED_Q15 runs the STFT and, for spectral flux,
+   the detection function in 16-bit fixed point (see README.md for its
+   accuracy against float). */
+typedef enum audiopeak_arithmetic {
+	AUDIOPEAK_ARITHMETIC_FLOAT = 0,
+	AUDIOPEAK_ARITHMETIC_FIXED_Q15
+} audiopeak_arithmetic;
+
+/* Both functions must be safe to call from whichever thread runs the
+   detector. allocate returns memory aligned for any type, or NULL. */
+typedef struct audiopeak_allocator {
+	void* (*allocate)(void* user, size_t bytes);
+	void (*release)(void* user, void* memory);
+	void* user;
+} audiopeak_allocator;
+
+/* The plug-in's controls, with the same units and defaults. */
+typedef struct audiopeak_settings {
+	size_t struct_size;
+	int onset_function;               /* audiopeak_onset_function */
+	double sample_rate;               /* of the buffers passed to analyze */
+	int fft_size;                     /* even, 16 to 16384 */
+	int hop_size;                     /* 1 to fft_size */
+	float threshold_multiplier;
+	int threshold_mode;               /* audiopeak_threshold_mode */
+	float threshold_percentile;       /* 0..100, Rolling Percentile only */
+	float percentile_window_seconds;  /* Rolling Percentile only */
+	float smoothing_percent;          /* 0..100 */
+	float min_separation_seconds;
+	double low_crossover_hz;
+	double high_crossover_hz;
+	int arithmetic;                   /* audiopeak_arithmetic */
+	int note_onsets;                  /* nonzero: also find onsets per note */
+} audiopeak_settings;
+
+typedef struct audiopeak_peak {
+	int64_t sample;     /* start of the peak's STFT frame */
+	double seconds;
+	float strength;     /* smoothed onset value */
+	float amplitude;    /* percent of the strongest peak */
+	int is_loud;        /* amplitude at or above 75% */
+} audiopeak_peak;
+
+/* An onset on one semitone, from a constant-Q kernel applied to each STFT
+   frame (see README.md). */
+typedef struct audiopeak_note {
+	int64_t sample;     /* start of the onset's STFT frame */
+	double seconds;
+	int note;           /* MIDI note number, 36 (C2) to 107 (B7) */
+	float strength;     /* smoothed pitch flux */
+	float amplitude;    /* percent of the strongest note onset */
+} audiopeak_note;
+
+/* Frames [first_frame, end_frame) of the onset curve that one shard of a
+   long recording computes, and the input frames [first_sample, end_sample)
+   it reads for them. See audiopeak_plan_shard(). */
+typedef struct audiopeak_shard {
+	int64_t first_frame;
+	int64_t end_frame;
+	int64_t first_sample;
+	int64_t end_sample;
+} audiopeak_shard;
+
+/* Fills buffer with up to capacity interleaved input frames and returns how
+   many; fewer only at the end of the input. */
+typedef size_t (*audiopeak_read_function)(void* user, float* buffer, size_t capacity);
+
+typedef struct audiopeak_detector audiopeak_detector;
+typedef struct audiopeak_result audiopeak_result;
+
+AUDIOPEAK_API unsigned audiopeak_abi_version(void);
+AUDIOPEAK_API const char* audiopeak_status_string(audiopeak_status status);
+
+/* Fills settings with the plug-in's defaults at 44.1 kHz (Standard quality). */
+AUDIOPEAK_API void audiopeak_default_settings(audiopeak_settings* settings);
+
+/* allocator may be NULL. The settings are copied. */
+AUDIOPEAK_API audiopeak_status audiopeak_create(const audiopeak_settings* settings,
+	const audiopeak_allocator* allocator,
+	audiopeak_detector** detector);
+AUDIOPEAK_API void audiopeak_destroy(audiopeak_detector* detector);
+
+/* Analyzes frame_count interleaved frames of channel_count channels, which
+   are averaged to mono. The result is independent of the detector and may
+   outlive it; release it with audiopeak_result_free(). */
+AUDIOPEAK_API audiopeak_status audiopeak_analyze(audiopeak_detector* detector,
+	const float* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result** result);
+
+/* audiopeak_analyze() for 16-bit PCM, full scale at 32768. A fixed-point
+   detector takes the samples as they are; a float one scales them. */
+AUDIOPEAK_API audiopeak_status audiopeak_analyze_pcm16(audiopeak_detector* detector,
+	const int16_t* samples,
+	int channel_count,
+	size_t frame_count,
+	audiopeak_result** result);
+
+/*
+ Sharded analysis. A recording of frame_count input frames is split into
+ shard_count shards that can run in separate processes or on separate
+ machines, each with a detector of the same settings:
+
+ 1. audiopeak_plan_shard() gives shard shard_index its frames and the input
+    range to read, which starts a couple of hops early so its first frame
+    has the same history as in a single pass.
+ 2. audiopeak_analyze_shard() pulls that range from read and returns the
+    shard's curve, without peaks.
+ 3. The curves, laid end to end in shard order, are the single-pass curve
+    bit for bit; audiopeak_pick_peaks() smooths and picks over the whole of
+    it, across the shard boundaries, and gives the same peaks as
+    audiopeak_analyze() over the whole recording.
+*/
+AUDIOPEAK_API audiopeak_status audiopeak_plan_shard(const audiopeak_detector* detector,
+	int64_t frame_count,
+	int shard_index,
+	int shard_count,
+	audiopeak_shard* shard);
+/* read delivers input from shard->first_sample on. */
+AUDIOPEAK_API audiopeak_status audiopeak_analyze_shard(audiopeak_detector* detector,
+	const audiopeak_shard* shard,
+	int channel_count,
+	audiopeak_read_function read,
+	void* user,
+	audiopeak_result** result);
+/* Peaks of a complete onset curve, frame 0 first. The result holds a copy of
+   the curve. */
+AUDIOPEAK_API audiopeak_status audiopeak_pick_peaks(audiopeak_detector* detector,
+	const float* flux,
+	size_t frame_count,
+	audiopeak_result** result);
+
+/* Broadband onset curve before smoothing, one value per STFT frame. */
+AUDIOPEAK_API const float* audiopeak_result_flux(const audiopeak_result* result, size_t* frame_count);
+AUDIOPEAK_API double audiopeak_result_frames_per_second(const audiopeak_result* result);
+/* Frame of the curve's first value: 0, or the shard's first frame. */
+AUDIOPEAK_API int64_t audiopeak_result_first_frame(const audiopeak_result* result);
+/* Broadband peaks in time order. */
+AUDIOPEAK_API const audiopeak_peak* audiopeak_result_peaks(const audiopeak_result* result, size_t* peak_count);
+/* Note onsets in time order, lower notes first within a frame. Only
+   audiopeak_analyze() and audiopeak_analyze_pcm16() find them, and only
+   with note_onsets set; other results have none. */
+AUDIOPEAK_API const audiopeak_note* audiopeak_result_notes(const audiopeak_result* result, size_t* note_count);
+/* Pitch flux summed over octaves: 12 values per frame, C first, for the
+   frames of audiopeak_result_flux(). NULL unless the analysis looked for
+   note onsets. */
+AUDIOPEAK_API const float* audiopeak_result_chroma_flux(const audiopeak_result* result, size_t* frame_count);
+AUDIOPEAK_API void audiopeak_result_free(audiopeak_result* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AUDIOPEAK_H */
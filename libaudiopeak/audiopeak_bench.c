@@ -0,0 +1,203 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Thread-scaling benchmark for libaudiopeak. One synthetic track is analyzed
+ by 1, 2, 4, ... threads at once, each thread with its own detector and its
+ own counting allocator, and every thread must find the same peaks as the
+ single-threaded run.
+
+ Usage: audiopeak_bench [seconds of audio = 600] [max threads = 8] [runs per thread = 4]
+*/
+
+#include "audiopeak.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct counting_heap {
+	size_t allocations;
+	size_t bytes;
+} counting_heap;
+
+typedef struct bench_thread {
+	pthread_t thread;
+	const float* samples;
+	size_t frame_count;
+	int runs;
+	counting_heap heap;
+	size_t peak_count;
+	int64_t last_peak_sample;
+	audiopeak_status status;
+} bench_thread;
+
+static void* CountingAllocate(void* user, size_t bytes)
+{
+	counting_heap* heap = (counting_heap*)user;
+	++heap->allocations;
+	heap->bytes += bytes;
+	return malloc(bytes);
+}
+
+static void CountingRelease(void* user, void* memory)
+{
+	(void)user;
+	free(memory);
+}
+
+static double NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+/* A kick-like click every 0.25 to 0.75 s over low noise, deterministic. */
+static float* MakeTrack(double sample_rate, size_t frame_count)
+{
+	float* samples = (float*)malloc(frame_count * sizeof(float));
+	uint32_t state = 12345u;
+	size_t next_hit = 0;
+	size_t hit_start = 0;
+	size_t i;
+	if (!samples) {
+		return NULL;
+	}
+	for (i = 0; i < frame_count; ++i) {
+		float value;
+		state = state * 1664525u + 1013904223u;
+		value = ((float)(state >> 8) / 16777216.0f - 0.5f) * 0.02f;
+		if (i == next_hit) {
+			hit_start = i;
+			next_hit = i + (size_t)(sample_rate * (0.25 + 0.5 * (double)(state >> 24) / 255.0));
+		}
+		if (i - hit_start < 2048) {
+			const float decay = 1.0f - (float)(i - hit_start) / 2048.0f;
+			value += decay * decay * (((i - hit_start) / 40) % 2 ? 0.8f : -0.8f);
+		}
+		samples[i] = value;
+	}
+	return samples;
+}
+
+static void* RunThread(void* argument)
+{
+	bench_thread* bench = (bench_thread*)argument;
+	audiopeak_settings settings;
+	audiopeak_allocator allocator;
+	audiopeak_detector* detector = NULL;
+	int run;
+
+	audiopeak_default_settings(&settings);
+	allocator.allocate = CountingAllocate;
+	allocator.release = CountingRelease;
+	allocator.user = &bench->heap;
+	bench->status = audiopeak_create(&settings, &allocator, &detector);
+	for (run = 0; run < bench->runs && bench->status == AUDIOPEAK_OK; ++run) {
+		audiopeak_result* result = NULL;
+		bench->status = audiopeak_analyze(detector, bench->samples, 1, bench->frame_count, &result);
+		if (bench->status == AUDIOPEAK_OK) {
+			const audiopeak_peak* peaks = audiopeak_result_peaks(result, &bench->peak_count);
+			bench->last_peak_sample = bench->peak_count ? peaks[bench->peak_count - 1].sample : -1;
+			audiopeak_result_free(result);
+		}
+	}
+	audiopeak_destroy(detector);
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	const double seconds = (argc > 1) ? atof(argv[1]) : 600.0;
+	const int max_threads = (argc > 2) ? atoi(argv[2]) : 8;
+	const int runs = (argc > 3) ? atoi(argv[3]) : 4;
+	const double sample_rate = 44100.0;
+	const size_t frame_count = (size_t)(seconds * sample_rate);
+	float* samples;
+	double single_rate = 0.0;
+	size_t expected_peaks = 0;
+	int64_t expected_last = -1;
+	int thread_count;
+	int failed = 0;
+
+	if (seconds <= 0.0 || max_threads < 1 || runs < 1) {
+		fprintf(stderr, "usage: %s [seconds] [max threads] [runs per thread]\n", argv[0]);
+		return 2;
+	}
+	samples = MakeTrack(sample_rate, frame_count);
+	if (!samples) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("libaudiopeak ABI %u, %.0f s of audio, %d runs per thread\n", audiopeak_abi_version(), seconds, runs);
+	printf("threads  wall (s)  audio/wall  speedup  peaks  allocations/run\n");
+	for (thread_count = 1; thread_count <= max_threads; thread_count *= 2) {
+		bench_thread* threads = (bench_thread*)calloc((size_t)thread_count, sizeof(bench_thread));
+		double start;
+		double wall;
+		double rate;
+		int t;
+		if (!threads) {
+			failed = 1;
+			break;
+		}
+		start = NowSeconds();
+		for (t = 0; t < thread_count; ++t) {
+			threads[t].samples = samples;
+			threads[t].frame_count = frame_count;
+			threads[t].runs = runs;
+			pthread_create(&threads[t].thread, NULL, RunThread, &threads[t]);
+		}
+		for (t = 0; t < thread_count; ++t) {
+			pthread_join(threads[t].thread, NULL);
+		}
+		wall = NowSeconds() - start;
+		rate = seconds * runs * thread_count / wall;
+		if (thread_count == 1) {
+			single_rate = rate;
+			expected_peaks = threads[0].peak_count;
+			expected_last = threads[0].last_peak_sample;
+		}
+		for (t = 0; t < thread_count; ++t) {
+			if (threads[t].status != AUDIOPEAK_OK) {
+				fprintf(stderr, "thread %d: %s\n", t, audiopeak_status_string(threads[t].status));
+				failed = 1;
+			} else if (threads[t].peak_count != expected_peaks || threads[t].last_peak_sample != expected_last) {
+				fprintf(stderr, "thread %d: %zu peaks, expected %zu\n", t, threads[t].peak_count, expected_peaks);
+				failed = 1;
+			}
+		}
+		printf("%7d  %8.3f  %9.0fx  %7.2f  %5zu  %15.1f\n",
+			thread_count,
+			wall,
+			rate,
+			rate / single_rate,
+			threads[0].peak_count,
+			(double)threads[0].heap.allocations / runs);
+		free(threads);
+	}
+
+	free(samples);
+	return failed;
+}
@@ -0,0 +1,206 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Accuracy and speed of the fixed-point (Q15) pipeline against float, on a
+ synthetic stereo 16-bit track played at several levels below full scale.
+ For every detection function and level it reports how far the Q15 onset
+ curve strays from the float one, relative to the float curve's largest
+ value, how many float peaks the Q15 run finds within one frame, and the
+ time of each run.
+
+ Usage: audiopeak_pcm16_bench [seconds of audio = 60] [fft size = 2048]
+*/
+
+#include "audiopeak.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+/* Decaying clicks every 0.25 to 0.75 s over a chord whose notes swell and
+   fade, and low noise; peaks near 0.9 of full scale. Deterministic. */
+static float* MakeTrack(double sample_rate, size_t frame_count)
+{
+	static const double kNotes[] = { 110.0, 164.8, 220.0, 277.2, 329.6 };
+	float* samples = (float*)malloc(frame_count * 2 * sizeof(float));
+	uint32_t state = 12345u;
+	size_t next_hit = 0;
+	size_t hit_start = 0;
+	size_t i;
+	int note;
+	if (!samples) {
+		return NULL;
+	}
+	for (i = 0; i < frame_count; ++i) {
+		const double t = (double)i / sample_rate;
+		float value = 0.0f;
+		state = state * 1664525u + 1013904223u;
+		value += ((float)(state >> 8) / 16777216.0f - 0.5f) * 0.01f;
+		for (note = 0; note < 5; ++note) {
+			const double swell = 0.5 + 0.5 * sin(2.0 * 3.14159265358979 * t / (3.0 + note));
+			value += (float)(0.06 * swell * sin(2.0 * 3.14159265358979 * kNotes[note] * t));
+		}
+		if (i == next_hit) {
+			hit_start = i;
+			next_hit = i + (size_t)(sample_rate * (0.25 + 0.5 * (double)(state >> 24) / 255.0));
+		}
+		if (i - hit_start < 2048) {
+			const float decay = 1.0f - (float)(i - hit_start) / 2048.0f;
+			value += decay * decay * (((i - hit_start) / 40) % 2 ? 0.5f : -0.5f);
+		}
+		samples[2 * i] = value;
+		samples[2 * i + 1] = value * 0.8f;
+	}
+	return samples;
+}
+
+static void ToPcm16(const float* samples, size_t count, double gain, int16_t* pcm)
+{
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		const double value = floor(samples[i] * gain * 32768.0 + 0.5);
+		pcm[i] = (int16_t)(value > 32767.0 ? 32767.0 : (value < -32768.0 ? -32768.0 : value));
+	}
+}
+
+/* Best of three runs, in seconds; the last run's result is kept. */
+static double TimeAnalysis(audiopeak_detector* detector, const int16_t* pcm, size_t frame_count, audiopeak_result** result)
+{
+	double best = 1e30;
+	int run;
+	for (run = 0; run < 3; ++run) {
+		const double start = NowSeconds();
+		double elapsed;
+		audiopeak_result_free(*result);
+		*result = NULL;
+		if (audiopeak_analyze_pcm16(detector, pcm, 2, frame_count, result) != AUDIOPEAK_OK) {
+			return -1.0;
+		}
+		elapsed = NowSeconds() - start;
+		best = (elapsed < best) ? elapsed : best;
+	}
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	static const char* kFunctions[] = { "", "flux", "log flux", "hfc", "complex", "energy" };
+	static const double kLevels[] = { 0.0, -12.0, -24.0, -36.0, -48.0 };
+	const double seconds = (argc > 1) ? atof(argv[1]) : 60.0;
+	const int fft_size = (argc > 2) ? atoi(argv[2]) : 2048;
+	audiopeak_settings settings;
+	size_t frame_count;
+	float* track;
+	int16_t* pcm;
+	int function;
+	size_t level;
+
+	audiopeak_default_settings(&settings);
+	settings.fft_size = fft_size;
+	settings.hop_size = fft_size / 2;
+	frame_count = (size_t)(seconds * settings.sample_rate);
+	track = MakeTrack(settings.sample_rate, frame_count);
+	pcm = (int16_t*)malloc(frame_count * 2 * sizeof(int16_t));
+	if (!track || !pcm) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	printf("%.0f s stereo, %d-point frames\n", seconds, fft_size);
+	printf("function   level  max err  mean err  float peaks  q15 found  extra  float ms  q15 ms  speedup\n");
+	for (function = AUDIOPEAK_ONSET_SPECTRAL_FLUX; function <= AUDIOPEAK_ONSET_ENERGY_ENVELOPE; ++function) {
+		for (level = 0; level < sizeof(kLevels) / sizeof(kLevels[0]); ++level) {
+			audiopeak_detector* float_detector = NULL;
+			audiopeak_detector* fixed_detector = NULL;
+			audiopeak_result* float_result = NULL;
+			audiopeak_result* fixed_result = NULL;
+			const float* float_flux;
+			const float* fixed_flux;
+			const audiopeak_peak* float_peaks;
+			const audiopeak_peak* fixed_peaks;
+			size_t flux_count, fixed_count, float_peak_count, fixed_peak_count;
+			double float_time, fixed_time, float_max = 0.0, max_error = 0.0, sum_error = 0.0;
+			size_t i, j, found = 0;
+
+			ToPcm16(track, frame_count * 2, pow(10.0, kLevels[level] / 20.0), pcm);
+			settings.onset_function = function;
+			settings.arithmetic = AUDIOPEAK_ARITHMETIC_FLOAT;
+			audiopeak_create(&settings, NULL, &float_detector);
+			settings.arithmetic = AUDIOPEAK_ARITHMETIC_FIXED_Q15;
+			audiopeak_create(&settings, NULL, &fixed_detector);
+			if (!float_detector || !fixed_detector) {
+				fprintf(stderr, "cannot create detectors\n");
+				return 1;
+			}
+			float_time = TimeAnalysis(float_detector, pcm, frame_count, &float_result);
+			fixed_time = TimeAnalysis(fixed_detector, pcm, frame_count, &fixed_result);
+			if (float_time < 0.0 || fixed_time < 0.0) {
+				fprintf(stderr, "analysis failed\n");
+				return 1;
+			}
+
+			float_flux = audiopeak_result_flux(float_result, &flux_count);
+			fixed_flux = audiopeak_result_flux(fixed_result, &fixed_count);
+			for (i = 0; i < flux_count; ++i) {
+				float_max = (float_flux[i] > float_max) ? float_flux[i] : float_max;
+			}
+			for (i = 0; i < flux_count && i < fixed_count; ++i) {
+				const double error = fabs((double)fixed_flux[i] - float_flux[i]);
+				max_error = (error > max_error) ? error : max_error;
+				sum_error += error;
+			}
+			float_peaks = audiopeak_result_peaks(float_result, &float_peak_count);
+			fixed_peaks = audiopeak_result_peaks(fixed_result, &fixed_peak_count);
+			for (i = 0, j = 0; i < float_peak_count; ++i) {
+				while (j < fixed_peak_count && fixed_peaks[j].sample + settings.hop_size < float_peaks[i].sample) {
+					++j;
+				}
+				if (j < fixed_peak_count && fixed_peaks[j].sample <= float_peaks[i].sample + settings.hop_size) {
+					++found;
+				}
+			}
+
+			printf("%-9s %6.0f  %6.2f%%  %7.3f%%  %11zu  %9zu  %5zu  %8.1f  %6.1f  %6.2fx\n",
+				kFunctions[function], kLevels[level],
+				float_max > 0.0 ? 100.0 * max_error / float_max : 0.0,
+				float_max > 0.0 && flux_count > 0 ? 100.0 * sum_error / (float_max * (double)flux_count) : 0.0,
+				float_peak_count, found, fixed_peak_count - (found < fixed_peak_count ? found : fixed_peak_count),
+				float_time * 1e3, fixed_time * 1e3, float_time / fixed_time);
+
+			audiopeak_result_free(fixed_result);
+			audiopeak_result_free(float_result);
+			audiopeak_destroy(fixed_detector);
+			audiopeak_destroy(float_detector);
+		}
+	}
+	free(pcm);
+	free(track);
+	return 0;
+}
@@ -0,0 +1,498 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Sharded analysis of long recordings with libaudiopeak. The input is raw
+ interleaved 32-bit float audio (for example `sox in.wav -t f32 out.f32`),
+ analyzed with the library's default settings.
+
+   audiopeak_shard analyze <input.f32> <rate> <channels> <shard> <shards> <slice.apkf>
+     Computes one shard's onset curve, reading only the shard's part of the
+     input, and writes it to a slice file. Shards can run on any machine
+     that sees the input.
+   audiopeak_shard merge <slice.apkf>...
+     Stitches the slices of every shard, picks peaks over the whole curve
+     and prints them as CSV (seconds,sample,amplitude,loud).
+   audiopeak_shard run <input.f32> <rate> <channels> <processes> [--verify]
+     Runs one shard per process on this machine, merges them and prints the
+     peaks. --verify also analyzes the input in a single process and checks
+     that curve and peaks are identical.
+
+ A slice file, little-endian: "APKF", u32 version 1, f64 sample rate, i32
+ FFT size, i32 hop, i32 onset function, i32 reserved, f64 low and f64 high
+ crossover, i64 first frame, i64 frame count, i64 frames of the whole
+ recording, then the curve as f32.
+*/
+
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+
+#include "audiopeak.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLICE_VERSION 1u
+
+typedef struct slice_header {
+	double sample_rate;
+	int32_t fft_size;
+	int32_t hop_size;
+	int32_t onset_function;
+	double low_crossover_hz;
+	double high_crossover_hz;
+	int64_t first_frame;
+	int64_t frame_count;
+	int64_t total_frames;
+} slice_header;
+
+typedef struct slice {
+	slice_header header;
+	float* flux;
+} slice;
+
+typedef struct file_reader {
+	FILE* file;
+	int channel_count;
+} file_reader;
+
+static double NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static size_t ReadFrames(void* user, float* buffer, size_t capacity)
+{
+	file_reader* reader = (file_reader*)user;
+	return fread(buffer, sizeof(float) * (size_t)reader->channel_count, capacity, reader->file);
+}
+
+static int64_t InputFrames(const char* path, int channel_count)
+{
+	struct stat info;
+	if (stat(path, &info) != 0) {
+		return -1;
+	}
+	return (int64_t)info.st_size / ((int64_t)sizeof(float) * channel_count);
+}
+
+static audiopeak_status CreateDetector(double sample_rate, audiopeak_detector** detector)
+{
+	audiopeak_settings settings;
+	audiopeak_default_settings(&settings);
+	settings.sample_rate = sample_rate;
+	return audiopeak_create(&settings, NULL, detector);
+}
+
+/* ---------------------------------------------------------------- Slices */
+
+static int WriteSlice(const char* path, const audiopeak_settings* settings, const audiopeak_result* result, int64_t total_frames)
+{
+	FILE* file = fopen(path, "wb");
+	const uint32_t version = SLICE_VERSION;
+	const int32_t reserved = 0;
+	size_t frame_count = 0;
+	const float* flux = audiopeak_result_flux(result, &frame_count);
+	const int64_t first_frame = audiopeak_result_first_frame(result);
+	const int64_t count = (int64_t)frame_count;
+	const int32_t fft_size = settings->fft_size;
+	const int32_t hop_size = settings->hop_size;
+	const int32_t onset_function = settings->onset_function;
+	int ok;
+	if (!file) {
+		return 0;
+	}
+	ok = fwrite("APKF", 1, 4, file) == 4 &&
+		fwrite(&version, sizeof(version), 1, file) == 1 &&
+		fwrite(&settings->sample_rate, sizeof(double), 1, file) == 1 &&
+		fwrite(&fft_size, sizeof(fft_size), 1, file) == 1 &&
+		fwrite(&hop_size, sizeof(hop_size), 1, file) == 1 &&
+		fwrite(&onset_function, sizeof(onset_function), 1, file) == 1 &&
+		fwrite(&reserved, sizeof(reserved), 1, file) == 1 &&
+		fwrite(&settings->low_crossover_hz, sizeof(double), 1, file) == 1 &&
+		fwrite(&settings->high_crossover_hz, sizeof(double), 1, file) == 1 &&
+		fwrite(&first_frame, sizeof(first_frame), 1, file) == 1 &&
+		fwrite(&count, sizeof(count), 1, file) == 1 &&
+		fwrite(&total_frames, sizeof(total_frames), 1, file) == 1 &&
+		fwrite(flux, sizeof(float), frame_count, file) == frame_count;
+	return (fclose(file) == 0) && ok;
+}
+
+static int ReadSlice(const char* path, slice* out)
+{
+	FILE* file = fopen(path, "rb");
+	char magic[4];
+	uint32_t version = 0;
+	int32_t reserved = 0;
+	slice_header* header = &out->header;
+	int ok;
+	out->flux = NULL;
+	if (!file) {
+		return 0;
+	}
+	ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "APKF", 4) == 0 &&
+		fread(&version, sizeof(version), 1, file) == 1 && version == SLICE_VERSION &&
+		fread(&header->sample_rate, sizeof(double), 1, file) == 1 &&
+		fread(&header->fft_size, sizeof(int32_t), 1, file) == 1 &&
+		fread(&header->hop_size, sizeof(int32_t), 1, file) == 1 &&
+		fread(&header->onset_function, sizeof(int32_t), 1, file) == 1 &&
+		fread(&reserved, sizeof(reserved), 1, file) == 1 &&
+		fread(&header->low_crossover_hz, sizeof(double), 1, file) == 1 &&
+		fread(&header->high_crossover_hz, sizeof(double), 1, file) == 1 &&
+		fread(&header->first_frame, sizeof(int64_t), 1, file) == 1 &&
+		fread(&header->frame_count, sizeof(int64_t), 1, file) == 1 &&
+		fread(&header->total_frames, sizeof(int64_t), 1, file) == 1 &&
+		header->frame_count >= 0 && header->first_frame >= 0;
+	if (ok) {
+		out->flux = (float*)malloc((size_t)(header->frame_count ? header->frame_count : 1) * sizeof(float));
+		ok = out->flux && fread(out->flux, sizeof(float), (size_t)header->frame_count, file) == (size_t)header->frame_count;
+	}
+	fclose(file);
+	if (!ok) {
+		free(out->flux);
+		out->flux = NULL;
+	}
+	return ok;
+}
+
+static int CompareSlices(const void* a, const void* b)
+{
+	const int64_t first_a = ((const slice*)a)->header.first_frame;
+	const int64_t first_b = ((const slice*)b)->header.first_frame;
+	return (first_a > first_b) - (first_a < first_b);
+}
+
+/* Stitches the slices into one curve after checking that they come from the
+   same settings and cover every frame once. NULL on error. */
+static float* StitchSlices(slice* slices, int slice_count, slice_header* whole)
+{
+	float* flux;
+	int64_t next_frame = 0;
+	int i;
+	qsort(slices, (size_t)slice_count, sizeof(slice), CompareSlices);
+	*whole = slices[0].header;
+	for (i = 0; i < slice_count; ++i) {
+		const slice_header* header = &slices[i].header;
+		if (header->sample_rate != whole->sample_rate || header->fft_size != whole->fft_size ||
+			header->hop_size != whole->hop_size || header->onset_function != whole->onset_function ||
+			header->low_crossover_hz != whole->low_crossover_hz || header->high_crossover_hz != whole->high_crossover_hz ||
+			header->total_frames != whole->total_frames) {
+			fprintf(stderr, "audiopeak_shard: slices come from different settings or recordings\n");
+			return NULL;
+		}
+		if (header->first_frame != next_frame) {
+			fprintf(stderr, "audiopeak_shard: frames %lld to %lld are missing or doubled\n",
+				(long long)next_frame, (long long)header->first_frame);
+			return NULL;
+		}
+		next_frame += header->frame_count;
+	}
+	if (next_frame != whole->total_frames) {
+		fprintf(stderr, "audiopeak_shard: frames from %lld on are missing\n", (long long)next_frame);
+		return NULL;
+	}
+	flux = (float*)malloc((size_t)(whole->total_frames ? whole->total_frames : 1) * sizeof(float));
+	if (!flux) {
+		return NULL;
+	}
+	for (i = 0; i < slice_count; ++i) {
+		memcpy(flux + slices[i].header.first_frame, slices[i].flux, (size_t)slices[i].header.frame_count * sizeof(float));
+	}
+	whole->first_frame = 0;
+	whole->frame_count = whole->total_frames;
+	return flux;
+}
+
+/* ---------------------------------------------------------------- Commands */
+
+static int AnalyzeShard(const char* input, double sample_rate, int channel_count, int shard_index, int shard_count, const char* output)
+{
+	const int64_t frame_count = InputFrames(input, channel_count);
+	audiopeak_detector* detector = NULL;
+	audiopeak_result* result = NULL;
+	audiopeak_settings settings;
+	audiopeak_shard shard;
+	audiopeak_shard whole;
+	file_reader reader;
+	audiopeak_status status;
+	int ok = 0;
+
+	if (frame_count < 0) {
+		fprintf(stderr, "audiopeak_shard: cannot read %s\n", input);
+		return 0;
+	}
+	audiopeak_default_settings(&settings);
+	settings.sample_rate = sample_rate;
+	status = audiopeak_create(&settings, NULL, &detector);
+	if (status == AUDIOPEAK_OK) {
+		status = audiopeak_plan_shard(detector, frame_count, shard_index, shard_count, &shard);
+	}
+	if (status == AUDIOPEAK_OK) {
+		status = audiopeak_plan_shard(detector, frame_count, 0, 1, &whole);
+	}
+	reader.channel_count = channel_count;
+	reader.file = (status == AUDIOPEAK_OK) ? fopen(input, "rb") : NULL;
+	if (reader.file && fseeko(reader.file, (off_t)(shard.first_sample * channel_count * (int64_t)sizeof(float)), SEEK_SET) == 0) {
+		status = audiopeak_analyze_shard(detector, &shard, channel_count, ReadFrames, &reader, &result);
+		ok = (status == AUDIOPEAK_OK) && WriteSlice(output, &settings, result, whole.end_frame);
+	}
+	if (reader.file) {
+		fclose(reader.file);
+	}
+	if (status != AUDIOPEAK_OK) {
+		fprintf(stderr, "audiopeak_shard: shard %d: %s\n", shard_index, audiopeak_status_string(status));
+	} else if (!ok) {
+		fprintf(stderr, "audiopeak_shard: shard %d: cannot read %s or write %s\n", shard_index, input, output);
+	}
+	audiopeak_result_free(result);
+	audiopeak_destroy(detector);
+	return ok;
+}
+
+/* Stitches the slices, picks the peaks of the whole curve and returns them
+   with the curve; NULL on error. */
+static audiopeak_result* MergeSlices(char** paths, int path_count)
+{
+	slice* slices = (slice*)calloc((size_t)path_count, sizeof(slice));
+	audiopeak_result* result = NULL;
+	audiopeak_detector* detector = NULL;
+	audiopeak_settings settings;
+	slice_header whole;
+	float* flux = NULL;
+	int loaded = 0;
+	audiopeak_status status;
+
+	if (!slices) {
+		return NULL;
+	}
+	while (loaded < path_count && ReadSlice(paths[loaded], &slices[loaded])) {
+		++loaded;
+	}
+	if (loaded < path_count) {
+		fprintf(stderr, "audiopeak_shard: cannot read slice %s\n", paths[loaded]);
+	} else {
+		flux = StitchSlices(slices, loaded, &whole);
+	}
+	if (flux) {
+		audiopeak_default_settings(&settings);
+		settings.sample_rate = whole.sample_rate;
+		settings.fft_size = whole.fft_size;
+		settings.hop_size = whole.hop_size;
+		settings.onset_function = whole.onset_function;
+		settings.low_crossover_hz = whole.low_crossover_hz;
+		settings.high_crossover_hz = whole.high_crossover_hz;
+		status = audiopeak_create(&settings, NULL, &detector);
+		if (status == AUDIOPEAK_OK) {
+			status = audiopeak_pick_peaks(detector, flux, (size_t)whole.total_frames, &result);
+		}
+		if (status != AUDIOPEAK_OK) {
+			fprintf(stderr, "audiopeak_shard: merge: %s\n", audiopeak_status_string(status));
+		}
+		audiopeak_destroy(detector);
+	}
+	free(flux);
+	while (loaded > 0) {
+		free(slices[--loaded].flux);
+	}
+	free(slices);
+	return result;
+}
+
+static void PrintPeaks(const audiopeak_result* result)
+{
+	size_t peak_count = 0;
+	const audiopeak_peak* peaks = audiopeak_result_peaks(result, &peak_count);
+	size_t i;
+	printf("seconds,sample,amplitude,loud\n");
+	for (i = 0; i < peak_count; ++i) {
+		printf("%.6f,%lld,%.3f,%d\n", peaks[i].seconds, (long long)peaks[i].sample, peaks[i].amplitude, peaks[i].is_loud);
+	}
+}
+
+/* Single-process analysis of the whole input, mapped rather than read, and
+   a check that the merged result matches it. */
+static int VerifyMerge(const char* input, double sample_rate, int channel_count, const audiopeak_result* merged)
+{
+	const int64_t frame_count = InputFrames(input, channel_count);
+	const int descriptor = open(input, O_RDONLY);
+	const size_t bytes = (size_t)frame_count * (size_t)channel_count * sizeof(float);
+	void* mapping = MAP_FAILED;
+	audiopeak_detector* detector = NULL;
+	audiopeak_result* single = NULL;
+	size_t merged_frames = 0, single_frames = 0, merged_peaks = 0, single_peaks = 0;
+	const float* merged_flux;
+	const float* single_flux;
+	const audiopeak_peak* merged_list;
+	const audiopeak_peak* single_list;
+	double start;
+	int same = 0;
+	size_t i;
+
+	if (descriptor >= 0 && bytes > 0) {
+		mapping = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, descriptor, 0);
+	}
+	if (mapping == MAP_FAILED || CreateDetector(sample_rate, &detector) != AUDIOPEAK_OK) {
+		fprintf(stderr, "audiopeak_shard: cannot map %s\n", input);
+	} else {
+		start = NowSeconds();
+		if (audiopeak_analyze(detector, (const float*)mapping, channel_count, (size_t)frame_count, &single) == AUDIOPEAK_OK) {
+			fprintf(stderr, "single process: %.3f s\n", NowSeconds() - start);
+			merged_flux = audiopeak_result_flux(merged, &merged_frames);
+			single_flux = audiopeak_result_flux(single, &single_frames);
+			merged_list = audiopeak_result_peaks(merged, &merged_peaks);
+			single_list = audiopeak_result_peaks(single, &single_peaks);
+			same = merged_frames == single_frames && merged_peaks == single_peaks &&
+				memcmp(merged_flux, single_flux, merged_frames * sizeof(float)) == 0;
+			for (i = 0; same && i < merged_peaks; ++i) {
+				same = merged_list[i].sample == single_list[i].sample && merged_list[i].strength == single_list[i].strength;
+			}
+			fprintf(stderr, "verify: %zu frames, %zu peaks single, %zu merged: %s\n",
+				single_frames, single_peaks, merged_peaks, same ? "identical" : "DIFFERENT");
+		}
+	}
+	audiopeak_result_free(single);
+	audiopeak_destroy(detector);
+	if (mapping != MAP_FAILED) {
+		munmap(mapping, bytes);
+	}
+	if (descriptor >= 0) {
+		close(descriptor);
+	}
+	return same;
+}
+
+static int RunShards(const char* input, double sample_rate, int channel_count, int process_count, int verify)
+{
+	char directory[] = "/tmp/audiopeak_shard.XXXXXX";
+	char** paths = (char**)calloc((size_t)process_count, sizeof(char*));
+	pid_t* children = (pid_t*)calloc((size_t)process_count, sizeof(pid_t));
+	audiopeak_result* merged = NULL;
+	double start;
+	double analyzed;
+	int ok = 1;
+	int p;
+
+	if (!paths || !children || !mkdtemp(directory)) {
+		fprintf(stderr, "audiopeak_shard: cannot create a work directory\n");
+		free(paths);
+		free(children);
+		return 0;
+	}
+	for (p = 0; p < process_count && ok; ++p) {
+		paths[p] = (char*)malloc(sizeof(directory) + 32);
+		ok = paths[p] != NULL;
+		if (ok) {
+			snprintf(paths[p], sizeof(directory) + 32, "%s/shard_%04d.apkf", directory, p);
+		}
+	}
+
+	start = NowSeconds();
+	for (p = 0; p < process_count && ok; ++p) {
+		children[p] = fork();
+		if (children[p] == 0) {
+			_exit(AnalyzeShard(input, sample_rate, channel_count, p, process_count, paths[p]) ? 0 : 1);
+		}
+		ok = children[p] > 0;
+	}
+	for (p = 0; p < process_count; ++p) {
+		int child_status = 0;
+		if (children[p] > 0 && (waitpid(children[p], &child_status, 0) < 0 || !WIFEXITED(child_status) || WEXITSTATUS(child_status) != 0)) {
+			ok = 0;
+		}
+	}
+	analyzed = NowSeconds();
+	if (ok) {
+		merged = MergeSlices(paths, process_count);
+		ok = merged != NULL;
+	}
+	if (ok) {
+		size_t peak_count = 0;
+		audiopeak_result_peaks(merged, &peak_count);
+		fprintf(stderr, "%d processes: shards %.3f s, merge %.3f s, %zu peaks\n",
+			process_count, analyzed - start, NowSeconds() - analyzed, peak_count);
+		if (verify) {
+			ok = VerifyMerge(input, sample_rate, channel_count, merged);
+		}
+		PrintPeaks(merged);
+	}
+
+	for (p = 0; p < process_count; ++p) {
+		if (paths[p]) {
+			unlink(paths[p]);
+			free(paths[p]);
+		}
+	}
+	rmdir(directory);
+	audiopeak_result_free(merged);
+	free(paths);
+	free(children);
+	return ok;
+}
+
+static int Usage(void)
+{
+	fprintf(stderr,
+		"usage: audiopeak_shard analyze <input.f32> <rate> <channels> <shard> <shards> <slice.apkf>\n"
+		"       audiopeak_shard merge <slice.apkf>...\n"
+		"       audiopeak_shard run <input.f32> <rate> <channels> <processes> [--verify]\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc == 8 && strcmp(argv[1], "analyze") == 0) {
+		const double sample_rate = atof(argv[3]);
+		const int channel_count = atoi(argv[4]);
+		if (sample_rate <= 0.0 || channel_count < 1) {
+			return Usage();
+		}
+		return AnalyzeShard(argv[2], sample_rate, channel_count, atoi(argv[5]), atoi(argv[6]), argv[7]) ? 0 : 1;
+	}
+	if (argc >= 3 && strcmp(argv[1], "merge") == 0) {
+		audiopeak_result* merged = MergeSlices(argv + 2, argc - 2);
+		if (!merged) {
+			return 1;
+		}
+		PrintPeaks(merged);
+		audiopeak_result_free(merged);
+		return 0;
+	}
+	if ((argc == 6 || (argc == 7 && strcmp(argv[6], "--verify") == 0)) && strcmp(argv[1], "run") == 0) {
+		const double sample_rate = atof(argv[3]);
+		const int channel_count = atoi(argv[4]);
+		const int process_count = atoi(argv[5]);
+		if (sample_rate <= 0.0 || channel_count < 1 || process_count < 1) {
+			return Usage();
+		}
+		return RunShards(argv[2], sample_rate, channel_count, process_count, argc == 7) ? 0 : 1;
+	}
+	return Usage();
+}
@@ -0,0 +1,234 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Sharded analysis against a single pass. For every detection function, five
+ FFT/hop geometries, both threshold modes and 2 to 13 shards, plus a short
+ input split into more shards than it has frames, it plans and analyzes each
+ shard through a read callback, lays the shard curves end to end and picks
+ peaks over them. The stitched curve must equal audiopeak_analyze()'s curve
+ bit for bit, and the peaks must equal its peaks field for field. Prints
+ every difference and exits 1 if there was any.
+
+ Usage: audiopeak_shard_test [seconds of audio = 20]
+*/
+
+#include "audiopeak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct track_reader {
+	const float* samples;
+	int channel_count;
+	size_t frame_count;
+	size_t position;
+} track_reader;
+
+static const int kGeometries[][2] = {
+	{ 1024, 512 }, { 2048, 1024 }, { 2048, 512 }, { 4096, 1024 }, { 1920, 480 }
+};
+
+/* Decaying clicks every 0.2 to 0.6 s over a slow tone and low noise, two
+   channels that differ in level. Deterministic. */
+static float* MakeTrack(double sample_rate, size_t frame_count)
+{
+	float* samples = (float*)malloc(frame_count * 2 * sizeof(float));
+	uint32_t state = 99u;
+	size_t next_hit = 0;
+	size_t hit_start = 0;
+	size_t i;
+	if (!samples) {
+		return NULL;
+	}
+	for (i = 0; i < frame_count; ++i) {
+		float value;
+		state = state * 1664525u + 1013904223u;
+		value = ((float)(state >> 8) / 16777216.0f - 0.5f) * 0.01f + 0.05f * (float)((i / 100) % 2);
+		if (i == next_hit) {
+			hit_start = i;
+			next_hit = i + (size_t)(sample_rate * (0.2 + 0.4 * (double)(state >> 24) / 255.0));
+		}
+		if (i - hit_start < 1500) {
+			const float decay = 1.0f - (float)(i - hit_start) / 1500.0f;
+			value += decay * decay * (((i - hit_start) / 25) % 2 ? 0.7f : -0.7f);
+		}
+		samples[2 * i] = value;
+		samples[2 * i + 1] = 0.5f * value;
+	}
+	return samples;
+}
+
+static size_t ReadTrack(void* user, float* buffer, size_t capacity)
+{
+	track_reader* reader = (track_reader*)user;
+	size_t count = reader->frame_count - reader->position;
+	if (count > capacity) {
+		count = capacity;
+	}
+	memcpy(buffer, reader->samples + reader->position * (size_t)reader->channel_count,
+		count * (size_t)reader->channel_count * sizeof(float));
+	reader->position += count;
+	return count;
+}
+
+static int SamePeaks(const audiopeak_peak* a, const audiopeak_peak* b, size_t count)
+{
+	size_t i;
+	for (i = 0; i < count; ++i) {
+		if (a[i].sample != b[i].sample || a[i].seconds != b[i].seconds || a[i].strength != b[i].strength ||
+			a[i].amplitude != b[i].amplitude || a[i].is_loud != b[i].is_loud) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Analyzes samples in shard_count shards and compares against one pass.
+   Returns 1 when curve and peaks match. */
+static int CheckShards(const audiopeak_settings* settings,
+	const float* samples,
+	size_t frame_count,
+	int shard_count,
+	size_t* single_frames,
+	size_t* single_peaks)
+{
+	audiopeak_detector* detector = NULL;
+	audiopeak_result* single = NULL;
+	audiopeak_result* merged = NULL;
+	const float* single_flux;
+	const audiopeak_peak* single_peak_list;
+	float* stitched = NULL;
+	size_t stitched_count = 0;
+	size_t frames;
+	int same = 0;
+	int shard_index;
+
+	if (audiopeak_create(settings, NULL, &detector) != AUDIOPEAK_OK ||
+		audiopeak_analyze(detector, samples, 2, frame_count, &single) != AUDIOPEAK_OK) {
+		goto done;
+	}
+	single_flux = audiopeak_result_flux(single, &frames);
+	single_peak_list = audiopeak_result_peaks(single, single_peaks);
+	*single_frames = frames;
+	stitched = (float*)malloc((frames ? frames : 1) * sizeof(float));
+	if (!stitched) {
+		goto done;
+	}
+
+	for (shard_index = 0; shard_index < shard_count; ++shard_index) {
+		audiopeak_shard shard;
+		audiopeak_result* part = NULL;
+		track_reader reader;
+		const float* flux;
+		size_t count;
+		if (audiopeak_plan_shard(detector, (int64_t)frame_count, shard_index, shard_count, &shard) != AUDIOPEAK_OK) {
+			goto done;
+		}
+		reader.samples = samples;
+		reader.channel_count = 2;
+		reader.frame_count = frame_count;
+		reader.position = (size_t)shard.first_sample;
+		if (audiopeak_analyze_shard(detector, &shard, 2, ReadTrack, &reader, &part) != AUDIOPEAK_OK) {
+			goto done;
+		}
+		flux = audiopeak_result_flux(part, &count);
+		if (audiopeak_result_first_frame(part) != (int64_t)stitched_count || stitched_count + count > frames) {
+			audiopeak_result_free(part);
+			goto done;
+		}
+		if (count > 0) {
+			memcpy(stitched + stitched_count, flux, count * sizeof(float));
+		}
+		stitched_count += count;
+		audiopeak_result_free(part);
+	}
+	if (stitched_count != frames || (frames > 0 && memcmp(stitched, single_flux, frames * sizeof(float)) != 0)) {
+		goto done;
+	}
+
+	if (audiopeak_pick_peaks(detector, stitched, stitched_count, &merged) == AUDIOPEAK_OK) {
+		size_t merged_count = 0;
+		const audiopeak_peak* merged_peaks = audiopeak_result_peaks(merged, &merged_count);
+		same = merged_count == *single_peaks && SamePeaks(merged_peaks, single_peak_list, merged_count);
+	}
+
+done:
+	audiopeak_result_free(merged);
+	audiopeak_result_free(single);
+	audiopeak_destroy(detector);
+	free(stitched);
+	return same;
+}
+
+int main(int argc, char** argv)
+{
+	const double seconds = (argc > 1) ? atof(argv[1]) : 20.0;
+	const double sample_rate = 44100.0;
+	const size_t frame_count = (size_t)(seconds * sample_rate);
+	float* samples = MakeTrack(sample_rate, frame_count);
+	size_t runs = 0;
+	size_t failures = 0;
+	size_t peaks_checked = 0;
+	int function;
+	size_t geometry;
+	int mode;
+	int shard_count;
+
+	if (!samples) {
+		fprintf(stderr, "audiopeak_shard_test: out of memory\n");
+		return 1;
+	}
+	for (function = AUDIOPEAK_ONSET_SPECTRAL_FLUX; function <= AUDIOPEAK_ONSET_ENERGY_ENVELOPE; ++function) {
+		for (geometry = 0; geometry < sizeof(kGeometries) / sizeof(kGeometries[0]); ++geometry) {
+			for (mode = AUDIOPEAK_THRESHOLD_TRAILING_MEAN; mode <= AUDIOPEAK_THRESHOLD_ROLLING_PERCENTILE; ++mode) {
+				audiopeak_settings settings;
+				size_t frames = 0;
+				size_t peaks = 0;
+				audiopeak_default_settings(&settings);
+				settings.onset_function = function;
+				settings.fft_size = kGeometries[geometry][0];
+				settings.hop_size = kGeometries[geometry][1];
+				settings.threshold_mode = mode;
+				for (shard_count = 2; shard_count <= 13; ++shard_count) {
+					++runs;
+					if (!CheckShards(&settings, samples, frame_count, shard_count, &frames, &peaks)) {
+						++failures;
+						printf("DIFFERENT: function %d, %d/%d, threshold mode %d, %d shards\n",
+							function, settings.fft_size, settings.hop_size, mode, shard_count);
+					}
+					peaks_checked += peaks;
+				}
+
+				/* Three frames in more shards than that, so some shards are empty. */
+				++runs;
+				if (!CheckShards(&settings, samples, (size_t)(settings.fft_size + 2 * settings.hop_size), 7, &frames, &peaks)) {
+					++failures;
+					printf("DIFFERENT: function %d, %d/%d, threshold mode %d, 7 shards of %zu frames\n",
+						function, settings.fft_size, settings.hop_size, mode, frames);
+				}
+			}
+		}
+	}
+	printf("%zu runs over %.0f s of audio, %zu peaks compared: %zu different\n", runs, seconds, peaks_checked, failures);
+	free(samples);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Cost of Export Peaks. Writes a million onsets spread over an hour, with the
+ curve of that hour at the Standard frame rate (310,078 frames), in every
+ format through WriteOnsetExport, best of a few runs, and reports the time
+ and size of each file. The onsets and curve are pulled from generators, as
+ the plug-in pulls them from its results. Built against the export code
+ only:
+
+ g++ -std=c++17 -O2 -I. -o export_bench libaudiopeak/export_bench.cpp AudioPeakDetection_Export.cpp
+
+ Usage: export_bench [output directory = /tmp] [onsets = 1000000]
+*/
+
+#include "AudioPeakDetection_Export.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+constexpr double kSampleRate = 44100.0;
+constexpr double kSeconds = 3600.0;
+constexpr double kFramesPerSecond = kSampleRate / 1024.0;
+constexpr size_t kCurveFrames = 310078;
+constexpr int kRuns = 3;
+
+double NowSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const std::string directory = (argc > 1) ? argv[1] : "/tmp";
+	const size_t onset_count = (argc > 2) ? static_cast<size_t>(std::atol(argv[2])) : 1000000;
+	const struct {
+		ExportFormat format;
+		const char* name;
+		bool curve;
+	} formats[] = {
+		{ kExportCsv, "CSV", true },
+		{ kExportJson, "JSON", true },
+		{ kExportBinary, "Binary", true },
+		{ kExportMidi, "MIDI", false },
+	};
+
+	ExportHeader header;
+	header.sample_rate = kSampleRate;
+	header.tempo_bpm = 128.0;
+	header.flux_frames_per_second = kFramesPerSecond;
+
+	std::printf("%zu onsets over %.0f s, curve of %zu frames, best of %d runs\n", onset_count, kSeconds, kCurveFrames, kRuns);
+	for (const auto& entry : formats) {
+		const std::string path = directory + "/export_bench." + ExportExtension(entry.format);
+		double best = 1e30;
+		ExportCounts counts;
+		long bytes = 0;
+		for (int run = 0; run < kRuns; ++run) {
+			std::FILE* file = std::fopen(path.c_str(), "wb");
+			if (!file) {
+				std::printf("cannot create %s\n", path.c_str());
+				return 1;
+			}
+			size_t next_onset = 0;
+			uint32_t state = 7u;
+			const ExportOnsetSource onsets = [&](ExportOnset& onset) {
+				if (next_onset >= onset_count) {
+					return false;
+				}
+				state = state * 1664525u + 1013904223u;
+				onset.sample = static_cast<int64_t>(static_cast<double>(next_onset++) * kSeconds * kSampleRate / static_cast<double>(onset_count));
+				onset.amplitude = 100.0f * static_cast<float>(state >> 8) / 16777216.0f;
+				onset.is_loud = onset.amplitude >= 75.0f;
+				return true;
+			};
+			size_t next_frame = 0;
+			ExportFluxSource flux;
+			if (entry.curve) {
+				flux = [&](float* values, size_t capacity) {
+					const size_t count = std::min(capacity, kCurveFrames - next_frame);
+					for (size_t i = 0; i < count; ++i) {
+						values[i] = static_cast<float>((next_frame + i) % 1000) * 0.1f;
+					}
+					next_frame += count;
+					return count;
+				};
+			}
+			const double start = NowSeconds();
+			const bool written = WriteOnsetExport(file, entry.format, header, onsets, flux, counts);
+			const bool closed = std::fclose(file) == 0;
+			best = std::min(best, NowSeconds() - start);
+			if (!written || !closed) {
+				std::printf("%s: write failed\n", entry.name);
+				return 1;
+			}
+		}
+		if (std::FILE* file = std::fopen(path.c_str(), "rb")) {
+			std::fseek(file, 0, SEEK_END);
+			bytes = std::ftell(file);
+			std::fclose(file);
+		}
+		std::printf("%-7s %8.1f ms  %zu onsets, %zu curve frames, %.1f MB\n",
+			entry.name,
+			1e3 * best,
+			counts.onsets,
+			counts.flux_frames,
+			static_cast<double>(bytes) / 1048576.0);
+		std::remove(path.c_str());
+	}
+	return 0;
+}
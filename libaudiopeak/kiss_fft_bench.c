@@ -0,0 +1,223 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Times kiss_fft, kiss_fftr and kiss_fftri over 2^8 to 2^20 complex points,
+ the 2-3-5 halves of 40 to 100 ms frames at 48 kHz (1920 to 4800 samples),
+ a few sizes with a factor of 7 or 11 that go through kf_bfly_generic, and
+ a few 2-3-5 sizes like those the tempo stage pads to. A real transform
+ of 2n points is a complex transform of n points plus the split loop that
+ separates the two packed half-length spectra; the split columns give that
+ loop's share of the real transform's time. The path each size takes
+ follows KISS_FFT_STOCKHAM_MIN_SIZE; build once more with it set to 2 or to
+ 0x7fffffff to time every size through the Stockham passes or through the
+ recursive kf_work. It first round-trips the 1- and 2-point plans, which
+ have no scratch of their own.
+
+ Usage: kiss_fft_bench
+*/
+
+#include "../_kiss_fft_guts.h"
+#include "../kiss_fftr.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double NowSeconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+/* Largest error of a forward and inverse round trip, relative to nfft. */
+static double RoundTripError(kiss_fft_cfg forward, int nfft, const kiss_fft_cpx* in, kiss_fft_cpx* out)
+{
+	kiss_fft_cfg inverse = kiss_fft_alloc(nfft, 1, NULL, NULL);
+	kiss_fft_cpx* back = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (size_t)nfft);
+	double error = 0.0;
+	int i;
+	if (inverse && back) {
+		kiss_fft(forward, in, out);
+		kiss_fft(inverse, out, back);
+		for (i = 0; i < nfft; ++i) {
+			const double e = hypot(back[i].r / nfft - in[i].r, back[i].i / nfft - in[i].i);
+			if (e > error) {
+				error = e;
+			}
+		}
+	}
+	free(back);
+	kiss_fft_free(inverse);
+	return error;
+}
+
+/* Round trips of the smallest plans, which carry no scratch of their own: a
+   complex transform of 1 and 2 points, out of place and in place, and a
+   real one of 2 and 4 points. Returns the largest error. */
+static double TinyRoundTripError(void)
+{
+	double error = 0.0;
+	int nfft;
+	for (nfft = 1; nfft <= 2; ++nfft) {
+		kiss_fft_cfg forward = kiss_fft_alloc(nfft, 0, NULL, NULL);
+		kiss_fft_cfg inverse = kiss_fft_alloc(nfft, 1, NULL, NULL);
+		kiss_fftr_cfg real_forward = kiss_fftr_alloc(2 * nfft, 0, NULL, NULL);
+		kiss_fftr_cfg real_inverse = kiss_fftr_alloc(2 * nfft, 1, NULL, NULL);
+		kiss_fft_cpx in[2] = { { 0.75f, -0.5f }, { 0.25f, 1.0f } };
+		kiss_fft_cpx data[2];
+		kiss_fft_cpx back[2];
+		kiss_fft_cpx spectrum[3];
+		kiss_fft_scalar real_in[4] = { 0.5f, -1.0f, 0.25f, 0.75f };
+		kiss_fft_scalar real_back[4];
+		int i;
+		if (!forward || !inverse || !real_forward || !real_inverse) {
+			return 1.0;
+		}
+		kiss_fft(forward, in, data);
+		kiss_fft(inverse, data, back);
+		for (i = 0; i < nfft; ++i) {
+			data[i] = in[i];
+		}
+		kiss_fft(forward, data, data);
+		kiss_fft(inverse, data, data);
+		for (i = 0; i < nfft; ++i) {
+			const double e = hypot(back[i].r / nfft - in[i].r, back[i].i / nfft - in[i].i);
+			const double e_in_place = hypot(data[i].r / nfft - in[i].r, data[i].i / nfft - in[i].i);
+			error = (e > error) ? e : error;
+			error = (e_in_place > error) ? e_in_place : error;
+		}
+		kiss_fftr(real_forward, real_in, spectrum);
+		kiss_fftri(real_inverse, spectrum, real_back);
+		for (i = 0; i < 2 * nfft; ++i) {
+			const double e = fabs(real_back[i] / (2 * nfft) - real_in[i]);
+			error = (e > error) ? e : error;
+		}
+		kiss_fftr_free(real_inverse);
+		kiss_fftr_free(real_forward);
+		kiss_fft_free(inverse);
+		kiss_fft_free(forward);
+	}
+	return error;
+}
+
+/* Percentage of a real transform's time spent outside the complex one. */
+static double SplitShare(double real, double transform)
+{
+	return (real > transform) ? 100.0 * (real - transform) / real : 0.0;
+}
+
+int main(void)
+{
+	static const int kMixedSizes[] = {
+		960, 1200, 1920, 2400,
+		896, 1400, 1408, 3584,
+		12288, 40960, 155520, 622080
+	};
+	int sizes[32];
+	int size_count = 0;
+	int i;
+
+	for (i = 8; i <= 20; ++i) {
+		sizes[size_count++] = 1 << i;
+	}
+	for (i = 0; i < (int)(sizeof(kMixedSizes) / sizeof(kMixedSizes[0])); ++i) {
+		sizes[size_count++] = kMixedSizes[i];
+	}
+
+	printf("1 and 2 points (real 2 and 4): round trip %.1e\n", TinyRoundTripError());
+	printf("  points  path           complex (us)  real 2n (us)  split  inverse (us)  split  round trip\n");
+	for (i = 0; i < size_count; ++i) {
+		const int nfft = sizes[i];
+		const int stages = kf_stockham_stages(nfft);
+		const int repeats = (int)(2e7 / (nfft * log2((double)nfft))) + 3;
+		kiss_fft_cfg cfg = kiss_fft_alloc(nfft, 0, NULL, NULL);
+		kiss_fftr_cfg real_cfg = kiss_fftr_alloc(2 * nfft, 0, NULL, NULL);
+		kiss_fftr_cfg inverse_cfg = kiss_fftr_alloc(2 * nfft, 1, NULL, NULL);
+		kiss_fft_cpx* in = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (size_t)nfft);
+		kiss_fft_cpx* out = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (size_t)(nfft + 1));
+		kiss_fft_cpx* scratch = (kiss_fft_cpx*)malloc(sizeof(kiss_fft_cpx) * (size_t)(kf_scratch_points(nfft) + 1));
+		kiss_fft_scalar* real_in = (kiss_fft_scalar*)malloc(sizeof(kiss_fft_scalar) * 2 * (size_t)nfft);
+		kiss_fft_scalar* real_back = (kiss_fft_scalar*)malloc(sizeof(kiss_fft_scalar) * 2 * (size_t)nfft);
+		double best_complex = 1e30;
+		double best_real = 1e30;
+		double best_inverse = 1e30;
+		char path[32];
+		int run, r, k;
+
+		if (!cfg || !real_cfg || !inverse_cfg || !in || !out || !scratch || !real_in || !real_back) {
+			fprintf(stderr, "out of memory at %d points\n", nfft);
+			return 1;
+		}
+		for (k = 0; k < nfft; ++k) {
+			in[k].r = (kiss_fft_scalar)sin(k * 0.01);
+			in[k].i = (kiss_fft_scalar)cos(k * 0.003);
+			real_in[2 * k] = (kiss_fft_scalar)sin(k * 0.013);
+			real_in[2 * k + 1] = (kiss_fft_scalar)sin(k * 0.029);
+		}
+		/* best of five batches */
+		for (run = 0; run < 5; ++run) {
+			double start = NowSeconds();
+			double elapsed;
+			/* with its own work buffer, as inside kiss_fftr */
+			for (r = 0; r < repeats; ++r) {
+				kf_transform(cfg, in, out, 1, scratch);
+			}
+			elapsed = (NowSeconds() - start) / repeats;
+			best_complex = (elapsed < best_complex) ? elapsed : best_complex;
+			start = NowSeconds();
+			for (r = 0; r < repeats; ++r) {
+				kiss_fftr(real_cfg, real_in, out);
+			}
+			elapsed = (NowSeconds() - start) / repeats;
+			best_real = (elapsed < best_real) ? elapsed : best_real;
+			start = NowSeconds();
+			for (r = 0; r < repeats; ++r) {
+				kiss_fftri(inverse_cfg, out, real_back);
+			}
+			elapsed = (NowSeconds() - start) / repeats;
+			best_inverse = (elapsed < best_inverse) ? elapsed : best_inverse;
+		}
+		if (stages) {
+			snprintf(path, sizeof(path), "stockham x%d", stages);
+		} else if (cfg->generic_radix) {
+			snprintf(path, sizeof(path), "recursive r%d", cfg->generic_radix);
+		} else {
+			snprintf(path, sizeof(path), "recursive");
+		}
+		printf("%8d  %-13s  %12.2f  %12.2f  %4.0f%%  %12.2f  %4.0f%%  %10.1e\n",
+			nfft, path, best_complex * 1e6,
+			best_real * 1e6, SplitShare(best_real, best_complex),
+			best_inverse * 1e6, SplitShare(best_inverse, best_complex),
+			RoundTripError(cfg, nfft, in, out));
+
+		free(real_back);
+		free(real_in);
+		free(scratch);
+		free(out);
+		free(in);
+		kiss_fftr_free(inverse_cfg);
+		kiss_fftr_free(real_cfg);
+		kiss_fft_free(cfg);
+	}
+	return 0;
+}
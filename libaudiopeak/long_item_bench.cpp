@@ -0,0 +1,225 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ A multi-hour item at a high sample rate, taken through the core the way the
+ plug-in takes a layer: one-minute windows addressed in 32-bit ticks with
+ SampleRangeToTicks, rendered by a stand-in host that reads the samples at
+ the tick positions it was given, and pushed into one onset curve. The audio
+ is a 128 BPM click track over noise. It checks that every window lands
+ sample-exactly once the tick scale has to be coarsened and that every click
+ has a peak within two hops, and reports the tempo, the last peak as a marker
+ time (SecondsToTicks) and the time of each stage. Exits 1 on a failure.
+ Built against the core, not the library:
+
+ g++ -std=c++17 -O2 -I. -o long_item_bench libaudiopeak/long_item_bench.cpp \
+     AudioPeakDetection_Core.cpp kiss_fft.o kiss_fftr.o kiss_fftr_q15.o -lpthread
+
+ Usage: long_item_bench [hours = 6] [sample rate = 192000]
+*/
+
+#include "AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+constexpr int64_t kMaxTicks = INT32_MAX;
+constexpr double kWindowSeconds = 60.0;
+constexpr double kTempoBpm = 128.0;
+constexpr double kFirstClickSeconds = 0.5;
+constexpr int64_t kClickSamples = 800;
+
+double NowSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sample position where click index starts.
+int64_t ClickStart(int64_t index, double sample_rate)
+{
+	return std::llround(sample_rate * (kFirstClickSeconds + static_cast<double>(index) * 60.0 / kTempoBpm));
+}
+
+// The host's side of a window: reads tick_count ticks of the track from
+// first_tick on, one sample at a time, as noise plus a decaying click.
+void RenderTicks(const TickRange& range, uint32_t sample_rate, int64_t count, float* mono)
+{
+	const int64_t samples_per_tick = static_cast<int64_t>(sample_rate / range.ticks_per_second);
+	const int64_t first_sample = range.first_tick * samples_per_tick;
+	const double period = static_cast<double>(sample_rate) * 60.0 / kTempoBpm;
+	for (int64_t i = 0; i < count; ++i) {
+		const int64_t position = first_sample + i;
+		uint32_t state = static_cast<uint32_t>(position * 2654435761u);
+		state ^= state >> 15;
+		float value = (static_cast<float>(state >> 9) / 8388608.0f - 0.5f) * 0.02f;
+		const int64_t index = std::max<int64_t>(0,
+			static_cast<int64_t>(std::floor((static_cast<double>(position) - kFirstClickSeconds * sample_rate) / period)));
+		const int64_t offset = position - ClickStart(index, sample_rate);
+		if (offset >= 0 && offset < kClickSamples) {
+			value += std::sin(static_cast<float>(offset) * 0.3f) * std::exp(-static_cast<float>(offset) / 150.0f);
+		}
+		mono[i] = value;
+	}
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const double hours = (argc > 1) ? std::atof(argv[1]) : 6.0;
+	const uint32_t sample_rate = (argc > 2) ? static_cast<uint32_t>(std::atol(argv[2])) : 192000u;
+	const int64_t total = static_cast<int64_t>(hours * 3600.0 * sample_rate);
+	const int64_t window = static_cast<int64_t>(kWindowSeconds * sample_rate);
+	const OnsetGeometry geometry;
+	const double frames_per_second = OnsetFramesPerSecond(sample_rate, geometry);
+
+	ScratchArena arena;
+	OnsetCurveBuilder builder;
+	if (!builder.Initialize(arena, geometry, kOnsetSpectralFlux, sample_rate, 150.0, 5000.0, OnsetFrameCount(total, geometry))) {
+		std::printf("out of memory\n");
+		return 1;
+	}
+
+	// Windows as RenderItemAudio addresses them.
+	std::vector<float> mono(static_cast<size_t>(window));
+	int64_t coarse_windows = 0;
+	int64_t first_coarse_sample = -1;
+	uint32_t coarsest_scale = sample_rate;
+	const double flux_start = NowSeconds();
+	for (int64_t first_sample = 0; first_sample < total; first_sample += window) {
+		const int64_t count = std::min(window, total - first_sample);
+		TickRange range;
+		if (!SampleRangeToTicks(first_sample, count, sample_rate, kMaxTicks, range)) {
+			std::printf("FAIL: no tick scale addresses samples %lld..%lld\n",
+				static_cast<long long>(first_sample), static_cast<long long>(first_sample + count));
+			return 1;
+		}
+		const int64_t samples_per_tick = static_cast<int64_t>(sample_rate / range.ticks_per_second);
+		if (range.first_tick * samples_per_tick != first_sample || range.tick_count * samples_per_tick < count ||
+			range.tick_count * samples_per_tick - count >= samples_per_tick) {
+			std::printf("FAIL: window at sample %lld addressed as %lld + %lld ticks of %u/s\n",
+				static_cast<long long>(first_sample),
+				static_cast<long long>(range.first_tick),
+				static_cast<long long>(range.tick_count),
+				range.ticks_per_second);
+			return 1;
+		}
+		if (samples_per_tick > 1) {
+			++coarse_windows;
+			if (first_coarse_sample < 0) {
+				first_coarse_sample = first_sample;
+			}
+			coarsest_scale = std::min(coarsest_scale, range.ticks_per_second);
+		}
+		RenderTicks(range, sample_rate, count, mono.data());
+		builder.Push(mono.data(), static_cast<size_t>(count));
+	}
+	const double flux_seconds = NowSeconds() - flux_start;
+
+	int64_t click_count = 0;
+	while (ClickStart(click_count, sample_rate) + kClickSamples <= total) {
+		++click_count;
+	}
+
+	const double pick_start = NowSeconds();
+	const ArenaSpan<const float> flux = builder.Flux();
+	// No smoothing: at 192 kHz the default radius spreads a click over 27
+	// frames, which would blur the timing this checks.
+	const PeakPickingSpans spans = PeakPickingSpansFor(0.0f, 0.12f, frames_per_second);
+	const ArenaSpan<const float> smoothed = SmoothFlux(flux, spans.smoothing_radius, arena);
+	const ArenaSpan<CandidatePeak> candidates = AllocateCandidates(arena, flux.size());
+	const size_t peak_count = SelectPeaks(smoothed, 1.5f, spans, candidates);
+	const double pick_seconds = NowSeconds() - pick_start;
+
+	const double tempo_start = NowSeconds();
+	const BeatGrid grid = TrackBeatGrid(flux, frames_per_second, arena);
+	const double tempo_seconds = NowSeconds() - tempo_start;
+
+	// The noise between clicks gives weak peaks of its own; the clicks are
+	// the ones above a tenth of the strongest. Each must lie within two hops
+	// of a click's start.
+	float strongest = 0.0f;
+	for (size_t i = 0; i < peak_count; ++i) {
+		strongest = std::max(strongest, candidates[i].flux_value);
+	}
+	std::vector<double> click_peaks;
+	for (size_t i = 0; i < peak_count; ++i) {
+		if (candidates[i].flux_value >= 0.1f * strongest) {
+			click_peaks.push_back(OnsetFrameSeconds(candidates[i].frame_index, sample_rate, geometry));
+		}
+	}
+	const double tolerance = 2.0 * static_cast<double>(geometry.hop_size) / sample_rate;
+	int64_t matched = 0;
+	size_t next = 0;
+	for (int64_t click = 0; click < click_count; ++click) {
+		const double seconds = static_cast<double>(ClickStart(click, sample_rate)) / sample_rate;
+		while (next < click_peaks.size() && click_peaks[next] < seconds - tolerance) {
+			++next;
+		}
+		if (next < click_peaks.size() && click_peaks[next] <= seconds + tolerance) {
+			++matched;
+		}
+	}
+
+	std::printf("%.2f h at %u Hz: %lld samples in %lld windows, %lld frames\n",
+		hours,
+		sample_rate,
+		static_cast<long long>(total),
+		static_cast<long long>((total + window - 1) / window),
+		static_cast<long long>(flux.size()));
+	if (coarse_windows > 0) {
+		std::printf("%lld windows past the 32-bit tick limit, from %.1f s on, at down to %u ticks/s; all sample-exact\n",
+			static_cast<long long>(coarse_windows),
+			static_cast<double>(first_coarse_sample) / sample_rate,
+			coarsest_scale);
+	} else {
+		std::printf("every window addressed in samples\n");
+	}
+	std::printf("%lld clicks, %zu peaks of which %zu strong, %lld clicks matched; %.3f BPM, %zu beats\n",
+		static_cast<long long>(click_count),
+		peak_count,
+		click_peaks.size(),
+		static_cast<long long>(matched),
+		grid.tempo_bpm,
+		grid.beat_frames.size());
+	if (!click_peaks.empty()) {
+		const double last_seconds = click_peaks.back();
+		uint32_t scale = sample_rate;
+		const int64_t ticks = SecondsToTicks(last_seconds, scale, kMaxTicks);
+		std::printf("last peak %.4f s = %lld / %u ticks, last click %.4f s\n",
+			last_seconds,
+			static_cast<long long>(ticks),
+			scale,
+			static_cast<double>(ClickStart(click_count - 1, sample_rate)) / sample_rate);
+	}
+	std::printf("flux %.1f s, peaks %.2f s, tempo %.2f s, scratch %.1f MB\n",
+		flux_seconds,
+		pick_seconds,
+		tempo_seconds,
+		static_cast<double>(arena.PeakBytes()) / 1048576.0);
+	return (matched == click_count && click_peaks.size() == static_cast<size_t>(click_count)) ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Cost of each onset detection function. For every analysis geometry of the
+ Quality presets (and one custom one) it times the onset curve builder over
+ the same synthetic track with each function, best of a few runs, and prints
+ the mean high frequency content per frame, which is weighted by the bin
+ index over the FFT size of that geometry. Built against the core, not the
+ library:
+
+ g++ -std=c++17 -O2 -I. -o odf_bench libaudiopeak/odf_bench.cpp \
+     AudioPeakDetection_Core.cpp kiss_fft.o kiss_fftr.o kiss_fftr_q15.o -lpthread
+
+ Usage: odf_bench [seconds of audio = 600]
+*/
+
+#include "AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+constexpr double kTwoPi = 6.283185307179586476925;
+constexpr int kRuns = 3;
+
+struct BenchGeometry {
+	const char* name;
+	double sample_rate;
+	OnsetGeometry geometry;
+};
+
+const BenchGeometry kGeometries[] = {
+	{ "Draft", 22050.0, { 1024, 512 } },
+	{ "Standard", 44100.0, { 2048, 1024 } },
+	{ "Precise", 44100.0, { 2048, 512 } },
+	{ "4096/1024", 48000.0, { 4096, 1024 } },
+};
+
+const struct {
+	OnsetFunction function;
+	const char* name;
+} kFunctions[] = {
+	{ kOnsetSpectralFlux, "flux" },
+	{ kOnsetLogFlux, "log flux" },
+	{ kOnsetHighFrequencyContent, "hfc" },
+	{ kOnsetComplexDomain, "complex" },
+	{ kOnsetEnergyEnvelope, "energy" },
+};
+
+double NowSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Noise at -40 dB with a decaying 2 kHz burst every half second. Deterministic.
+std::vector<float> MakeTrack(double sample_rate, size_t sample_count)
+{
+	std::vector<float> track(sample_count);
+	uint32_t state = 4242u;
+	const size_t spacing = static_cast<size_t>(0.5 * sample_rate);
+	for (size_t i = 0; i < sample_count; ++i) {
+		state = state * 1664525u + 1013904223u;
+		const double t = static_cast<double>(i % spacing) / sample_rate;
+		track[i] = static_cast<float>((static_cast<double>(state >> 8) / 16777216.0 - 0.5) * 0.02 +
+			0.5 * std::exp(-30.0 * t) * std::sin(kTwoPi * 2000.0 * t));
+	}
+	return track;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const double seconds = (argc > 1) ? std::atof(argv[1]) : 600.0;
+	std::printf("%.0f s of audio, best of %d runs (s per run)\n", seconds, kRuns);
+	std::printf("%-10s  %6s  %5s", "quality", "rate", "fft");
+	for (const auto& function : kFunctions) {
+		std::printf("  %8s", function.name);
+	}
+	std::printf("  mean hfc\n");
+
+	ScratchArena arena;
+	for (const BenchGeometry& entry : kGeometries) {
+		const std::vector<float> track = MakeTrack(entry.sample_rate, static_cast<size_t>(seconds * entry.sample_rate));
+		const int64_t frame_count = OnsetFrameCount(static_cast<int64_t>(track.size()), entry.geometry);
+		std::printf("%-10s  %6.0f  %5d", entry.name, entry.sample_rate, entry.geometry.fft_size);
+		double mean_hfc = 0.0;
+		for (const auto& function : kFunctions) {
+			double best = 1e30;
+			for (int run = 0; run < kRuns; ++run) {
+				arena.Reset();
+				OnsetCurveBuilder builder;
+				const double start = NowSeconds();
+				if (!builder.Initialize(arena, entry.geometry, function.function, entry.sample_rate, 150.0, 5000.0, frame_count)) {
+					std::printf("  out of memory\n");
+					return 1;
+				}
+				builder.Push(track.data(), track.size());
+				best = std::min(best, NowSeconds() - start);
+				if (function.function == kOnsetHighFrequencyContent && run == 0) {
+					const ArenaSpan<const float> flux = builder.Flux();
+					double sum = 0.0;
+					for (size_t frame = 0; frame < flux.size(); ++frame) {
+						sum += flux[frame];
+					}
+					mean_hfc = flux.empty() ? 0.0 : sum / static_cast<double>(flux.size());
+				}
+			}
+			std::printf("  %8.3f", best);
+		}
+		std::printf("  %8.3g\n", mean_hfc);
+	}
+	return 0;
+}
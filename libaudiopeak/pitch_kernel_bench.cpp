@@ -0,0 +1,277 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ Cost and accuracy of the sparse constant-Q pitch kernel. For each frame size
+ it reports the kernel's size, the time per frame of the real FFT, of the
+ sparse kernel multiply and of a direct constant-Q transform of the same
+ frame (each pitch's windowed sinusoid summed over the samples), and how far
+ the sparse values stray from the direct ones on noise. It then times the
+ onset curve builder over a synthetic track with and without the pitch
+ stage, and the note picking. Built against the core, not the library:
+
+ g++ -std=c++17 -O2 -I. -o pitch_kernel_bench libaudiopeak/pitch_kernel_bench.cpp \
+     AudioPeakDetection_Core.cpp kiss_fft.o kiss_fftr.o kiss_fftr_q15.o -lpthread
+
+ Usage: pitch_kernel_bench [seconds of audio = 60]
+*/
+
+#include "AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+constexpr double kSampleRate = 44100.0;
+constexpr double kTwoPi = 6.283185307179586476925;
+constexpr int kFrames = 64;
+constexpr int kRuns = 5;
+
+double NowSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of kRuns passes of body over all kFrames frames, in microseconds per frame.
+template <typename Body>
+double TimePerFrame(int repeats, const Body& body)
+{
+	double best = 1e30;
+	for (int run = 0; run < kRuns; ++run) {
+		const double start = NowSeconds();
+		for (int repeat = 0; repeat < repeats; ++repeat) {
+			for (int frame = 0; frame < kFrames; ++frame) {
+				body(frame);
+			}
+		}
+		best = std::min(best, (NowSeconds() - start) / (repeats * kFrames));
+	}
+	return best * 1e6;
+}
+
+// The temporal kernels the sparse one is built from, for the direct
+// transform: complex weights from sample offset[p] on.
+struct DirectKernel {
+	std::vector<int> offset;
+	std::vector<std::vector<float>> real;
+	std::vector<std::vector<float>> imag;
+};
+
+DirectKernel MakeDirectKernel(int fft_size, int pitch_count, ArenaSpan<const float> frame_window)
+{
+	DirectKernel kernel;
+	for (int pitch = 0; pitch < pitch_count; ++pitch) {
+		const double frequency = PitchFrequency(kPitchLowestNote + pitch);
+		const int length = std::min(fft_size, static_cast<int>(std::ceil(kPitchQ * kSampleRate / frequency)));
+		const int offset = (fft_size - length) / 2;
+		double gain = 0.0;
+		for (int n = 0; n < length; ++n) {
+			gain += (0.5 - 0.5 * std::cos(kTwoPi * n / (length - 1))) * frame_window[static_cast<size_t>(offset + n)];
+		}
+		std::vector<float> real(static_cast<size_t>(length));
+		std::vector<float> imag(static_cast<size_t>(length));
+		for (int n = 0; n < length; ++n) {
+			const double window = (0.5 - 0.5 * std::cos(kTwoPi * n / (length - 1))) / gain;
+			const double phase = kTwoPi * frequency * (offset + n) / kSampleRate;
+			real[static_cast<size_t>(n)] = static_cast<float>(window * std::cos(phase));
+			imag[static_cast<size_t>(n)] = static_cast<float>(-window * std::sin(phase));
+		}
+		kernel.offset.push_back(offset);
+		kernel.real.push_back(std::move(real));
+		kernel.imag.push_back(std::move(imag));
+	}
+	return kernel;
+}
+
+void ApplyDirectKernel(const DirectKernel& kernel, const float* windowed, float* magnitude)
+{
+	for (size_t pitch = 0; pitch < kernel.offset.size(); ++pitch) {
+		const float* x = windowed + kernel.offset[pitch];
+		const std::vector<float>& real = kernel.real[pitch];
+		const std::vector<float>& imag = kernel.imag[pitch];
+		float re = 0.0f;
+		float im = 0.0f;
+		for (size_t n = 0; n < real.size(); ++n) {
+			re += x[n] * real[n];
+			im += x[n] * imag[n];
+		}
+		magnitude[pitch] = std::sqrt(re * re + im * im);
+	}
+}
+
+void BenchFrameSize(int fft_size)
+{
+	const PitchKernel* kernel = SharedPitchKernel(fft_size, kSampleRate);
+	const ArenaSpan<const float> window = SharedHannWindow(fft_size);
+	ScratchArena arena;
+	const kiss_fftr_cfg cfg = AllocateSharedFftConfig(arena, fft_size);
+	if (!kernel || window.empty() || !cfg) {
+		std::printf("%6d  no plan\n", fft_size);
+		return;
+	}
+	const size_t size = static_cast<size_t>(fft_size);
+	const size_t bin_count = size / 2 + 1;
+	const size_t pitch_count = static_cast<size_t>(kernel->pitch_count);
+	const DirectKernel direct = MakeDirectKernel(fft_size, kernel->pitch_count, window);
+
+	// Windowed noise frames and their spectra.
+	std::vector<float> windowed(size * kFrames);
+	std::vector<kiss_fft_cpx> spectra(bin_count * kFrames);
+	uint32_t state = 12345u;
+	for (size_t i = 0; i < windowed.size(); ++i) {
+		state = state * 1664525u + 1013904223u;
+		windowed[i] = (static_cast<float>(state >> 8) / 16777216.0f - 0.5f) * window[i % size];
+	}
+	for (int frame = 0; frame < kFrames; ++frame) {
+		kiss_fftr(cfg, windowed.data() + frame * size, spectra.data() + frame * bin_count);
+	}
+
+	double error = 0.0;
+	double power = 0.0;
+	std::vector<float> sparse(pitch_count);
+	std::vector<float> reference(pitch_count);
+	for (int frame = 0; frame < kFrames; ++frame) {
+		ApplyPitchKernel(*kernel, spectra.data() + frame * bin_count, sparse.data());
+		ApplyDirectKernel(direct, windowed.data() + frame * size, reference.data());
+		for (size_t pitch = 0; pitch < pitch_count; ++pitch) {
+			error += (sparse[pitch] - reference[pitch]) * (sparse[pitch] - reference[pitch]);
+			power += reference[pitch] * reference[pitch];
+		}
+	}
+
+	const int repeats = std::max(1, 4 * 2048 / fft_size);
+	std::vector<kiss_fft_cpx> out(bin_count);
+	const double fft_us = TimePerFrame(repeats * 8, [&](int frame) {
+		kiss_fftr(cfg, windowed.data() + frame * size, out.data());
+	});
+	const double sparse_us = TimePerFrame(repeats * 8, [&](int frame) {
+		ApplyPitchKernel(*kernel, spectra.data() + frame * bin_count, sparse.data());
+	});
+	const double direct_us = TimePerFrame(repeats, [&](int frame) {
+		ApplyDirectKernel(direct, windowed.data() + frame * size, reference.data());
+	});
+
+	size_t direct_taps = 0;
+	for (const std::vector<float>& taps : direct.real) {
+		direct_taps += taps.size();
+	}
+	std::printf("%6d  %7zu  %9zu  %6.2f%%  %8.2f  %8.2f  %5.1f%%  %8.1f  %6.1fx  %6zu  %7.2f%%\n",
+		fft_size,
+		pitch_count,
+		kernel->NonzeroBins(),
+		100.0 * static_cast<double>(kernel->NonzeroBins()) / static_cast<double>(pitch_count * bin_count),
+		fft_us,
+		sparse_us,
+		100.0 * sparse_us / fft_us,
+		direct_us,
+		direct_us / fft_us,
+		direct_taps,
+		100.0 * std::sqrt(error / power));
+}
+
+// Decaying notes with three partials, a new one every 0.3 s, over low noise.
+std::vector<float> MakeTrack(size_t sample_count)
+{
+	std::vector<float> track(sample_count);
+	uint32_t state = 777u;
+	for (size_t i = 0; i < sample_count; ++i) {
+		state = state * 1664525u + 1013904223u;
+		track[i] = (static_cast<float>(state >> 8) / 16777216.0f - 0.5f) * 0.002f;
+	}
+	const size_t spacing = static_cast<size_t>(0.3 * kSampleRate);
+	for (size_t start = spacing / 2, index = 0; start < sample_count; start += spacing, ++index) {
+		const double frequency = PitchFrequency(48 + static_cast<int>((index * 7) % 36));
+		const size_t end = std::min(sample_count, start + static_cast<size_t>(kSampleRate));
+		for (size_t i = start; i < end; ++i) {
+			const double t = static_cast<double>(i - start) / kSampleRate;
+			const double envelope = 0.2 * std::min(1.0, t / 0.005) * std::exp(-4.0 * t);
+			track[i] += static_cast<float>(envelope * (std::sin(kTwoPi * frequency * t) +
+				0.5 * std::sin(2.0 * kTwoPi * frequency * t) + 0.25 * std::sin(3.0 * kTwoPi * frequency * t)));
+		}
+	}
+	return track;
+}
+
+void BenchBuilder(double seconds)
+{
+	const OnsetGeometry geometry;
+	const std::vector<float> track = MakeTrack(static_cast<size_t>(seconds * kSampleRate));
+	const int64_t frame_count = OnsetFrameCount(static_cast<int64_t>(track.size()), geometry);
+	const double frames_per_second = OnsetFramesPerSecond(kSampleRate, geometry);
+	const PeakPickingSpans spans = PeakPickingSpansFor(30.0f, 0.12f, frames_per_second);
+
+	double best[2] = { 1e30, 1e30 };
+	double pick_best = 1e30;
+	size_t note_count = 0;
+	ScratchArena arena;
+	for (int run = 0; run < kRuns; ++run) {
+		for (int pitch_stage = 0; pitch_stage < 2; ++pitch_stage) {
+			arena.Reset();
+			OnsetCurveBuilder builder;
+			const double start = NowSeconds();
+			if (!builder.Initialize(arena, geometry, kOnsetSpectralFlux, kSampleRate, 150.0, 5000.0, frame_count) ||
+				(pitch_stage && !builder.EnablePitchFlux(arena))) {
+				std::printf("out of memory\n");
+				return;
+			}
+			builder.Push(track.data(), track.size());
+			best[pitch_stage] = std::min(best[pitch_stage], NowSeconds() - start);
+			if (pitch_stage) {
+				ArenaSpan<PitchOnset> onsets;
+				const double pick_start = NowSeconds();
+				SelectPitchOnsets(builder, 1.5f, spans, arena, onsets);
+				pick_best = std::min(pick_best, NowSeconds() - pick_start);
+				note_count = onsets.size();
+			}
+		}
+	}
+	const double frames = static_cast<double>(frame_count);
+	std::printf("\n%.0f s, %lld frames of %d: builder %.2f us/frame, with the pitch stage %.2f us/frame (+%.0f%%);\n"
+		"picking %zu note onsets from %d pitch curves took %.1f ms (%.2f us/frame)\n",
+		seconds,
+		static_cast<long long>(frame_count),
+		geometry.fft_size,
+		1e6 * best[0] / frames,
+		1e6 * best[1] / frames,
+		100.0 * (best[1] - best[0]) / best[0],
+		note_count,
+		kPitchCount,
+		1e3 * pick_best,
+		1e6 * pick_best / frames);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const double seconds = (argc > 1) ? std::atof(argv[1]) : 60.0;
+	std::printf("pitch kernel at %.0f Hz, best of %d runs (times in us per frame)\n", kSampleRate, kRuns);
+	std::printf("  fft  pitches  nonzeros  density       fft    kernel  of fft    direct  of fft    taps  rms error\n");
+	for (const int fft_size : { 1024, 2048, 4096, 8192 }) {
+		BenchFrameSize(fft_size);
+	}
+	BenchBuilder(seconds);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*******************************************************************/
+/*                                                                 */
+/*                      ADOBE CONFIDENTIAL                         */
+/*                   _ _ _ _ _ _ _ _ _ _ _ _ _                     */
+/*                                                                 */
+/* Copyright 2007-2023 Adobe Inc.                                  */
+/* All Rights Reserved.                                            */
+/*                                                                 */
+/* NOTICE:  All information contained herein is, and remains the   */
+/* property of Adobe Inc. and its suppliers, if                    */
+/* any.  The intellectual and technical concepts contained         */
+/* herein are proprietary to Adobe Inc. and its                    */
+/* suppliers and may be covered by U.S. and Foreign Patents,       */
+/* patents in process, and are protected by trade secret or        */
+/* copyright law.  Dissemination of this information or            */
+/* reproduction of this material is strictly forbidden unless      */
+/* prior written permission is obtained from Adobe Inc.            */
+/*                                                                 */
+/*******************************************************************/
+
+/*
+ StreamingOnsetDetector as an audio callback would drive it. For each block
+ size it pushes a synthetic track one block at a time and polls after every
+ block, and reports the mean, 99.9th percentile and worst time per block
+ against the block's duration (the worst includes any preemption by the OS),
+ the shortest and longest observed latency (samples pushed when an onset came
+ back, minus its position) against LatencySamples(), and how many heap
+ allocations happened after Initialize(): operator new calls plus blocks
+ taken by the detector's arena. Built against the core, not the library:
+
+ g++ -std=c++17 -O2 -I. -o streaming_bench libaudiopeak/streaming_bench.cpp \
+     AudioPeakDetection_Core.cpp kiss_fft.o kiss_fftr.o kiss_fftr_q15.o -lpthread
+
+ Usage: streaming_bench [seconds of audio = 60]
+*/
+
+#include "AudioPeakDetection_Core.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace {
+
+std::atomic<size_t> g_new_calls(0);
+
+}
+
+void* operator new(size_t size)
+{
+	++g_new_calls;
+	if (void* memory = std::malloc(size ? size : 1)) {
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	std::free(memory);
+}
+
+namespace {
+
+constexpr double kSampleRate = 48000.0;
+constexpr double kTwoPi = 6.283185307179586476925;
+
+double NowSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Decaying noise bursts 0.3 to 0.7 s apart over low noise. Deterministic.
+std::vector<float> MakeTrack(size_t sample_count)
+{
+	std::vector<float> track(sample_count);
+	uint32_t state = 2024u;
+	size_t next_hit = static_cast<size_t>(0.25 * kSampleRate);
+	size_t hit_start = 0;
+	for (size_t i = 0; i < sample_count; ++i) {
+		state = state * 1664525u + 1013904223u;
+		const double noise = static_cast<double>(state >> 8) / 16777216.0 - 0.5;
+		if (i == next_hit) {
+			hit_start = i;
+			next_hit += static_cast<size_t>((0.3 + 0.4 * static_cast<double>(state >> 24) / 256.0) * kSampleRate);
+		}
+		const double t = static_cast<double>(i - hit_start) / kSampleRate;
+		const double burst = (hit_start > 0) ? std::exp(-40.0 * t) : 0.0;
+		track[i] = static_cast<float>(noise * (0.004 + 0.8 * burst) + 0.05 * std::sin(kTwoPi * 220.0 * static_cast<double>(i) / kSampleRate));
+	}
+	return track;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	const double seconds = (argc > 1) ? std::atof(argv[1]) : 60.0;
+	const std::vector<float> track = MakeTrack(static_cast<size_t>(seconds * kSampleRate));
+
+	std::printf("%.0f s at %.0f Hz\n", seconds, kSampleRate);
+	std::printf(" block  block (us)  mean (us)  p99.9 (us)  worst (us)  onsets  latency min..max  LatencySamples  allocations\n");
+	for (const size_t block : { 32, 64, 128, 256, 512, 1024, 4096 }) {
+		std::vector<double> times(track.size() / block);
+		StreamingDetectorSettings settings;
+		settings.sample_rate = kSampleRate;
+		StreamingOnsetDetector detector;
+		if (!detector.Initialize(settings)) {
+			std::printf("%6zu  initialisation failed\n", block);
+			return 1;
+		}
+		const size_t arena_blocks = detector.HeapAllocations();
+		const size_t new_calls = g_new_calls.load();
+
+		StreamingOnset onsets[64];
+		size_t onset_count = 0;
+		int64_t latency_min = INT64_MAX;
+		int64_t latency_max = 0;
+		size_t block_count = 0;
+		for (size_t start = 0; start + block <= track.size(); start += block) {
+			const double begin = NowSeconds();
+			detector.Push(track.data() + start, block);
+			const size_t polled = detector.Poll(onsets, 64);
+			times[block_count++] = NowSeconds() - begin;
+
+			const int64_t pushed = static_cast<int64_t>(start + block);
+			for (size_t i = 0; i < polled; ++i) {
+				const int64_t latency = pushed - onsets[i].sample_position;
+				latency_min = std::min(latency_min, latency);
+				latency_max = std::max(latency_max, latency);
+			}
+			onset_count += polled;
+		}
+
+		const size_t allocations = (g_new_calls.load() - new_calls) + (detector.HeapAllocations() - arena_blocks);
+		double total = 0.0;
+		for (size_t i = 0; i < block_count; ++i) {
+			total += times[i];
+		}
+		std::sort(times.begin(), times.begin() + static_cast<std::ptrdiff_t>(block_count));
+		std::printf("%6zu  %10.1f  %9.2f  %10.2f  %10.2f  %6zu  %7lld..%-7lld  %14lld  %zu\n",
+			block,
+			1e6 * static_cast<double>(block) / kSampleRate,
+			1e6 * total / static_cast<double>(block_count),
+			1e6 * times[block_count * 999 / 1000],
+			1e6 * times[block_count - 1],
+			onset_count,
+			static_cast<long long>(onset_count ? latency_min : 0),
+			static_cast<long long>(latency_max),
+			static_cast<long long>(detector.LatencySamples()),
+			allocations);
+	}
+	return 0;
+}